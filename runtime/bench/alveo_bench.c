@@ -0,0 +1,336 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmark of the platform API.
+//
+// Sweeps copies over sizes, stream chunk sizes and queue depths, and measures register round trips, device memory
+// allocation and the buffer cache. Every result is printed as one JSON object per line. Runs against real cards, or
+// against the emulated card with FLETCHER_ALVEO_EMULATION=1.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fletcher/fletcher.h"
+#include "fletcher_alveo.h"
+
+typedef struct {
+  const char *xclbin;
+  const char *device;
+  const char *kernel;
+  uint64_t min_size;
+  uint64_t max_size;
+  uint32_t iterations;
+  int streams;                  // Also sweep stream copies, which need a kernel that consumes and produces them.
+  uint64_t scratch_reg;         // Register that is safe to write while the kernel is idle.
+  FILE *out;
+} BenchConfig;
+
+static uint64_t chunk_sizes[] = {256ull << 10, 1ull << 20, 4ull << 20, 16ull << 20};
+static uint32_t queue_depths[] = {1, 2, 4, 8, 16, 32};
+
+#define COUNT_OF(a) (sizeof(a) / sizeof((a)[0]))
+
+static const char *backend(void) {
+  return alveo_state.config.emulation ? "emulated" : "hardware";
+}
+
+// Iterations for a copy of size bytes: fewer for large copies, so that the whole sweep finishes in reasonable time.
+static uint32_t iterations_for(const BenchConfig *b, uint64_t size) {
+  uint32_t n = b->iterations;
+  for (uint64_t s = 64ull << 20; (s < size) && (n > 1); s <<= 1) {
+    n /= 2;
+  }
+  return n;
+}
+
+static void report_copy(const BenchConfig *b, const char *name, uint64_t size, int64_t chunk, uint32_t depth,
+                        uint32_t n, uint64_t ns) {
+  fprintf(b->out, "{\"bench\":\"%s\",\"backend\":\"%s\",\"size\":%lu,\"chunk\":%ld,\"depth\":%u,\"iterations\":%u,"
+                  "\"ns\":%lu,\"gbps\":%.3f}\n",
+          name, backend(), (unsigned long) size, (long) chunk, depth, n, (unsigned long) (ns / n),
+          (double) size * n / (double) ns);
+  fflush(b->out);
+}
+
+static void report_skip(const BenchConfig *b, const char *name, uint64_t size, const char *reason) {
+  fprintf(b->out, "{\"bench\":\"%s\",\"backend\":\"%s\",\"size\":%lu,\"skipped\":\"%s\"}\n", name, backend(),
+          (unsigned long) size, reason);
+  fflush(b->out);
+}
+
+// Copies between host memory and on-board memory.
+static void bench_copies(const BenchConfig *b, uint8_t *host) {
+  for (uint64_t size = b->min_size; size <= b->max_size; size <<= 1) {
+    da_t device;
+    if (platformDeviceMalloc(&device, (int64_t) size) != FLETCHER_STATUS_OK) {
+      report_skip(b, "h2d", size, "device allocation failed");
+      continue;
+    }
+    uint32_t n = iterations_for(b, size);
+    fstatus_t status = FLETCHER_STATUS_OK;
+    uint64_t start = alveoNowNs();
+    for (uint32_t i = 0; (i < n) && (status == FLETCHER_STATUS_OK); i++) {
+      status = platformCopyHostToDevice(host, device, (int64_t) size);
+    }
+    if (status != FLETCHER_STATUS_OK) {
+      report_skip(b, "h2d", size, "copy failed");
+    } else {
+      report_copy(b, "h2d", size, 0, 0, n, alveoNowNs() - start);
+    }
+    status = FLETCHER_STATUS_OK;
+    start = alveoNowNs();
+    for (uint32_t i = 0; (i < n) && (status == FLETCHER_STATUS_OK); i++) {
+      status = platformCopyDeviceToHost(device, host, (int64_t) size);
+    }
+    if (status != FLETCHER_STATUS_OK) {
+      report_skip(b, "d2h", size, "copy failed");
+    } else {
+      report_copy(b, "d2h", size, 0, 0, n, alveoNowNs() - start);
+    }
+    platformDeviceFree(device);
+  }
+}
+
+// Copies through the kernel streams, for every chunk size and queue depth.
+static void bench_streams(const BenchConfig *b, uint8_t *host) {
+  int64_t chunk_size = alveo_state.config.chunk_size;
+  uint32_t queue_depth = alveo_state.config.queue_depth;
+  for (size_t c = 0; c < COUNT_OF(chunk_sizes); c++) {
+    for (size_t d = 0; d < COUNT_OF(queue_depths); d++) {
+      alveo_state.config.chunk_size = (int64_t) chunk_sizes[c];
+      alveo_state.config.queue_depth = queue_depths[d];
+      for (uint64_t size = b->min_size; size <= b->max_size; size <<= 1) {
+        uint32_t n = iterations_for(b, size);
+        uint64_t start = alveoNowNs();
+        fstatus_t status = FLETCHER_STATUS_OK;
+        for (uint32_t i = 0; (i < n) && (status == FLETCHER_STATUS_OK); i++) {
+          status = platformCopyDuplex(host, ALVEO_STREAM_ADDRESS(alveo_state.config.h2k_args[0]), (int64_t) size,
+                                      ALVEO_STREAM_ADDRESS(alveo_state.config.k2h_args[0]), host, (int64_t) size);
+        }
+        if (status != FLETCHER_STATUS_OK) {
+          report_skip(b, "stream", size, "stream copy failed");
+          break;
+        }
+        report_copy(b, "stream", size, (int64_t) chunk_sizes[c], queue_depths[d], n, alveoNowNs() - start);
+      }
+    }
+  }
+  alveo_state.config.chunk_size = chunk_size;
+  alveo_state.config.queue_depth = queue_depth;
+}
+
+static void report_latency(const BenchConfig *b, const char *name, uint32_t n, uint64_t ns) {
+  fprintf(b->out, "{\"bench\":\"%s\",\"backend\":\"%s\",\"iterations\":%u,\"ns\":%lu}\n", name, backend(), n,
+          (unsigned long) (ns / n));
+  fflush(b->out);
+}
+
+static void bench_mmio(const BenchConfig *b) {
+  uint32_t n = b->iterations * 100;
+  uint32_t value;
+  uint64_t start = alveoNowNs();
+  for (uint32_t i = 0; i < n; i++) {
+    platformWriteMMIO(b->scratch_reg, i);
+  }
+  report_latency(b, "mmio_write", n, alveoNowNs() - start);
+  start = alveoNowNs();
+  for (uint32_t i = 0; i < n; i++) {
+    platformReadMMIO(FLETCHER_REG_STATUS, &value);
+  }
+  report_latency(b, "mmio_read", n, alveoNowNs() - start);
+  start = alveoNowNs();
+  for (uint32_t i = 0; i < n; i++) {
+    platformWriteMMIO(b->scratch_reg, i);
+    platformReadMMIO(b->scratch_reg, &value);
+  }
+  report_latency(b, "mmio_round_trip", n, alveoNowNs() - start);
+}
+
+// Allocate a batch of buffers of one size, then free them all, for sizes from 64 bytes to 64 MiB.
+static void bench_malloc(const BenchConfig *b) {
+  enum { BATCH = 256 };
+  da_t addresses[BATCH];
+  for (uint64_t size = 64; size <= (64ull << 20); size <<= 2) {
+    uint32_t n = 0;
+    uint64_t alloc_ns = 0;
+    uint64_t free_ns = 0;
+    for (uint32_t round = 0; round < b->iterations; round++) {
+      uint32_t count = 0;
+      uint64_t start = alveoNowNs();
+      while ((count < BATCH) && (platformDeviceMalloc(&addresses[count], (int64_t) size) == FLETCHER_STATUS_OK)) {
+        count++;
+      }
+      uint64_t mid = alveoNowNs();
+      for (uint32_t i = 0; i < count; i++) {
+        platformDeviceFree(addresses[i]);
+      }
+      alloc_ns += mid - start;
+      free_ns += alveoNowNs() - mid;
+      n += count;
+    }
+    if (n == 0) {
+      report_skip(b, "malloc", size, "device allocation failed");
+      continue;
+    }
+    fprintf(b->out, "{\"bench\":\"malloc\",\"backend\":\"%s\",\"size\":%lu,\"count\":%u,\"alloc_ns\":%lu,"
+                    "\"free_ns\":%lu,\"ops_per_s\":%.0f}\n",
+            backend(), (unsigned long) size, n, (unsigned long) (alloc_ns / n), (unsigned long) (free_ns / n),
+            2.0e9 * n / (double) (alloc_ns + free_ns));
+    fflush(b->out);
+  }
+}
+
+// Uploads through platformCacheHostBuffer of a buffer that changes every time (misses), of the same buffer (hits), and
+// plain uploads to a fresh allocation, which never cache. A cache_hit_speedup row compares a hit to an uncached upload.
+static void bench_cache(const BenchConfig *b, uint8_t *host) {
+  for (uint64_t size = b->min_size; size <= b->max_size; size <<= 2) {
+    if (size > alveo_state.config.cache_budget / 2) {
+      report_skip(b, "cache", size, "larger than half the cache budget");
+      break;
+    }
+    uint32_t n = iterations_for(b, size);
+    const char *names[3] = {"cache_miss", "cache_hit", "uncached"};
+    uint64_t mode_ns[3] = {0, 0, 0};
+    for (int mode = 0; mode < 3; mode++) {
+      uint64_t ns = 0;
+      fstatus_t status = FLETCHER_STATUS_OK;
+      for (uint32_t i = 0; (i < n) && (status == FLETCHER_STATUS_OK); i++) {
+        da_t device;
+        int alloced = 0;
+        if (mode == 0) {
+          host[0]++;
+          host[size - 1]++;
+        }
+        uint64_t start = alveoNowNs();
+        if (mode == 2) {
+          status = platformDeviceMalloc(&device, (int64_t) size);
+          alloced = status == FLETCHER_STATUS_OK;
+          if (alloced) {
+            status = platformCopyHostToDevice(host, device, (int64_t) size);
+          }
+        } else {
+          status = platformCacheHostBuffer(host, &device, (int64_t) size);
+          alloced = status == FLETCHER_STATUS_OK;
+        }
+        ns += alveoNowNs() - start;
+        if (alloced) {
+          platformDeviceFree(device);
+        }
+      }
+      if (status != FLETCHER_STATUS_OK) {
+        report_skip(b, names[mode], size, "upload failed");
+        continue;
+      }
+      report_copy(b, names[mode], size, 0, 0, n, ns);
+      mode_ns[mode] = ns;
+    }
+    if ((mode_ns[1] > 0) && (mode_ns[2] > 0)) {
+      fprintf(b->out, "{\"bench\":\"cache_hit_speedup\",\"backend\":\"%s\",\"size\":%lu,\"hit_ns\":%lu,"
+                      "\"uncached_ns\":%lu,\"speedup\":%.2f}\n",
+              backend(), (unsigned long) size, (unsigned long) (mode_ns[1] / n), (unsigned long) (mode_ns[2] / n),
+              (double) mode_ns[2] / (double) mode_ns[1]);
+      fflush(b->out);
+    }
+  }
+}
+
+static uint64_t parse_size(const char *str) {
+  char *end;
+  uint64_t value = strtoull(str, &end, 0);
+  switch (*end) {
+    case 'K': case 'k': return value << 10;
+    case 'M': case 'm': return value << 20;
+    case 'G': case 'g': return value << 30;
+    default: return value;
+  }
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [-x xclbin] [-d device] [-k kernel] [-m min size] [-M max size] [-n iterations] [-s]\n"
+          "          [-r scratch register] [-o output file]\n"
+          "  -s  also sweep stream copies over chunk sizes and queue depths; the kernel must consume its H2K stream\n"
+          "      and produce its K2H stream.\n"
+          "Set FLETCHER_ALVEO_EMULATION=1 to run on the emulated card.\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  BenchConfig b = {NULL, NULL, NULL, 4ull << 10, 4ull << 30, 20, 0, 4, stdout};
+  int opt;
+  while ((opt = getopt(argc, argv, "x:d:k:m:M:n:sr:o:h")) != -1) {
+    switch (opt) {
+      case 'x': b.xclbin = optarg; break;
+      case 'd': b.device = optarg; break;
+      case 'k': b.kernel = optarg; break;
+      case 'm': b.min_size = parse_size(optarg); break;
+      case 'M': b.max_size = parse_size(optarg); break;
+      case 'n': b.iterations = (uint32_t) strtoul(optarg, NULL, 0); break;
+      case 's': b.streams = 1; break;
+      case 'r': b.scratch_reg = strtoull(optarg, NULL, 0); break;
+      case 'o':
+        b.out = fopen(optarg, "w");
+        if (b.out == NULL) {
+          perror(optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+  if ((b.iterations == 0) || (b.min_size == 0) || (b.min_size > b.max_size)) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  void *init_args[3] = {(void *) b.xclbin, (void *) b.device, (void *) b.kernel};
+  if (platformInit(init_args) != FLETCHER_STATUS_OK) {
+    fprintf(stderr, "Failed to initialize the platform.\n");
+    return EXIT_FAILURE;
+  }
+
+  // The largest size may not fit in host memory; shrink it until it does.
+  uint8_t *host = NULL;
+  while ((host == NULL) && (b.max_size >= b.min_size)) {
+    if (posix_memalign((void **) &host, ALVEO_DEVICE_ALIGNMENT, b.max_size) != 0) {
+      host = NULL;
+      report_skip(&b, "host", b.max_size, "host allocation failed");
+      b.max_size >>= 1;
+    }
+  }
+  if (host == NULL) {
+    platformTerminate(NULL);
+    return EXIT_FAILURE;
+  }
+  memset(host, 0xA5, b.max_size);
+
+  bench_mmio(&b);
+  bench_malloc(&b);
+  bench_copies(&b, host);
+  if (b.streams) {
+    bench_streams(&b, host);
+  }
+  bench_cache(&b, host);
+
+  free(host);
+  platformTerminate(NULL);
+  if (b.out != stdout) {
+    fclose(b.out);
+  }
+  return EXIT_SUCCESS;
+}
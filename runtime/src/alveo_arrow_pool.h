@@ -0,0 +1,62 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+// An arrow::MemoryPool that allocates from the pinned host memory pool of the Alveo platform, so that Arrow builders
+// write their buffers straight into memory the card can DMA from. Header only, for applications that use Arrow:
+//
+//   fletcher::AlveoMemoryPool pool;
+//   arrow::Int64Builder builder(&pool);
+
+#include <cstdint>
+#include <string>
+
+#include <arrow/memory_pool.h>
+#include <arrow/status.h>
+
+extern "C" {
+#include "fletcher_alveo.h"
+}
+
+namespace fletcher {
+
+class AlveoMemoryPool : public arrow::MemoryPool {
+ public:
+  arrow::Status Allocate(int64_t size, uint8_t **out) override {
+    if (platformHostAllocate(size, out) != FLETCHER_STATUS_OK) {
+      return arrow::Status::OutOfMemory("Alveo host memory pool: failed to allocate ", size, " bytes");
+    }
+    return arrow::Status::OK();
+  }
+
+  arrow::Status Reallocate(int64_t old_size, int64_t new_size, uint8_t **ptr) override {
+    if (platformHostReallocate(old_size, new_size, ptr) != FLETCHER_STATUS_OK) {
+      return arrow::Status::OutOfMemory("Alveo host memory pool: failed to reallocate ", new_size, " bytes");
+    }
+    return arrow::Status::OK();
+  }
+
+  void Free(uint8_t *buffer, int64_t size) override { platformHostFree(buffer, size); }
+
+  void ReleaseUnused() override { platformHostReleaseUnused(); }
+
+  int64_t bytes_allocated() const override { return platformHostBytesAllocated(); }
+
+  int64_t max_memory() const override { return platformHostMaxMemory(); }
+
+  std::string backend_name() const override { return "alveo"; }
+};
+
+}  // namespace fletcher
@@ -0,0 +1,243 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "fletcher/fletcher.h"
+#include "alveo_async.h"
+
+AlveoFuture *alveoFutureCreate(void) {
+  AlveoFuture *f = (AlveoFuture *) malloc(sizeof(AlveoFuture));
+  if (f == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->cond, NULL);
+  f->done = 0;
+  f->status = FLETCHER_STATUS_OK;
+  f->refs = 1;
+  return f;
+}
+
+void alveoFutureRetain(AlveoFuture *f) {
+  __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+void alveoFutureRelease(AlveoFuture *f) {
+  if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    pthread_cond_destroy(&f->cond);
+    pthread_mutex_destroy(&f->lock);
+    free(f);
+  }
+}
+
+void alveoFutureComplete(AlveoFuture *f, fstatus_t status) {
+  pthread_mutex_lock(&f->lock);
+  f->status = status;
+  f->done = 1;
+  pthread_cond_broadcast(&f->cond);
+  pthread_mutex_unlock(&f->lock);
+}
+
+fstatus_t alveoFutureWait(AlveoFuture *f) {
+  pthread_mutex_lock(&f->lock);
+  while (!f->done) {
+    pthread_cond_wait(&f->cond, &f->lock);
+  }
+  fstatus_t status = f->status;
+  pthread_mutex_unlock(&f->lock);
+  return status;
+}
+
+int alveoFuturePoll(AlveoFuture *f, fstatus_t *status) {
+  pthread_mutex_lock(&f->lock);
+  int done = f->done;
+  if (done && (status != NULL)) {
+    *status = f->status;
+  }
+  pthread_mutex_unlock(&f->lock);
+  return done;
+}
+
+static inline void relax(void) {
+#if defined(__x86_64__)
+  _mm_pause();
+#endif
+}
+
+// Return the slot at the head of the ring if its operation was published, NULL otherwise.
+static AlveoAsyncSlot *head_slot(AlveoAsyncQueue *q) {
+  AlveoAsyncSlot *slot = &q->slots[q->head & (q->depth - 1)];
+  return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == q->head + 1 ? slot : NULL;
+}
+
+// Sleep until an operation is published or the queue stops. Returns 0 if it stopped and the ring is empty.
+static int sleep_until_queued(AlveoAsyncQueue *q) {
+  pthread_mutex_lock(&q->lock);
+  __atomic_store_n(&q->sleeping, 1, __ATOMIC_RELAXED);
+  // Pairs with the fence in alveoAsyncSubmit: either the submitter sees sleeping set, or this thread sees its slot.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  while ((head_slot(q) == NULL) && !q->stop) {
+    pthread_cond_wait(&q->wake, &q->lock);
+  }
+  __atomic_store_n(&q->sleeping, 0, __ATOMIC_RELAXED);
+  int queued = head_slot(q) != NULL;
+  pthread_mutex_unlock(&q->lock);
+  return queued;
+}
+
+static void *queue_main(void *p) {
+  AlveoAsyncQueue *q = (AlveoAsyncQueue *) p;
+  uint32_t idle = 0;
+  for (;;) {
+    AlveoAsyncSlot *slot = head_slot(q);
+    if (slot == NULL) {
+      if (++idle < ALVEO_ASYNC_SPIN) {
+        relax();
+      } else if (!sleep_until_queued(q)) {
+        return NULL;
+      }
+      continue;
+    }
+    idle = 0;
+    AlveoAsyncOp op = slot->op;
+    // Hand the slot back to the submitters for the next round of the ring.
+    __atomic_store_n(&slot->seq, q->head + q->depth, __ATOMIC_RELEASE);
+    q->head++;
+
+    // Operations that depend on a failed one fail as well, without touching the card.
+    fstatus_t status = FLETCHER_STATUS_OK;
+    if (op.after != NULL) {
+      status = alveoFutureWait(op.after);
+      alveoFutureRelease(op.after);
+    }
+    if (status == FLETCHER_STATUS_OK) {
+      status = op.run(q->ctx, &op);
+    }
+    q->executed++;
+    if (status != FLETCHER_STATUS_OK) {
+      q->failed++;
+    }
+    if (op.future != NULL) {
+      alveoFutureComplete(op.future, status);
+      alveoFutureRelease(op.future);
+    }
+  }
+}
+
+void alveoAsyncInit(AlveoAsyncQueue *q, void *ctx, uint32_t depth) {
+  memset(q, 0, sizeof(*q));
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->wake, NULL);
+  q->ctx = ctx;
+  q->depth = 1;
+  while ((q->depth < depth) && (q->depth < (1u << 31))) {
+    q->depth <<= 1;
+  }
+  // Submissions fail if the ring could not be allocated.
+  q->slots = (AlveoAsyncSlot *) malloc(q->depth * sizeof(AlveoAsyncSlot));
+  for (uint32_t i = 0; (q->slots != NULL) && (i < q->depth); i++) {
+    q->slots[i].seq = i;
+  }
+}
+
+static fstatus_t start_thread(AlveoAsyncQueue *q) {
+  fstatus_t status = FLETCHER_STATUS_OK;
+  pthread_mutex_lock(&q->lock);
+  if (!q->started) {
+    if (pthread_create(&q->thread, NULL, queue_main, q) != 0) {
+      status = FLETCHER_STATUS_ERROR;
+    } else {
+      alveoNumaPin(q->thread, q->cpus);
+      __atomic_store_n(&q->started, 1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&q->lock);
+  return status;
+}
+
+fstatus_t alveoAsyncSubmit(AlveoAsyncQueue *q, const AlveoAsyncOp *op) {
+  if (q->slots == NULL) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  if (!__atomic_load_n(&q->started, __ATOMIC_ACQUIRE) && (start_thread(q) != FLETCHER_STATUS_OK)) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  // Claim the slot at the tail. Its sequence number equals the position once the thread took what it held last round.
+  uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  int waited = 0;
+  AlveoAsyncSlot *slot;
+  for (;;) {
+    slot = &q->slots[pos & (q->depth - 1)];
+    int64_t diff = (int64_t) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The ring is full. The thread frees slots as it goes, so give it the processor.
+      waited = 1;
+      sched_yield();
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    } else {
+      // Another submitter claimed this slot first.
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+  if (waited) {
+    __atomic_add_fetch(&q->full, 1, __ATOMIC_RELAXED);
+  }
+  if (op->future != NULL) {
+    alveoFutureRetain(op->future);
+  }
+  if (op->after != NULL) {
+    alveoFutureRetain(op->after);
+  }
+  slot->op = *op;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&q->lock);
+    pthread_cond_signal(&q->wake);
+    pthread_mutex_unlock(&q->lock);
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+void alveoAsyncTerminate(AlveoAsyncQueue *q) {
+  // Initialized queues have a depth of at least one, so a zero depth marks a queue that was already terminated.
+  if (q->depth == 0) {
+    return;
+  }
+  pthread_mutex_lock(&q->lock);
+  q->stop = 1;
+  pthread_cond_signal(&q->wake);
+  int started = q->started;
+  pthread_mutex_unlock(&q->lock);
+  if (started) {
+    pthread_join(q->thread, NULL);
+  }
+  free(q->slots);
+  pthread_cond_destroy(&q->wake);
+  pthread_mutex_destroy(&q->lock);
+  q->slots = NULL;
+  q->depth = 0;
+  q->started = 0;
+}
@@ -0,0 +1,117 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "fletcher/fletcher.h"
+#include "alveo_numa.h"
+
+// Asynchronous operations.
+//
+// Every compute unit has an in-order queue of operations (copies, stream transfers, kernel runs) that a thread of its
+// own executes, so that the thread that queued them can prepare the next record batch in the meantime. Every operation
+// can complete a future, which can be waited on, polled, or passed as the operation another one has to wait for, also
+// on another compute unit or card.
+//
+// The queue is a bounded ring that any number of threads submit to without taking a lock: a submitter claims a slot by
+// advancing the tail with a compare-and-swap, fills it in, and publishes it by storing its sequence number. Only the
+// thread of the compute unit takes operations out, so it owns the card for them. It polls the ring for a while when it
+// runs empty, and only then sleeps; submitters only wake it up when it does.
+
+/// @brief Completion handle of an asynchronous operation. Reference counted.
+typedef struct AlveoFuture {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;          ///< Signalled when the operation completes.
+  int done;
+  fstatus_t status;
+  uint32_t refs;
+} AlveoFuture;
+
+typedef struct AlveoAsyncOp AlveoAsyncOp;
+
+/// @brief Executes \p op on the queue owned by \p ctx.
+typedef fstatus_t (*AlveoAsyncFn)(void *ctx, const AlveoAsyncOp *op);
+
+struct AlveoAsyncOp {
+  AlveoAsyncFn run;
+  uint8_t *host;
+  da_t device;
+  int64_t size;
+  uint64_t timeout_us;
+  uint64_t queued_ns;           ///< When the operation was queued, for profiling.
+  AlveoFuture *after;           ///< The operation only starts when this one completed successfully, if not NULL.
+  AlveoFuture *future;          ///< Completed with the result of the operation, if not NULL.
+};
+
+#define ALVEO_ASYNC_SPIN 4096    ///< Polls of an empty ring before the thread of a queue goes to sleep.
+
+typedef struct {
+  uint64_t seq;                 ///< Position + 1 once the operation was published, position + depth once it was taken.
+  AlveoAsyncOp op;
+} AlveoAsyncSlot;
+
+typedef struct {
+  uint64_t tail;                ///< Next position to claim. Advanced by the submitters.
+  uint8_t pad0[56];             ///< Keeps the submitters' cache line apart from the thread's.
+  uint64_t head;                ///< Next position to take. Only the thread of the queue uses it.
+  uint64_t executed;
+  uint64_t failed;
+  uint8_t pad1[40];
+  AlveoAsyncSlot *slots;        ///< Ring of depth slots.
+  uint32_t depth;               ///< A power of two.
+  uint32_t sleeping;            ///< The thread sleeps on wake, and must be woken up for new operations.
+  uint64_t full;                ///< Submissions that had to wait for a free slot.
+  pthread_mutex_t lock;         ///< Protects starting the thread, and sleeping on wake.
+  pthread_cond_t wake;          ///< Signalled when operations are queued to a sleeping thread, or the queue stops.
+  pthread_t thread;             ///< Started when the first operation is queued.
+  int started;
+  const AlveoCpuSet *cpus;      ///< Processors the thread runs on, NULL for any.
+  int stop;
+  void *ctx;                    ///< Passed to every operation.
+} AlveoAsyncQueue;
+
+/// @brief Create a future with one reference, held by the caller.
+AlveoFuture *alveoFutureCreate(void);
+
+/// @brief Add a reference to \p f.
+void alveoFutureRetain(AlveoFuture *f);
+
+/// @brief Drop a reference to \p f, and free it if it was the last one.
+void alveoFutureRelease(AlveoFuture *f);
+
+/// @brief Complete \p f with \p status and wake up all waiters.
+void alveoFutureComplete(AlveoFuture *f, fstatus_t status);
+
+/// @brief Wait until \p f completed and return its status.
+fstatus_t alveoFutureWait(AlveoFuture *f);
+
+/// @brief Return 1 and store the status of \p f in \p status if it completed, 0 otherwise.
+int alveoFuturePoll(AlveoFuture *f, fstatus_t *status);
+
+/// @brief Initialize an empty queue of \p depth slots, rounded up to a power of two, whose operations receive \p ctx.
+void alveoAsyncInit(AlveoAsyncQueue *q, void *ctx, uint32_t depth);
+
+/**
+ * @brief Queue a copy of \p op. The queue takes references to op->future and op->after.
+ *
+ * Does not take a lock, except to start the thread of the queue with the first operation, and to wake it up if it was
+ * idle long enough to sleep. Waits for a free slot if all of them are in use.
+ */
+fstatus_t alveoAsyncSubmit(AlveoAsyncQueue *q, const AlveoAsyncOp *op);
+
+/// @brief Execute the remaining operations, then stop the thread of \p q and free it. Later calls do nothing.
+void alveoAsyncTerminate(AlveoAsyncQueue *q);
@@ -0,0 +1,361 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "fletcher/fletcher.h"
+#include "fletcher_alveo.h"
+#include "alveo_cache.h"
+
+// Buffers up to this size are hashed completely.
+#define FULL_HASH_LIMIT (16 * 1024)
+// Larger buffers hash their first and last EDGE bytes, plus SAMPLES words spread evenly over the rest.
+#define EDGE 4096
+#define SAMPLES 256
+// Bytes are hashed in stripes of eight independent 64-bit lanes, so the lanes can be computed in parallel.
+#define LANES 8
+#define STRIPE (LANES * 8)
+
+// Initial keys of the lanes. Every stripe adds KEY_STEP, so that stripes that trade places change the fingerprint.
+static const uint64_t lane_keys[LANES] = {
+    0x9E3779B97F4A7C15ull, 0xBF58476D1CE4E5B9ull, 0x94D049BB133111EBull, 0xC2B2AE3D27D4EB4Full,
+    0x165667B19E3779F9ull, 0x27D4EB2F165667C5ull, 0x85EBCA77C2B2AE63ull, 0xD6E8FEB86659FD93ull};
+#define KEY_STEP 0x2545F4914F6CDD1Dull
+
+static uint64_t mix(uint64_t h, uint64_t v) {
+  h ^= v + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+  h ^= h >> 31;
+  h *= 0xBF58476D1CE4E5B9ull;
+  return h;
+}
+
+// Every lane adds the product of the low and high half of its word, keyed, and the word of its neighbour itself, so no
+// bit of the input is lost in the product. The vector versions compute exactly the same.
+static void accumulate_scalar(uint64_t *acc, const uint8_t *data, int64_t stripes) {
+  uint64_t keys[LANES];
+  memcpy(keys, lane_keys, sizeof(keys));
+  for (int64_t s = 0; s < stripes; s++) {
+    for (int j = 0; j < LANES; j++) {
+      uint64_t v;
+      memcpy(&v, data + s * STRIPE + j * 8, 8);
+      uint64_t k = v ^ keys[j];
+      acc[j ^ 1] += v;
+      acc[j] += (k & 0xFFFFFFFFull) * (k >> 32);
+      keys[j] += KEY_STEP;
+    }
+  }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t *acc, const uint8_t *data, int64_t stripes) {
+  __m256i acc_lo = _mm256_loadu_si256((const __m256i *) acc);
+  __m256i acc_hi = _mm256_loadu_si256((const __m256i *) (acc + 4));
+  __m256i key_lo = _mm256_loadu_si256((const __m256i *) lane_keys);
+  __m256i key_hi = _mm256_loadu_si256((const __m256i *) (lane_keys + 4));
+  __m256i step = _mm256_set1_epi64x((long long) KEY_STEP);
+  for (int64_t s = 0; s < stripes; s++) {
+    __m256i v_lo = _mm256_loadu_si256((const __m256i *) (data + s * STRIPE));
+    __m256i v_hi = _mm256_loadu_si256((const __m256i *) (data + s * STRIPE + 32));
+    __m256i k_lo = _mm256_xor_si256(v_lo, key_lo);
+    __m256i k_hi = _mm256_xor_si256(v_hi, key_hi);
+    __m256i p_lo = _mm256_mul_epu32(k_lo, _mm256_srli_epi64(k_lo, 32));
+    __m256i p_hi = _mm256_mul_epu32(k_hi, _mm256_srli_epi64(k_hi, 32));
+    // Swap the words of neighbouring lanes.
+    acc_lo = _mm256_add_epi64(acc_lo, _mm256_add_epi64(p_lo, _mm256_shuffle_epi32(v_lo, _MM_SHUFFLE(1, 0, 3, 2))));
+    acc_hi = _mm256_add_epi64(acc_hi, _mm256_add_epi64(p_hi, _mm256_shuffle_epi32(v_hi, _MM_SHUFFLE(1, 0, 3, 2))));
+    key_lo = _mm256_add_epi64(key_lo, step);
+    key_hi = _mm256_add_epi64(key_hi, step);
+  }
+  _mm256_storeu_si256((__m256i *) acc, acc_lo);
+  _mm256_storeu_si256((__m256i *) (acc + 4), acc_hi);
+}
+
+__attribute__((target("avx512f")))
+static void accumulate_avx512(uint64_t *acc, const uint8_t *data, int64_t stripes) {
+  __m512i a = _mm512_loadu_si512((const void *) acc);
+  __m512i key = _mm512_loadu_si512((const void *) lane_keys);
+  __m512i step = _mm512_set1_epi64((long long) KEY_STEP);
+  for (int64_t s = 0; s < stripes; s++) {
+    __m512i v = _mm512_loadu_si512((const void *) (data + s * STRIPE));
+    __m512i k = _mm512_xor_si512(v, key);
+    __m512i p = _mm512_mul_epu32(k, _mm512_srli_epi64(k, 32));
+    a = _mm512_add_epi64(a, _mm512_add_epi64(p, _mm512_shuffle_epi32(v, (_MM_PERM_ENUM) _MM_SHUFFLE(1, 0, 3, 2))));
+    key = _mm512_add_epi64(key, step);
+  }
+  _mm512_storeu_si512((void *) acc, a);
+}
+#endif
+
+static uint64_t hash_range(AlveoStageIsa isa, uint64_t h, const uint8_t *data, int64_t size) {
+  uint64_t acc[LANES] = {0};
+  int64_t stripes = size / STRIPE;
+#if defined(__x86_64__)
+  if (isa == ALVEO_STAGE_AVX512) {
+    accumulate_avx512(acc, data, stripes);
+  } else if (isa == ALVEO_STAGE_AVX2) {
+    accumulate_avx2(acc, data, stripes);
+  } else {
+    accumulate_scalar(acc, data, stripes);
+  }
+#else
+  (void) isa;
+  accumulate_scalar(acc, data, stripes);
+#endif
+  for (int j = 0; j < LANES; j++) {
+    h = mix(h, acc[j]);
+  }
+  int64_t i = stripes * STRIPE;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t v;
+    memcpy(&v, data + i, 8);
+    h = mix(h, v);
+  }
+  for (; i < size; i++) {
+    h = mix(h, data[i]);
+  }
+  return h;
+}
+
+uint64_t alveoFingerprint(AlveoStageIsa isa, const uint8_t *data, int64_t size) {
+  uint64_t h = mix(0, (uint64_t) size);
+  if (size <= FULL_HASH_LIMIT) {
+    return hash_range(isa, h, data, size);
+  }
+  h = hash_range(isa, h, data, EDGE);
+  h = hash_range(isa, h, data + size - EDGE, EDGE);
+  int64_t stride = (size - 2 * EDGE) / SAMPLES;
+  for (int64_t s = 0; s < SAMPLES; s++) {
+    uint64_t v;
+    memcpy(&v, data + EDGE + s * stride, 8);
+    h = mix(h, v);
+  }
+  return h;
+}
+
+static uint32_t bucket_of(uint64_t key) {
+  return (uint32_t) (mix(0, key) & (ALVEO_CACHE_BUCKETS - 1));
+}
+
+static void lru_unlink(AlveoCache *cache, AlveoCacheEntry *e) {
+  if (e->lru_prev != NULL) {
+    e->lru_prev->lru_next = e->lru_next;
+  } else {
+    cache->lru_head = e->lru_next;
+  }
+  if (e->lru_next != NULL) {
+    e->lru_next->lru_prev = e->lru_prev;
+  } else {
+    cache->lru_tail = e->lru_prev;
+  }
+  e->lru_prev = NULL;
+  e->lru_next = NULL;
+}
+
+static void lru_push_front(AlveoCache *cache, AlveoCacheEntry *e) {
+  e->lru_prev = NULL;
+  e->lru_next = cache->lru_head;
+  if (cache->lru_head != NULL) {
+    cache->lru_head->lru_prev = e;
+  } else {
+    cache->lru_tail = e;
+  }
+  cache->lru_head = e;
+}
+
+static void unlink_host(AlveoCache *cache, AlveoCacheEntry *e) {
+  AlveoCacheEntry **p = &cache->by_host[bucket_of((uint64_t) e->host)];
+  while (*p != NULL) {
+    if (*p == e) {
+      *p = e->host_next;
+      break;
+    }
+    p = &(*p)->host_next;
+  }
+  e->host_next = NULL;
+}
+
+void alveoCacheRemove(AlveoCache *cache, AlveoDevMem *dm, AlveoCacheEntry *entry) {
+  if (!entry->stale) {
+    unlink_host(cache, entry);
+  }
+  AlveoCacheEntry **p = &cache->by_dev[bucket_of(entry->device)];
+  while (*p != NULL) {
+    if (*p == entry) {
+      *p = entry->dev_next;
+      break;
+    }
+    p = &(*p)->dev_next;
+  }
+  lru_unlink(cache, entry);
+  cache->resident -= (uint64_t) entry->size;
+  alveoDevMemFree(dm, entry->device);
+  free(entry);
+}
+
+AlveoCacheEntry *alveoCacheLookup(AlveoCache *cache, AlveoDevMem *dm, const uint8_t *host, int64_t size,
+                                  uint64_t fingerprint, uint64_t banks) {
+  if (cache->budget == 0) {
+    return NULL;
+  }
+  AlveoCacheEntry *next;
+  for (AlveoCacheEntry *e = cache->by_host[bucket_of((uint64_t) host)]; e != NULL; e = next) {
+    next = e->host_next;
+    if ((e->host != host) || (e->size != size)) {
+      continue;
+    }
+    if (e->fingerprint == fingerprint) {
+      // A copy the caller's compute unit cannot reach does not count.
+      if ((e->bank < 0) || (e->bank >= 64) || !((banks >> e->bank) & 1)) {
+        continue;
+      }
+      e->refs++;
+      lru_unlink(cache, e);
+      lru_push_front(cache, e);
+      cache->stats.hits++;
+      cache->stats.bytes_saved += (uint64_t) size;
+      return e;
+    }
+    // The buffer was modified or the host memory was reused. Drop the old copy once nobody uses it anymore.
+    cache->stats.invalidations++;
+    if (e->refs == 0) {
+      alveoCacheRemove(cache, dm, e);
+    } else {
+      unlink_host(cache, e);
+      e->stale = 1;
+    }
+  }
+  cache->stats.misses++;
+  return NULL;
+}
+
+// Drop a reference to e, and free it if it was the last one of a stale entry.
+static void drop_ref(AlveoCache *cache, AlveoDevMem *dm, AlveoCacheEntry *e) {
+  if (e->refs > 0) {
+    e->refs--;
+  }
+  if (e->stale && (e->refs == 0)) {
+    alveoCacheRemove(cache, dm, e);
+  }
+}
+
+int alveoCacheWaitReady(AlveoCache *cache, AlveoDevMem *dm, AlveoCacheEntry *entry, pthread_mutex_t *lock) {
+  while (entry->pending) {
+    pthread_cond_wait(&cache->ready, lock);
+  }
+  if (entry->failed) {
+    drop_ref(cache, dm, entry);
+    return 0;
+  }
+  return 1;
+}
+
+AlveoCacheEntry *alveoCacheInsert(AlveoCache *cache, AlveoDevMem *dm, const uint8_t *host, int64_t size,
+                                  uint64_t fingerprint, uint64_t banks) {
+  // Buffers that would take more than half of the budget would flush everything else; do not admit them.
+  if ((cache->budget == 0) || ((uint64_t) size > cache->budget / 2)) {
+    cache->stats.bypasses++;
+    return NULL;
+  }
+  // Evict unreferenced entries from the cold end of the LRU list until the new buffer fits.
+  AlveoCacheEntry *victim = cache->lru_tail;
+  while ((cache->resident + (uint64_t) size > cache->budget) && (victim != NULL)) {
+    AlveoCacheEntry *prev = victim->lru_prev;
+    if (victim->refs == 0) {
+      alveoCacheRemove(cache, dm, victim);
+      cache->stats.evictions++;
+    }
+    victim = prev;
+  }
+  if (cache->resident + (uint64_t) size > cache->budget) {
+    cache->stats.bypasses++;
+    return NULL;
+  }
+  AlveoCacheEntry *e = (AlveoCacheEntry *) calloc(1, sizeof(AlveoCacheEntry));
+  if (e == NULL) {
+    return NULL;
+  }
+  uint64_t offset;
+  if (alveoDevMemAllocBanks(dm, &e->device, size, banks) != FLETCHER_STATUS_OK) {
+    free(e);
+    cache->stats.bypasses++;
+    return NULL;
+  }
+  e->bank = alveoDevMemFind(dm, e->device, size, &offset)->bank;
+  e->host = host;
+  e->size = size;
+  e->fingerprint = fingerprint;
+  e->refs = 1;
+  e->pending = 1;
+  uint32_t hb = bucket_of((uint64_t) host);
+  e->host_next = cache->by_host[hb];
+  cache->by_host[hb] = e;
+  uint32_t db = bucket_of(e->device);
+  e->dev_next = cache->by_dev[db];
+  cache->by_dev[db] = e;
+  lru_push_front(cache, e);
+  cache->resident += (uint64_t) size;
+  return e;
+}
+
+void alveoCacheReady(AlveoCache *cache, AlveoDevMem *dm, AlveoCacheEntry *entry, int ok) {
+  entry->pending = 0;
+  if (!ok) {
+    // Nobody finds the entry anymore; the threads that already did see that it failed.
+    entry->failed = 1;
+    if (!entry->stale) {
+      unlink_host(cache, entry);
+      entry->stale = 1;
+    }
+    drop_ref(cache, dm, entry);
+  }
+  pthread_cond_broadcast(&cache->ready);
+}
+
+int alveoCacheRelease(AlveoCache *cache, AlveoDevMem *dm, da_t device) {
+  for (AlveoCacheEntry *e = cache->by_dev[bucket_of(device)]; e != NULL; e = e->dev_next) {
+    if (e->device == device) {
+      drop_ref(cache, dm, e);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void alveoCacheTerminate(AlveoCache *cache, AlveoDevMem *dm) {
+  while (cache->lru_head != NULL) {
+    alveoCacheRemove(cache, dm, cache->lru_head);
+  }
+}
+
+void alveoCachePrintStats(const AlveoCache *cache) {
+  const AlveoCacheStats *s = &cache->stats;
+  fprintf(stderr,
+          "[FLETCHER_ALVEO] Cache: %lu hits, %lu misses, %lu evictions, %lu invalidations, %lu bypasses, "
+          "%lu bytes saved, %lu / %lu bytes resident.\n",
+          (unsigned long) s->hits,
+          (unsigned long) s->misses,
+          (unsigned long) s->evictions,
+          (unsigned long) s->invalidations,
+          (unsigned long) s->bypasses,
+          (unsigned long) s->bytes_saved,
+          (unsigned long) cache->resident,
+          (unsigned long) cache->budget);
+}
@@ -0,0 +1,121 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "fletcher/fletcher.h"
+#include "alveo_devmem.h"
+#include "alveo_stage.h"
+
+// Resident-buffer cache behind platformCacheHostBuffer.
+//
+// Buffers are keyed by host address, size and a fingerprint of their contents, so that uploading the same unchanged
+// Arrow buffer again returns the device copy that is already resident. Entries are reference counted: every hit or
+// insert takes a reference, and platformDeviceFree on a cached address drops it again without freeing the memory.
+// Unreferenced entries are evicted in LRU order once the resident size would exceed the budget.
+//
+// An entry is visible from the moment it is inserted, but pending until its upload completed; a lookup that finds it
+// waits for that. If the upload fails, the entry is dropped as soon as the threads waiting on it let go.
+//
+// Compute units may be connected to different banks. Copies are placed in a bank the uploading compute unit can reach,
+// and a lookup only returns copies in the banks it is given, so the same buffer may be resident once per bank group.
+
+#define ALVEO_CACHE_BUCKETS 4096
+
+typedef struct AlveoCacheEntry {
+  const uint8_t *host;
+  int64_t size;
+  uint64_t fingerprint;
+  da_t device;
+  int bank;                             ///< Bank the copy was placed in.
+  uint32_t refs;
+  int stale;                            ///< Contents changed; freed as soon as the last reference is dropped.
+  int pending;                          ///< Still being uploaded by the thread that inserted it.
+  int failed;                           ///< The upload failed. Also stale.
+  struct AlveoCacheEntry *host_next;    ///< Chain in the host key table.
+  struct AlveoCacheEntry *dev_next;     ///< Chain in the device address table.
+  struct AlveoCacheEntry *lru_prev;     ///< Towards the most recently used entry.
+  struct AlveoCacheEntry *lru_next;
+} AlveoCacheEntry;
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t invalidations;
+  uint64_t bypasses;                    ///< Buffers that did not fit in the budget and were uploaded uncached.
+  uint64_t bytes_saved;                 ///< PCIe traffic avoided by hits.
+} AlveoCacheStats;
+
+typedef struct {
+  uint64_t budget;                      ///< Maximum resident bytes, 0 disables the cache.
+  uint64_t resident;
+  AlveoCacheEntry *by_host[ALVEO_CACHE_BUCKETS];
+  AlveoCacheEntry *by_dev[ALVEO_CACHE_BUCKETS];
+  AlveoCacheEntry *lru_head;            ///< Most recently used.
+  AlveoCacheEntry *lru_tail;
+  pthread_cond_t ready;                 ///< Broadcast when a pending entry was uploaded or failed.
+  AlveoCacheStats stats;
+} AlveoCache;
+
+/// @brief Cheap fingerprint of \p size bytes at \p data, computed with instruction set \p isa. Small buffers are hashed
+/// completely, large buffers are sampled. Every instruction set computes the same fingerprint.
+uint64_t alveoFingerprint(AlveoStageIsa isa, const uint8_t *data, int64_t size);
+
+/// @brief Return the resident copy of \p host in one of the banks set in the mask \p banks, taking a reference, or NULL
+/// on a miss.
+AlveoCacheEntry *alveoCacheLookup(AlveoCache *cache, AlveoDevMem *dm, const uint8_t *host, int64_t size,
+                                  uint64_t fingerprint, uint64_t banks);
+
+/**
+ * @brief Wait until \p entry, returned by alveoCacheLookup, was uploaded.
+ *
+ * \p lock is the lock the caller holds around the cache. Returns 0, having dropped the reference to \p entry, if the
+ * upload failed.
+ */
+int alveoCacheWaitReady(AlveoCache *cache, AlveoDevMem *dm, AlveoCacheEntry *entry, pthread_mutex_t *lock);
+
+/**
+ * @brief Allocate device memory for a new entry in one of the banks set in the mask \p banks, evicting unreferenced
+ * entries if required.
+ *
+ * The entry is pending. The caller must copy the buffer to the entry's device address, and then report the result
+ * with alveoCacheReady.
+ *
+ * @return The new entry holding one reference, or NULL if the buffer does not fit in the budget.
+ */
+AlveoCacheEntry *alveoCacheInsert(AlveoCache *cache, AlveoDevMem *dm, const uint8_t *host, int64_t size,
+                                  uint64_t fingerprint, uint64_t banks);
+
+/**
+ * @brief End the upload of pending \p entry, and wake up the threads waiting on it.
+ *
+ * If \p ok is 0, the reference of the caller is dropped, and the entry is removed once the waiters dropped theirs.
+ */
+void alveoCacheReady(AlveoCache *cache, AlveoDevMem *dm, AlveoCacheEntry *entry, int ok);
+
+/// @brief Remove \p entry and free its device memory, regardless of its references.
+void alveoCacheRemove(AlveoCache *cache, AlveoDevMem *dm, AlveoCacheEntry *entry);
+
+/// @brief Drop a reference to the entry at \p device. Returns 0 if \p device is not a cached address.
+int alveoCacheRelease(AlveoCache *cache, AlveoDevMem *dm, da_t device);
+
+/// @brief Remove all entries and free their device memory.
+void alveoCacheTerminate(AlveoCache *cache, AlveoDevMem *dm);
+
+/// @brief Print the counters of \p cache to stderr.
+void alveoCachePrintStats(const AlveoCache *cache);
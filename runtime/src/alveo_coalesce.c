@@ -0,0 +1,217 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fletcher/fletcher.h"
+#include "alveo_emu.h"
+#include "alveo_coalesce.h"
+
+#define INITIAL_CAPACITY 16
+
+// Take the batch being gathered. Called with the lock held.
+static AlveoCoalesceBatch *take_batch(AlveoCoalescer *c) {
+  AlveoCoalesceBatch *batch = c->batch;
+  c->batch = NULL;
+  c->capacity = 0;
+  c->stats.batches++;
+  if (batch->num_jobs > c->stats.max_jobs) {
+    c->stats.max_jobs = batch->num_jobs;
+  }
+  return batch;
+}
+
+// Hand \p batch over, or fail its jobs if that is not possible.
+static void hand_over(AlveoCoalescer *c, AlveoCoalesceBatch *batch) {
+  if (c->submit(c->ctx, batch) != FLETCHER_STATUS_OK) {
+    alveoCoalesceComplete(batch, FLETCHER_STATUS_ERROR);
+  }
+}
+
+// Hands batches over when their first job waited long enough, or when asked to. Full batches are handed over by the
+// thread that filled them, so that they do not grow while this thread is not scheduled.
+static void *coalesce_main(void *p) {
+  AlveoCoalescer *c = (AlveoCoalescer *) p;
+  pthread_mutex_lock(&c->lock);
+  for (;;) {
+    if (c->batch == NULL) {
+      c->flush = 0;
+      if (c->stop) {
+        break;
+      }
+      pthread_cond_wait(&c->wake, &c->lock);
+      continue;
+    }
+    // The batch may have been taken and replaced while waiting, so the deadline is that of the current one.
+    uint64_t deadline = c->oldest_ns + c->max_delay_ns;
+    if (!c->flush && !c->stop && (alveoNowNs() < deadline)) {
+      struct timespec ts = {.tv_sec = (time_t) (deadline / 1000000000), .tv_nsec = (long) (deadline % 1000000000)};
+      pthread_cond_timedwait(&c->wake, &c->lock, &ts);
+      continue;
+    }
+    if (c->flush || c->stop) {
+      c->stats.flushed++;
+    } else {
+      c->stats.expired++;
+    }
+    c->flush = 0;
+    AlveoCoalesceBatch *batch = take_batch(c);
+    pthread_mutex_unlock(&c->lock);
+    hand_over(c, batch);
+    pthread_mutex_lock(&c->lock);
+  }
+  pthread_mutex_unlock(&c->lock);
+  return NULL;
+}
+
+fstatus_t alveoCoalesceStart(AlveoCoalescer *c, const AlveoCoalesceLayout *layout, int64_t max_rows,
+                             uint64_t max_delay_ns, AlveoCoalesceSubmitFn submit, void *ctx) {
+  memset(c, 0, sizeof(*c));
+  if ((layout->num_inputs > ALVEO_COALESCE_MAX_BUFFERS) || (layout->num_outputs > ALVEO_COALESCE_MAX_BUFFERS)
+      || (max_rows <= 0) || (submit == NULL)) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  c->layout = *layout;
+  c->max_rows = max_rows;
+  c->max_delay_ns = max_delay_ns;
+  c->submit = submit;
+  c->ctx = ctx;
+  pthread_mutex_init(&c->lock, NULL);
+  // Deadlines are taken from alveoNowNs, which reads the monotonic clock.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&c->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&c->thread, NULL, coalesce_main, c) != 0) {
+    pthread_cond_destroy(&c->wake);
+    pthread_mutex_destroy(&c->lock);
+    return FLETCHER_STATUS_ERROR;
+  }
+  c->running = 1;
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t alveoCoalesceSubmit(AlveoCoalescer *c, int64_t num_rows, const uint8_t *const *inputs,
+                              uint8_t *const *outputs, AlveoFuture **future) {
+  if (!c->running || (num_rows < 0)) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  AlveoFuture *f = alveoFutureCreate();
+  if (f == NULL) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  pthread_mutex_lock(&c->lock);
+  if ((c->batch == NULL) && !c->stop) {
+    c->batch = (AlveoCoalesceBatch *) calloc(1, sizeof(AlveoCoalesceBatch));
+  }
+  AlveoCoalesceBatch *batch = c->batch;
+  if ((batch != NULL) && (batch->num_jobs == c->capacity)) {
+    uint32_t capacity = c->capacity == 0 ? INITIAL_CAPACITY : 2 * c->capacity;
+    AlveoCoalesceJob *jobs = (AlveoCoalesceJob *) realloc(batch->jobs, capacity * sizeof(AlveoCoalesceJob));
+    if (jobs != NULL) {
+      batch->jobs = jobs;
+      c->capacity = capacity;
+    }
+  }
+  if (c->stop || (batch == NULL) || (batch->num_jobs == c->capacity)) {
+    pthread_mutex_unlock(&c->lock);
+    alveoFutureRelease(f);
+    return FLETCHER_STATUS_ERROR;
+  }
+  AlveoCoalesceJob *job = &batch->jobs[batch->num_jobs++];
+  memset(job, 0, sizeof(*job));
+  job->num_rows = num_rows;
+  for (uint32_t i = 0; i < c->layout.num_inputs; i++) {
+    job->inputs[i] = inputs[i];
+  }
+  for (uint32_t i = 0; i < c->layout.num_outputs; i++) {
+    job->outputs[i] = outputs[i];
+  }
+  job->first = batch->num_rows;
+  job->future = f;
+  batch->num_rows += num_rows;
+  c->stats.jobs++;
+  c->stats.rows += (uint64_t) num_rows;
+  if (future != NULL) {
+    alveoFutureRetain(f);
+    *future = f;
+  }
+  AlveoCoalesceBatch *full = NULL;
+  if (batch->num_rows >= c->max_rows) {
+    c->stats.full++;
+    full = take_batch(c);
+  } else if (batch->num_jobs == 1) {
+    // The thread only needs to know when a batch starts, for its deadline.
+    c->oldest_ns = alveoNowNs();
+    pthread_cond_signal(&c->wake);
+  }
+  pthread_mutex_unlock(&c->lock);
+  if (full != NULL) {
+    hand_over(c, full);
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+void alveoCoalesceFlush(AlveoCoalescer *c) {
+  if (!c->running) {
+    return;
+  }
+  pthread_mutex_lock(&c->lock);
+  if (c->batch != NULL) {
+    c->flush = 1;
+    pthread_cond_signal(&c->wake);
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+void alveoCoalesceComplete(AlveoCoalesceBatch *batch, fstatus_t status) {
+  for (uint32_t j = 0; j < batch->num_jobs; j++) {
+    alveoFutureComplete(batch->jobs[j].future, status);
+    alveoFutureRelease(batch->jobs[j].future);
+  }
+  free(batch->jobs);
+  free(batch);
+}
+
+void alveoCoalesceStop(AlveoCoalescer *c) {
+  if (!c->running) {
+    return;
+  }
+  pthread_mutex_lock(&c->lock);
+  c->stop = 1;
+  pthread_cond_signal(&c->wake);
+  pthread_mutex_unlock(&c->lock);
+  pthread_join(c->thread, NULL);
+  c->running = 0;
+  pthread_cond_destroy(&c->wake);
+  pthread_mutex_destroy(&c->lock);
+}
+
+void alveoCoalescePrintStats(const AlveoCoalescer *c) {
+  const AlveoCoalesceStats *s = &c->stats;
+  fprintf(stderr, "[FLETCHER_ALVEO] Coalescing: %lu jobs, %lu rows in %lu batches (%lu full, %lu expired, "
+                  "%lu flushed), %lu jobs per batch average, %lu max.\n",
+          (unsigned long) s->jobs,
+          (unsigned long) s->rows,
+          (unsigned long) s->batches,
+          (unsigned long) s->full,
+          (unsigned long) s->expired,
+          (unsigned long) s->flushed,
+          (unsigned long) (s->batches > 0 ? s->jobs / s->batches : 0),
+          (unsigned long) s->max_jobs);
+}
@@ -0,0 +1,119 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "fletcher/fletcher.h"
+#include "alveo_async.h"
+
+// Coalescing of small jobs.
+//
+// Every kernel run pays for its register writes, the start pulse and the status poll, which dominates when record
+// batches are small. A coalescer gathers jobs until they hold enough rows, or the oldest one waited long enough, and
+// hands them over as one batch. The batch is run as one job: the buffers of its jobs are packed back to back, the
+// kernel runs once over the combined index range, and the results are split back out to the jobs. Every job has a
+// future of its own, completed when its results are in place.
+//
+// Packing by concatenation only holds for buffers with a fixed number of bytes per row: values of fixed-width types,
+// and results with one value per row. Offsets and validity bitmaps would have to be rebased and shifted.
+
+#define ALVEO_COALESCE_MAX_BUFFERS 16
+
+/// @brief How the kernel takes the index range and buffers of a batch.
+typedef struct {
+  uint32_t num_inputs;
+  uint32_t input_width[ALVEO_COALESCE_MAX_BUFFERS];   ///< Bytes per row of every input buffer.
+  uint32_t num_outputs;
+  uint32_t output_width[ALVEO_COALESCE_MAX_BUFFERS];  ///< Bytes per row of every output buffer.
+  uint64_t index_reg;           ///< Register of the first index. The last index, exclusive, is the next one.
+  uint64_t buffer_reg;          ///< Register of the first buffer address, inputs first, then outputs, two per address.
+  uint64_t timeout_us;          ///< Status wait limit of a batch, 0 for none.
+} AlveoCoalesceLayout;
+
+typedef struct {
+  int64_t num_rows;
+  const uint8_t *inputs[ALVEO_COALESCE_MAX_BUFFERS];
+  uint8_t *outputs[ALVEO_COALESCE_MAX_BUFFERS];
+  int64_t first;                ///< Index of its first row in the batch.
+  AlveoFuture *future;
+} AlveoCoalesceJob;
+
+typedef struct {
+  AlveoCoalesceJob *jobs;
+  uint32_t num_jobs;
+  int64_t num_rows;
+} AlveoCoalesceBatch;
+
+/// @brief Start running \p batch, e.g. by dispatching it. Whoever runs it completes it with alveoCoalesceComplete.
+typedef fstatus_t (*AlveoCoalesceSubmitFn)(void *ctx, AlveoCoalesceBatch *batch);
+
+typedef struct {
+  uint64_t jobs;
+  uint64_t rows;
+  uint64_t batches;
+  uint64_t full;                ///< Batches handed over by alveoCoalesceSubmit because they reached the row limit.
+  uint64_t expired;             ///< Batches handed over because the oldest job waited the longest delay.
+  uint64_t flushed;             ///< Batches handed over by alveoCoalesceFlush or alveoCoalesceStop.
+  uint64_t max_jobs;            ///< Most jobs in one batch.
+} AlveoCoalesceStats;
+
+typedef struct {
+  AlveoCoalesceLayout layout;
+  int64_t max_rows;             ///< A batch is handed over as soon as it holds this many rows.
+  uint64_t max_delay_ns;        ///< Or when its oldest job waited this long.
+  AlveoCoalesceSubmitFn submit;
+  void *ctx;
+  pthread_t thread;
+  int running;
+  pthread_mutex_t lock;         ///< Protects the fields below.
+  pthread_cond_t wake;          ///< Signalled when a batch starts, must be handed over, or the coalescer stops.
+  AlveoCoalesceBatch *batch;    ///< The batch being gathered, NULL if there is no job yet.
+  uint32_t capacity;            ///< Jobs that fit in batch->jobs.
+  uint64_t oldest_ns;           ///< When the first job of the batch was submitted.
+  int flush;
+  int stop;
+  AlveoCoalesceStats stats;
+} AlveoCoalescer;
+
+/// @brief Start the thread of \p c, which hands batches of jobs over to \p submit(\p ctx, batch) when they expire.
+fstatus_t alveoCoalesceStart(AlveoCoalescer *c, const AlveoCoalesceLayout *layout, int64_t max_rows,
+                             uint64_t max_delay_ns, AlveoCoalesceSubmitFn submit, void *ctx);
+
+/**
+ * @brief Add a job of \p num_rows rows to the batch being gathered.
+ *
+ * If the batch now holds max_rows rows, it is handed over by the calling thread.
+ *
+ * \p inputs and \p outputs hold layout.num_inputs and layout.num_outputs buffers, of num_rows times their width bytes.
+ * They must stay valid until the job completed.
+ *
+ * @param future                A future completed with the status of the batch is stored here; release it with
+ *                              alveoFutureRelease. May be NULL.
+ */
+fstatus_t alveoCoalesceSubmit(AlveoCoalescer *c, int64_t num_rows, const uint8_t *const *inputs,
+                              uint8_t *const *outputs, AlveoFuture **future);
+
+/// @brief Hand the batch being gathered over right away.
+void alveoCoalesceFlush(AlveoCoalescer *c);
+
+/// @brief Complete the futures of all jobs of \p batch with \p status, and free it.
+void alveoCoalesceComplete(AlveoCoalesceBatch *batch, fstatus_t status);
+
+/// @brief Hand the remaining jobs over, then stop the thread of \p c.
+void alveoCoalesceStop(AlveoCoalescer *c);
+
+void alveoCoalescePrintStats(const AlveoCoalescer *c);
@@ -0,0 +1,409 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fletcher/fletcher.h"
+#include "fletcher_alveo.h"
+#include "alveo_devmem.h"
+
+#define NIL UINT32_MAX
+
+// State of a granule. Only the first granule of a block has one other than GRANULE_NONE, so that only the address a
+// block was handed out at can be freed.
+enum {
+  GRANULE_NONE = 0,
+  GRANULE_FREE = 1,
+  GRANULE_USED = 2,
+  GRANULE_SLAB = 3
+};
+
+static void list_push(AlveoArena *a, uint32_t k, uint32_t idx) {
+  a->state[idx] = GRANULE_FREE;
+  a->order[idx] = (uint8_t) k;
+  a->prev[idx] = NIL;
+  a->next[idx] = a->free_head[k];
+  if (a->free_head[k] != NIL) {
+    a->prev[a->free_head[k]] = idx;
+  }
+  a->free_head[k] = idx;
+}
+
+static void list_remove(AlveoArena *a, uint32_t k, uint32_t idx) {
+  if (a->prev[idx] != NIL) {
+    a->next[a->prev[idx]] = a->next[idx];
+  } else {
+    a->free_head[k] = a->next[idx];
+  }
+  if (a->next[idx] != NIL) {
+    a->prev[a->next[idx]] = a->prev[idx];
+  }
+}
+
+static uint32_t buddy_alloc(AlveoArena *a, uint32_t order) {
+  uint32_t k = order;
+  while ((k < ALVEO_DEVMEM_MAX_ORDERS) && (a->free_head[k] == NIL)) {
+    k++;
+  }
+  if (k == ALVEO_DEVMEM_MAX_ORDERS) {
+    return NIL;
+  }
+  uint32_t idx = a->free_head[k];
+  list_remove(a, k, idx);
+  // Split until the block has the requested order, returning the upper halves to the free lists.
+  while (k > order) {
+    k--;
+    list_push(a, k, idx + (1u << k));
+  }
+  a->state[idx] = GRANULE_USED;
+  a->order[idx] = (uint8_t) order;
+  return idx;
+}
+
+static void buddy_free(AlveoArena *a, uint32_t idx) {
+  uint32_t k = a->order[idx];
+  while (k + 1 < ALVEO_DEVMEM_MAX_ORDERS) {
+    uint32_t buddy = idx ^ (1u << k);
+    uint32_t merged = idx < buddy ? idx : buddy;
+    if (((uint64_t) merged + (2ull << k) > a->num_granules) || (a->state[buddy] != GRANULE_FREE)
+        || (a->order[buddy] != k)) {
+      break;
+    }
+    list_remove(a, k, buddy);
+    // The two halves stop being blocks of their own.
+    a->state[idx] = GRANULE_NONE;
+    a->state[buddy] = GRANULE_NONE;
+    idx = merged;
+    k++;
+  }
+  list_push(a, k, idx);
+}
+
+static uint32_t order_of(uint64_t size) {
+  uint64_t granules = (size + ALVEO_DEVMEM_GRANULE - 1) >> ALVEO_DEVMEM_GRANULE_SHIFT;
+  uint32_t order = 0;
+  while ((1ull << order) < granules) {
+    order++;
+  }
+  return order;
+}
+
+static uint32_t class_of(uint64_t size) {
+  uint32_t c = 0;
+  while ((1ull << (c + ALVEO_DEVMEM_SLAB_MIN_SHIFT)) < size) {
+    c++;
+  }
+  return c;
+}
+
+static void account_alloc(AlveoArena *a, uint64_t bytes) {
+  a->stats.allocs++;
+  a->stats.in_use += bytes;
+  if (a->stats.in_use > a->stats.peak) {
+    a->stats.peak = a->stats.in_use;
+  }
+}
+
+static void slab_unlink(AlveoArena *a, AlveoSlab *slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    a->partial[slab->size_class] = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+  slab->next = NULL;
+  slab->prev = NULL;
+}
+
+static void slab_link(AlveoArena *a, AlveoSlab *slab) {
+  slab->prev = NULL;
+  slab->next = a->partial[slab->size_class];
+  if (slab->next != NULL) {
+    slab->next->prev = slab;
+  }
+  a->partial[slab->size_class] = slab;
+}
+
+static int slab_alloc(AlveoArena *a, uint32_t size_class, uint64_t *offset) {
+  AlveoSlab *slab = a->partial[size_class];
+  if (slab == NULL) {
+    uint32_t granule = buddy_alloc(a, 0);
+    if (granule == NIL) {
+      return 0;
+    }
+    slab = (AlveoSlab *) calloc(1, sizeof(AlveoSlab));
+    if (slab == NULL) {
+      buddy_free(a, granule);
+      return 0;
+    }
+    slab->granule = granule;
+    slab->size_class = size_class;
+    slab->num_objects = (uint32_t) (ALVEO_DEVMEM_GRANULE >> (size_class + ALVEO_DEVMEM_SLAB_MIN_SHIFT));
+    slab->num_free = slab->num_objects;
+    for (uint32_t i = 0; i < slab->num_objects; i++) {
+      slab->free_map[i / 64] |= 1ull << (i % 64);
+    }
+    a->state[granule] = GRANULE_SLAB;
+    a->slabs[granule] = slab;
+    a->stats.slab_bytes += ALVEO_DEVMEM_GRANULE;
+    slab_link(a, slab);
+  }
+  uint32_t w = 0;
+  while (slab->free_map[w] == 0) {
+    w++;
+  }
+  uint32_t obj = w * 64 + (uint32_t) __builtin_ctzll(slab->free_map[w]);
+  slab->free_map[w] &= ~(1ull << (obj % 64));
+  if (--slab->num_free == 0) {
+    slab_unlink(a, slab);
+  }
+  *offset = ((uint64_t) slab->granule << ALVEO_DEVMEM_GRANULE_SHIFT)
+      + ((uint64_t) obj << (size_class + ALVEO_DEVMEM_SLAB_MIN_SHIFT));
+  account_alloc(a, 1ull << (size_class + ALVEO_DEVMEM_SLAB_MIN_SHIFT));
+  return 1;
+}
+
+static fstatus_t slab_free(AlveoArena *a, AlveoSlab *slab, uint64_t offset) {
+  uint32_t shift = slab->size_class + ALVEO_DEVMEM_SLAB_MIN_SHIFT;
+  uint64_t in_slab = offset - ((uint64_t) slab->granule << ALVEO_DEVMEM_GRANULE_SHIFT);
+  uint32_t obj = (uint32_t) (in_slab >> shift);
+  if ((in_slab & ((1ull << shift) - 1)) || (slab->free_map[obj / 64] & (1ull << (obj % 64)))) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  slab->free_map[obj / 64] |= 1ull << (obj % 64);
+  if (slab->num_free++ == 0) {
+    slab_link(a, slab);
+  }
+  a->stats.frees++;
+  a->stats.in_use -= 1ull << shift;
+  // Hand empty slabs back to the buddy allocator, but keep the last one of a class around to avoid thrashing.
+  if ((slab->num_free == slab->num_objects) && ((a->partial[slab->size_class] != slab) || (slab->next != NULL))) {
+    slab_unlink(a, slab);
+    a->slabs[slab->granule] = NULL;
+    a->stats.slab_bytes -= ALVEO_DEVMEM_GRANULE;
+    buddy_free(a, slab->granule);
+    free(slab);
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t alveoDevMemAddArena(AlveoDevMem *dm, da_t base, uint64_t size, int bank, cl_mem mem) {
+  if (dm->num_arenas == ALVEO_DEVMEM_MAX_ARENAS) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  AlveoArena *a = &dm->arenas[dm->num_arenas];
+  memset(a, 0, sizeof(*a));
+  a->base = base;
+  a->num_granules = (uint32_t) (size >> ALVEO_DEVMEM_GRANULE_SHIFT);
+  a->size = (uint64_t) a->num_granules << ALVEO_DEVMEM_GRANULE_SHIFT;
+  a->bank = bank;
+  a->mem = mem;
+  a->state = (uint8_t *) calloc(a->num_granules, sizeof(uint8_t));
+  a->order = (uint8_t *) calloc(a->num_granules, sizeof(uint8_t));
+  a->next = (uint32_t *) malloc(a->num_granules * sizeof(uint32_t));
+  a->prev = (uint32_t *) malloc(a->num_granules * sizeof(uint32_t));
+  a->slabs = (AlveoSlab **) calloc(a->num_granules, sizeof(AlveoSlab *));
+  if ((a->num_granules == 0) || !a->state || !a->order || !a->next || !a->prev || !a->slabs) {
+    free(a->state);
+    free(a->order);
+    free(a->next);
+    free(a->prev);
+    free(a->slabs);
+    return FLETCHER_STATUS_ERROR;
+  }
+  for (uint32_t k = 0; k < ALVEO_DEVMEM_MAX_ORDERS; k++) {
+    a->free_head[k] = NIL;
+  }
+  // Seed the free lists with the largest naturally aligned blocks that fit, so arenas need not be a power of two.
+  uint32_t idx = 0;
+  while (idx < a->num_granules) {
+    uint32_t k = 0;
+    while ((k + 1 < ALVEO_DEVMEM_MAX_ORDERS) && ((idx & ((2u << k) - 1)) == 0)
+        && ((uint64_t) idx + (2u << k) <= a->num_granules)) {
+      k++;
+    }
+    list_push(a, k, idx);
+    idx += 1u << k;
+  }
+  a->stats.capacity = a->size;
+  dm->num_arenas++;
+  if ((bank >= 0) && (bank < 64)) {
+    dm->banks |= 1ull << bank;
+  }
+  debug_print("[FLETCHER_ALVEO] Added device memory arena.  [dev] 0x%016lX (%lu bytes) in bank %d.\n",
+              (unsigned long) base,
+              (unsigned long) a->size,
+              bank);
+  return FLETCHER_STATUS_OK;
+}
+
+static int arena_alloc(AlveoArena *a, uint64_t size, uint64_t *offset) {
+  if (size <= (ALVEO_DEVMEM_GRANULE >> 1)) {
+    return slab_alloc(a, class_of(size), offset);
+  }
+  uint32_t order = order_of(size);
+  if (order >= ALVEO_DEVMEM_MAX_ORDERS) {
+    return 0;
+  }
+  uint32_t idx = buddy_alloc(a, order);
+  if (idx == NIL) {
+    return 0;
+  }
+  *offset = (uint64_t) idx << ALVEO_DEVMEM_GRANULE_SHIFT;
+  account_alloc(a, ALVEO_DEVMEM_GRANULE << order);
+  return 1;
+}
+
+static int in_banks(const AlveoArena *a, uint64_t banks) {
+  return (a->bank >= 0) && (a->bank < 64) && ((banks >> a->bank) & 1);
+}
+
+fstatus_t alveoDevMemAllocBanks(AlveoDevMem *dm, da_t *device_address, int64_t size, uint64_t banks) {
+  uint64_t bytes = size > 0 ? (uint64_t) size : 1;
+  uint64_t tried = 0;
+  // Try the candidate arenas from the least to the most utilized, so that buffers spread over the banks and the
+  // bandwidth of all of them is used. Equally utilized arenas are taken round-robin, starting at next_arena.
+  for (;;) {
+    AlveoArena *best = NULL;
+    uint32_t best_n = 0;
+    double best_use = 0.0;
+    for (uint32_t i = 0; i < dm->num_arenas; i++) {
+      uint32_t n = (dm->next_arena + i) % dm->num_arenas;
+      AlveoArena *a = &dm->arenas[n];
+      if (!in_banks(a, banks) || ((tried >> n) & 1)) {
+        continue;
+      }
+      double use = (double) a->stats.in_use / (double) a->stats.capacity;
+      if ((best == NULL) || (use < best_use)) {
+        best = a;
+        best_n = n;
+        best_use = use;
+      }
+    }
+    if (best == NULL) {
+      break;
+    }
+    uint64_t offset;
+    if (arena_alloc(best, bytes, &offset)) {
+      dm->next_arena = (best_n + 1) % dm->num_arenas;
+      *device_address = best->base + offset;
+      return FLETCHER_STATUS_OK;
+    }
+    tried |= 1ull << best_n;
+  }
+  for (uint32_t i = 0; i < dm->num_arenas; i++) {
+    if (in_banks(&dm->arenas[i], banks)) {
+      dm->arenas[i].stats.failures++;
+    }
+  }
+  return FLETCHER_STATUS_DEVICE_OUT_OF_MEMORY;
+}
+
+fstatus_t alveoDevMemAlloc(AlveoDevMem *dm, da_t *device_address, int64_t size, int bank) {
+  if (bank >= 64) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  return alveoDevMemAllocBanks(dm, device_address, size, bank < 0 ? ~0ull : 1ull << bank);
+}
+
+AlveoArena *alveoDevMemFind(AlveoDevMem *dm, da_t address, int64_t size, uint64_t *offset) {
+  for (uint32_t i = 0; i < dm->num_arenas; i++) {
+    AlveoArena *a = &dm->arenas[i];
+    if ((address >= a->base) && (address - a->base + (uint64_t) size <= a->size)) {
+      *offset = address - a->base;
+      return a;
+    }
+  }
+  return NULL;
+}
+
+fstatus_t alveoDevMemFree(AlveoDevMem *dm, da_t device_address) {
+  uint64_t offset;
+  AlveoArena *a = alveoDevMemFind(dm, device_address, 0, &offset);
+  if (a == NULL) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  if (offset >= a->size) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  uint32_t idx = (uint32_t) (offset >> ALVEO_DEVMEM_GRANULE_SHIFT);
+  if (a->state[idx] == GRANULE_SLAB) {
+    return slab_free(a, a->slabs[idx], offset);
+  }
+  if ((a->state[idx] != GRANULE_USED) || (offset & (ALVEO_DEVMEM_GRANULE - 1))) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  a->stats.frees++;
+  a->stats.in_use -= ALVEO_DEVMEM_GRANULE << a->order[idx];
+  buddy_free(a, idx);
+  return FLETCHER_STATUS_OK;
+}
+
+void alveoDevMemTerminate(AlveoDevMem *dm) {
+  for (uint32_t i = 0; i < dm->num_arenas; i++) {
+    AlveoArena *a = &dm->arenas[i];
+    for (uint32_t g = 0; g < a->num_granules; g++) {
+      if (a->state[g] == GRANULE_SLAB) {
+        free(a->slabs[g]);
+      }
+    }
+    free(a->state);
+    free(a->order);
+    free(a->next);
+    free(a->prev);
+    free(a->slabs);
+  }
+  memset(dm, 0, sizeof(*dm));
+}
+
+void alveoDevMemPrintStats(const AlveoDevMem *dm) {
+  AlveoDevMemStats banks[ALVEO_DEVMEM_MAX_ARENAS];
+  int used[ALVEO_DEVMEM_MAX_ARENAS] = {0};
+  memset(banks, 0, sizeof(banks));
+  for (uint32_t i = 0; i < dm->num_arenas; i++) {
+    const AlveoArena *a = &dm->arenas[i];
+    int b = a->bank % ALVEO_DEVMEM_MAX_ARENAS;
+    used[b] = 1;
+    banks[b].capacity += a->stats.capacity;
+    banks[b].in_use += a->stats.in_use;
+    banks[b].peak += a->stats.peak;
+    banks[b].slab_bytes += a->stats.slab_bytes;
+    banks[b].allocs += a->stats.allocs;
+    banks[b].frees += a->stats.frees;
+    banks[b].failures += a->stats.failures;
+    banks[b].bytes_written += a->stats.bytes_written;
+    banks[b].bytes_read += a->stats.bytes_read;
+  }
+  for (int b = 0; b < ALVEO_DEVMEM_MAX_ARENAS; b++) {
+    if (used[b]) {
+      fprintf(stderr,
+              "[FLETCHER_ALVEO] Bank %2d: %lu / %lu bytes in use (peak %lu, slabs %lu), %lu allocs, %lu frees, "
+              "%lu failures, %lu bytes written, %lu bytes read.\n",
+              b,
+              (unsigned long) banks[b].in_use,
+              (unsigned long) banks[b].capacity,
+              (unsigned long) banks[b].peak,
+              (unsigned long) banks[b].slab_bytes,
+              (unsigned long) banks[b].allocs,
+              (unsigned long) banks[b].frees,
+              (unsigned long) banks[b].failures,
+              (unsigned long) banks[b].bytes_written,
+              (unsigned long) banks[b].bytes_read);
+    }
+  }
+}
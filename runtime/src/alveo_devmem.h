@@ -0,0 +1,105 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <CL/opencl.h>
+
+#include "fletcher/fletcher.h"
+
+// On-board memory allocator.
+//
+// Device memory is carved out of a few large arenas that are created once at platformInit, one cl_mem per DDR bank or
+// HBM pseudo-channel that the compute units are connected to. Allocations go to the least utilized arena among the
+// banks they may be placed in. Large allocations are served by a binary buddy allocator with a granule of 64 KiB. Small
+// allocations, such as validity bitmaps and offset buffers, are served from slabs: single granules split into objects
+// of one power-of-two size class. All metadata lives on the host, since on-board memory is not host-accessible.
+
+#define ALVEO_DEVMEM_MAX_ARENAS 64
+#define ALVEO_DEVMEM_GRANULE_SHIFT 16
+#define ALVEO_DEVMEM_GRANULE (1ull << ALVEO_DEVMEM_GRANULE_SHIFT)
+#define ALVEO_DEVMEM_MAX_ORDERS 32
+
+// Slab size classes are 64 B, 128 B, ..., 32 KiB.
+#define ALVEO_DEVMEM_SLAB_MIN_SHIFT 6
+#define ALVEO_DEVMEM_NUM_CLASSES (ALVEO_DEVMEM_GRANULE_SHIFT - ALVEO_DEVMEM_SLAB_MIN_SHIFT)
+#define ALVEO_DEVMEM_SLAB_MAP_WORDS ((ALVEO_DEVMEM_GRANULE >> ALVEO_DEVMEM_SLAB_MIN_SHIFT) / 64)
+
+typedef struct AlveoSlab {
+  struct AlveoSlab *next;       ///< Next slab in the partial list of its size class.
+  struct AlveoSlab *prev;
+  uint32_t granule;
+  uint32_t size_class;
+  uint32_t num_objects;
+  uint32_t num_free;
+  uint64_t free_map[ALVEO_DEVMEM_SLAB_MAP_WORDS];  ///< A set bit marks a free object.
+} AlveoSlab;
+
+typedef struct {
+  uint64_t capacity;
+  uint64_t in_use;              ///< Bytes handed out, rounded up to the block or object size.
+  uint64_t peak;
+  uint64_t slab_bytes;          ///< Bytes of granules currently used as slabs.
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t failures;
+  uint64_t bytes_written;       ///< Bytes copied from the host, updated atomically by the copies.
+  uint64_t bytes_read;          ///< Bytes copied to the host.
+} AlveoDevMemStats;
+
+typedef struct {
+  da_t base;
+  uint64_t size;
+  int bank;
+  cl_mem mem;                   ///< Buffer backing the arena, or NULL on the emulated card.
+  uint32_t num_granules;
+  uint8_t *state;               ///< Per granule; GRANULE_NONE unless it is the first granule of a block.
+  uint8_t *order;
+  uint32_t *next;               ///< Free list links per granule.
+  uint32_t *prev;
+  AlveoSlab **slabs;
+  uint32_t free_head[ALVEO_DEVMEM_MAX_ORDERS];
+  AlveoSlab *partial[ALVEO_DEVMEM_NUM_CLASSES];
+  AlveoDevMemStats stats;
+} AlveoArena;
+
+typedef struct {
+  AlveoArena arenas[ALVEO_DEVMEM_MAX_ARENAS];
+  uint32_t num_arenas;
+  uint64_t banks;               ///< Banks that hold an arena.
+  uint32_t next_arena;          ///< Arena that wins ties between equally utilized arenas.
+} AlveoDevMem;
+
+/// @brief Add an arena of \p size bytes at device address \p base in \p bank, backed by \p mem.
+fstatus_t alveoDevMemAddArena(AlveoDevMem *dm, da_t base, uint64_t size, int bank, cl_mem mem);
+
+/// @brief Allocate \p size bytes. \p bank selects a bank, or -1 for any bank.
+fstatus_t alveoDevMemAlloc(AlveoDevMem *dm, da_t *device_address, int64_t size, int bank);
+
+/// @brief Allocate \p size bytes in the least utilized arena of one of the banks set in the mask \p banks.
+fstatus_t alveoDevMemAllocBanks(AlveoDevMem *dm, da_t *device_address, int64_t size, uint64_t banks);
+
+/// @brief Free an allocation made by alveoDevMemAlloc.
+fstatus_t alveoDevMemFree(AlveoDevMem *dm, da_t device_address);
+
+/// @brief Return the arena holding [\p address, \p address + \p size) and the offset of \p address in it, or NULL.
+AlveoArena *alveoDevMemFind(AlveoDevMem *dm, da_t address, int64_t size, uint64_t *offset);
+
+/// @brief Release all host-side metadata. Arena buffers are owned by the caller.
+void alveoDevMemTerminate(AlveoDevMem *dm);
+
+/// @brief Print the per-bank statistics of \p dm to stderr.
+void alveoDevMemPrintStats(const AlveoDevMem *dm);
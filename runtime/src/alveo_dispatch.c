@@ -0,0 +1,258 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fletcher/fletcher.h"
+#include "alveo_dispatch.h"
+
+#define INITIAL_CAPACITY 64
+
+static fstatus_t deque_push_back(AlveoDeque *q, AlveoJobFn fn, void *arg) {
+  if (q->count == q->capacity) {
+    uint32_t capacity = q->capacity > 0 ? 2 * q->capacity : INITIAL_CAPACITY;
+    AlveoJob *jobs = (AlveoJob *) malloc(capacity * sizeof(AlveoJob));
+    if (jobs == NULL) {
+      return FLETCHER_STATUS_ERROR;
+    }
+    for (uint32_t i = 0; i < q->count; i++) {
+      jobs[i] = q->jobs[(q->head + i) % q->capacity];
+    }
+    free(q->jobs);
+    q->jobs = jobs;
+    q->capacity = capacity;
+    q->head = 0;
+  }
+  AlveoJob *job = &q->jobs[(q->head + q->count) % q->capacity];
+  job->fn = fn;
+  job->arg = arg;
+  // The count is read without the lock to find the shortest and longest queues.
+  __atomic_store_n(&q->count, q->count + 1, __ATOMIC_RELAXED);
+  return FLETCHER_STATUS_OK;
+}
+
+static int deque_pop_front(AlveoDeque *q, AlveoJob *job) {
+  pthread_mutex_lock(&q->lock);
+  int found = q->count > 0;
+  if (found) {
+    *job = q->jobs[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    __atomic_store_n(&q->count, q->count - 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+static int deque_pop_back(AlveoDeque *q, AlveoJob *job) {
+  pthread_mutex_lock(&q->lock);
+  int found = q->count > 0;
+  if (found) {
+    __atomic_store_n(&q->count, q->count - 1, __ATOMIC_RELAXED);
+    *job = q->jobs[(q->head + q->count) % q->capacity];
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+// Take the next job for worker w: its own oldest job, or else the newest job of the longest other queue.
+static int take_job(AlveoDispatcher *d, uint32_t w, AlveoJob *job) {
+  if (deque_pop_front(&d->deques[w], job)) {
+    return 1;
+  }
+  for (;;) {
+    AlveoDeque *victim = NULL;
+    uint32_t longest = 0;
+    for (uint32_t i = 1; i < d->num_workers; i++) {
+      AlveoDeque *q = &d->deques[(w + i) % d->num_workers];
+      uint32_t count = __atomic_load_n(&q->count, __ATOMIC_RELAXED);
+      if (count > longest) {
+        victim = q;
+        longest = count;
+      }
+    }
+    if (victim == NULL) {
+      return 0;
+    }
+    if (deque_pop_back(victim, job)) {
+      d->deques[w].stolen++;
+      return 1;
+    }
+  }
+}
+
+typedef struct {
+  AlveoDispatcher *d;
+  uint32_t worker;
+} WorkerArg;
+
+static void *worker_main(void *p) {
+  WorkerArg *wa = (WorkerArg *) p;
+  AlveoDispatcher *d = wa->d;
+  uint32_t w = wa->worker;
+  free(wa);
+  for (;;) {
+    AlveoJob job;
+    if (!take_job(d, w, &job)) {
+      pthread_mutex_lock(&d->lock);
+      // Only sleep if no job was queued since the queues were inspected.
+      while ((d->queued <= 0) && !d->stop) {
+        pthread_cond_wait(&d->wake, &d->lock);
+      }
+      int stop = d->stop && (d->queued <= 0);
+      pthread_mutex_unlock(&d->lock);
+      if (stop) {
+        return NULL;
+      }
+      continue;
+    }
+    pthread_mutex_lock(&d->lock);
+    d->queued--;
+    pthread_mutex_unlock(&d->lock);
+
+    if (d->enter != NULL) {
+      d->enter(w);
+    }
+    fstatus_t status = job.fn(job.arg);
+    if (d->leave != NULL) {
+      d->leave(w);
+    }
+    d->deques[w].executed++;
+
+    pthread_mutex_lock(&d->lock);
+    if (status != FLETCHER_STATUS_OK) {
+      d->status = FLETCHER_STATUS_ERROR;
+    }
+    if (--d->pending == 0) {
+      pthread_cond_broadcast(&d->drained);
+    }
+    pthread_mutex_unlock(&d->lock);
+  }
+}
+
+fstatus_t alveoDispatchStart(AlveoDispatcher *d, uint32_t num_workers, AlveoWorkerHook enter, AlveoWorkerHook leave) {
+  memset(d, 0, sizeof(*d));
+  if (num_workers == 0) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  d->deques = (AlveoDeque *) calloc(num_workers, sizeof(AlveoDeque));
+  d->threads = (pthread_t *) calloc(num_workers, sizeof(pthread_t));
+  if ((d->deques == NULL) || (d->threads == NULL)) {
+    free(d->deques);
+    free(d->threads);
+    return FLETCHER_STATUS_ERROR;
+  }
+  d->enter = enter;
+  d->leave = leave;
+  d->status = FLETCHER_STATUS_OK;
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->wake, NULL);
+  pthread_cond_init(&d->drained, NULL);
+  for (uint32_t w = 0; w < num_workers; w++) {
+    pthread_mutex_init(&d->deques[w].lock, NULL);
+  }
+  // Workers look at all queues, so the number of workers is set before any of them starts.
+  d->num_workers = num_workers;
+  for (uint32_t w = 0; w < num_workers; w++) {
+    WorkerArg *wa = (WorkerArg *) malloc(sizeof(WorkerArg));
+    if (wa != NULL) {
+      wa->d = d;
+      wa->worker = w;
+    }
+    if ((wa == NULL) || (pthread_create(&d->threads[w], NULL, worker_main, wa) != 0)) {
+      free(wa);
+      // Only join the workers that were started. The queues are empty, so they do not steal from the others.
+      d->num_workers = w;
+      alveoDispatchStop(d);
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t alveoDispatchSubmit(AlveoDispatcher *d, AlveoJobFn fn, void *arg) {
+  if (d->num_workers == 0) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  // Pick the shortest queue, starting at a different one every time so that ties are spread round-robin.
+  uint32_t first = __atomic_fetch_add(&d->next, 1, __ATOMIC_RELAXED);
+  AlveoDeque *target = NULL;
+  uint32_t shortest = UINT32_MAX;
+  for (uint32_t i = 0; i < d->num_workers; i++) {
+    AlveoDeque *q = &d->deques[(first + i) % d->num_workers];
+    uint32_t count = __atomic_load_n(&q->count, __ATOMIC_RELAXED);
+    if (count < shortest) {
+      target = q;
+      shortest = count;
+    }
+  }
+  pthread_mutex_lock(&target->lock);
+  fstatus_t status = deque_push_back(target, fn, arg);
+  pthread_mutex_unlock(&target->lock);
+  if (status != FLETCHER_STATUS_OK) {
+    return status;
+  }
+  pthread_mutex_lock(&d->lock);
+  d->queued++;
+  d->pending++;
+  pthread_cond_signal(&d->wake);
+  pthread_mutex_unlock(&d->lock);
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t alveoDispatchWait(AlveoDispatcher *d) {
+  pthread_mutex_lock(&d->lock);
+  while (d->pending > 0) {
+    pthread_cond_wait(&d->drained, &d->lock);
+  }
+  fstatus_t status = d->status;
+  d->status = FLETCHER_STATUS_OK;
+  pthread_mutex_unlock(&d->lock);
+  return status;
+}
+
+void alveoDispatchStop(AlveoDispatcher *d) {
+  if (d->deques == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&d->lock);
+  d->stop = 1;
+  pthread_cond_broadcast(&d->wake);
+  pthread_mutex_unlock(&d->lock);
+  for (uint32_t w = 0; w < d->num_workers; w++) {
+    pthread_join(d->threads[w], NULL);
+  }
+  for (uint32_t w = 0; w < d->num_workers; w++) {
+    free(d->deques[w].jobs);
+    pthread_mutex_destroy(&d->deques[w].lock);
+  }
+  pthread_cond_destroy(&d->drained);
+  pthread_cond_destroy(&d->wake);
+  pthread_mutex_destroy(&d->lock);
+  free(d->deques);
+  free(d->threads);
+  d->deques = NULL;
+  d->threads = NULL;
+  d->num_workers = 0;
+}
+
+void alveoDispatchPrintStats(const AlveoDispatcher *d) {
+  for (uint32_t w = 0; w < d->num_workers; w++) {
+    fprintf(stderr, "[FLETCHER_ALVEO] Dispatcher: worker %u ran %lu jobs, %lu of them stolen.\n",
+            w,
+            (unsigned long) d->deques[w].executed,
+            (unsigned long) d->deques[w].stolen);
+  }
+}
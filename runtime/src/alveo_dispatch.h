@@ -0,0 +1,80 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "fletcher/fletcher.h"
+
+// Work-stealing job dispatcher.
+//
+// There is one worker thread per compute unit, and every worker owns a queue of jobs. New jobs go to the shortest
+// queue. A worker takes jobs from the front of its own queue, and when that is empty, steals from the back of the
+// longest other queue. That way, a compute unit stuck on a slow batch does not hold up the jobs queued behind it.
+
+/// @brief A job. Its return value is collected by alveoDispatchWait.
+typedef fstatus_t (*AlveoJobFn)(void *arg);
+
+typedef struct {
+  AlveoJobFn fn;
+  void *arg;
+} AlveoJob;
+
+typedef struct {
+  pthread_mutex_t lock;
+  AlveoJob *jobs;               ///< Ring buffer of capacity entries.
+  uint32_t capacity;
+  uint32_t head;                ///< Index of the front job.
+  uint32_t count;
+  uint64_t executed;            ///< Jobs run by the worker that owns this queue.
+  uint64_t stolen;              ///< Of those, jobs it stole from other queues.
+} AlveoDeque;
+
+typedef struct AlveoDispatcher AlveoDispatcher;
+
+/// @brief Called by worker \p worker around every job, e.g. to select and lock its compute unit.
+typedef void (*AlveoWorkerHook)(uint32_t worker);
+
+struct AlveoDispatcher {
+  uint32_t num_workers;
+  AlveoDeque *deques;
+  pthread_t *threads;
+  AlveoWorkerHook enter;
+  AlveoWorkerHook leave;
+  pthread_mutex_t lock;         ///< Protects the fields below.
+  pthread_cond_t wake;          ///< Signalled when jobs are queued or the dispatcher stops.
+  pthread_cond_t drained;       ///< Signalled when the last pending job completes.
+  int64_t queued;               ///< Jobs in all queues.
+  uint64_t pending;             ///< Jobs queued or running.
+  uint32_t next;                ///< Queue to consider first for the next job.
+  fstatus_t status;             ///< FLETCHER_STATUS_ERROR if a job failed since the last alveoDispatchWait.
+  int stop;
+};
+
+/// @brief Start \p num_workers worker threads. \p enter and \p leave may be NULL.
+fstatus_t alveoDispatchStart(AlveoDispatcher *d, uint32_t num_workers, AlveoWorkerHook enter, AlveoWorkerHook leave);
+
+/// @brief Queue \p fn(\p arg) on the shortest queue.
+fstatus_t alveoDispatchSubmit(AlveoDispatcher *d, AlveoJobFn fn, void *arg);
+
+/// @brief Wait until all queued jobs completed. Returns FLETCHER_STATUS_ERROR if any of them failed.
+fstatus_t alveoDispatchWait(AlveoDispatcher *d);
+
+/// @brief Run the remaining jobs, then stop and join all workers.
+void alveoDispatchStop(AlveoDispatcher *d);
+
+/// @brief Print the per-worker job counts of \p d to stderr.
+void alveoDispatchPrintStats(const AlveoDispatcher *d);
@@ -0,0 +1,394 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "fletcher/fletcher.h"
+#include "fletcher_alveo.h"
+#include "alveo_emu.h"
+
+#define COUNT(counter, n) __atomic_add_fetch(&(counter), (n), __ATOMIC_RELAXED)
+
+uint64_t alveoNowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t env_u64(const char *name, uint64_t def) {
+  const char *str = getenv(name);
+  if (str == NULL || *str == '\0') {
+    return def;
+  }
+  return strtoull(str, NULL, 0);
+}
+
+static double env_double(const char *name, double def) {
+  const char *str = getenv(name);
+  if (str == NULL || *str == '\0') {
+    return def;
+  }
+  return strtod(str, NULL);
+}
+
+void alveoEmuDefaultModel(AlveoEmuCostModel *model) {
+  model->mmio_latency_ns = env_u64("FLETCHER_ALVEO_EMU_MMIO_NS", 1000);
+  model->dma_latency_ns = env_u64("FLETCHER_ALVEO_EMU_DMA_NS", 5000);
+  model->pcie_bandwidth = env_double("FLETCHER_ALVEO_EMU_PCIE_GBPS", 12.0);
+  model->ddr_bandwidth = env_double("FLETCHER_ALVEO_EMU_DDR_GBPS", 19.2);
+  model->kernel_latency_ns = env_u64("FLETCHER_ALVEO_EMU_KERNEL_NS", 0);
+  model->program_latency_ns = env_u64("FLETCHER_ALVEO_EMU_PROGRAM_NS", 0);
+  model->num_banks = (uint32_t) env_u64("FLETCHER_ALVEO_EMU_BANKS", 4);
+  model->bank_size = env_u64("FLETCHER_ALVEO_EMU_BANK_SIZE", 16ull << 30);
+  model->enforce = (int) env_u64("FLETCHER_ALVEO_EMU_ENFORCE", 0);
+  model->num_cus = (uint32_t) env_u64("FLETCHER_ALVEO_EMU_CUS", 1);
+}
+
+fstatus_t alveoEmuInit(AlveoEmu *emu, const AlveoEmuCostModel *model) {
+  memset(emu, 0, sizeof(*emu));
+  pthread_mutex_init(&emu->lock, NULL);
+  emu->model = *model;
+  if ((model->num_banks == 0) || (model->num_banks > ALVEO_EMU_MAX_BANKS)
+      || (model->bank_size > (1ull << ALVEO_EMU_BANK_SHIFT))
+      || (model->num_cus == 0) || (model->num_cus > ALVEO_EMU_MAX_CUS)) {
+    fprintf(stderr, "[FLETCHER_ALVEO] Invalid emulated card: %u banks of %lu bytes, %u compute units.\n",
+            model->num_banks,
+            (unsigned long) model->bank_size,
+            model->num_cus);
+    return FLETCHER_STATUS_ERROR;
+  }
+  // Banks are reserved lazily; pages are only backed by host memory once they are touched.
+  for (uint32_t b = 0; b < model->num_banks; b++) {
+    void *bank = mmap(NULL, model->bank_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                      -1, 0);
+    if (bank == MAP_FAILED) {
+      fprintf(stderr, "[FLETCHER_ALVEO] Could not reserve emulated bank %u.\n", b);
+      alveoEmuTerminate(emu);
+      return FLETCHER_STATUS_ERROR;
+    }
+    emu->banks[b] = (uint8_t *) bank;
+  }
+  for (uint32_t c = 0; c < model->num_cus; c++) {
+    emu->cus[c].regs[FLETCHER_REG_STATUS] = ALVEO_EMU_STATUS_IDLE;
+  }
+  debug_print("[FLETCHER_ALVEO] Emulating %u banks of %lu bytes, %u compute units.\n",
+              model->num_banks,
+              (unsigned long) model->bank_size,
+              model->num_cus);
+  return FLETCHER_STATUS_OK;
+}
+
+void alveoEmuTerminate(AlveoEmu *emu) {
+  for (uint32_t b = 0; b < ALVEO_EMU_MAX_BANKS; b++) {
+    if (emu->banks[b] != NULL) {
+      munmap(emu->banks[b], emu->model.bank_size);
+      emu->banks[b] = NULL;
+    }
+  }
+  pthread_mutex_destroy(&emu->lock);
+}
+
+int alveoEmuProgram(AlveoEmu *emu, const uuid_t uuid, uint32_t card) {
+  const char *base = getenv("FLETCHER_ALVEO_EMU_STATE");
+  if (base == NULL) {
+    base = "/tmp/fletcher_alveo_emu.xclbinuuid";
+  }
+  char state[4096];
+  if (card == 0) {
+    snprintf(state, sizeof(state), "%s", base);
+  } else {
+    snprintf(state, sizeof(state), "%s.%u", base, card);
+  }
+  char str[37];
+  uuid_t loaded;
+  FILE *f = fopen(state, "r");
+  if (f != NULL) {
+    int held = (fgets(str, sizeof(str), f) != NULL) && (uuid_parse(str, loaded) == 0)
+        && (uuid_compare(loaded, uuid) == 0);
+    fclose(f);
+    if (held) {
+      return 0;
+    }
+  }
+  alveoEmuCharge(emu, emu->model.program_latency_ns);
+  f = fopen(state, "w");
+  if (f != NULL) {
+    uuid_unparse(uuid, str);
+    fprintf(f, "%s\n", str);
+    fclose(f);
+  }
+  return 1;
+}
+
+int alveoEmuBank(const AlveoEmu *emu, da_t address, int64_t size) {
+  if ((address < ALVEO_EMU_BANK_BASE(0)) || (size < 0)) {
+    return -1;
+  }
+  uint64_t bank = (address >> ALVEO_EMU_BANK_SHIFT) - 1;
+  uint64_t offset = address - ALVEO_EMU_BANK_BASE(bank);
+  if ((bank >= emu->model.num_banks) || (offset + (uint64_t) size > emu->model.bank_size)) {
+    return -1;
+  }
+  return (int) bank;
+}
+
+uint8_t *alveoEmuTranslate(const AlveoEmu *emu, da_t address, int64_t size) {
+  int bank = alveoEmuBank(emu, address, size);
+  if (bank < 0) {
+    return NULL;
+  }
+  return emu->banks[bank] + (address - ALVEO_EMU_BANK_BASE(bank));
+}
+
+void alveoEmuCharge(AlveoEmu *emu, uint64_t ns) {
+  COUNT(emu->stats.modeled_ns, ns);
+  if (emu->model.enforce && (ns > 0)) {
+    uint64_t until = alveoNowNs() + ns;
+    while (alveoNowNs() < until) {}
+  }
+}
+
+static fstatus_t emu_write_reg(AlveoEmu *emu, AlveoEmuCU *cu, uint64_t offset, uint32_t value) {
+  if (offset >= ALVEO_EMU_NUM_REGS) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  COUNT(emu->stats.mmio_writes, 1);
+  if (offset == FLETCHER_REG_STATUS) {
+    // The status register is read-only.
+    return FLETCHER_STATUS_OK;
+  }
+  cu->regs[offset] = value;
+  if (offset == FLETCHER_REG_CONTROL) {
+    if (value & ALVEO_EMU_CONTROL_RESET) {
+      cu->regs[FLETCHER_REG_STATUS] = ALVEO_EMU_STATUS_IDLE;
+    } else if (value & ALVEO_EMU_CONTROL_START) {
+      cu->regs[FLETCHER_REG_STATUS] = ALVEO_EMU_STATUS_BUSY;
+      cu->kernel_done_ns = alveoNowNs() + emu->model.kernel_latency_ns;
+      COUNT(emu->stats.kernel_runs, 1);
+      COUNT(emu->stats.modeled_ns, emu->model.kernel_latency_ns);
+    }
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t alveoEmuWriteMMIO(AlveoEmu *emu, uint32_t cu, uint64_t offset, uint32_t value) {
+  if (cu >= emu->model.num_cus) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  alveoEmuCharge(emu, emu->model.mmio_latency_ns);
+  return emu_write_reg(emu, &emu->cus[cu], offset, value);
+}
+
+fstatus_t alveoEmuWriteMMIOBatch(AlveoEmu *emu, uint32_t cu, const uint64_t *offsets, const uint32_t *values,
+                                 size_t n) {
+  if (cu >= emu->model.num_cus) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  alveoEmuCharge(emu, emu->model.mmio_latency_ns);
+  for (size_t i = 0; i < n; i++) {
+    if (emu_write_reg(emu, &emu->cus[cu], offsets[i], values[i]) != FLETCHER_STATUS_OK) {
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t alveoEmuReadMMIO(AlveoEmu *emu, uint32_t cu, uint64_t offset, uint32_t *value) {
+  if ((offset >= ALVEO_EMU_NUM_REGS) || (cu >= emu->model.num_cus)) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  AlveoEmuCU *c = &emu->cus[cu];
+  COUNT(emu->stats.mmio_reads, 1);
+  alveoEmuCharge(emu, emu->model.mmio_latency_ns);
+  if ((offset == FLETCHER_REG_STATUS) && (c->regs[offset] & ALVEO_EMU_STATUS_BUSY)
+      && (alveoNowNs() >= c->kernel_done_ns)) {
+    c->regs[offset] = ALVEO_EMU_STATUS_DONE | ALVEO_EMU_STATUS_IDLE;
+  }
+  *value = c->regs[offset];
+  return FLETCHER_STATUS_OK;
+}
+
+// Schedule a transfer in direction dir of stream_bytes to or from kernel streams and bank_bytes[b] bytes to or from
+// every bank b, and return the time at which it completes. It starts once the direction and all of its banks are free,
+// keeps the direction busy for all of its bytes, and every bank for its own bytes only.
+static uint64_t schedule(AlveoEmu *emu, AlveoEmuDirection dir, const uint64_t *bank_bytes, uint64_t stream_bytes) {
+  const AlveoEmuCostModel *m = &emu->model;
+  uint64_t total = stream_bytes;
+  pthread_mutex_lock(&emu->lock);
+  uint64_t now = alveoNowNs();
+  uint64_t start = now > emu->pcie_busy[dir] ? now : emu->pcie_busy[dir];
+  for (uint32_t b = 0; b < m->num_banks; b++) {
+    if (bank_bytes[b] > 0) {
+      total += bank_bytes[b];
+      start = emu->bank_busy[b] > start ? emu->bank_busy[b] : start;
+    }
+  }
+  uint64_t end = start + m->dma_latency_ns + (uint64_t) ((double) total / m->pcie_bandwidth);
+  emu->pcie_busy[dir] = end;
+  for (uint32_t b = 0; b < m->num_banks; b++) {
+    if (bank_bytes[b] > 0) {
+      emu->bank_busy[b] = start + m->dma_latency_ns + (uint64_t) ((double) bank_bytes[b] / m->ddr_bandwidth);
+      end = emu->bank_busy[b] > end ? emu->bank_busy[b] : end;
+    }
+  }
+  COUNT(emu->stats.transfers[dir], 1);
+  COUNT(emu->stats.bytes[dir], total);
+  COUNT(emu->stats.modeled_ns, end - start);
+  emu->stats.wait_ns += start - now;
+  if (emu->stats.first_ns == 0) {
+    emu->stats.first_ns = start;
+  }
+  emu->stats.last_ns = end > emu->stats.last_ns ? end : emu->stats.last_ns;
+  pthread_mutex_unlock(&emu->lock);
+  return end;
+}
+
+// Wait until a scheduled transfer completes, if the cost model is enforced.
+static void wait_until(const AlveoEmu *emu, uint64_t end) {
+  if (emu->model.enforce) {
+    while (alveoNowNs() < end) {}
+  }
+}
+
+// Move data between host memory and the emulated card, and add the bytes that went to or from a bank to bank_bytes,
+// or to stream_bytes if they went to or from a kernel stream. The number of bytes moved is stored in moved, if not NULL.
+static fstatus_t emu_move(AlveoEmu *emu, AlveoEmuDirection dir, uint8_t *host, da_t device, int64_t size, int stream,
+                          uint64_t *bank_bytes, uint64_t *stream_bytes, int64_t *moved) {
+  if (stream) {
+    // The emulated kernel loops its streams back: it sends as many bytes as it received, and a K2H read ends early
+    // once all of them were read. Their contents are not modeled.
+    pthread_mutex_lock(&emu->lock);
+    if (dir == ALVEO_EMU_H2D) {
+      emu->stream_pending += (uint64_t) size;
+    } else {
+      if ((uint64_t) size > emu->stream_pending) {
+        size = (int64_t) emu->stream_pending;
+      }
+      emu->stream_pending -= (uint64_t) size;
+    }
+    pthread_mutex_unlock(&emu->lock);
+    if (dir == ALVEO_EMU_D2H) {
+      memset(host, 0, (size_t) size);
+    }
+    *stream_bytes += (uint64_t) size;
+    if (moved != NULL) {
+      *moved = size;
+    }
+    return FLETCHER_STATUS_OK;
+  }
+  int bank = alveoEmuBank(emu, device, size);
+  if (bank < 0) {
+    fprintf(stderr, "[FLETCHER_ALVEO] Emulated copy outside device memory: [dev] 0x%016lX (%lu bytes).\n",
+            (unsigned long) device,
+            (unsigned long) size);
+    return FLETCHER_STATUS_ERROR;
+  }
+  uint8_t *mem = emu->banks[bank] + (device - ALVEO_EMU_BANK_BASE(bank));
+  if (dir == ALVEO_EMU_H2D) {
+    memcpy(mem, host, (size_t) size);
+  } else {
+    memcpy(host, mem, (size_t) size);
+  }
+  COUNT(emu->stats.bank_bytes[bank], (uint64_t) size);
+  bank_bytes[bank] += (uint64_t) size;
+  if (moved != NULL) {
+    *moved = size;
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+// Move a single buffer, and return the time at which the transfer completes in end.
+static fstatus_t emu_transfer(AlveoEmu *emu, AlveoEmuDirection dir, uint8_t *host, da_t device, int64_t size,
+                              int stream, uint64_t *end, int64_t *moved) {
+  uint64_t bank_bytes[ALVEO_EMU_MAX_BANKS] = {0};
+  uint64_t stream_bytes = 0;
+  fstatus_t status = emu_move(emu, dir, host, device, size, stream, bank_bytes, &stream_bytes, moved);
+  if (status == FLETCHER_STATUS_OK) {
+    *end = schedule(emu, dir, bank_bytes, stream_bytes);
+  }
+  return status;
+}
+
+fstatus_t alveoEmuCopy(AlveoEmu *emu, AlveoEmuDirection dir, uint8_t *host, da_t device, int64_t size) {
+  uint64_t end;
+  fstatus_t status = emu_transfer(emu, dir, host, device, size, 0, &end, NULL);
+  if (status == FLETCHER_STATUS_OK) {
+    wait_until(emu, end);
+  }
+  return status;
+}
+
+fstatus_t alveoEmuCopyV(AlveoEmu *emu, const AlveoCopyDesc *descs, size_t n) {
+  uint64_t bank_bytes[ALVEO_EMU_MAX_BANKS] = {0};
+  uint64_t stream_bytes = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (emu_move(emu, ALVEO_EMU_H2D, (uint8_t *) descs[i].host, descs[i].device, descs[i].size,
+                 alveoEmuBank(emu, descs[i].device, descs[i].size) < 0, bank_bytes, &stream_bytes, NULL)
+        != FLETCHER_STATUS_OK) {
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  wait_until(emu, schedule(emu, ALVEO_EMU_H2D, bank_bytes, stream_bytes));
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t alveoEmuStream(AlveoEmu *emu, AlveoEmuDirection dir, uint8_t *host, int64_t size, int64_t *moved) {
+  uint64_t end;
+  emu_transfer(emu, dir, host, 0, size, 1, &end, moved);
+  wait_until(emu, end);
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t alveoEmuDuplex(AlveoEmu *emu, uint8_t *h2d_host, da_t h2d_device, int64_t h2d_size,
+                         da_t d2h_device, uint8_t *d2h_host, int64_t d2h_size) {
+  uint64_t h2d_end = 0;
+  uint64_t d2h_end = 0;
+  if ((h2d_size > 0) && (emu_transfer(emu, ALVEO_EMU_H2D, h2d_host, h2d_device, h2d_size,
+                                      alveoEmuBank(emu, h2d_device, h2d_size) < 0, &h2d_end, NULL)
+                          != FLETCHER_STATUS_OK)) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  if ((d2h_size > 0) && (emu_transfer(emu, ALVEO_EMU_D2H, d2h_host, d2h_device, d2h_size,
+                                      alveoEmuBank(emu, d2h_device, d2h_size) < 0, &d2h_end, NULL)
+                          != FLETCHER_STATUS_OK)) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  wait_until(emu, h2d_end > d2h_end ? h2d_end : d2h_end);
+  return FLETCHER_STATUS_OK;
+}
+
+void alveoEmuPrintStats(const AlveoEmu *emu) {
+  const AlveoEmuStats *s = &emu->stats;
+  fprintf(stderr, "[FLETCHER_ALVEO] Emulator: %lu MMIO reads, %lu MMIO writes, %lu kernel runs.\n",
+          (unsigned long) s->mmio_reads,
+          (unsigned long) s->mmio_writes,
+          (unsigned long) s->kernel_runs);
+  fprintf(stderr, "[FLETCHER_ALVEO] Emulator: H2D %lu transfers / %lu bytes, D2H %lu transfers / %lu bytes.\n",
+          (unsigned long) s->transfers[ALVEO_EMU_H2D],
+          (unsigned long) s->bytes[ALVEO_EMU_H2D],
+          (unsigned long) s->transfers[ALVEO_EMU_D2H],
+          (unsigned long) s->bytes[ALVEO_EMU_D2H]);
+  for (uint32_t b = 0; b < emu->model.num_banks; b++) {
+    fprintf(stderr, "[FLETCHER_ALVEO] Emulator: bank %u moved %lu bytes.\n", b, (unsigned long) s->bank_bytes[b]);
+  }
+  fprintf(stderr, "[FLETCHER_ALVEO] Emulator: %lu ns of modeled device time, transfers spanning %lu ns, "
+                  "%lu ns waiting for a busy direction or bank.\n",
+          (unsigned long) s->modeled_ns,
+          (unsigned long) (s->last_ns - s->first_ns),
+          (unsigned long) s->wait_ns);
+}
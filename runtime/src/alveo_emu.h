@@ -0,0 +1,160 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+#include <uuid/uuid.h>
+
+#include "fletcher/fletcher.h"
+#include "alveo_gather.h"
+
+// In-process emulation of an Alveo card. Device memory lives in host memory and every operation is charged against a
+// simple latency/bandwidth cost model, so that transfer scheduling and caching can be benchmarked without a card.
+//
+// Each PCIe direction and each bank is a resource with a timeline: it is busy until the end of the last transfer that
+// was scheduled on it. A transfer starts once all resources it uses are free, so transfers in opposite directions or
+// to different banks overlap, and transfers that share a direction or a bank queue up behind each other. Timelines are
+// kept in wall-clock time; unless the model is enforced, transfers do not actually take that long, and the modeled
+// time shows in the statistics only.
+
+#define ALVEO_EMU_MAX_BANKS 32
+#define ALVEO_EMU_NUM_REGS 1024
+#define ALVEO_EMU_MAX_CUS 16
+
+// Every emulated bank occupies its own window in the device address space. Bank b starts at (b + 1) << BANK_SHIFT, so
+// that device address 0 is never valid.
+#define ALVEO_EMU_BANK_SHIFT 36
+#define ALVEO_EMU_BANK_BASE(bank) (((da_t) (bank) + 1) << ALVEO_EMU_BANK_SHIFT)
+
+// Fletcher control and status register bits.
+#define ALVEO_EMU_CONTROL_START 0x1u
+#define ALVEO_EMU_CONTROL_STOP 0x2u
+#define ALVEO_EMU_CONTROL_RESET 0x4u
+#define ALVEO_EMU_STATUS_IDLE 0x1u
+#define ALVEO_EMU_STATUS_BUSY 0x2u
+#define ALVEO_EMU_STATUS_DONE 0x4u
+
+typedef enum {
+  ALVEO_EMU_H2D = 0,
+  ALVEO_EMU_D2H = 1
+} AlveoEmuDirection;
+
+/// @brief Cost model of the emulated card. Bandwidths are in GB/s, which conveniently equals bytes per nanosecond.
+typedef struct {
+  uint64_t mmio_latency_ns;     ///< Round trip of a single register access.
+  uint64_t dma_latency_ns;      ///< Fixed setup cost of a single PCIe DMA transfer.
+  double pcie_bandwidth;        ///< Per direction; PCIe is full duplex.
+  double ddr_bandwidth;         ///< Per bank.
+  uint64_t kernel_latency_ns;   ///< Time between a start pulse and the kernel reporting done.
+  uint64_t program_latency_ns;  ///< Time to program the card with a new xclbin.
+  uint32_t num_banks;
+  uint64_t bank_size;
+  uint32_t num_cus;             ///< Number of compute units, every one running its own copy of the kernel.
+  int enforce;                  ///< Busy-wait so that modeled time also passes in wall-clock time.
+} AlveoEmuCostModel;
+
+typedef struct {
+  uint64_t mmio_reads;
+  uint64_t mmio_writes;
+  uint64_t transfers[2];        ///< Indexed by AlveoEmuDirection.
+  uint64_t bytes[2];
+  uint64_t bank_bytes[ALVEO_EMU_MAX_BANKS];
+  uint64_t kernel_runs;
+  uint64_t modeled_ns;          ///< Total device time charged by the cost model.
+  uint64_t wait_ns;             ///< Time transfers waited for a direction or bank that was busy.
+  uint64_t first_ns;            ///< Start of the first transfer.
+  uint64_t last_ns;             ///< End of the last transfer.
+} AlveoEmuStats;
+
+typedef struct {
+  uint32_t regs[ALVEO_EMU_NUM_REGS];
+  uint64_t kernel_done_ns;      ///< Wall-clock time at which a started kernel completes.
+} AlveoEmuCU;
+
+// Compute units of an emulated card may be driven from different threads; the statistics are updated atomically.
+typedef struct {
+  AlveoEmuCostModel model;
+  uint8_t *banks[ALVEO_EMU_MAX_BANKS];
+  AlveoEmuCU cus[ALVEO_EMU_MAX_CUS];
+  pthread_mutex_t lock;         ///< Guards the timelines and the stream loopback.
+  uint64_t pcie_busy[2];        ///< Per AlveoEmuDirection, the time until which it is busy.
+  uint64_t bank_busy[ALVEO_EMU_MAX_BANKS];
+  uint64_t stream_pending;      ///< Bytes the kernel received on its streams and did not send back yet.
+  AlveoEmuStats stats;
+} AlveoEmu;
+
+/// @brief Fill \p model with the defaults (roughly a U250 in a Gen3 x16 slot), overridden by FLETCHER_ALVEO_EMU_*
+/// environment variables.
+void alveoEmuDefaultModel(AlveoEmuCostModel *model);
+
+/// @brief Allocate the emulated banks of \p emu according to \p model.
+fstatus_t alveoEmuInit(AlveoEmu *emu, const AlveoEmuCostModel *model);
+
+/// @brief Release the emulated banks of \p emu.
+void alveoEmuTerminate(AlveoEmu *emu);
+
+/**
+ * @brief Program the emulated card with the xclbin identified by \p uuid.
+ *
+ * The UUID of the loaded xclbin is kept in the file named by FLETCHER_ALVEO_EMU_STATE, so that it survives the process,
+ * like the bitstream on a real card. The program latency is only charged if the UUID differs. Card \p card
+ * other than the first one keep their UUID in a file with the card index appended.
+ *
+ * @return 1 if the card was reprogrammed, 0 if it already held the xclbin.
+ */
+int alveoEmuProgram(AlveoEmu *emu, const uuid_t uuid, uint32_t card);
+
+/// @brief Return the bank that holds [\p address, \p address + \p size), or -1 if the range is not device memory.
+int alveoEmuBank(const AlveoEmu *emu, da_t address, int64_t size);
+
+/// @brief Translate a device address to the host memory that backs it, or NULL if the range is not device memory.
+uint8_t *alveoEmuTranslate(const AlveoEmu *emu, da_t address, int64_t size);
+
+/// @brief Charge \p ns of device time, and wait for it if the cost model is enforced.
+void alveoEmuCharge(AlveoEmu *emu, uint64_t ns);
+
+/// @brief Access a register of compute unit \p cu.
+fstatus_t alveoEmuWriteMMIO(AlveoEmu *emu, uint32_t cu, uint64_t offset, uint32_t value);
+fstatus_t alveoEmuReadMMIO(AlveoEmu *emu, uint32_t cu, uint64_t offset, uint32_t *value);
+
+/// @brief Write \p n registers. Writes are posted, so the batch is charged a single register round trip.
+fstatus_t alveoEmuWriteMMIOBatch(AlveoEmu *emu, uint32_t cu, const uint64_t *offsets, const uint32_t *values,
+                                 size_t n);
+
+/// @brief Copy \p size bytes between host memory and emulated device memory in direction \p dir.
+fstatus_t alveoEmuCopy(AlveoEmu *emu, AlveoEmuDirection dir, uint8_t *host, da_t device, int64_t size);
+
+/// @brief Copy the \p n buffers described by \p descs to the emulated card as one DMA transfer, which only pays the
+/// setup cost once and keeps every bank it writes to busy for just the bytes written to that bank. Addresses outside
+/// device memory refer to streams.
+fstatus_t alveoEmuCopyV(AlveoEmu *emu, const AlveoCopyDesc *descs, size_t n);
+
+/// @brief Move up to \p size bytes between host memory and an emulated kernel stream, and store the number of bytes moved
+/// in \p moved if it is not NULL. The emulated kernel sends back as many bytes as it received, so a K2H read ends early
+/// when it has read all of them. K2H data is all zeros.
+fstatus_t alveoEmuStream(AlveoEmu *emu, AlveoEmuDirection dir, uint8_t *host, int64_t size, int64_t *moved);
+
+/// @brief Copy \p h2d_size bytes to \p h2d_device and \p d2h_size bytes from \p d2h_device at the same time. Addresses
+/// outside device memory refer to streams. PCIe is full duplex, so both directions are scheduled at once, and only
+/// contend if they use the same bank.
+fstatus_t alveoEmuDuplex(AlveoEmu *emu, uint8_t *h2d_host, da_t h2d_device, int64_t h2d_size,
+                         da_t d2h_device, uint8_t *d2h_host, int64_t d2h_size);
+
+/// @brief Print the statistics of \p emu to stderr.
+void alveoEmuPrintStats(const AlveoEmu *emu);
+
+/// @brief Monotonic wall-clock time in nanoseconds.
+uint64_t alveoNowNs(void);
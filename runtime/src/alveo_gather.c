@@ -0,0 +1,83 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "alveo_gather.h"
+
+static int compare_pieces(const void *a, const void *b) {
+  const AlveoGatherPiece *pa = (const AlveoGatherPiece *) a;
+  const AlveoGatherPiece *pb = (const AlveoGatherPiece *) b;
+  if (pa->target != pb->target) {
+    return (uintptr_t) pa->target < (uintptr_t) pb->target ? -1 : 1;
+  }
+  if (pa->offset != pb->offset) {
+    return pa->offset < pb->offset ? -1 : 1;
+  }
+  return 0;
+}
+
+// Whether piece p can be appended to run, whose last piece is last.
+static int can_merge(const AlveoGatherRun *run, const AlveoGatherPiece *last, const AlveoGatherPiece *p) {
+  if ((p->target != run->target) || (p->offset != run->offset + (uint64_t) run->size)) {
+    return 0;
+  }
+  if (p->stream) {
+    return 1;
+  }
+  // Contiguous on the host as well: no copy needed.
+  if ((run->host != NULL) && (p->host == run->host + run->size)) {
+    return 1;
+  }
+  // Otherwise, pack small pieces only, so that large ones are never copied.
+  return (last->size <= ALVEO_GATHER_PACK_MAX) && (p->size <= ALVEO_GATHER_PACK_MAX)
+      && ((run->host == NULL) || (run->size <= ALVEO_GATHER_PACK_MAX));
+}
+
+uint32_t alveoGatherPlan(AlveoGatherPiece *pieces, uint32_t n, AlveoGatherRun *runs) {
+  qsort(pieces, n, sizeof(AlveoGatherPiece), compare_pieces);
+  uint32_t num_runs = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    AlveoGatherPiece *p = &pieces[i];
+    if (p->size <= 0) {
+      continue;
+    }
+    AlveoGatherRun *run = num_runs > 0 ? &runs[num_runs - 1] : NULL;
+    if ((run != NULL) && can_merge(run, &pieces[run->first + run->count - 1], p)) {
+      if ((run->host != NULL) && (p->host != run->host + run->size)) {
+        run->host = NULL;
+      }
+      run->size += p->size;
+      run->count = i - run->first + 1;
+      continue;
+    }
+    run = &runs[num_runs++];
+    run->target = p->target;
+    run->offset = p->offset;
+    run->size = p->size;
+    run->host = p->host;
+    run->first = i;
+    run->count = 1;
+  }
+  return num_runs;
+}
+
+void alveoGatherPack(const AlveoGatherPiece *pieces, const AlveoGatherRun *run, uint8_t *staging) {
+  for (uint32_t i = run->first; i < run->first + run->count; i++) {
+    if (pieces[i].size > 0) {
+      memcpy(staging + (pieces[i].offset - run->offset), pieces[i].host, (size_t) pieces[i].size);
+    }
+  }
+}
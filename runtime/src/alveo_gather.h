@@ -0,0 +1,65 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "fletcher/fletcher.h"
+
+// Planning of vectored copies, see platformCopyHostToDeviceV.
+//
+// Every piece of a vectored copy is resolved to a target, an OpenCL buffer or a stream, and an offset in it. Pieces are
+// then sorted by target and offset and merged into runs that are written with one command each. Pieces that are also
+// contiguous on the host are merged without copying. Small pieces that are only contiguous on the device are packed
+// into a staging buffer first. Pieces for a stream are always merged, in order, so that every stream gets one transfer.
+
+#define ALVEO_GATHER_PACK_MAX (64 * 1024)   ///< Pieces up to this size are packed rather than written on their own.
+
+/// @brief One buffer of a vectored copy.
+typedef struct {
+  const uint8_t *host;
+  da_t device;
+  int64_t size;
+} AlveoCopyDesc;
+
+typedef struct {
+  const void *target;           ///< Buffer or stream the piece goes to. Only pieces of one target are merged.
+  uint64_t offset;              ///< Offset in the target.
+  const uint8_t *host;
+  int64_t size;
+  int stream;                   ///< The target is a stream.
+} AlveoGatherPiece;
+
+typedef struct {
+  const void *target;
+  uint64_t offset;
+  int64_t size;
+  const uint8_t *host;          ///< Source of the run, if it is contiguous on the host; NULL if it must be packed.
+  uint32_t first;               ///< Index of its first piece, after planning.
+  uint32_t count;
+} AlveoGatherRun;
+
+/**
+ * @brief Sort \p n \p pieces by target and offset, and merge them into runs.
+ *
+ * \p runs must have room for \p n runs. Pieces of a stream must have increasing offsets in the order in which they are
+ * to be sent, e.g. their running sum.
+ *
+ * @return                      The number of runs.
+ */
+uint32_t alveoGatherPlan(AlveoGatherPiece *pieces, uint32_t n, AlveoGatherRun *runs);
+
+/// @brief Copy the pieces of a run that is not contiguous on the host, back to back, into \p staging.
+void alveoGatherPack(const AlveoGatherPiece *pieces, const AlveoGatherRun *run, uint8_t *staging);
@@ -0,0 +1,146 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fletcher/fletcher.h"
+#include "alveo_hostmap.h"
+
+AlveoHostMapping *alveoHostMapLookup(AlveoHostMap *hm, const uint8_t *host, int64_t size) {
+  for (uint32_t i = 0; i < hm->num_maps; i++) {
+    AlveoHostMapping *m = &hm->maps[i];
+    if ((host >= m->host) && (host + size <= m->host + m->size)) {
+      m->refs++;
+      m->last_use = ++hm->clock;
+      hm->stats.hits++;
+      return m;
+    }
+  }
+  return NULL;
+}
+
+AlveoHostMapping *alveoHostMapFind(AlveoHostMap *hm, da_t device, int64_t size, uint64_t *offset) {
+  for (uint32_t i = 0; i < hm->num_maps; i++) {
+    AlveoHostMapping *m = &hm->maps[i];
+    if ((device >= m->device) && (device + (uint64_t) size <= m->device + m->size)) {
+      *offset = device - m->device;
+      return m;
+    }
+  }
+  return NULL;
+}
+
+static void remove_at(AlveoHostMap *hm, uint32_t i) {
+  clReleaseMemObject(hm->maps[i].mem);
+  hm->maps[i] = hm->maps[--hm->num_maps];
+}
+
+// Release the least recently used unreferenced registrations until at most limit of them are left.
+static void trim(AlveoHostMap *hm) {
+  for (;;) {
+    uint32_t unused = 0;
+    uint32_t oldest = 0;
+    for (uint32_t i = 0; i < hm->num_maps; i++) {
+      if (hm->maps[i].refs > 0) {
+        continue;
+      }
+      if ((unused == 0) || (hm->maps[i].last_use < hm->maps[oldest].last_use)) {
+        oldest = i;
+      }
+      unused++;
+    }
+    if (unused <= hm->limit) {
+      return;
+    }
+    remove_at(hm, oldest);
+    hm->stats.releases++;
+  }
+}
+
+AlveoHostMapping *alveoHostMapInsert(AlveoHostMap *hm, const uint8_t *host, uint64_t size, cl_mem mem, da_t device,
+                                     int keep) {
+  if (hm->num_maps == hm->capacity) {
+    uint32_t capacity = hm->capacity > 0 ? 2 * hm->capacity : 16;
+    AlveoHostMapping *maps = (AlveoHostMapping *) realloc(hm->maps, capacity * sizeof(AlveoHostMapping));
+    if (maps == NULL) {
+      return NULL;
+    }
+    hm->maps = maps;
+    hm->capacity = capacity;
+  }
+  AlveoHostMapping *m = &hm->maps[hm->num_maps++];
+  m->host = host;
+  m->size = size;
+  m->mem = mem;
+  m->device = device;
+  m->refs = 1;
+  m->keep = keep;
+  m->last_use = ++hm->clock;
+  hm->stats.registrations++;
+  return m;
+}
+
+int alveoHostMapRelease(AlveoHostMap *hm, da_t device) {
+  uint64_t offset;
+  AlveoHostMapping *m = alveoHostMapFind(hm, device, 1, &offset);
+  if (m == NULL) {
+    return 0;
+  }
+  if (m->refs > 0) {
+    m->refs--;
+  }
+  if ((m->refs == 0) && !m->keep) {
+    remove_at(hm, (uint32_t) (m - hm->maps));
+    hm->stats.releases++;
+    return 1;
+  }
+  trim(hm);
+  return 1;
+}
+
+int alveoHostMapForget(AlveoHostMap *hm, const uint8_t *host, uint64_t size) {
+  for (uint32_t i = 0; i < hm->num_maps; i++) {
+    const AlveoHostMapping *m = &hm->maps[i];
+    if ((m->host < host + size) && (host < m->host + m->size) && (m->refs > 0)) {
+      return 0;
+    }
+  }
+  for (uint32_t i = hm->num_maps; i > 0; i--) {
+    const AlveoHostMapping *m = &hm->maps[i - 1];
+    if ((m->host < host + size) && (host < m->host + m->size)) {
+      remove_at(hm, i - 1);
+      hm->stats.releases++;
+    }
+  }
+  return 1;
+}
+
+void alveoHostMapTerminate(AlveoHostMap *hm) {
+  while (hm->num_maps > 0) {
+    remove_at(hm, hm->num_maps - 1);
+  }
+  free(hm->maps);
+  hm->maps = NULL;
+  hm->capacity = 0;
+}
+
+void alveoHostMapPrintStats(const AlveoHostMap *hm) {
+  fprintf(stderr, "[FLETCHER_ALVEO] Host buffers: %lu registered, %lu reused, %lu released, %lu copied (misaligned).\n",
+          (unsigned long) hm->stats.registrations,
+          (unsigned long) hm->stats.hits,
+          (unsigned long) hm->stats.releases,
+          (unsigned long) hm->stats.fallbacks);
+}
@@ -0,0 +1,89 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <CL/opencl.h>
+
+#include "fletcher/fletcher.h"
+
+// Host buffers registered with the card behind platformPrepareHostBuffer.
+//
+// A page-aligned host buffer is wrapped in a CL_MEM_USE_HOST_PTR buffer, which the driver pins and moves by DMA
+// straight from the application's pages, without a staging copy. Registrations are kept by host address range, so
+// preparing a buffer that lies within one that was registered before reuses that registration. They are reference
+// counted like cache entries: every prepare takes a reference, platformDeviceFree on the device address drops it.
+//
+// The runtime cannot tell when the application frees or unmaps memory it allocated itself, so registrations of such
+// memory are released as soon as their last reference is dropped. Only registrations of memory from the runtime's own
+// host pool, which calls alveoHostMapForget before it unmaps anything, are kept around for reuse when unreferenced,
+// until more than the limit of them exists; they are then released in LRU order.
+
+typedef struct {
+  const uint8_t *host;
+  uint64_t size;                ///< Registered bytes, a whole number of pages.
+  cl_mem mem;
+  da_t device;                  ///< Device address of the first byte.
+  uint32_t refs;
+  int keep;                     ///< Kept for reuse when unreferenced: the memory belongs to the runtime's host pool.
+  uint64_t last_use;
+} AlveoHostMapping;
+
+typedef struct {
+  uint64_t registrations;
+  uint64_t hits;                ///< Prepares served by an existing registration.
+  uint64_t releases;            ///< Registrations released when unreferenced or to stay within the limit.
+  uint64_t fallbacks;           ///< Misaligned buffers that had to be copied instead.
+} AlveoHostMapStats;
+
+typedef struct {
+  AlveoHostMapping *maps;
+  uint32_t num_maps;
+  uint32_t capacity;
+  uint32_t limit;               ///< Unreferenced registrations kept for reuse.
+  uint64_t clock;
+  AlveoHostMapStats stats;
+} AlveoHostMap;
+
+/// @brief Return the registration that holds [\p host, \p host + \p size), taking a reference, or NULL if there is
+/// none.
+AlveoHostMapping *alveoHostMapLookup(AlveoHostMap *hm, const uint8_t *host, int64_t size);
+
+/// @brief Return the registration that holds device addresses [\p device, \p device + \p size) and the offset of
+/// \p device in it, or NULL.
+AlveoHostMapping *alveoHostMapFind(AlveoHostMap *hm, da_t device, int64_t size, uint64_t *offset);
+
+/// @brief Add a registration of \p size bytes at \p host, backed by \p mem at device address \p device, holding one
+/// reference. \p keep tells whether it may outlive its last reference, see AlveoHostMapping::keep.
+AlveoHostMapping *alveoHostMapInsert(AlveoHostMap *hm, const uint8_t *host, uint64_t size, cl_mem mem, da_t device,
+                                     int keep);
+
+/// @brief Drop a reference to the registration holding \p device, releasing it once unreferenced unless it is kept.
+/// Returns 0 if \p device is not a registered address.
+int alveoHostMapRelease(AlveoHostMap *hm, da_t device);
+
+/**
+ * @brief Release the registrations that overlap [\p host, \p host + \p size), before that memory is unmapped.
+ *
+ * Returns 0 and releases nothing if any of them is still referenced.
+ */
+int alveoHostMapForget(AlveoHostMap *hm, const uint8_t *host, uint64_t size);
+
+/// @brief Release all registrations.
+void alveoHostMapTerminate(AlveoHostMap *hm);
+
+/// @brief Print the counters of \p hm to stderr.
+void alveoHostMapPrintStats(const AlveoHostMap *hm);
@@ -0,0 +1,245 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "alveo_hostmem.h"
+#include "alveo_numa.h"
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+// The address handed out for zero-size allocations, which must not be dereferenced.
+static uint8_t zero_size_area[1] __attribute__((aligned(4096)));
+
+// Return the size class of a block of size bytes, or -1 if it is too large to pool.
+static int class_of(int64_t size) {
+  for (int c = 0; c < ALVEO_HOSTMEM_CLASSES; c++) {
+    if ((uint64_t) size <= (ALVEO_HOSTMEM_PAGE << c)) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+static uint64_t class_size(int c) {
+  return ALVEO_HOSTMEM_PAGE << c;
+}
+
+// Map size bytes, a multiple of the chunk size, aligned to the chunk size, and lock them in memory.
+static void *map_region(AlveoHostMem *pool, size_t size) {
+  if (pool->num_mappings == pool->capacity) {
+    uint32_t capacity = pool->capacity > 0 ? 2 * pool->capacity : 64;
+    AlveoHostMemMapping *mappings =
+        (AlveoHostMemMapping *) realloc(pool->mappings, capacity * sizeof(AlveoHostMemMapping));
+    if (mappings == NULL) {
+      return NULL;
+    }
+    pool->mappings = mappings;
+    pool->capacity = capacity;
+  }
+
+  void *base = MAP_FAILED;
+  if (pool->huge_pages) {
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    if (base != MAP_FAILED) {
+      pool->stats.huge += size;
+    }
+  }
+  if (base == MAP_FAILED) {
+    // Over-allocate to be able to align the region, and ask for transparent huge pages instead.
+    uint8_t *raw = (uint8_t *) mmap(NULL, size + ALVEO_HOSTMEM_CHUNK, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+      return NULL;
+    }
+    uintptr_t mask = (uintptr_t) (ALVEO_HOSTMEM_CHUNK - 1);
+    uint8_t *aligned = (uint8_t *) (((uintptr_t) raw + mask) & ~mask);
+    if (aligned > raw) {
+      munmap(raw, (size_t) (aligned - raw));
+    }
+    if (aligned + size < raw + size + ALVEO_HOSTMEM_CHUNK) {
+      munmap(aligned + size, (size_t) (raw + size + ALVEO_HOSTMEM_CHUNK - (aligned + size)));
+    }
+    base = aligned;
+    madvise(base, size, MADV_HUGEPAGE);
+  }
+  // The policy must be set before the pages are faulted in by mlock.
+  if (pool->node >= 0) {
+    alveoNumaBind(base, size, pool->node);
+  }
+  // Locking faults the pages in and keeps them resident, so they are not swapped out from under a DMA.
+  if (mlock(base, size) != 0) {
+    pool->stats.unpinned += size;
+  } else if ((pool->node >= 0) && (alveoNumaNodeOf(base) != pool->node)) {
+    pool->stats.remote += size;
+  }
+  pool->mappings[pool->num_mappings].base = base;
+  pool->mappings[pool->num_mappings].size = size;
+  pool->num_mappings++;
+  pool->stats.mapped += size;
+  return base;
+}
+
+// Take a block of class c off its free list, refilling the list from a new chunk if it is empty.
+static uint8_t *take_block(AlveoHostMem *pool, int c) {
+  if (pool->free_lists[c] != NULL) {
+    void *block = pool->free_lists[c];
+    pool->free_lists[c] = *(void **) block;
+    pool->stats.hits++;
+    return (uint8_t *) block;
+  }
+  uint64_t size = class_size(c);
+  if (size >= ALVEO_HOSTMEM_CHUNK) {
+    return (uint8_t *) map_region(pool, size);
+  }
+  uint8_t *chunk = (uint8_t *) map_region(pool, ALVEO_HOSTMEM_CHUNK);
+  if (chunk == NULL) {
+    return NULL;
+  }
+  // Hand out the first block, put the rest of the chunk on the free list.
+  for (uint64_t offset = ALVEO_HOSTMEM_CHUNK - size; offset > 0; offset -= size) {
+    *(void **) (chunk + offset) = pool->free_lists[c];
+    pool->free_lists[c] = chunk + offset;
+  }
+  return chunk;
+}
+
+int alveoHostMemAllocate(AlveoHostMem *pool, int64_t size, uint8_t **out) {
+  if (size < 0) {
+    return -1;
+  }
+  if (size == 0) {
+    *out = zero_size_area;
+    return 0;
+  }
+  int c = class_of(size);
+  if (c < 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&pool->lock);
+  uint8_t *block = take_block(pool, c);
+  if (block != NULL) {
+    pool->stats.allocations++;
+    pool->bytes_allocated += size;
+    if (pool->bytes_allocated > pool->max_memory) {
+      pool->max_memory = pool->bytes_allocated;
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  if (block == NULL) {
+    return -1;
+  }
+  *out = block;
+  return 0;
+}
+
+void alveoHostMemFree(AlveoHostMem *pool, uint8_t *buffer, int64_t size) {
+  if ((buffer == NULL) || (buffer == zero_size_area)) {
+    return;
+  }
+  int c = class_of(size);
+  if (c < 0) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  *(void **) buffer = pool->free_lists[c];
+  pool->free_lists[c] = buffer;
+  pool->bytes_allocated -= size;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int alveoHostMemReallocate(AlveoHostMem *pool, int64_t old_size, int64_t new_size, uint8_t **ptr) {
+  if ((*ptr != zero_size_area) && (new_size > 0) && (class_of(old_size) == class_of(new_size))) {
+    // The block is large enough already.
+    pthread_mutex_lock(&pool->lock);
+    pool->bytes_allocated += new_size - old_size;
+    if (pool->bytes_allocated > pool->max_memory) {
+      pool->max_memory = pool->bytes_allocated;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+  }
+  uint8_t *block;
+  if (alveoHostMemAllocate(pool, new_size, &block) != 0) {
+    return -1;
+  }
+  if ((new_size > 0) && (old_size > 0)) {
+    memcpy(block, *ptr, (size_t) (old_size < new_size ? old_size : new_size));
+  }
+  alveoHostMemFree(pool, *ptr, old_size);
+  *ptr = block;
+  return 0;
+}
+
+int alveoHostMemOwns(AlveoHostMem *pool, const uint8_t *buffer, int64_t size) {
+  int owns = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (uint32_t i = 0; (i < pool->num_mappings) && !owns; i++) {
+    const uint8_t *base = (const uint8_t *) pool->mappings[i].base;
+    owns = (buffer >= base) && (buffer + size <= base + pool->mappings[i].size);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return owns;
+}
+
+static void forget_mapping(AlveoHostMem *pool, void *base) {
+  for (uint32_t i = 0; i < pool->num_mappings; i++) {
+    if (pool->mappings[i].base == base) {
+      pool->mappings[i] = pool->mappings[--pool->num_mappings];
+      return;
+    }
+  }
+}
+
+void alveoHostMemTrim(AlveoHostMem *pool, int (*can_unmap)(void *arg, void *base, size_t size), void *arg) {
+  pthread_mutex_lock(&pool->lock);
+  // Blocks of at least a chunk are mappings of their own. Smaller blocks share their chunk with others, which may be
+  // in use, so those chunks are kept.
+  for (int c = class_of(ALVEO_HOSTMEM_CHUNK); c < ALVEO_HOSTMEM_CLASSES; c++) {
+    void **link = &pool->free_lists[c];
+    while (*link != NULL) {
+      void *block = *link;
+      if ((can_unmap != NULL) && !can_unmap(arg, block, class_size(c))) {
+        link = (void **) block;
+        continue;
+      }
+      *link = *(void **) block;
+      munmap(block, class_size(c));
+      forget_mapping(pool, block);
+      pool->stats.trimmed += class_size(c);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void alveoHostMemPrintStats(AlveoHostMem *pool) {
+  pthread_mutex_lock(&pool->lock);
+  fprintf(stderr, "[FLETCHER_ALVEO] Host memory: %lu allocations, %lu reused, %lu bytes mapped "
+                  "(%lu huge, %lu unpinned, %lu off node %d), %lu trimmed, peak %ld bytes.\n",
+          (unsigned long) pool->stats.allocations,
+          (unsigned long) pool->stats.hits,
+          (unsigned long) pool->stats.mapped,
+          (unsigned long) pool->stats.huge,
+          (unsigned long) pool->stats.unpinned,
+          (unsigned long) pool->stats.remote,
+          pool->node,
+          (unsigned long) pool->stats.trimmed,
+          (long) pool->max_memory);
+  pthread_mutex_unlock(&pool->lock);
+}
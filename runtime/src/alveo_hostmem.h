@@ -0,0 +1,87 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Pool of pinned, DMA-ready host memory behind platformHostAllocate.
+//
+// Blocks come in power-of-two size classes from 4 KiB up. Blocks smaller than 2 MiB are carved from 2 MiB chunks and
+// are 4 KiB aligned; larger blocks are mappings of their own and 2 MiB aligned. Chunks are backed by huge pages when
+// those are enabled and available, and locked in memory, so the driver can DMA from them without bouncing through a
+// pinned staging buffer. Freed blocks go to a free list per class and are handed out again; memory is only returned to
+// the system by alveoHostMemTrim.
+//
+// Chunks mapped after a NUMA node is set are placed on that node, normally the one the cards are attached to, so that
+// DMA from them does not cross the link between sockets.
+//
+// Like Arrow's memory pools, the size of a block is passed back when it is freed, so the pool keeps no per-block
+// bookkeeping.
+
+#define ALVEO_HOSTMEM_PAGE (4096ull)
+#define ALVEO_HOSTMEM_CHUNK (2ull << 20)
+#define ALVEO_HOSTMEM_CLASSES 20    ///< 4 KiB up to 2 GiB. Larger blocks are not pooled.
+
+typedef struct {
+  uint64_t allocations;
+  uint64_t hits;                ///< Allocations served from a free list.
+  uint64_t mapped;              ///< Bytes mapped from the system.
+  uint64_t huge;                ///< Of which backed by explicit huge pages.
+  uint64_t unpinned;            ///< Of which could not be locked in memory.
+  uint64_t remote;              ///< Of which ended up on another NUMA node than the one asked for.
+  uint64_t trimmed;             ///< Bytes returned to the system by alveoHostMemTrim.
+} AlveoHostMemStats;
+
+typedef struct {
+  void *base;
+  size_t size;
+} AlveoHostMemMapping;
+
+typedef struct {
+  pthread_mutex_t lock;
+  int huge_pages;               ///< Try explicit huge pages (MAP_HUGETLB) before transparent ones.
+  int node;                     ///< NUMA node to place new chunks on, -1 for any.
+  void *free_lists[ALVEO_HOSTMEM_CLASSES];
+  AlveoHostMemMapping *mappings;
+  uint32_t num_mappings;
+  uint32_t capacity;
+  int64_t bytes_allocated;
+  int64_t max_memory;
+  AlveoHostMemStats stats;
+} AlveoHostMem;
+
+/// @brief Allocate \p size bytes, at least 4 KiB aligned. Zero-size allocations all return the same address.
+int alveoHostMemAllocate(AlveoHostMem *pool, int64_t size, uint8_t **out);
+
+/// @brief Grow or shrink the block at \p *ptr of \p old_size bytes to \p new_size bytes, moving it if needed.
+int alveoHostMemReallocate(AlveoHostMem *pool, int64_t old_size, int64_t new_size, uint8_t **ptr);
+
+/// @brief Return the block at \p buffer of \p size bytes to the pool.
+void alveoHostMemFree(AlveoHostMem *pool, uint8_t *buffer, int64_t size);
+
+/// @brief Return 1 if [\p buffer, \p buffer + \p size) lies in memory mapped by \p pool, 0 otherwise.
+int alveoHostMemOwns(AlveoHostMem *pool, const uint8_t *buffer, int64_t size);
+
+/**
+ * @brief Return unused blocks that are mappings of their own to the system.
+ *
+ * \p can_unmap is asked first for every such block, so that the caller can drop anything that still refers to the
+ * memory, e.g. a registration with the card. Blocks for which it returns 0 are kept.
+ */
+void alveoHostMemTrim(AlveoHostMem *pool, int (*can_unmap)(void *arg, void *base, size_t size), void *arg);
+
+void alveoHostMemPrintStats(AlveoHostMem *pool);
@@ -0,0 +1,297 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "alveo_ipc.h"
+
+#define MAGIC "ARROW1"
+#define MAGIC_SIZE 6
+#define CONTINUATION 0xFFFFFFFFu
+
+// Message header types, from Message.fbs.
+#define HEADER_RECORD_BATCH 3
+
+// Just enough of a FlatBuffers reader to find the record batches, with every access checked against the buffer.
+typedef struct {
+  const uint8_t *base;
+  size_t size;
+} FlatBuf;
+
+static int fb_fits(const FlatBuf *b, uint64_t pos, uint64_t n) {
+  return (pos <= b->size) && (n <= b->size - pos);
+}
+
+static uint16_t fb_u16(const FlatBuf *b, uint64_t pos) {
+  uint16_t v;
+  memcpy(&v, b->base + pos, sizeof(v));
+  return v;
+}
+
+static uint32_t fb_u32(const FlatBuf *b, uint64_t pos) {
+  uint32_t v;
+  memcpy(&v, b->base + pos, sizeof(v));
+  return v;
+}
+
+static int64_t fb_i64(const FlatBuf *b, uint64_t pos) {
+  int64_t v;
+  memcpy(&v, b->base + pos, sizeof(v));
+  return v;
+}
+
+// Return the position of the root table, or 0 if there is none.
+static uint64_t fb_root(const FlatBuf *b) {
+  if (!fb_fits(b, 0, 4)) {
+    return 0;
+  }
+  uint64_t table = fb_u32(b, 0);
+  return fb_fits(b, table, 4) ? table : 0;
+}
+
+// Return the position of field i of the table at position table, or 0 if it is absent.
+static uint64_t fb_field(const FlatBuf *b, uint64_t table, uint32_t i, uint64_t field_size) {
+  int32_t soffset = (int32_t) fb_u32(b, table);
+  int64_t vtable = (int64_t) table - soffset;
+  if ((vtable < 0) || !fb_fits(b, (uint64_t) vtable, 4)) {
+    return 0;
+  }
+  uint16_t vtable_size = fb_u16(b, (uint64_t) vtable);
+  if ((4 + 2 * (uint64_t) i + 2 > vtable_size) || !fb_fits(b, (uint64_t) vtable, vtable_size)) {
+    return 0;
+  }
+  uint16_t offset = fb_u16(b, (uint64_t) vtable + 4 + 2 * i);
+  if ((offset == 0) || !fb_fits(b, table + offset, field_size)) {
+    return 0;
+  }
+  return table + offset;
+}
+
+// Follow the offset stored in field i of the table at position table, to a table or vector. Returns 0 if absent.
+static uint64_t fb_ref(const FlatBuf *b, uint64_t table, uint32_t i) {
+  uint64_t field = fb_field(b, table, i, 4);
+  if (field == 0) {
+    return 0;
+  }
+  uint64_t target = field + fb_u32(b, field);
+  return fb_fits(b, target, 4) ? target : 0;
+}
+
+// Return the size of the encapsulated message at offset of the file and the position of its flatbuffer, or 0.
+static uint64_t message_at(const AlveoIpcFile *f, uint64_t offset, uint64_t *flatbuf, uint64_t *flatbuf_size) {
+  FlatBuf file = {f->data, f->size};
+  if (!fb_fits(&file, offset, 8)) {
+    return 0;
+  }
+  // Messages are prefixed by a continuation marker and their length, or only their length in older files.
+  uint64_t prefix = 4;
+  uint32_t length = fb_u32(&file, offset);
+  if (length == CONTINUATION) {
+    prefix = 8;
+    length = fb_u32(&file, offset + 4);
+  }
+  if ((length == 0) || !fb_fits(&file, offset + prefix, length)) {
+    return 0;
+  }
+  *flatbuf = offset + prefix;
+  *flatbuf_size = length;
+  return prefix + length;
+}
+
+// Read the header type and body length of the message flatbuffer at buf. Returns its header table, or 0.
+static uint64_t parse_message(const FlatBuf *msg, uint8_t *header_type, int64_t *body_size) {
+  uint64_t root = fb_root(msg);
+  if (root == 0) {
+    return 0;
+  }
+  uint64_t type = fb_field(msg, root, 1, 1);
+  uint64_t body = fb_field(msg, root, 3, 8);
+  *header_type = type != 0 ? msg->base[type] : 0;
+  *body_size = body != 0 ? fb_i64(msg, body) : 0;
+  return fb_ref(msg, root, 2);
+}
+
+// Return whether a message of metadata_size and body_size bytes at offset lies within the file.
+static int message_fits(const AlveoIpcFile *f, uint64_t offset, uint64_t metadata_size, int64_t body_size) {
+  return (body_size >= 0) && (offset <= f->size) && (metadata_size <= f->size - offset)
+      && ((uint64_t) body_size <= f->size - offset - metadata_size);
+}
+
+static int add_batch(AlveoIpcFile *f, uint32_t *capacity, uint64_t offset, uint64_t metadata_size, int64_t body_size) {
+  if (!message_fits(f, offset, metadata_size, body_size)) {
+    return 0;
+  }
+  if (f->num_batches == *capacity) {
+    uint32_t n = *capacity > 0 ? 2 * *capacity : 64;
+    AlveoIpcBatch *batches = (AlveoIpcBatch *) realloc(f->batches, n * sizeof(AlveoIpcBatch));
+    if (batches == NULL) {
+      return 0;
+    }
+    f->batches = batches;
+    *capacity = n;
+  }
+  AlveoIpcBatch *b = &f->batches[f->num_batches++];
+  b->offset = offset;
+  b->metadata_size = metadata_size;
+  b->body_size = (uint64_t) body_size;
+  return 1;
+}
+
+// The footer lists the blocks of all record batches: {offset: long, metaDataLength: int, bodyLength: long}.
+static fstatus_t read_footer(AlveoIpcFile *f) {
+  FlatBuf file = {f->data, f->size};
+  uint64_t tail = f->size - MAGIC_SIZE - 4;
+  uint32_t footer_size = fb_u32(&file, tail);
+  if (footer_size > tail) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  FlatBuf footer = {f->data + tail - footer_size, footer_size};
+  uint64_t root = fb_root(&footer);
+  uint64_t blocks = root != 0 ? fb_ref(&footer, root, 3) : 0;
+  if (blocks == 0) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  uint32_t n = fb_u32(&footer, blocks);
+  if (!fb_fits(&footer, blocks + 4, (uint64_t) n * 24)) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  uint32_t capacity = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t block = blocks + 4 + (uint64_t) i * 24;
+    int64_t offset = fb_i64(&footer, block);
+    int32_t metadata_size = (int32_t) fb_u32(&footer, block + 8);
+    int64_t body_size = fb_i64(&footer, block + 16);
+    if ((offset < 0) || (metadata_size <= 0)
+        || !add_batch(f, &capacity, (uint64_t) offset, (uint64_t) metadata_size, body_size)) {
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+// Walk the messages of a stream, starting at offset, until the end-of-stream marker or the end of the file.
+static fstatus_t walk_stream(AlveoIpcFile *f, uint64_t offset) {
+  uint32_t capacity = 0;
+  for (;;) {
+    uint64_t flatbuf;
+    uint64_t flatbuf_size;
+    uint64_t size = message_at(f, offset, &flatbuf, &flatbuf_size);
+    if (size == 0) {
+      return FLETCHER_STATUS_OK;
+    }
+    // Metadata is padded to a multiple of 8 bytes, and the body follows it.
+    size = (size + 7) & ~7ull;
+    FlatBuf msg = {f->data + flatbuf, flatbuf_size};
+    uint8_t type;
+    int64_t body_size;
+    // Every message is checked before it is skipped, whatever its type, so that the walk always moves forward.
+    if ((parse_message(&msg, &type, &body_size) == 0) || !message_fits(f, offset, size, body_size)) {
+      return FLETCHER_STATUS_ERROR;
+    }
+    if ((type == HEADER_RECORD_BATCH) && !add_batch(f, &capacity, offset, size, body_size)) {
+      return FLETCHER_STATUS_ERROR;
+    }
+    offset += size + (uint64_t) body_size;
+  }
+}
+
+fstatus_t alveoIpcOpen(AlveoIpcFile *f, const char *path) {
+  memset(f, 0, sizeof(*f));
+  f->fd = open(path, O_RDONLY);
+  if (f->fd < 0) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  struct stat st;
+  if ((fstat(f->fd, &st) != 0) || (st.st_size < 8)) {
+    alveoIpcClose(f);
+    return FLETCHER_STATUS_ERROR;
+  }
+  void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+  if (data == MAP_FAILED) {
+    alveoIpcClose(f);
+    return FLETCHER_STATUS_ERROR;
+  }
+  f->data = (const uint8_t *) data;
+  f->size = (size_t) st.st_size;
+  madvise(data, f->size, MADV_SEQUENTIAL);
+  fstatus_t status;
+  int file_format = (f->size >= 2 * 8 + 4) && (memcmp(f->data, MAGIC, MAGIC_SIZE) == 0)
+      && (memcmp(f->data + f->size - MAGIC_SIZE, MAGIC, MAGIC_SIZE) == 0);
+  if (file_format) {
+    status = read_footer(f);
+  } else {
+    status = walk_stream(f, 0);
+  }
+  if (status != FLETCHER_STATUS_OK) {
+    alveoIpcClose(f);
+  }
+  return status;
+}
+
+const uint8_t *alveoIpcBody(const AlveoIpcFile *f, uint32_t i) {
+  return f->data + f->batches[i].offset + f->batches[i].metadata_size;
+}
+
+int64_t alveoIpcRows(const AlveoIpcFile *f, uint32_t i) {
+  uint64_t flatbuf;
+  uint64_t flatbuf_size;
+  if (message_at(f, f->batches[i].offset, &flatbuf, &flatbuf_size) == 0) {
+    return -1;
+  }
+  FlatBuf msg = {f->data + flatbuf, flatbuf_size};
+  uint8_t type;
+  int64_t body_size;
+  uint64_t header = parse_message(&msg, &type, &body_size);
+  if ((header == 0) || (type != HEADER_RECORD_BATCH)) {
+    return -1;
+  }
+  uint64_t length = fb_field(&msg, header, 0, 8);
+  return length != 0 ? fb_i64(&msg, length) : 0;
+}
+
+void alveoIpcAdvise(const AlveoIpcFile *f, uint64_t offset, uint64_t size, int will_need) {
+  // Advice applies to whole pages; only drop the pages that lie entirely inside the range.
+  uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+  uint64_t begin = will_need ? offset & ~(page - 1) : (offset + page - 1) & ~(page - 1);
+  uint64_t end = will_need ? offset + size : (offset + size) & ~(page - 1);
+  if (end > f->size) {
+    end = f->size;
+  }
+  if (end <= begin) {
+    return;
+  }
+  if (will_need) {
+    madvise((void *) (f->data + begin), end - begin, MADV_WILLNEED);
+  } else {
+    madvise((void *) (f->data + begin), end - begin, MADV_DONTNEED);
+    posix_fadvise(f->fd, (off_t) begin, (off_t) (end - begin), POSIX_FADV_DONTNEED);
+  }
+}
+
+void alveoIpcClose(AlveoIpcFile *f) {
+  if (f->data != NULL) {
+    munmap((void *) f->data, f->size);
+  }
+  if (f->fd >= 0) {
+    close(f->fd);
+  }
+  free(f->batches);
+  memset(f, 0, sizeof(*f));
+  f->fd = -1;
+}
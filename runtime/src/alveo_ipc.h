@@ -0,0 +1,59 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fletcher/fletcher.h"
+
+// Memory-mapped Arrow IPC files, see platformStreamIpcFile.
+//
+// Both the IPC file format (Feather v2) and the streaming format are read. Files are located through their footer, so
+// opening a file only touches its last pages; streams are walked message by message. Record batches are described by
+// the position and size of their body in the mapping. Dictionary batches are skipped.
+
+typedef struct {
+  uint64_t offset;              ///< Offset of the message in the file.
+  uint64_t metadata_size;       ///< Size of the encapsulated message metadata, including its prefix and padding.
+  uint64_t body_size;
+} AlveoIpcBatch;
+
+typedef struct {
+  int fd;
+  const uint8_t *data;          ///< The file, mapped read-only.
+  size_t size;
+  AlveoIpcBatch *batches;
+  uint32_t num_batches;
+} AlveoIpcFile;
+
+/// @brief Map the Arrow IPC file or stream at \p path and find its record batches.
+fstatus_t alveoIpcOpen(AlveoIpcFile *f, const char *path);
+
+/// @brief Return the body of record batch \p i.
+const uint8_t *alveoIpcBody(const AlveoIpcFile *f, uint32_t i);
+
+/// @brief Return the number of rows of record batch \p i, read from its metadata, or -1 if the metadata is invalid.
+int64_t alveoIpcRows(const AlveoIpcFile *f, uint32_t i);
+
+/**
+ * @brief Advise the kernel about [\p offset, \p offset + \p size) of the file.
+ *
+ * With \p will_need, the range is read ahead asynchronously. Otherwise its pages are dropped from the mapping and the
+ * page cache, so that scanning a file keeps no more of it in memory than is being streamed.
+ */
+void alveoIpcAdvise(const AlveoIpcFile *f, uint64_t offset, uint64_t size, int will_need);
+
+void alveoIpcClose(AlveoIpcFile *f);
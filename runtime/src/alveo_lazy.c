@@ -0,0 +1,232 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/userfaultfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "alveo_lazy.h"
+
+typedef struct {
+  int used;
+  uint8_t *view;                ///< The mapping handed out.
+  size_t size;                  ///< Mapped bytes, a multiple of the page size.
+  size_t registered;            ///< Leading bytes that are fetched on a fault; the rest is zeros.
+  uint64_t produced;
+  da_t address;
+  uint8_t *present;             ///< Per block, set once the block was filled.
+  AlveoLazyFetch fetch;
+  void *ctx;
+  uint64_t failures;
+} LazyMapping;
+
+static LazyMapping mappings[ALVEO_LAZY_MAX_MAPPINGS];
+// Serializes adding and removing mappings against the fault thread, so a mapping is never removed while one of its
+// blocks is being filled.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t uffd_once = PTHREAD_ONCE_INIT;
+static int uffd = -1;
+static AlveoLazyStats stats;
+
+// Fill block of m: fetch its data into a bounce buffer and install that atomically, which also wakes up the threads
+// that are waiting on the block.
+static void fill_block(LazyMapping *m, uint64_t block, uint8_t *bounce) {
+  uint64_t offset = block * ALVEO_LAZY_BLOCK;
+  uint64_t size = m->registered - offset < ALVEO_LAZY_BLOCK ? m->registered - offset : ALVEO_LAZY_BLOCK;
+  if (m->present[block]) {
+    // A fault that was raised before the block was installed; the waiting thread only has to retry.
+    struct uffdio_range range = {(uint64_t) (uintptr_t) (m->view + offset), size};
+    ioctl(uffd, UFFDIO_WAKE, &range);
+    return;
+  }
+  uint64_t data = m->produced - offset < size ? m->produced - offset : size;
+  if (m->fetch(m->ctx, m->address + offset, bounce, (int64_t) data) == FLETCHER_STATUS_OK) {
+    stats.blocks++;
+    stats.bytes += data;
+  } else {
+    memset(bounce, 0, data);
+    m->failures++;
+    stats.failures++;
+  }
+  memset(bounce + data, 0, size - data);
+  struct uffdio_copy copy = {(uint64_t) (uintptr_t) (m->view + offset), (uint64_t) (uintptr_t) bounce, size, 0, 0};
+  if (ioctl(uffd, UFFDIO_COPY, &copy) != 0) {
+    // Let the waiting threads retry, which faults again if the block is still missing.
+    struct uffdio_range range = {copy.dst, size};
+    ioctl(uffd, UFFDIO_WAKE, &range);
+    return;
+  }
+  m->present[block] = 1;
+}
+
+// Resolve the page faults on all mappings. Runs for the lifetime of the process.
+static void *fault_main(void *arg) {
+  (void) arg;
+  uint8_t *bounce = (uint8_t *) malloc(ALVEO_LAZY_BLOCK);
+  if (bounce == NULL) {
+    return NULL;
+  }
+  for (;;) {
+    struct uffd_msg msg;
+    ssize_t n = read(uffd, &msg, sizeof(msg));
+    if (n != (ssize_t) sizeof(msg)) {
+      if ((n < 0) && (errno == EINTR)) {
+        continue;
+      }
+      break;
+    }
+    if (msg.event != UFFD_EVENT_PAGEFAULT) {
+      continue;
+    }
+    uint8_t *address = (uint8_t *) (uintptr_t) msg.arg.pagefault.address;
+    pthread_mutex_lock(&lock);
+    for (uint32_t i = 0; i < ALVEO_LAZY_MAX_MAPPINGS; i++) {
+      LazyMapping *m = &mappings[i];
+      if (m->used && (address >= m->view) && (address < m->view + m->registered)) {
+        fill_block(m, (uint64_t) (address - m->view) / ALVEO_LAZY_BLOCK, bounce);
+        break;
+      }
+    }
+    pthread_mutex_unlock(&lock);
+  }
+  free(bounce);
+  return NULL;
+}
+
+static void start_fault_thread(void) {
+  // Handling faults raised in the kernel, e.g. when a mapping is passed to a system call, may need privileges;
+  // without them, only faults in user mode are handled.
+  int fd = (int) syscall(SYS_userfaultfd, O_CLOEXEC);
+#ifdef UFFD_USER_MODE_ONLY
+  if ((fd < 0) && (errno == EPERM)) {
+    fd = (int) syscall(SYS_userfaultfd, O_CLOEXEC | UFFD_USER_MODE_ONLY);
+  }
+#endif
+  if (fd < 0) {
+    return;
+  }
+  struct uffdio_api api;
+  memset(&api, 0, sizeof(api));
+  api.api = UFFD_API;
+  if (ioctl(fd, UFFDIO_API, &api) != 0) {
+    close(fd);
+    return;
+  }
+  uffd = fd;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, fault_main, NULL) != 0) {
+    close(fd);
+    uffd = -1;
+    return;
+  }
+  pthread_detach(thread);
+}
+
+static void release(LazyMapping *m) {
+  if (m->view != MAP_FAILED) {
+    // Unmapping also unregisters the range.
+    munmap(m->view, m->size);
+  }
+  free(m->present);
+}
+
+fstatus_t alveoLazyMap(da_t address, int64_t size, int64_t produced, AlveoLazyFetch fetch, void *ctx,
+                       const uint8_t **host) {
+  if (size <= 0) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  pthread_once(&uffd_once, start_fault_thread);
+  if (uffd < 0) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+  size_t mapped = (size_t) (((uint64_t) size + page - 1) & ~(page - 1));
+  LazyMapping m;
+  memset(&m, 0, sizeof(m));
+  m.size = mapped;
+  m.produced = (produced < 0) || (produced > size) ? (uint64_t) size : (uint64_t) produced;
+  m.address = address;
+  m.fetch = fetch;
+  m.ctx = ctx;
+  // Blocks that hold no data are zeros already, so they are not registered and never fault.
+  uint64_t blocks = (m.produced + ALVEO_LAZY_BLOCK - 1) / ALVEO_LAZY_BLOCK;
+  m.registered = blocks * ALVEO_LAZY_BLOCK < mapped ? blocks * ALVEO_LAZY_BLOCK : mapped;
+  m.view = (uint8_t *) mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  m.present = (uint8_t *) calloc(blocks > 0 ? blocks : 1, sizeof(uint8_t));
+  if ((m.view == MAP_FAILED) || (m.present == NULL)) {
+    release(&m);
+    return FLETCHER_STATUS_ERROR;
+  }
+  if (m.registered > 0) {
+    struct uffdio_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = (uint64_t) (uintptr_t) m.view;
+    reg.range.len = m.registered;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (ioctl(uffd, UFFDIO_REGISTER, &reg) != 0) {
+      release(&m);
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  pthread_mutex_lock(&lock);
+  for (uint32_t i = 0; i < ALVEO_LAZY_MAX_MAPPINGS; i++) {
+    if (!mappings[i].used) {
+      mappings[i] = m;
+      mappings[i].used = 1;
+      stats.mappings++;
+      pthread_mutex_unlock(&lock);
+      *host = m.view;
+      return FLETCHER_STATUS_OK;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  release(&m);
+  return FLETCHER_STATUS_ERROR;
+}
+
+fstatus_t alveoLazyUnmap(const uint8_t *host) {
+  pthread_mutex_lock(&lock);
+  for (uint32_t i = 0; i < ALVEO_LAZY_MAX_MAPPINGS; i++) {
+    LazyMapping *m = &mappings[i];
+    if (m->used && (m->view == host)) {
+      fstatus_t status = m->failures == 0 ? FLETCHER_STATUS_OK : FLETCHER_STATUS_ERROR;
+      release(m);
+      memset(m, 0, sizeof(*m));
+      pthread_mutex_unlock(&lock);
+      return status;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return FLETCHER_STATUS_ERROR;
+}
+
+void alveoLazyPrintStats(void) {
+  pthread_mutex_lock(&lock);
+  fprintf(stderr, "[FLETCHER_ALVEO] Lazy results: %lu mappings, %lu blocks / %lu bytes fetched, %lu failures.\n",
+          (unsigned long) stats.mappings,
+          (unsigned long) stats.blocks,
+          (unsigned long) stats.bytes,
+          (unsigned long) stats.failures);
+  pthread_mutex_unlock(&lock);
+}
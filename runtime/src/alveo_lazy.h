@@ -0,0 +1,55 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "fletcher/fletcher.h"
+
+// Host mappings of device memory whose contents are fetched on first touch.
+//
+// A mapping starts out with no pages. The first access to a block faults, and the block is fetched from the device and
+// installed as a whole, so only the blocks that are actually read cross PCIe and no thread ever sees a block
+// half-filled. Blocks past the produced size are zero and are never fetched.
+//
+// Faults are delivered through userfaultfd to one thread of the runtime, which fetches the blocks while the threads
+// that touched them wait. Fetches therefore run in a normal thread rather than in a signal handler, and may take locks
+// and call into the driver. Mapping fails where userfaultfd is not available.
+
+#define ALVEO_LAZY_MAX_MAPPINGS 64
+#define ALVEO_LAZY_BLOCK (64 * 1024)
+
+/// @brief Copy \p size bytes at device address \p address into \p host.
+typedef fstatus_t (*AlveoLazyFetch)(void *ctx, da_t address, uint8_t *host, int64_t size);
+
+typedef struct {
+  uint64_t mappings;
+  uint64_t blocks;              ///< Blocks fetched.
+  uint64_t bytes;               ///< Bytes fetched.
+  uint64_t failures;            ///< Blocks that could not be fetched, which read as zeros.
+} AlveoLazyStats;
+
+/**
+ * @brief Map \p size bytes of device memory at \p address, of which the first \p produced bytes hold data.
+ *
+ * \p fetch is called with \p ctx for every block that is touched. The mapping is stored in \p host.
+ */
+fstatus_t alveoLazyMap(da_t address, int64_t size, int64_t produced, AlveoLazyFetch fetch, void *ctx,
+                       const uint8_t **host);
+
+/// @brief Remove a mapping made by alveoLazyMap. Returns FLETCHER_STATUS_ERROR if any of its blocks failed to fetch.
+fstatus_t alveoLazyUnmap(const uint8_t *host);
+
+void alveoLazyPrintStats(void);
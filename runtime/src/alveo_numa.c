@@ -0,0 +1,113 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "alveo_numa.h"
+
+// From linux/mempolicy.h.
+#define ALVEO_MPOL_PREFERRED 1
+#define ALVEO_MPOL_F_NODE (1 << 0)
+#define ALVEO_MPOL_F_ADDR (1 << 1)
+
+int alveoNumaReadNode(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  int node = -1;
+  if (fscanf(f, "%d", &node) != 1) {
+    node = -1;
+  }
+  fclose(f);
+  return node;
+}
+
+int alveoNumaNodeCpus(int node, AlveoCpuSet *cpus) {
+  memset(cpus, 0, sizeof(*cpus));
+  if (node < 0) {
+    return 0;
+  }
+  char path[128];
+  char list[4096];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+  char *line = fgets(list, sizeof(list), f);
+  fclose(f);
+  if (line == NULL) {
+    return 0;
+  }
+  // The list looks like "0-15,32-47".
+  char *p = list;
+  while ((*p >= '0') && (*p <= '9')) {
+    long first = strtol(p, &p, 10);
+    long last = first;
+    if (*p == '-') {
+      last = strtol(p + 1, &p, 10);
+    }
+    for (long c = first; (c <= last) && (c < ALVEO_NUMA_MAX_CPUS); c++) {
+      cpus->bits[c / 64] |= 1ull << (c % 64);
+    }
+    if (*p == ',') {
+      p++;
+    }
+  }
+  int count = 0;
+  for (int w = 0; w < ALVEO_NUMA_MAX_CPUS / 64; w++) {
+    count += __builtin_popcountll(cpus->bits[w]);
+  }
+  return count;
+}
+
+int alveoNumaBind(void *addr, size_t size, int node) {
+  if ((node < 0) || (node >= 64)) {
+    return -1;
+  }
+  unsigned long mask = 1ul << node;
+  return (int) syscall(SYS_mbind, addr, size, ALVEO_MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
+
+int alveoNumaNodeOf(const void *addr) {
+  int node = -1;
+  if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr, ALVEO_MPOL_F_NODE | ALVEO_MPOL_F_ADDR) != 0) {
+    return -1;
+  }
+  return node;
+}
+
+void alveoNumaPin(pthread_t thread, const AlveoCpuSet *cpus) {
+  if (cpus == NULL) {
+    return;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int c = 0; (c < ALVEO_NUMA_MAX_CPUS) && (c < CPU_SETSIZE); c++) {
+    if ((cpus->bits[c / 64] >> (c % 64)) & 1) {
+      CPU_SET(c, &set);
+    }
+  }
+  if (CPU_COUNT(&set) > 0) {
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+  }
+}
@@ -0,0 +1,48 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// NUMA locality of the cards.
+//
+// On hosts with several sockets, every card hangs off the PCIe root of one of them. DMA to and from memory of the other
+// socket crosses the inter-socket link, and so does every access by a thread running there. The functions here find
+// the node of a card, the processors of a node, and bind memory to a node, using sysfs and the kernel's NUMA system
+// calls directly so that the runtime does not depend on libnuma.
+
+#define ALVEO_NUMA_MAX_CPUS 1024
+
+/// @brief A set of processors. Kept apart from cpu_set_t, so that users of this header need no _GNU_SOURCE.
+typedef struct {
+  uint64_t bits[ALVEO_NUMA_MAX_CPUS / 64];
+} AlveoCpuSet;
+
+/// @brief Return the NUMA node in the sysfs attribute at \p path, e.g. the numa_node of a PCIe device, or -1.
+int alveoNumaReadNode(const char *path);
+
+/// @brief Store the processors of NUMA node \p node in \p cpus. Returns their number, 0 if the node is unknown.
+int alveoNumaNodeCpus(int node, AlveoCpuSet *cpus);
+
+/// @brief Prefer NUMA node \p node for the pages of [\p addr, \p addr + \p size) that are not faulted in yet.
+int alveoNumaBind(void *addr, size_t size, int node);
+
+/// @brief Return the NUMA node of the page at \p addr, which must be faulted in, or -1.
+int alveoNumaNodeOf(const void *addr);
+
+/// @brief Restrict \p thread to \p cpus. Does nothing if \p cpus is NULL or empty.
+void alveoNumaPin(pthread_t thread, const AlveoCpuSet *cpus);
@@ -0,0 +1,155 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fletcher/fletcher.h"
+#include "alveo_emu.h"
+#include "alveo_profile.h"
+
+static const char *kind_names[ALVEO_PROFILE_KINDS] = {"H2D", "D2H", "Run", "MMIO"};
+
+void alveoProfileInit(AlveoProfiler *p, int enabled, uint64_t max_records) {
+  memset(p, 0, sizeof(*p));
+  pthread_mutex_init(&p->lock, NULL);
+  p->enabled = enabled;
+  p->max_records = max_records;
+  p->epoch_ns = alveoNowNs();
+}
+
+static uint32_t bucket(uint64_t ns) {
+  uint32_t b = 0;
+  while ((ns > 1) && (b < ALVEO_PROFILE_BUCKETS - 1)) {
+    ns >>= 1;
+    b++;
+  }
+  return b;
+}
+
+void alveoProfileRecord(AlveoProfiler *p, const AlveoProfileRecord *r) {
+  if (!p->enabled) {
+    return;
+  }
+  uint64_t latency = r->end_ns - r->queued_ns;
+  pthread_mutex_lock(&p->lock);
+  AlveoProfileStats *s = &p->stats[r->kind];
+  s->count++;
+  if (r->kind != ALVEO_PROFILE_MMIO) {
+    s->bytes += (uint64_t) r->size;
+  }
+  s->busy_ns += r->end_ns - r->start_ns;
+  s->total_ns += latency;
+  if (latency > s->max_ns) {
+    s->max_ns = latency;
+  }
+  s->histogram[bucket(latency)]++;
+
+  if (p->num_records == p->capacity) {
+    uint64_t capacity = p->capacity > 0 ? 2 * p->capacity : 1024;
+    if (capacity > p->max_records) {
+      capacity = p->max_records;
+    }
+    AlveoProfileRecord *records = NULL;
+    if (capacity > p->capacity) {
+      records = (AlveoProfileRecord *) realloc(p->records, capacity * sizeof(AlveoProfileRecord));
+    }
+    if (records != NULL) {
+      p->records = records;
+      p->capacity = capacity;
+    }
+  }
+  if (p->num_records < p->capacity) {
+    p->records[p->num_records++] = *r;
+  } else {
+    p->dropped++;
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+// Return the upper bound of the bucket that holds quantile q of the histogram.
+static uint64_t percentile(const AlveoProfileStats *s, double q) {
+  uint64_t target = (uint64_t) (q * (double) s->count);
+  uint64_t seen = 0;
+  for (uint32_t b = 0; b < ALVEO_PROFILE_BUCKETS; b++) {
+    seen += s->histogram[b];
+    if (seen > target) {
+      return 2ull << b;
+    }
+  }
+  return s->max_ns;
+}
+
+void alveoProfilePrintStats(const AlveoProfiler *p) {
+  if (!p->enabled) {
+    return;
+  }
+  for (uint32_t k = 0; k < ALVEO_PROFILE_KINDS; k++) {
+    const AlveoProfileStats *s = &p->stats[k];
+    if (s->count == 0) {
+      continue;
+    }
+    fprintf(stderr, "[FLETCHER_ALVEO] Profile %-4s: %lu ops, %lu ns average, p50 < %lu ns, p99 < %lu ns, %lu ns max",
+            kind_names[k],
+            (unsigned long) s->count,
+            (unsigned long) (s->total_ns / s->count),
+            (unsigned long) percentile(s, 0.50),
+            (unsigned long) percentile(s, 0.99),
+            (unsigned long) s->max_ns);
+    if ((k != ALVEO_PROFILE_MMIO) && (s->busy_ns > 0)) {
+      fprintf(stderr, ", %lu bytes, %.3f GB/s", (unsigned long) s->bytes, (double) s->bytes / (double) s->busy_ns);
+    }
+    fprintf(stderr, ".\n");
+  }
+  if (p->dropped > 0) {
+    fprintf(stderr, "[FLETCHER_ALVEO] Profile: %lu records not kept for the trace.\n", (unsigned long) p->dropped);
+  }
+}
+
+fstatus_t alveoProfileWriteTrace(const AlveoProfiler *p, const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  // One complete event per record, from start to end, on a track per card (process) and compute unit (thread). The
+  // time spent waiting before the device picked the operation up is kept in the arguments.
+  fprintf(f, "{\"traceEvents\":[");
+  for (uint64_t i = 0; i < p->num_records; i++) {
+    const AlveoProfileRecord *r = &p->records[i];
+    fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+               "\"args\":{\"size\":%ld,\"bank\":%d,\"queued_us\":%.3f,\"submit_us\":%.3f}}",
+            i > 0 ? "," : "",
+            kind_names[r->kind],
+            r->kind == ALVEO_PROFILE_RUN ? "kernel" : (r->kind == ALVEO_PROFILE_MMIO ? "mmio" : "copy"),
+            r->card,
+            r->cu,
+            (double) (r->start_ns - p->epoch_ns) / 1000.0,
+            (double) (r->end_ns - r->start_ns) / 1000.0,
+            (long) r->size,
+            r->bank,
+            (double) (r->queued_ns - p->epoch_ns) / 1000.0,
+            (double) (r->submit_ns - p->epoch_ns) / 1000.0);
+  }
+  fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  return fclose(f) == 0 ? FLETCHER_STATUS_OK : FLETCHER_STATUS_ERROR;
+}
+
+void alveoProfileTerminate(AlveoProfiler *p) {
+  free(p->records);
+  p->records = NULL;
+  p->num_records = 0;
+  p->capacity = 0;
+  pthread_mutex_destroy(&p->lock);
+}
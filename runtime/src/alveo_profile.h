@@ -0,0 +1,86 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "fletcher/fletcher.h"
+
+// Profiling of transfers, kernel runs and register accesses.
+//
+// Every operation is recorded with four timestamps on the host clock: when the platform call was made (queued), when it
+// was handed to the driver (submit), and when the device started and ended it. Copies through the command queue take
+// start and end from the OpenCL profiling counters; for all others, start is the submit time and end is the time the
+// call completed. Records are aggregated per kind into log2 latency histograms and effective bandwidth, and can be
+// dumped as a Chrome trace (chrome://tracing, Perfetto) at platformTerminate.
+
+#define ALVEO_PROFILE_BUCKETS 48
+
+typedef enum {
+  ALVEO_PROFILE_H2D = 0,
+  ALVEO_PROFILE_D2H = 1,
+  ALVEO_PROFILE_RUN = 2,
+  ALVEO_PROFILE_MMIO = 3,
+  ALVEO_PROFILE_KINDS = 4
+} AlveoProfileKind;
+
+typedef struct {
+  AlveoProfileKind kind;
+  uint32_t card;
+  uint32_t cu;
+  int bank;                     ///< Bank of on-board memory, or -1 for streams and registers.
+  int64_t size;                 ///< Bytes moved, or the number of registers written.
+  uint64_t queued_ns;
+  uint64_t submit_ns;
+  uint64_t start_ns;
+  uint64_t end_ns;
+} AlveoProfileRecord;
+
+typedef struct {
+  uint64_t count;
+  uint64_t bytes;
+  uint64_t busy_ns;             ///< Sum of end - start.
+  uint64_t total_ns;            ///< Sum of end - queued.
+  uint64_t max_ns;
+  uint64_t histogram[ALVEO_PROFILE_BUCKETS];  ///< Bucket i counts latencies (end - queued) in [2^i, 2^(i+1)) ns.
+} AlveoProfileStats;
+
+typedef struct {
+  int enabled;
+  pthread_mutex_t lock;         ///< Protects the fields below.
+  AlveoProfileRecord *records;  ///< Kept for the trace, up to max_records.
+  uint64_t num_records;
+  uint64_t capacity;
+  uint64_t max_records;
+  uint64_t dropped;             ///< Records aggregated but not kept, because max_records was reached.
+  uint64_t epoch_ns;            ///< Trace timestamps are relative to this.
+  AlveoProfileStats stats[ALVEO_PROFILE_KINDS];
+} AlveoProfiler;
+
+/// @brief Initialize \p p. Nothing is recorded unless \p enabled is set. At most \p max_records are kept for the trace.
+void alveoProfileInit(AlveoProfiler *p, int enabled, uint64_t max_records);
+
+/// @brief Record \p r.
+void alveoProfileRecord(AlveoProfiler *p, const AlveoProfileRecord *r);
+
+/// @brief Print count, latency percentiles and effective bandwidth per kind to stderr.
+void alveoProfilePrintStats(const AlveoProfiler *p);
+
+/// @brief Write all kept records to \p path in the Chrome trace event format.
+fstatus_t alveoProfileWriteTrace(const AlveoProfiler *p, const char *path);
+
+/// @brief Free all records.
+void alveoProfileTerminate(AlveoProfiler *p);
@@ -0,0 +1,281 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "alveo_stage.h"
+
+#define ALVEO_STAGE_MAX_THREADS 32
+#define ALVEO_STAGE_STREAM_MIN (256 * 1024)   // Smaller copies likely stay in the cache anyway.
+
+// Shift a range of a bitmap. dst[i] takes bits s..7 of src[i] and bits 0..s-1 of src[i + 1], for i < n. Only the first
+// avail bytes of src may be read. s is 1 to 7.
+static void shift_scalar(uint8_t *dst, const uint8_t *src, unsigned s, int64_t n, int64_t avail, int64_t i) {
+  // Eight bytes at a time, as long as the byte after them can be read too.
+  for (; i + 9 <= avail && i + 8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, src + i, 8);
+    w = (w >> s) | ((uint64_t) src[i + 8] << (64 - s));
+    memcpy(dst + i, &w, 8);
+  }
+  for (; i < n; i++) {
+    uint8_t hi = i + 1 < avail ? (uint8_t) (src[i + 1] << (8 - s)) : 0;
+    dst[i] = (uint8_t) ((src[i] >> s) | hi);
+  }
+}
+
+static void copy_scalar(uint8_t *dst, const uint8_t *src, int64_t size) {
+  memcpy(dst, src, (size_t) size);
+}
+
+#if defined(__x86_64__)
+// Every 64-bit lane is shifted right, and the low bits of the lane eight bytes further fill in its top.
+__attribute__((target("avx2")))
+static void shift_avx2(uint8_t *dst, const uint8_t *src, unsigned s, int64_t n, int64_t avail) {
+  int64_t i = 0;
+  __m128i right = _mm_cvtsi32_si128((int) s);
+  __m128i left = _mm_cvtsi32_si128((int) (64 - s));
+  for (; i + 40 <= avail && i + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (src + i + 8));
+    __m256i w = _mm256_or_si256(_mm256_srl_epi64(a, right), _mm256_sll_epi64(b, left));
+    _mm256_storeu_si256((__m256i *) (dst + i), w);
+  }
+  shift_scalar(dst, src, s, n, avail, i);
+}
+
+__attribute__((target("avx512f")))
+static void shift_avx512(uint8_t *dst, const uint8_t *src, unsigned s, int64_t n, int64_t avail) {
+  int64_t i = 0;
+  __m128i right = _mm_cvtsi32_si128((int) s);
+  __m128i left = _mm_cvtsi32_si128((int) (64 - s));
+  for (; i + 72 <= avail && i + 64 <= n; i += 64) {
+    __m512i a = _mm512_loadu_si512((const void *) (src + i));
+    __m512i b = _mm512_loadu_si512((const void *) (src + i + 8));
+    __m512i w = _mm512_or_si512(_mm512_srl_epi64(a, right), _mm512_sll_epi64(b, left));
+    _mm512_storeu_si512((void *) (dst + i), w);
+  }
+  shift_scalar(dst, src, s, n, avail, i);
+}
+
+// Large copies use non-temporal stores: the staging buffer goes to the card next, not to the processor.
+__attribute__((target("avx2")))
+static void copy_avx2(uint8_t *dst, const uint8_t *src, int64_t size) {
+  if (size < ALVEO_STAGE_STREAM_MIN) {
+    memcpy(dst, src, (size_t) size);
+    return;
+  }
+  int64_t head = (int64_t) ((32 - ((uintptr_t) dst & 31)) & 31);
+  memcpy(dst, src, (size_t) head);
+  int64_t i = head;
+  for (; i + 128 <= size; i += 128) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (src + i + 32));
+    __m256i c = _mm256_loadu_si256((const __m256i *) (src + i + 64));
+    __m256i d = _mm256_loadu_si256((const __m256i *) (src + i + 96));
+    _mm256_stream_si256((__m256i *) (dst + i), a);
+    _mm256_stream_si256((__m256i *) (dst + i + 32), b);
+    _mm256_stream_si256((__m256i *) (dst + i + 64), c);
+    _mm256_stream_si256((__m256i *) (dst + i + 96), d);
+  }
+  _mm_sfence();
+  memcpy(dst + i, src + i, (size_t) (size - i));
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512(uint8_t *dst, const uint8_t *src, int64_t size) {
+  if (size < ALVEO_STAGE_STREAM_MIN) {
+    memcpy(dst, src, (size_t) size);
+    return;
+  }
+  int64_t head = (int64_t) ((64 - ((uintptr_t) dst & 63)) & 63);
+  memcpy(dst, src, (size_t) head);
+  int64_t i = head;
+  for (; i + 256 <= size; i += 256) {
+    __m512i a = _mm512_loadu_si512((const void *) (src + i));
+    __m512i b = _mm512_loadu_si512((const void *) (src + i + 64));
+    __m512i c = _mm512_loadu_si512((const void *) (src + i + 128));
+    __m512i d = _mm512_loadu_si512((const void *) (src + i + 192));
+    _mm512_stream_si512((void *) (dst + i), a);
+    _mm512_stream_si512((void *) (dst + i + 64), b);
+    _mm512_stream_si512((void *) (dst + i + 128), c);
+    _mm512_stream_si512((void *) (dst + i + 192), d);
+  }
+  _mm_sfence();
+  memcpy(dst + i, src + i, (size_t) (size - i));
+}
+#endif
+
+static void shift_range(AlveoStageIsa isa, uint8_t *dst, const uint8_t *src, unsigned s, int64_t n, int64_t avail) {
+#if defined(__x86_64__)
+  if (isa == ALVEO_STAGE_AVX512) {
+    shift_avx512(dst, src, s, n, avail);
+    return;
+  }
+  if (isa == ALVEO_STAGE_AVX2) {
+    shift_avx2(dst, src, s, n, avail);
+    return;
+  }
+#endif
+  (void) isa;
+  shift_scalar(dst, src, s, n, avail, 0);
+}
+
+static void copy_range(AlveoStageIsa isa, uint8_t *dst, const uint8_t *src, int64_t size) {
+#if defined(__x86_64__)
+  if (isa == ALVEO_STAGE_AVX512) {
+    copy_avx512(dst, src, size);
+    return;
+  }
+  if (isa == ALVEO_STAGE_AVX2) {
+    copy_avx2(dst, src, size);
+    return;
+  }
+#endif
+  (void) isa;
+  copy_scalar(dst, src, size);
+}
+
+void alveoStageInit(AlveoStager *st, AlveoStageIsa max_isa, uint32_t threads, uint64_t parallel_min) {
+  memset(st, 0, sizeof(*st));
+  st->isa = ALVEO_STAGE_SCALAR;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if ((max_isa >= ALVEO_STAGE_AVX512) && __builtin_cpu_supports("avx512f")) {
+    st->isa = ALVEO_STAGE_AVX512;
+  } else if ((max_isa >= ALVEO_STAGE_AVX2) && __builtin_cpu_supports("avx2")) {
+    st->isa = ALVEO_STAGE_AVX2;
+  }
+#else
+  (void) max_isa;
+#endif
+  st->threads = threads == 0 ? 1 : (threads > ALVEO_STAGE_MAX_THREADS ? ALVEO_STAGE_MAX_THREADS : threads);
+  st->parallel_min = parallel_min == 0 ? 1 : parallel_min;
+}
+
+// A part of a copy or bitmap shift, run by one thread. For a copy, shift is 0.
+typedef struct {
+  AlveoStageIsa isa;
+  uint8_t *dst;
+  const uint8_t *src;
+  unsigned shift;
+  int64_t n;
+  int64_t avail;
+} StagePart;
+
+static void run_part(const StagePart *p) {
+  if (p->shift == 0) {
+    copy_range(p->isa, p->dst, p->src, p->n);
+  } else {
+    shift_range(p->isa, p->dst, p->src, p->shift, p->n, p->avail);
+  }
+}
+
+static void *part_main(void *arg) {
+  run_part((const StagePart *) arg);
+  return NULL;
+}
+
+// Split n output bytes over as many threads as are worth it, and run the parts. The calling thread runs the first one.
+static void run_parallel(AlveoStager *st, uint8_t *dst, const uint8_t *src, unsigned shift, int64_t n, int64_t avail) {
+  uint64_t parts = (uint64_t) n / st->parallel_min;
+  if (parts > st->threads) {
+    parts = st->threads;
+  }
+  if (parts <= 1) {
+    StagePart p = {st->isa, dst, src, shift, n, avail};
+    run_part(&p);
+    return;
+  }
+  __atomic_add_fetch(&st->stats.parallel, 1, __ATOMIC_RELAXED);
+  StagePart part[ALVEO_STAGE_MAX_THREADS];
+  pthread_t threads[ALVEO_STAGE_MAX_THREADS];
+  int started[ALVEO_STAGE_MAX_THREADS];
+  // Parts start at multiples of 64 bytes, so that the vector stores of neighbouring parts do not share cache lines.
+  int64_t step = ((n + (int64_t) parts - 1) / (int64_t) parts + 63) & ~(int64_t) 63;
+  for (uint64_t t = 0; t < parts; t++) {
+    int64_t begin = (int64_t) t * step;
+    int64_t end = begin + step < n ? begin + step : n;
+    part[t].isa = st->isa;
+    part[t].dst = dst + begin;
+    part[t].src = src + begin;
+    part[t].shift = shift;
+    part[t].n = end > begin ? end - begin : 0;
+    part[t].avail = avail - begin;
+  }
+  for (uint64_t t = 1; t < parts; t++) {
+    // If a thread cannot be started, its part is run here instead.
+    started[t] = pthread_create(&threads[t], NULL, part_main, &part[t]) == 0;
+    if (started[t]) {
+      alveoNumaPin(threads[t], st->cpus);
+    }
+  }
+  run_part(&part[0]);
+  for (uint64_t t = 1; t < parts; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    } else {
+      run_part(&part[t]);
+    }
+  }
+}
+
+void alveoStageCopy(AlveoStager *st, uint8_t *dst, const uint8_t *src, int64_t size) {
+  if (size <= 0) {
+    return;
+  }
+  __atomic_add_fetch(&st->stats.copies, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&st->stats.bytes, (uint64_t) size, __ATOMIC_RELAXED);
+  run_parallel(st, dst, src, 0, size, size);
+}
+
+void alveoStageBitmap(AlveoStager *st, uint8_t *dst, const uint8_t *src, int64_t bit_offset, int64_t length) {
+  if (length <= 0) {
+    return;
+  }
+  src += bit_offset / 8;
+  unsigned s = (unsigned) (bit_offset % 8);
+  int64_t n = (length + 7) / 8;
+  __atomic_add_fetch(&st->stats.bitmaps, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&st->stats.bytes, (uint64_t) n, __ATOMIC_RELAXED);
+  // The source bits end in this byte; nothing after it may be read.
+  int64_t avail = ((int64_t) s + length + 7) / 8;
+  run_parallel(st, dst, src, s, n, avail);
+  if (length % 8 != 0) {
+    dst[n - 1] &= (uint8_t) ((1u << (length % 8)) - 1);
+  }
+}
+
+const char *alveoStageIsaName(AlveoStageIsa isa) {
+  switch (isa) {
+    case ALVEO_STAGE_AVX512: return "AVX-512";
+    case ALVEO_STAGE_AVX2: return "AVX2";
+    default: return "scalar";
+  }
+}
+
+void alveoStagePrintStats(const AlveoStager *st) {
+  fprintf(stderr, "[FLETCHER_ALVEO] Staging (%s): %lu copies, %lu bitmaps, %lu bytes, %lu split over threads.\n",
+          alveoStageIsaName(st->isa),
+          (unsigned long) st->stats.copies,
+          (unsigned long) st->stats.bitmaps,
+          (unsigned long) st->stats.bytes,
+          (unsigned long) st->stats.parallel);
+}
@@ -0,0 +1,65 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "alveo_numa.h"
+
+// Repacking of host buffers into aligned staging memory before they are copied to the card.
+//
+// Sliced Arrow arrays start at arbitrary byte offsets, and their validity bitmaps at arbitrary bit offsets. The kernels
+// here copy values into page-aligned staging memory, and shift bitmaps so that they start at bit 0, using AVX-512 or
+// AVX2 where the processor has it and a scalar path otherwise. The instruction set is selected once, at run time, so
+// the runtime needs no special compiler flags. Large buffers are split over several threads.
+
+typedef enum {
+  ALVEO_STAGE_SCALAR = 0,
+  ALVEO_STAGE_AVX2 = 1,
+  ALVEO_STAGE_AVX512 = 2
+} AlveoStageIsa;
+
+typedef struct {
+  uint64_t copies;
+  uint64_t bitmaps;
+  uint64_t bytes;
+  uint64_t parallel;            ///< Calls that were split over several threads.
+} AlveoStageStats;
+
+typedef struct {
+  AlveoStageIsa isa;
+  uint32_t threads;             ///< Most threads a single call is split over.
+  uint64_t parallel_min;        ///< Bytes per thread below which a call is not split.
+  const AlveoCpuSet *cpus;      ///< Processors the helper threads run on, NULL for any.
+  AlveoStageStats stats;
+} AlveoStager;
+
+/// @brief Select the widest instruction set the processor supports, up to \p max_isa, and set the thread limits.
+void alveoStageInit(AlveoStager *st, AlveoStageIsa max_isa, uint32_t threads, uint64_t parallel_min);
+
+/// @brief Copy \p size bytes from \p src to \p dst. Stores bypass the cache, as staged data is not read back.
+void alveoStageCopy(AlveoStager *st, uint8_t *dst, const uint8_t *src, int64_t size);
+
+/**
+ * @brief Copy \p length bits from bitmap \p src, starting at bit \p bit_offset, to \p dst, starting at bit 0.
+ *
+ * Bits are numbered LSB first, as in Arrow. \p dst must have room for (\p length + 7) / 8 bytes; the unused bits of the
+ * last byte are cleared.
+ */
+void alveoStageBitmap(AlveoStager *st, uint8_t *dst, const uint8_t *src, int64_t bit_offset, int64_t length);
+
+const char *alveoStageIsaName(AlveoStageIsa isa);
+
+void alveoStagePrintStats(const AlveoStager *st);
@@ -0,0 +1,290 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <CL/opencl.h>
+#include <CL/cl_ext_xilinx.h>
+
+#include "fletcher/fletcher.h"
+#include "fletcher_alveo.h"
+#include "alveo_stream.h"
+
+// Create the driver stream of s, for the kernel argument and direction it has.
+static fstatus_t create_stream(AlveoStream *s) {
+  // The extension pointer binds the stream to a kernel argument. The kernel reads from H2K streams and writes to K2H
+  // streams.
+  cl_mem_ext_ptr_t ext;
+  ext.flags = s->arg;
+  ext.obj = NULL;
+  ext.param = s->kernel;
+  cl_int err;
+  s->stream = clCreateStream(s->device, s->dir == ALVEO_H2K ? XCL_STREAM_READ_ONLY : XCL_STREAM_WRITE_ONLY, CL_STREAM,
+                             &ext, &err);
+  if (err != CL_SUCCESS) {
+    printf("Error: Failed to create %s stream for kernel argument %u (%d).\n", s->dir == ALVEO_H2K ? "H2K" : "K2H",
+           s->arg, err);
+    s->stream = NULL;
+    return FLETCHER_STATUS_ERROR;
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+static fstatus_t open_stream(AlveoStreamPool *pool, cl_device_id device, cl_kernel kernel, cl_uint arg,
+                             AlveoStreamDirection dir) {
+  if (pool->num_streams == ALVEO_MAX_STREAMS) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  AlveoStream *s = &pool->streams[pool->num_streams];
+  memset(s, 0, sizeof(*s));
+  s->device = device;
+  s->kernel = kernel;
+  s->arg = arg;
+  s->dir = dir;
+  if (create_stream(s) != FLETCHER_STATUS_OK) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  pool->num_streams++;
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t alveoStreamPoolOpen(AlveoStreamPool *pool, cl_device_id device, cl_kernel kernel,
+                              const uint32_t *h2k_args, uint32_t num_h2k_args,
+                              const uint32_t *k2h_args, uint32_t num_k2h_args) {
+  pool->num_streams = 0;
+  pool->device = device;
+  for (uint32_t i = 0; i < num_h2k_args; i++) {
+    if (open_stream(pool, device, kernel, h2k_args[i], ALVEO_H2K) != FLETCHER_STATUS_OK) {
+      alveoStreamPoolClose(pool);
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  for (uint32_t i = 0; i < num_k2h_args; i++) {
+    if (open_stream(pool, device, kernel, k2h_args[i], ALVEO_K2H) != FLETCHER_STATUS_OK) {
+      alveoStreamPoolClose(pool);
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+void alveoStreamPoolClose(AlveoStreamPool *pool) {
+  for (uint32_t i = 0; i < pool->num_streams; i++) {
+    if (pool->streams[i].stream != NULL) {
+      clReleaseStream(pool->streams[i].stream);
+    }
+  }
+  pool->num_streams = 0;
+}
+
+AlveoStream *alveoStreamFind(AlveoStreamPool *pool, AlveoStreamDirection dir, da_t address) {
+  AlveoStream *first = NULL;
+  for (uint32_t i = 0; i < pool->num_streams; i++) {
+    AlveoStream *s = &pool->streams[i];
+    if (s->dir != dir) {
+      continue;
+    }
+    if ((address & ALVEO_STREAM_ADDRESS_FLAG) && (s->arg == (address & 0xFFFF))) {
+      return s;
+    }
+    if (first == NULL) {
+      first = s;
+    }
+  }
+  return (address & ALVEO_STREAM_ADDRESS_FLAG) ? NULL : first;
+}
+
+// Hand the next chunk of x to the driver. A K2H transfer is read with one request for all of its remaining bytes: the
+// kernel may end the transaction anywhere, also on a chunk boundary, and a read queued behind the one it ended would
+// take the data of the next transaction.
+static fstatus_t submit_chunk(AlveoTransfer *x, int64_t chunk_size) {
+  AlveoStream *s = x->stream;
+  AlveoStreamSlot *slot = &s->slots[s->next_slot];
+  s->next_slot = (s->next_slot + 1) % ALVEO_STREAM_SLOTS;
+  int64_t len = x->size - x->submitted;
+  if ((s->dir == ALVEO_H2K) && (len > chunk_size)) {
+    len = chunk_size;
+  }
+  memset(&slot->req, 0, sizeof(slot->req));
+  slot->req.flags = CL_STREAM_NONBLOCKING;
+  if ((x->submitted + len == x->size) && !x->partial) {
+    slot->req.flags |= CL_STREAM_EOT;
+  }
+  slot->req.priv_data = (char *) slot;
+  slot->xfer = x;
+  slot->len = (size_t) len;
+  cl_int err;
+  if (s->dir == ALVEO_H2K) {
+    clWriteStream(s->stream, x->host + x->submitted, slot->len, &slot->req, &err);
+  } else {
+    clReadStream(s->stream, x->host + x->submitted, slot->len, &slot->req, &err);
+  }
+  if (err != CL_SUCCESS) {
+    slot->xfer = NULL;
+    return FLETCHER_STATUS_ERROR;
+  }
+  x->submitted += len;
+  x->in_flight++;
+  return FLETCHER_STATUS_OK;
+}
+
+// Poll the streams of xfers once for up to slice_ms each, and return the number of completions stored in the pool.
+static cl_int poll_streams(AlveoStreamPool *pool, AlveoTransfer *xfers, uint32_t num_xfers, uint32_t *waited_ms) {
+  cl_int completed = 0;
+  for (uint32_t i = 0; i < num_xfers; i++) {
+    if (xfers[i].in_flight == 0) {
+      continue;
+    }
+    cl_int n = 0;
+    cl_int err;
+    clPollStream(xfers[i].stream->stream, pool->completions + completed, 1, (cl_int) xfers[i].in_flight, &n,
+                 ALVEO_STREAM_POLL_SLICE_MS, &err);
+    if ((err != CL_SUCCESS) || (n <= 0)) {
+      // Timed out for this slice.
+      *waited_ms += ALVEO_STREAM_POLL_SLICE_MS;
+      continue;
+    }
+    completed += n;
+  }
+  return completed;
+}
+
+// Give up on a pipeline. Requests still in flight refer to the transfers, which the caller may free, and into whose
+// host buffers a K2H request may still write. They are drained, and the streams of those that do not complete in time
+// are recreated, which cancels them.
+static fstatus_t abort_pipeline(AlveoStreamPool *pool, AlveoTransfer *xfers, uint32_t num_xfers) {
+  uint32_t waited_ms = 0;
+  int busy = 1;
+  while (busy && (waited_ms < ALVEO_STREAM_DRAIN_TIMEOUT_MS)) {
+    cl_int completed = poll_streams(pool, xfers, num_xfers, &waited_ms);
+    for (cl_int c = 0; c < completed; c++) {
+      AlveoStreamSlot *slot = (AlveoStreamSlot *) pool->completions[c].priv_data;
+      if (slot->xfer != NULL) {
+        slot->xfer->in_flight--;
+        slot->xfer = NULL;
+      }
+    }
+    busy = 0;
+    for (uint32_t i = 0; i < num_xfers; i++) {
+      busy |= xfers[i].in_flight > 0;
+    }
+  }
+  for (uint32_t i = 0; i < num_xfers; i++) {
+    AlveoStream *s = xfers[i].stream;
+    if ((xfers[i].in_flight == 0) || (s->stream == NULL)) {
+      continue;
+    }
+    clReleaseStream(s->stream);
+    for (uint32_t k = 0; k < ALVEO_STREAM_SLOTS; k++) {
+      s->slots[k].xfer = NULL;
+    }
+    // If this fails, the stream stays NULL, and transfers on it fail until the platform is terminated.
+    create_stream(s);
+    xfers[i].in_flight = 0;
+  }
+  return FLETCHER_STATUS_ERROR;
+}
+
+fstatus_t alveoStreamPipeline(AlveoStreamPool *pool, AlveoTransfer *xfers, uint32_t num_xfers, int64_t chunk_size,
+                              uint32_t depth) {
+  uint32_t in_flight[2] = {0, 0};
+  uint32_t remaining = 0;
+  if (depth > ALVEO_STREAM_SLOTS) {
+    depth = ALVEO_STREAM_SLOTS;
+  }
+  if ((depth == 0) || (chunk_size <= 0)) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  for (uint32_t i = 0; i < num_xfers; i++) {
+    if (xfers[i].stream->stream == NULL) {
+      return FLETCHER_STATUS_ERROR;
+    }
+    xfers[i].submitted = 0;
+    xfers[i].completed = 0;
+    xfers[i].in_flight = 0;
+    xfers[i].done = xfers[i].size == 0;
+    remaining += !xfers[i].done;
+  }
+  while (remaining > 0) {
+    // Top up every direction to the requested depth, round-robin over the transfers.
+    int submitted;
+    do {
+      submitted = 0;
+      for (uint32_t i = 0; i < num_xfers; i++) {
+        AlveoTransfer *x = &xfers[i];
+        AlveoStreamDirection dir = x->stream->dir;
+        if (!x->done && (x->submitted < x->size) && (in_flight[dir] < depth)) {
+          if (submit_chunk(x, chunk_size) != FLETCHER_STATUS_OK) {
+            return abort_pipeline(pool, xfers, num_xfers);
+          }
+          in_flight[dir]++;
+          submitted = 1;
+        }
+      }
+    } while (submitted);
+
+    // Poll the streams of these transfers only, so that pipelines on other compute units, driven by other threads,
+    // keep their own completions. Every stream is polled for a short slice in turn, as one stream may only make
+    // progress once the kernel could drain another.
+    cl_int completed = 0;
+    uint32_t waited_ms = 0;
+    while (completed == 0) {
+      completed = poll_streams(pool, xfers, num_xfers, &waited_ms);
+      if ((completed == 0) && (waited_ms >= ALVEO_STREAM_POLL_TIMEOUT_MS)) {
+        return abort_pipeline(pool, xfers, num_xfers);
+      }
+    }
+    int failed = 0;
+    for (cl_int c = 0; c < completed; c++) {
+      cl_streams_poll_req_completions *compl = &pool->completions[c];
+      AlveoStreamSlot *slot = (AlveoStreamSlot *) compl->priv_data;
+      AlveoTransfer *x = slot->xfer;
+      if (x == NULL) {
+        // Left behind by a pipeline that was aborted.
+        continue;
+      }
+      slot->xfer = NULL;
+      x->completed += (int64_t) compl->nbytes;
+      x->in_flight--;
+      in_flight[x->stream->dir]--;
+      if (compl->err_code != CL_SUCCESS) {
+        failed = 1;
+        continue;
+      }
+      // A kernel may end its output stream before the host buffer is full. Its one read then completes short.
+      if ((x->stream->dir == ALVEO_K2H) && (compl->nbytes < slot->len)) {
+        x->size = x->submitted;
+      }
+      if (!x->done && (x->in_flight == 0) && (x->submitted == x->size)) {
+        x->done = 1;
+        remaining--;
+      }
+    }
+    if (failed) {
+      return abort_pipeline(pool, xfers, num_xfers);
+    }
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t alveoStreamTransfer(AlveoStreamPool *pool, AlveoStream *s, void *host, int64_t size, int64_t chunk_size,
+                              uint32_t depth) {
+  AlveoTransfer x;
+  memset(&x, 0, sizeof(x));
+  x.stream = s;
+  x.host = (uint8_t *) host;
+  x.size = size;
+  return alveoStreamPipeline(pool, &x, 1, chunk_size, depth);
+}
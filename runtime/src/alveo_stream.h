@@ -0,0 +1,114 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <CL/opencl.h>
+#include <CL/cl_ext_xilinx.h>
+
+#include "fletcher/fletcher.h"
+
+// Persistent host-to-kernel (H2K) and kernel-to-host (K2H) AXI streams.
+//
+// Streams are created once per streaming kernel argument at platformInit and live until platformTerminate. Every
+// stream owns a fixed set of request slots, so that a copy does not have to create or allocate anything.
+//
+// Transfers are pipelined: they are split into chunks, a number of chunks is kept in flight per direction, and
+// completions are drained with clPollStream. Transfers in opposite directions that are submitted together overlap.
+// Completions are polled per stream, so that threads driving the streams of different compute units do not take each
+// other's completions. A pool is not thread-safe itself; its users serialize on it.
+
+#define ALVEO_MAX_STREAMS 16
+#define ALVEO_STREAM_SLOTS 64
+
+// Device addresses with this bit set do not refer to on-board memory, but to the stream bound to kernel argument
+// (address & 0xFFFF). Copies to any other address outside on-board memory use the first stream of that direction.
+#define ALVEO_STREAM_ADDRESS_FLAG (1ull << 63)
+#define ALVEO_STREAM_ADDRESS(arg) (ALVEO_STREAM_ADDRESS_FLAG | (da_t) (arg))
+
+// Timeout of a single poll for stream completions.
+#define ALVEO_STREAM_POLL_TIMEOUT_MS 10000
+#define ALVEO_STREAM_POLL_SLICE_MS 1
+// Time a failed transfer waits for its requests still in flight, before it recreates their streams to cancel them.
+#define ALVEO_STREAM_DRAIN_TIMEOUT_MS 100
+
+typedef enum {
+  ALVEO_H2K = 0,
+  ALVEO_K2H = 1
+} AlveoStreamDirection;
+
+struct AlveoTransfer;
+
+typedef struct {
+  cl_stream_xfer_req req;
+  struct AlveoTransfer *xfer;   ///< Transfer this slot is in flight for.
+  size_t len;
+} AlveoStreamSlot;
+
+typedef struct {
+  cl_stream stream;             ///< NULL if it could not be recreated after a failed transfer.
+  cl_device_id device;
+  cl_kernel kernel;
+  cl_uint arg;
+  AlveoStreamDirection dir;
+  AlveoStreamSlot slots[ALVEO_STREAM_SLOTS];
+  uint32_t next_slot;
+} AlveoStream;
+
+typedef struct {
+  AlveoStream streams[ALVEO_MAX_STREAMS];
+  uint32_t num_streams;
+  cl_device_id device;
+  cl_streams_poll_req_completions completions[2 * ALVEO_STREAM_SLOTS];
+} AlveoStreamPool;
+
+/// @brief A transfer between host memory and a stream, split into chunks by alveoStreamPipeline.
+typedef struct AlveoTransfer {
+  AlveoStream *stream;
+  uint8_t *host;
+  int64_t size;
+  int64_t submitted;            ///< Bytes handed to the driver.
+  int64_t completed;            ///< Bytes moved.
+  uint32_t in_flight;           ///< Chunks handed to the driver that have not completed yet.
+  int partial;                  ///< The transaction goes on in a later transfer; the last chunk carries no EOT.
+  int done;                     ///< Set when all chunks completed, or when the kernel ended a K2H stream early.
+} AlveoTransfer;
+
+/// @brief Create one stream per kernel argument in \p h2k_args and \p k2h_args for \p kernel on \p device.
+fstatus_t alveoStreamPoolOpen(AlveoStreamPool *pool, cl_device_id device, cl_kernel kernel,
+                              const uint32_t *h2k_args, uint32_t num_h2k_args,
+                              const uint32_t *k2h_args, uint32_t num_k2h_args);
+
+/// @brief Release all streams of \p pool.
+void alveoStreamPoolClose(AlveoStreamPool *pool);
+
+/// @brief Return the stream in direction \p dir that device address \p address refers to, or NULL if there is none.
+AlveoStream *alveoStreamFind(AlveoStreamPool *pool, AlveoStreamDirection dir, da_t address);
+
+/**
+ * @brief Run \p num_xfers transfers concurrently and wait for all of them to complete.
+ *
+ * Every H2K transfer is split into chunks of \p chunk_size bytes. Up to \p depth chunks are kept in flight per
+ * direction. The last chunk of a transfer carries end-of-transaction, unless the transfer is partial. A K2H transfer is
+ * one read, which ends early if the kernel ends the transaction; completed then holds the bytes it sent. No two
+ * transfers may use the same stream. If the pipeline fails, no request of it is left in flight.
+ */
+fstatus_t alveoStreamPipeline(AlveoStreamPool *pool, AlveoTransfer *xfers, uint32_t num_xfers, int64_t chunk_size,
+                              uint32_t depth);
+
+/// @brief Move \p size bytes between \p host and stream \p s, and wait for the transfer to complete.
+fstatus_t alveoStreamTransfer(AlveoStreamPool *pool, AlveoStream *s, void *host, int64_t size, int64_t chunk_size,
+                              uint32_t depth);
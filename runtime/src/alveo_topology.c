@@ -0,0 +1,91 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string.h>
+
+#include "xclbin.h"
+
+#include "alveo_topology.h"
+
+// Return the contents of the first section of kind in xclbin, or NULL if it has none or it does not fit.
+static const void *find_section(const void *xclbin, size_t size, enum axlf_section_kind kind) {
+  const struct axlf *top = (const struct axlf *) xclbin;
+  if ((xclbin == NULL) || (size < sizeof(struct axlf)) || (memcmp(top->m_magic, "xclbin2", 7) != 0)) {
+    return NULL;
+  }
+  size_t headers = offsetof(struct axlf, m_sections) + top->m_header.m_numSections * sizeof(struct axlf_section_header);
+  if (headers > size) {
+    return NULL;
+  }
+  for (uint32_t i = 0; i < top->m_header.m_numSections; i++) {
+    const struct axlf_section_header *s = &top->m_sections[i];
+    if ((s->m_sectionKind == (uint32_t) kind) && (s->m_sectionOffset + s->m_sectionSize <= size)) {
+      return (const uint8_t *) xclbin + s->m_sectionOffset;
+    }
+  }
+  return NULL;
+}
+
+fstatus_t alveoTopologyRead(AlveoTopology *t, const void *xclbin, size_t size) {
+  memset(t, 0, sizeof(*t));
+  const struct mem_topology *mem = (const struct mem_topology *) find_section(xclbin, size, MEM_TOPOLOGY);
+  if (mem == NULL) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  t->xclbin = xclbin;
+  t->size = size;
+  for (int32_t i = 0; (i < mem->m_count) && (i < ALVEO_TOPOLOGY_MAX_BANKS); i++) {
+    const struct mem_data *m = &mem->m_mem_data[i];
+    AlveoBank *b = &t->banks[t->num_banks++];
+    b->index = (uint32_t) i;
+    // Streaming connections are not memory.
+    int memory = (m->m_type != MEM_STREAMING) && (m->m_type != MEM_STREAMING_CONNECTION);
+    b->used = memory && m->m_used;
+    b->hbm = m->m_type == MEM_HBM;
+    b->size = memory ? m->m_size * 1024 : 0;    // The topology has sizes in KiB.
+    b->base = memory ? m->m_base_address : 0;
+    memcpy(b->tag, m->m_tag, sizeof(m->m_tag));
+    b->tag[sizeof(b->tag) - 1] = '\0';
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+uint64_t alveoTopologyBanks(const AlveoTopology *t, const char *cu_name) {
+  const struct ip_layout *ips = (const struct ip_layout *) find_section(t->xclbin, t->size, IP_LAYOUT);
+  const struct connectivity *conn = (const struct connectivity *) find_section(t->xclbin, t->size, CONNECTIVITY);
+  if ((ips == NULL) || (conn == NULL)) {
+    return 0;
+  }
+  uint64_t banks = 0;
+  for (int32_t c = 0; c < conn->m_count; c++) {
+    const struct connection *e = &conn->m_connection[c];
+    if ((e->m_ip_layout_index < 0) || (e->m_ip_layout_index >= ips->m_count)
+        || (e->mem_data_index < 0) || ((uint32_t) e->mem_data_index >= t->num_banks)) {
+      continue;
+    }
+    const struct ip_data *ip = &ips->m_ip_data[e->m_ip_layout_index];
+    if ((ip->m_type == IP_KERNEL) && (strncmp((const char *) ip->m_name, cu_name, sizeof(ip->m_name)) == 0)
+        && t->banks[e->mem_data_index].used) {
+      banks |= 1ull << e->mem_data_index;
+    }
+  }
+  return banks;
+}
+
+const AlveoBank *alveoTopologyBank(const AlveoTopology *t, int bank) {
+  if ((bank < 0) || ((uint32_t) bank >= t->num_banks)) {
+    return NULL;
+  }
+  return &t->banks[bank];
+}
@@ -0,0 +1,53 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fletcher/fletcher.h"
+
+// Memory topology of an xclbin: its memory banks (DDR, HBM pseudo-channels, PLRAM) and which of them every compute unit
+// is connected to, read from the MEM_TOPOLOGY, IP_LAYOUT and CONNECTIVITY sections. Banks are identified by their index
+// in MEM_TOPOLOGY, which is also the bank that a buffer created with XCL_MEM_TOPOLOGY is placed in. Sets of banks are
+// bit masks over these indices.
+
+#define ALVEO_TOPOLOGY_MAX_BANKS 64
+
+typedef struct {
+  uint32_t index;               ///< Index in the memory topology.
+  uint64_t base;
+  uint64_t size;                ///< In bytes.
+  int used;                     ///< Connected to anything in this xclbin.
+  int hbm;
+  char tag[17];                 ///< E.g. "DDR[1]" or "HBM[12]".
+} AlveoBank;
+
+typedef struct {
+  AlveoBank banks[ALVEO_TOPOLOGY_MAX_BANKS];
+  uint32_t num_banks;
+  const void *xclbin;           ///< The xclbin the topology was read from, to look up compute units in.
+  size_t size;
+} AlveoTopology;
+
+/// @brief Read the memory banks of \p xclbin of \p size bytes. Returns FLETCHER_STATUS_ERROR if it has no memory
+/// topology.
+fstatus_t alveoTopologyRead(AlveoTopology *t, const void *xclbin, size_t size);
+
+/// @brief Return the banks that compute unit \p cu_name, e.g. "FLETCHER_KERNEL:FLETCHER_KERNEL_1", is connected to.
+uint64_t alveoTopologyBanks(const AlveoTopology *t, const char *cu_name);
+
+/// @brief Return the topology entry of \p bank, or NULL if there is none.
+const AlveoBank *alveoTopologyBank(const AlveoTopology *t, int bank);
@@ -13,40 +13,506 @@
 // limitations under the License.
 
 #include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <memory.h>
+#include <stdlib.h>
 #include <malloc.h>
 
 #include <CL/opencl.h>
 #include <CL/cl_ext.h>
 #include <CL/cl_ext_xilinx.h>
 
+#include "experimental/xclbin_util.h"
+
 #include "fletcher/fletcher.h"
 #include "fletcher_alveo.h"
 
-//da_t buffer_ptr = 0x0;
+PlatformState alveo_state = {.target_device_name = ALVEO_DEVICE_NAME,
+                             .hostmem = {.lock = PTHREAD_MUTEX_INITIALIZER, .node = -1},
+                             .ctx_lock = PTHREAD_MUTEX_INITIALIZER};
+static pthread_once_t hostmem_once = PTHREAD_ONCE_INIT;
+static pthread_once_t ctx_once = PTHREAD_ONCE_INIT;
+static pthread_key_t implicit_ctx_key;
+
+// Parse a comma-separated list of indices, e.g. "0,2". The list is left empty if the variable is not set.
+static void parse_list(const char *name, uint32_t *list, uint32_t *num, uint32_t max) {
+  const char *str = getenv(name);
+  *num = 0;
+  if (str == NULL) {
+    return;
+  }
+  while ((*str != '\0') && (*num < max)) {
+    char *end;
+    list[(*num)++] = (uint32_t) strtoul(str, &end, 0);
+    if (end == str) {
+      (*num)--;
+      break;
+    }
+    str = (*end == ',') ? end + 1 : end;
+  }
+}
+
+// Parse a comma-separated list of kernel argument indices, or use \p def if there is none.
+static void parse_args(const char *name, uint32_t *args, uint32_t *num_args, uint32_t def) {
+  parse_list(name, args, num_args, ALVEO_MAX_STREAMS);
+  if (*num_args == 0) {
+    args[(*num_args)++] = def;
+  }
+}
 
+static void load_config(AlveoConfig *config) {
+  const char *emulation = getenv("FLETCHER_ALVEO_EMULATION");
+  config->emulation = (emulation != NULL) && (strcmp(emulation, "0") != 0);
+  alveoEmuDefaultModel(&config->emu_model);
+  const char *arenas = getenv("FLETCHER_ALVEO_ARENAS");
+  config->num_arenas = arenas != NULL ? (uint32_t) strtoul(arenas, NULL, 0) : 0;
+  const char *arena_size = getenv("FLETCHER_ALVEO_ARENA_SIZE");
+  config->arena_size = arena_size != NULL ? strtoull(arena_size, NULL, 0) : (1ull << 30);
+  const char *cache_budget = getenv("FLETCHER_ALVEO_CACHE_BUDGET");
+  config->cache_budget = cache_budget != NULL ? strtoull(cache_budget, NULL, 0) : (1ull << 30);
+  parse_args("FLETCHER_ALVEO_H2K_ARGS", config->h2k_args, &config->num_h2k_args, 0);
+  parse_args("FLETCHER_ALVEO_K2H_ARGS", config->k2h_args, &config->num_k2h_args, 1);
+  const char *chunk_size = getenv("FLETCHER_ALVEO_CHUNK_SIZE");
+  config->chunk_size = chunk_size != NULL ? strtoll(chunk_size, NULL, 0) : (4ll << 20);
+  const char *queue_depth = getenv("FLETCHER_ALVEO_QUEUE_DEPTH");
+  config->queue_depth = queue_depth != NULL ? (uint32_t) strtoul(queue_depth, NULL, 0) : 8;
+  // Streams would make no progress with either of these at zero.
+  if (config->chunk_size <= 0) {
+    printf("Warning: Ignoring FLETCHER_ALVEO_CHUNK_SIZE=%s.\n", chunk_size);
+    config->chunk_size = 4ll << 20;
+  }
+  if (config->queue_depth == 0) {
+    printf("Warning: Ignoring FLETCHER_ALVEO_QUEUE_DEPTH=%s.\n", queue_depth);
+    config->queue_depth = 8;
+  }
+  const char *wait_spin = getenv("FLETCHER_ALVEO_WAIT_SPIN_NS");
+  config->wait_spin_ns = wait_spin != NULL ? strtoull(wait_spin, NULL, 0) : 20000;
+  const char *wait_backoff = getenv("FLETCHER_ALVEO_WAIT_MAX_BACKOFF_NS");
+  config->wait_max_backoff_ns = wait_backoff != NULL ? strtoull(wait_backoff, NULL, 0) : 1000000;
+  parse_list("FLETCHER_ALVEO_CARDS", config->cards, &config->num_cards, ALVEO_MAX_CARDS);
+  const char *emu_cards = getenv("FLETCHER_ALVEO_EMU_CARDS");
+  config->num_emu_cards = emu_cards != NULL ? (uint32_t) strtoul(emu_cards, NULL, 0) : 1;
+  if (config->num_emu_cards == 0) {
+    config->num_emu_cards = 1;
+  }
+  if (config->num_emu_cards > ALVEO_MAX_CARDS) {
+    config->num_emu_cards = ALVEO_MAX_CARDS;
+  }
+  const char *host_mappings = getenv("FLETCHER_ALVEO_HOST_MAPPINGS");
+  config->host_mappings = host_mappings != NULL ? (uint32_t) strtoul(host_mappings, NULL, 0) : 64;
+  const char *simd = getenv("FLETCHER_ALVEO_SIMD");
+  config->stage_isa = ALVEO_STAGE_AVX512;
+  if ((simd != NULL) && (strcmp(simd, "avx2") == 0)) {
+    config->stage_isa = ALVEO_STAGE_AVX2;
+  } else if ((simd != NULL) && (strcmp(simd, "scalar") == 0)) {
+    config->stage_isa = ALVEO_STAGE_SCALAR;
+  }
+  const char *stage_threads = getenv("FLETCHER_ALVEO_STAGE_THREADS");
+  config->stage_threads = stage_threads != NULL ? (uint32_t) strtoul(stage_threads, NULL, 0) : 4;
+  const char *ipc_window = getenv("FLETCHER_ALVEO_IPC_WINDOW");
+  config->ipc_window = ipc_window != NULL ? strtoll(ipc_window, NULL, 0) : (32ll << 20);
+  if (config->ipc_window < ALVEO_DEVICE_ALIGNMENT) {
+    config->ipc_window = ALVEO_DEVICE_ALIGNMENT;
+  }
+  const char *async_depth = getenv("FLETCHER_ALVEO_ASYNC_DEPTH");
+  config->async_depth = async_depth != NULL ? (uint32_t) strtoul(async_depth, NULL, 0) : 1024;
+  const char *coalesce_rows = getenv("FLETCHER_ALVEO_COALESCE_ROWS");
+  config->coalesce_rows = coalesce_rows != NULL ? strtoll(coalesce_rows, NULL, 0) : (1ll << 16);
+  if (config->coalesce_rows < 1) {
+    config->coalesce_rows = 1;
+  }
+  const char *coalesce_us = getenv("FLETCHER_ALVEO_COALESCE_US");
+  config->coalesce_delay_us = coalesce_us != NULL ? strtoull(coalesce_us, NULL, 0) : 200;
+  const char *numa = getenv("FLETCHER_ALVEO_NUMA");
+  config->numa = (numa == NULL) || (strcmp(numa, "0") != 0);
+  const char *numa_node = getenv("FLETCHER_ALVEO_NUMA_NODE");
+  config->numa_node = numa_node != NULL ? (int) strtol(numa_node, NULL, 0) : -1;
+  const char *profile = getenv("FLETCHER_ALVEO_PROFILE");
+  config->trace_path = getenv("FLETCHER_ALVEO_TRACE");
+  config->profile = ((profile != NULL) && (strcmp(profile, "0") != 0)) || (config->trace_path != NULL);
+  const char *profile_records = getenv("FLETCHER_ALVEO_PROFILE_RECORDS");
+  config->profile_records = profile_records != NULL ? strtoull(profile_records, NULL, 0) : (1ull << 20);
+}
 
-int load_file_to_memory(const char *filename, char **result)
-{
-    uint size = 0;
-    FILE *f = fopen(filename, "rb");
-    if (f == NULL) {
-        *result = NULL;
-        return -1; // -1 means file opening fail
+// Set up compute unit i of the kernel: a kernel handle bound to it only, so that its streams connect to this instance,
+// its index, and a context on it that stays open, so that register accesses do not have to look anything up.
+static fstatus_t open_cu(AlveoCard *card, AlveoCU *cu, const char *kernel_name) {
+  char cu_name[128];
+  char name[256];
+  cl_int err = xclGetComputeUnitInfo(card->kernel, cu->index, XCL_COMPUTE_UNIT_NAME, sizeof(cu_name), cu_name, NULL);
+  err |= xclGetComputeUnitInfo(card->kernel, cu->index, XCL_COMPUTE_UNIT_INDEX, sizeof(cu->cu_index), &cu->cu_index,
+                               NULL);
+  if (err != CL_SUCCESS) {
+    printf("Error: Failed to look up compute unit %u of the kernel.\n", cu->index);
+    return FLETCHER_STATUS_ERROR;
+  }
+  // The memory topology names compute units kernel:cu; use every bank if it does not list this one.
+  snprintf(name, sizeof(name), "%s:%s", kernel_name, cu_name);
+  cu->banks = alveoTopologyBanks(&alveo_state.topology, name);
+  if (cu->banks == 0) {
+    cu->banks = ~0ull;
+  }
+  snprintf(name, sizeof(name), "%s:{%s}", kernel_name, cu_name);
+  cu->kernel = clCreateKernel(card->program, name, &err);
+  if (err != CL_SUCCESS) {
+    printf("Error: Failed to create kernel %s.\n", name);
+    return FLETCHER_STATUS_ERROR;
+  }
+  if (alveoStreamPoolOpen(&cu->streams, card->device_id, cu->kernel,
+                          alveo_state.config.h2k_args, alveo_state.config.num_h2k_args,
+                          alveo_state.config.k2h_args, alveo_state.config.num_k2h_args) != FLETCHER_STATUS_OK) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  if (xclOpenContext(card->device_handle, alveo_state.xclbin_uuid, cu->cu_index, true) != 0) {
+    printf("Error: Failed to open a context on compute unit %u.\n", cu->cu_index);
+    return FLETCHER_STATUS_ERROR;
+  }
+  cu->context_open = 1;
+  return FLETCHER_STATUS_OK;
+}
+
+// Create one large buffer per bank up front, so that platformDeviceMalloc never has to create OpenCL buffers. Arenas go
+// in the banks the compute units of the card are connected to, according to the memory topology of the xclbin. Without
+// one, the first FLETCHER_ALVEO_ARENAS banks are used, 4 by default.
+static fstatus_t create_arenas(AlveoCard *card) {
+  const AlveoTopology *topology = &alveo_state.topology;
+  uint64_t banks = 0;
+  for (uint32_t i = 0; i < card->num_cus; i++) {
+    banks |= card->cus[i].banks;
+  }
+  uint32_t max_arenas = alveo_state.config.num_arenas;
+  if (topology->num_banks == 0) {
+    banks = (1ull << (max_arenas != 0 ? max_arenas : 4)) - 1;
+  }
+  if ((max_arenas == 0) || (max_arenas > ALVEO_DEVMEM_MAX_ARENAS)) {
+    max_arenas = ALVEO_DEVMEM_MAX_ARENAS;
+  }
+  for (int b = 0; (b < ALVEO_TOPOLOGY_MAX_BANKS) && (card->devmem.num_arenas < max_arenas); b++) {
+    const AlveoBank *bank = alveoTopologyBank(topology, b);
+    if (!((banks >> b) & 1) || ((topology->num_banks != 0) && ((bank == NULL) || !bank->used))) {
+      continue;
+    }
+    uint64_t size = alveo_state.config.arena_size;
+    if ((bank != NULL) && (bank->size < size)) {
+      size = bank->size;
+    }
+    if (size < ALVEO_DEVMEM_GRANULE) {
+      continue;
+    }
+    cl_mem_ext_ptr_t ext;
+    ext.flags = (unsigned) b | XCL_MEM_TOPOLOGY;
+    ext.obj = NULL;
+    ext.param = 0;
+    cl_int err;
+    cl_mem mem = clCreateBuffer(card->context, CL_MEM_READ_WRITE | CL_MEM_EXT_PTR_XILINX, size, &ext, &err);
+    if (err != CL_SUCCESS) {
+      printf("Error: Failed to create device memory arena in bank %d (%d).\n", b, err);
+      return FLETCHER_STATUS_ERROR;
     }
-    fseek(f, 0, SEEK_END);
-    size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    *result = (char *)malloc(size+1);
-    if (size != fread(*result, sizeof(char), size, f)) {
-        free(*result);
-        return -2; // -2 means file reading fail
+    // Buffers are only allocated on the card once they are migrated to it.
+    uint64_t base;
+    err = clEnqueueMigrateMemObjects(card->commands, 1, &mem, CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED, 0, NULL,
+                                     NULL);
+    err |= clFinish(card->commands);
+    err |= xclGetMemObjDeviceAddress(mem, card->device_id, sizeof(base), &base);
+    if ((err != CL_SUCCESS) || (alveoDevMemAddArena(&card->devmem, base, size, b, mem) != FLETCHER_STATUS_OK)) {
+      printf("Error: Failed to place device memory arena in bank %d.\n", b);
+      clReleaseMemObject(mem);
+      return FLETCHER_STATUS_ERROR;
     }
-    fclose(f);
-    (*result)[size] = 0;
-    return size;
+    debug_print("[FLETCHER_ALVEO] Device %u bank %d (%s): arena of %lu bytes.\n",
+                card->index,
+                b,
+                bank != NULL ? bank->tag : "?",
+                (unsigned long) size);
+  }
+  if (card->devmem.num_arenas == 0) {
+    printf("Error: Device %u has no memory bank to place device memory in.\n", card->index);
+    return FLETCHER_STATUS_ERROR;
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+// Map the xclbin rather than reading it into a heap buffer, and compute its UUID once.
+static fstatus_t map_xclbin(const char *filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return FLETCHER_STATUS_ERROR;
+  }
+  void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  alveo_state.xclbin_data = (const unsigned char *) data;
+  alveo_state.xclbin_size = (size_t) st.st_size;
+  xclbin_uuid(data, alveo_state.xclbin_uuid);
+  if (alveoTopologyRead(&alveo_state.topology, data, alveo_state.xclbin_size) != FLETCHER_STATUS_OK) {
+    debug_print("[FLETCHER_ALVEO] The xclbin has no memory topology.\n");
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+// Check whether the card already holds a bitstream with the UUID of the mapped xclbin.
+static int card_holds_xclbin(AlveoCard *card) {
+  char path[512];
+  char loaded_str[64];
+  uuid_t loaded;
+  xclGetSysfsPath(card->device_handle, "icap", "xclbinuuid", path, sizeof(path));
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+  char *line = fgets(loaded_str, sizeof(loaded_str), f);
+  fclose(f);
+  if (line == NULL) {
+    return 0;
+  }
+  loaded_str[strcspn(loaded_str, "\r\n")] = '\0';
+  return (uuid_parse(loaded_str, loaded) == 0) && (uuid_compare(loaded, alveo_state.xclbin_uuid) == 0);
+}
+
+// The context bound to the calling thread, see alveo_ctx.
+static __thread AlveoContext *current_ctx = NULL;
+
+// Used by threads for which no context could be allocated. They share its queues, which OpenCL allows.
+static AlveoContext fallback_ctx;
+
+static AlveoContext *context_new(int implicit) {
+  AlveoContext *ctx = (AlveoContext *) calloc(1, sizeof(AlveoContext));
+  if (ctx == NULL) {
+    return NULL;
+  }
+  ctx->implicit = implicit;
+  pthread_mutex_lock(&alveo_state.ctx_lock);
+  ctx->next = alveo_state.contexts;
+  alveo_state.contexts = ctx;
+  pthread_mutex_unlock(&alveo_state.ctx_lock);
+  return ctx;
+}
+
+static void context_release_queues(AlveoContext *ctx) {
+  for (uint32_t c = 0; c < ALVEO_MAX_CARDS; c++) {
+    if (ctx->queues[c] != NULL) {
+      clReleaseCommandQueue(ctx->queues[c]);
+      ctx->queues[c] = NULL;
+    }
+  }
 }
 
+static void context_free(AlveoContext *ctx) {
+  pthread_mutex_lock(&alveo_state.ctx_lock);
+  for (AlveoContext **link = &alveo_state.contexts; *link != NULL; link = &(*link)->next) {
+    if (*link == ctx) {
+      *link = ctx->next;
+      break;
+    }
+  }
+  context_release_queues(ctx);
+  pthread_mutex_unlock(&alveo_state.ctx_lock);
+  free(ctx);
+}
+
+static void implicit_ctx_destroy(void *ctx) {
+  context_free((AlveoContext *) ctx);
+}
+
+static void implicit_ctx_init(void) {
+  pthread_key_create(&implicit_ctx_key, implicit_ctx_destroy);
+}
+
+// The implicit context of the calling thread, created on first use.
+static AlveoContext *implicit_ctx(void) {
+  pthread_once(&ctx_once, implicit_ctx_init);
+  AlveoContext *ctx = (AlveoContext *) pthread_getspecific(implicit_ctx_key);
+  if (ctx == NULL) {
+    ctx = context_new(1);
+    if ((ctx == NULL) || (pthread_setspecific(implicit_ctx_key, ctx) != 0)) {
+      if (ctx != NULL) {
+        context_free(ctx);
+      }
+      return &fallback_ctx;
+    }
+  }
+  return ctx;
+}
+
+static AlveoContext *alveo_ctx(void) {
+  if (current_ctx == NULL) {
+    current_ctx = implicit_ctx();
+  }
+  return current_ctx;
+}
+
+// The compute unit the calling thread works on: the one it selected last, or the first compute unit of the first card.
+static AlveoCU *alveo_cu(void) {
+  AlveoCU *cu = alveo_ctx()->cu;
+  return cu != NULL ? cu : &alveo_state.cards[0].cus[0];
+}
+
+static void select_cu(AlveoCU *cu) {
+  alveo_ctx()->cu = cu;
+}
+
+// The command queue of the calling thread on card. Falls back to the queue of the card if no queue can be created.
+static cl_command_queue alveo_queue(AlveoCard *card) {
+  AlveoContext *ctx = alveo_ctx();
+  if (ctx->queues[card->index] == NULL) {
+    cl_int err;
+    cl_command_queue queue = clCreateCommandQueue(card->context, card->device_id,
+                                                  alveo_state.config.profile ? CL_QUEUE_PROFILING_ENABLE : 0, &err);
+    if (err != CL_SUCCESS) {
+      return card->commands;
+    }
+    ctx->queues[card->index] = queue;
+  }
+  return ctx->queues[card->index];
+}
+
+static AlveoCard *alveo_card(void) {
+  return alveo_cu()->card;
+}
+
+// Count the bytes copied to or from an arena, per bank. Copies do not hold the memory lock, so the counters are atomic.
+static void count_traffic(AlveoArena *arena, int64_t size, int to_device) {
+  __atomic_add_fetch(to_device ? &arena->stats.bytes_written : &arena->stats.bytes_read, (uint64_t) size,
+                     __ATOMIC_RELAXED);
+}
+
+static AlveoCard *add_card(cl_device_id device_id) {
+  AlveoCard *card = &alveo_state.cards[alveo_state.num_cards];
+  memset(card, 0, sizeof(*card));
+  card->index = alveo_state.num_cards++;
+  card->device_id = device_id;
+  card->cache.budget = alveo_state.config.cache_budget;
+  card->hostmap.limit = alveo_state.config.host_mappings;
+  card->numa_node = -1;
+  pthread_mutex_init(&card->mem_lock, NULL);
+  pthread_cond_init(&card->cache.ready, NULL);
+  return card;
+}
+
+static AlveoCU *add_cu(AlveoCard *card) {
+  AlveoCU *cu = &card->cus[card->num_cus];
+  memset(cu, 0, sizeof(*cu));
+  cu->index = card->num_cus++;
+  cu->card = card;
+  pthread_mutex_init(&cu->lock, NULL);
+  pthread_mutex_init(&cu->stream_lock, NULL);
+  cu->banks = ~0ull;
+  alveoAsyncInit(&cu->async, cu, alveo_state.config.async_depth);
+  alveo_state.cus[alveo_state.num_cus++] = cu;
+  return cu;
+}
+
+// Dispatcher workers map one to one onto compute units, and hold it while they run a job.
+static void worker_enter(uint32_t worker) {
+  AlveoCU *cu = alveo_state.cus[worker];
+  pthread_mutex_lock(&cu->lock);
+  cu->jobs++;
+  select_cu(cu);
+}
+
+static void worker_leave(uint32_t worker) {
+  pthread_mutex_unlock(&alveo_state.cus[worker]->lock);
+}
+
+// Find the NUMA node of every card and the processors of that node. The threads of a compute unit run on the node of
+// its card, and the pinned host memory pool, from which staging buffers come, is placed on the node of the first card.
+static void place_cards(void) {
+  if (!alveo_state.config.numa) {
+    return;
+  }
+  AlveoCard *home = NULL;
+  for (uint32_t c = 0; c < alveo_state.num_cards; c++) {
+    AlveoCard *card = &alveo_state.cards[c];
+    int node = alveo_state.config.numa_node;
+    char path[512];
+    if ((node < 0) && (card->emu == NULL)
+        && (xclGetSysfsPath(card->device_handle, "", "numa_node", path, sizeof(path)) == 0)) {
+      node = alveoNumaReadNode(path);
+    }
+    card->num_cpus = alveoNumaNodeCpus(node, &card->cpus);
+    card->numa_node = card->num_cpus > 0 ? node : -1;
+    if (card->numa_node < 0) {
+      continue;
+    }
+    debug_print("[FLETCHER_ALVEO] Device %u is on NUMA node %d with %d processors.\n", c, node, card->num_cpus);
+    for (uint32_t i = 0; i < card->num_cus; i++) {
+      card->cus[i].async.cpus = &card->cpus;
+    }
+    if (home == NULL) {
+      home = card;
+    } else if (card->numa_node != home->numa_node) {
+      printf("INFO: Device %u is on NUMA node %d, pinned host memory is placed on node %d.\n", c, card->numa_node,
+             home->numa_node);
+    }
+  }
+  if (home != NULL) {
+    pthread_mutex_lock(&alveo_state.hostmem.lock);
+    alveo_state.hostmem.node = home->numa_node;
+    pthread_mutex_unlock(&alveo_state.hostmem.lock);
+    alveo_state.stager.cpus = &home->cpus;
+  }
+}
+
+static fstatus_t start_dispatcher(void) {
+  place_cards();
+  fstatus_t status = alveoDispatchStart(&alveo_state.dispatcher, alveo_state.num_cus, worker_enter, worker_leave);
+  // Every worker submits and completes the jobs of one compute unit, so it runs next to that card.
+  for (uint32_t w = 0; (status == FLETCHER_STATUS_OK) && (w < alveo_state.dispatcher.num_workers); w++) {
+    AlveoCard *card = alveo_state.cus[w]->card;
+    if (card->num_cpus > 0) {
+      alveoNumaPin(alveo_state.dispatcher.threads[w], &card->cpus);
+    }
+  }
+  return status;
+}
+
+static fstatus_t emulatorInit(void **argv) {
+  if ((argv != NULL) && (argv[0] != NULL)) {
+    alveo_state.xclbin = (char *) argv[0];
+    if (map_xclbin(alveo_state.xclbin) != FLETCHER_STATUS_OK) {
+      printf("failed to load kernel from xclbin: %s\n", alveo_state.xclbin);
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  for (uint32_t c = 0; c < alveo_state.config.num_emu_cards; c++) {
+    AlveoCard *card = add_card(NULL);
+    card->emu = (AlveoEmu *) malloc(sizeof(AlveoEmu));
+    if (card->emu == NULL) {
+      return FLETCHER_STATUS_ERROR;
+    }
+    fstatus_t status = alveoEmuInit(card->emu, &alveo_state.config.emu_model);
+    if (status != FLETCHER_STATUS_OK) {
+      free(card->emu);
+      card->emu = NULL;
+      return status;
+    }
+    if (alveo_state.xclbin_data != NULL) {
+      card->xclbin_reused = !alveoEmuProgram(card->emu, alveo_state.xclbin_uuid, card->index);
+    }
+    for (uint32_t i = 0; (i < card->emu->model.num_cus) && (i < ALVEO_MAX_CUS); i++) {
+      add_cu(card);
+    }
+    for (uint32_t b = 0; b < card->emu->model.num_banks; b++) {
+      alveoDevMemAddArena(&card->devmem, ALVEO_EMU_BANK_BASE(b), card->emu->model.bank_size, (int) b, NULL);
+    }
+  }
+  printf("INFO: Running on %u emulated Alveo card(s) with %u compute unit(s) in total.\n", alveo_state.num_cards,
+         alveo_state.num_cus);
+  return start_dispatcher();
+}
+
+
 fstatus_t platformGetName(char *name, size_t size) {
   size_t len = strlen(FLETCHER_PLATFORM_NAME);
   if (len > size) {
@@ -61,12 +527,23 @@ fstatus_t platformGetName(char *name, size_t size) {
 
 
 
+static fstatus_t card_init(AlveoCard *card, void **argv);
+
 // argv[0] -> .xclbin file.
 // argv[1] -> Target device name.
 //argv[2] -> Kernel name.
 
-fstatus_t platformInit(void *argv[]) {
+fstatus_t platformInit(void *arg) {
   debug_print("[FLETCHER_ALVEO] Initializing platform.       Arguments @ [host] %016lX.\n", (unsigned long) arg);
+  void **argv = (void **) arg;
+
+  load_config(&alveo_state.config);
+  alveoProfileInit(&alveo_state.profiler, alveo_state.config.profile, alveo_state.config.profile_records);
+  alveoStageInit(&alveo_state.stager, alveo_state.config.stage_isa, alveo_state.config.stage_threads, 1 << 20);
+  debug_print("[FLETCHER_ALVEO] Staging with %s.\n", alveoStageIsaName(alveo_state.stager.isa));
+  if (alveo_state.config.emulation) {
+    return emulatorInit(argv);
+  }
   // Check psl_server.dat is present
 
     char *target_device_name_pass;
@@ -126,7 +603,8 @@ fstatus_t platformInit(void *argv[]) {
        return -1;
    }
 
-   //iterate all devices to select the target device.
+   //iterate all devices to select the target devices.
+   uint32_t num_matching = 0;
    for (uint i=0; i<num_devices; i++) {
       alveo_state.err = clGetDeviceInfo(devices[i], CL_DEVICE_NAME, 1024, cl_device_name, 0);
 
@@ -139,10 +617,17 @@ fstatus_t platformInit(void *argv[]) {
       printf("CL_DEVICE_NAME %s\n", cl_device_name);
 
       if(strstr(alveo_state.target_device_name, cl_device_name) != NULL) {
-           alveo_state.device_id = devices[i];
-           device_found = 1;
-           printf("Selected %s as the target device\n", cl_device_name);
-
+           // Open all matching devices, or only those listed in FLETCHER_ALVEO_CARDS.
+           int selected = alveo_state.config.num_cards == 0;
+           for (uint32_t c = 0; c < alveo_state.config.num_cards; c++) {
+             selected |= alveo_state.config.cards[c] == num_matching;
+           }
+           num_matching++;
+           if (selected && (alveo_state.num_cards < ALVEO_MAX_CARDS)) {
+             add_card(devices[i]);
+             device_found = 1;
+             printf("Selected %s as target device %u\n", cl_device_name, alveo_state.num_cards - 1);
+           }
       }
    }
   if (!device_found) {
@@ -150,18 +635,42 @@ fstatus_t platformInit(void *argv[]) {
        return EXIT_FAILURE;
    }
 
+    // Map the binary from disk once, for all cards.
+    alveo_state.xclbin = argv[0];
+
+    printf("INFO: loading xclbin %s\n", alveo_state.xclbin);
+    if (map_xclbin(alveo_state.xclbin) != FLETCHER_STATUS_OK) {
+     printf("failed to load kernel from xclbin: %s\n", alveo_state.xclbin);
+     printf("Test failed\n");
+     return EXIT_FAILURE;
+    }
+
+  for (uint32_t c = 0; c < alveo_state.num_cards; c++) {
+    if (card_init(&alveo_state.cards[c], argv) != FLETCHER_STATUS_OK) {
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  return start_dispatcher();
+}
+
+// Create the context, queue, program, kernel, streams and device memory arenas of one card.
+static fstatus_t card_init(AlveoCard *card, void **argv) {
+  clGetDeviceInfo(card->device_id, CL_DEVICE_HANDLE, sizeof(card->device_handle),
+                  &card->device_handle, NULL);
 
    // Create a compute context
-    alveo_state.context = clCreateContext(0, 1, &(alveo_state.device_id), NULL, NULL, &(alveo_state.err));
-    if (!alveo_state.context) {
+    card->context = clCreateContext(0, 1, &card->device_id, NULL, NULL, &(alveo_state.err));
+    if (!card->context) {
         printf("Error: Failed to create a compute context!\n");
         printf("Test failed\n");
         return EXIT_FAILURE;
     }
 
     // Create a command q "commands".
-    alveo_state.commands = clCreateCommandQueue(alveo_state.context, &(alveo_state.device_id), 0, &(alveo_state.err));
-    if (!alveo_state.commands) {
+    card->commands = clCreateCommandQueue(card->context, card->device_id,
+                                          alveo_state.config.profile ? CL_QUEUE_PROFILING_ENABLE : 0,
+                                          &(alveo_state.err));
+    if (!card->commands) {
         printf("Error: Failed to create a command commands!\n");
         printf("Error: code %i\n",alveo_state.err);
         printf("Test failed\n");
@@ -183,24 +692,17 @@ runs, it must load the .xclbin file using the clCreateProgramWithBinary API.
 
 
 
-    // Create Program Objects
-    // Load binary from disk
-    unsigned char *kernelbinary;
-    alveo_state.xclbin = argv[0];
+    // Create Program Objects from the mapped binary
+    const unsigned char *kernelbinary = alveo_state.xclbin_data;
+    size_t n0 = alveo_state.xclbin_size;  //size of the mapped file.
 
-    printf("INFO: loading xclbin %s\n", alveo_state.xclbin);
-    int n_i0 = load_file_to_memory(alveo_state.xclbin, (char **) &kernelbinary); //load xclbin to kernelbinary
-    if (n_i0 < 0) {
-     printf("failed to load kernel from xclbin: %s\n", xclbin);
-     printf("Test failed\n");
-     return EXIT_FAILURE;
+    // A program object is still needed for the kernel and stream handles, but when the card already holds this
+    // bitstream the driver does not download it again, so a warm start takes milliseconds.
+    card->xclbin_reused = card_holds_xclbin(card);
+    if (card->xclbin_reused) {
+      printf("INFO: Device %u already holds xclbin %s, skipping reprogramming.\n", card->index, alveo_state.xclbin);
     }
 
-
-
-
-    size_t n0 = n_i0;  //size of the file loaded into memory.
-
     // Create the compute program from offline.
 
     //When the host application runs, it must load the FPGA binary(.xclbin)
@@ -208,10 +710,10 @@ runs, it must load the .xclbin file using the clCreateProgramWithBinary API.
 
     //Creates a program object for a context, and loads
     //specified binary data into the program object.
-    alveo_state.program = clCreateProgramWithBinary(context, 1, &alveo_state.device_id, &n0,
-                                     (const unsigned char **) &kernelbinary, &status, &(alveo_state.err));
+    card->program = clCreateProgramWithBinary(card->context, 1, &card->device_id, &n0,
+                                     &kernelbinary, &status, &(alveo_state.err));
 
-    if ((!program) || ((alveo_state.err)!=CL_SUCCESS)) {
+    if ((!card->program) || ((alveo_state.err)!=CL_SUCCESS)) {
      printf("Error: Failed to create compute program from binary %d!\n", alveo_state.err);
      printf("Test failed\n");
      return EXIT_FAILURE;
@@ -223,15 +725,15 @@ runs, it must load the .xclbin file using the clCreateProgramWithBinary API.
 /* Is clBuildProgram necessary?
     // Build the program executable.
 
-    //Builds (compiles and links) a program executable(alveo_state.program)
+    //Builds (compiles and links) a program executable(card->program)
     //from the program source or binary.
-    alveo_state.err = clBuildProgram(alveo_state.program, 0, NULL, NULL, NULL, NULL);
+    alveo_state.err = clBuildProgram(card->program, 0, NULL, NULL, NULL, NULL);
     if (alveo_state.err != CL_SUCCESS) {
       size_t len;
       char buffer[2048];
 
       printf("Error: Failed to build program executable!\n");
-      clGetProgramBuildInfo(alveo_state.program, alveo_state.device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
+      clGetProgramBuildInfo(card->program, card->device_id, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, &len);
       printf("%s\n", buffer);
       printf("Test failed\n");
       return EXIT_FAILURE;
@@ -260,55 +762,447 @@ runs, it must load the .xclbin file using the clCreateProgramWithBinary API.
 
     // Create the compute kernel in the program we wish to run.
 
-    const char *kernel_name = argv[2];
+    const char *kernel_name = argv[2] != NULL ? (const char *) argv[2] : "FLETCHER_KERNEL";
 
     //The OpenCL API clCreateKernel should be used to access the kernels contained
     // within the .xclbin file (the "program").
-    alveo_state.kernel = clCreateKernel(alveo_state.program, "FLETCHER_KERNEL", &(alveo_state.err));
-    if (!(alveo_state.kernel) || (alveo_state.err) != CL_SUCCESS) {
+    card->kernel = clCreateKernel(card->program, kernel_name, &(alveo_state.err));
+    if (!card->kernel || (alveo_state.err) != CL_SUCCESS) {
        printf("Error: Failed to create compute kernel!\n");
        printf("Test failed\n");
        return EXIT_FAILURE;
     }
 
-    //The cl_kernel (alveo_state.kernel) object identifies a kernel in the program loaded
+    //The cl_kernel (card->kernel) object identifies a kernel in the program loaded
     //into the FPGA that can be run by the host application.
 
 
 
-    // Create memory buffers
-    cl_mem dev_buf1 = clCreateBuffer(alveo_state.context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, size, &host_mem_ptr1, NULL);
+    // Host buffers are wrapped in CL_MEM_USE_HOST_PTR buffers when they are prepared, see platformPrepareHostBuffer.
 
 
-    alveo_state.err |= clSetKernelArg(alveo_state.kernel, 0, sizeof(cl_mem), &dev_buf1);
 
 
+  // The xclbin may instantiate the kernel several times; every instance gets its own registers and streams.
+  cl_uint num_cus = 0;
+  clGetKernelInfo(card->kernel, CL_KERNEL_COMPUTE_UNIT_COUNT, sizeof(num_cus), &num_cus, NULL);
+  if (num_cus == 0) {
+    printf("Error: Kernel %s has no compute units.\n", kernel_name);
+    return FLETCHER_STATUS_ERROR;
+  }
+  for (cl_uint i = 0; (i < num_cus) && (i < ALVEO_MAX_CUS); i++) {
+    if (open_cu(card, add_cu(card), kernel_name) != FLETCHER_STATUS_OK) {
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  printf("INFO: Device %u has %u compute unit(s).\n", card->index, card->num_cus);
 
+  return create_arenas(card);
+}
 
+uint32_t platformCardCount(void) {
+  return alveo_state.num_cards;
+}
 
+fstatus_t platformSelectCard(uint32_t card) {
+  if (card >= alveo_state.num_cards) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  select_cu(&alveo_state.cards[card].cus[0]);
   return FLETCHER_STATUS_OK;
 }
 
+fstatus_t platformContextCreate(AlveoContext **ctx) {
+  AlveoContext *c = context_new(0);
+  if (c == NULL) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  c->cu = alveo_ctx()->cu;
+  *ctx = c;
+  return FLETCHER_STATUS_OK;
+}
 
-fstatus_t platformWriteMMIO(uint64_t offset, uint32_t value) {
-  xclRegRead(alveo_state.device_handle, )
+fstatus_t platformContextBind(AlveoContext *ctx) {
+  current_ctx = ctx != NULL ? ctx : implicit_ctx();
+  return FLETCHER_STATUS_OK;
+}
 
+void platformContextDestroy(AlveoContext *ctx) {
+  if ((ctx == NULL) || ctx->implicit) {
+    return;
+  }
+  if (current_ctx == ctx) {
+    current_ctx = NULL;
+  }
+  context_free(ctx);
+}
 
-  debug_print("[FLETCHER_SNAP] Writing MMIO register.       %04lu <= 0x%08X\n", offset, value);
+uint32_t platformComputeUnitCount(void) {
+  return alveo_card()->num_cus;
+}
+
+fstatus_t platformSelectComputeUnit(uint32_t cu) {
+  AlveoCard *card = alveo_card();
+  if (cu >= card->num_cus) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  select_cu(&card->cus[cu]);
   return FLETCHER_STATUS_OK;
 }
 
+fstatus_t platformAcquireCard(uint32_t *card) {
+  if (alveo_state.num_cus == 0) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  // Every compute unit has its own queue of jobs; join the shortest one. Start at a different compute unit every time,
+  // so that idle ones are used round-robin.
+  uint32_t first = __atomic_fetch_add(&alveo_state.next_cu, 1, __ATOMIC_RELAXED);
+  AlveoCU *best = NULL;
+  uint32_t best_queued = UINT32_MAX;
+  for (uint32_t i = 0; i < alveo_state.num_cus; i++) {
+    AlveoCU *cu = alveo_state.cus[(first + i) % alveo_state.num_cus];
+    uint32_t queued = __atomic_load_n(&cu->queued, __ATOMIC_RELAXED);
+    if (queued < best_queued) {
+      best = cu;
+      best_queued = queued;
+    }
+  }
+  __atomic_add_fetch(&best->queued, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&best->lock);
+  best->jobs++;
+  select_cu(best);
+  *card = best->card->index;
+  debug_print("[FLETCHER_ALVEO] Acquired card %u unit %u.     %u jobs queued.\n", best->card->index, best->index,
+              best_queued + 1);
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t platformReleaseCard(uint32_t card) {
+  AlveoCU *cu = alveo_ctx()->cu;
+  if ((cu == NULL) || (cu->card->index != card)) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  pthread_mutex_unlock(&cu->lock);
+  __atomic_sub_fetch(&cu->queued, 1, __ATOMIC_RELAXED);
+  return FLETCHER_STATUS_OK;
+}
+
+fstatus_t platformDispatch(AlveoJobFn fn, void *arg) {
+  return alveoDispatchSubmit(&alveo_state.dispatcher, fn, arg);
+}
+
+fstatus_t platformDispatchWait(void) {
+  return alveoDispatchWait(&alveo_state.dispatcher);
+}
+
+// Copy output k of a batch back and split it over its jobs. A batch of one job is copied to its buffer directly.
+static fstatus_t split_output(AlveoCoalesceBatch *batch, uint32_t k, da_t device, uint32_t width) {
+  int64_t size = batch->num_rows * width;
+  if (batch->num_jobs == 1) {
+    return platformCopyDeviceToHost(device, batch->jobs[0].outputs[k], size);
+  }
+  uint8_t *staging = NULL;
+  if (platformHostAllocate(size, &staging) != FLETCHER_STATUS_OK) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  fstatus_t status = platformCopyDeviceToHost(device, staging, size);
+  for (uint32_t j = 0; (status == FLETCHER_STATUS_OK) && (j < batch->num_jobs); j++) {
+    const AlveoCoalesceJob *job = &batch->jobs[j];
+    memcpy(job->outputs[k], staging + job->first * width, (size_t) (job->num_rows * width));
+  }
+  platformHostFree(staging, size);
+  return status;
+}
+
+// Run a batch of coalesced jobs on the compute unit of the dispatcher worker: one vectored copy of all inputs, one
+// register batch that sets the index range and buffer addresses and starts the kernel, one status wait, and one copy
+// back per output.
+static fstatus_t run_batch(void *arg) {
+  AlveoCoalesceBatch *batch = (AlveoCoalesceBatch *) arg;
+  const AlveoCoalesceLayout *layout = &alveo_state.coalescer.layout;
+  uint32_t num_buffers = layout->num_inputs + layout->num_outputs;
+  da_t buffers[2 * ALVEO_COALESCE_MAX_BUFFERS] = {0};
+  fstatus_t status = batch->num_rows <= UINT32_MAX ? FLETCHER_STATUS_OK : FLETCHER_STATUS_ERROR;
+  if ((status == FLETCHER_STATUS_OK) && (batch->num_rows > 0)) {
+    for (uint32_t b = 0; (status == FLETCHER_STATUS_OK) && (b < num_buffers); b++) {
+      uint32_t width = b < layout->num_inputs ? layout->input_width[b] : layout->output_width[b - layout->num_inputs];
+      if (width > 0) {
+        status = platformDeviceMalloc(&buffers[b], batch->num_rows * width);
+      }
+    }
+    size_t max_descs = (size_t) batch->num_jobs * layout->num_inputs;
+    AlveoCopyDesc *descs = (AlveoCopyDesc *) malloc(max_descs * sizeof(AlveoCopyDesc));
+    size_t n = 0;
+    for (uint32_t j = 0; (descs != NULL) && (j < batch->num_jobs); j++) {
+      const AlveoCoalesceJob *job = &batch->jobs[j];
+      for (uint32_t i = 0; i < layout->num_inputs; i++) {
+        if ((job->num_rows > 0) && (layout->input_width[i] > 0)) {
+          descs[n].host = job->inputs[i];
+          descs[n].device = buffers[i] + job->first * layout->input_width[i];
+          descs[n].size = job->num_rows * layout->input_width[i];
+          n++;
+        }
+      }
+    }
+    if ((status == FLETCHER_STATUS_OK) && (n > 0)) {
+      status = descs != NULL ? platformCopyHostToDeviceV(descs, n) : FLETCHER_STATUS_ERROR;
+    }
+    free(descs);
+    if (status == FLETCHER_STATUS_OK) {
+      uint64_t offsets[4 + 4 * ALVEO_COALESCE_MAX_BUFFERS];
+      uint32_t values[4 + 4 * ALVEO_COALESCE_MAX_BUFFERS];
+      size_t r = 0;
+      offsets[r] = layout->index_reg;
+      values[r++] = 0;
+      offsets[r] = layout->index_reg + 1;
+      values[r++] = (uint32_t) batch->num_rows;
+      for (uint32_t b = 0; b < num_buffers; b++) {
+        offsets[r] = layout->buffer_reg + 2 * b;
+        values[r++] = (uint32_t) buffers[b];
+        offsets[r] = layout->buffer_reg + 2 * b + 1;
+        values[r++] = (uint32_t) (buffers[b] >> 32);
+      }
+      offsets[r] = FLETCHER_REG_CONTROL;
+      values[r++] = ALVEO_CONTROL_START;
+      offsets[r] = FLETCHER_REG_CONTROL;
+      values[r++] = 0;
+      status = platformWriteMMIOBatch(offsets, values, r);
+    }
+    if (status == FLETCHER_STATUS_OK) {
+      status = platformWaitStatus(ALVEO_STATUS_DONE, layout->timeout_us, NULL);
+    }
+    for (uint32_t k = 0; (status == FLETCHER_STATUS_OK) && (k < layout->num_outputs); k++) {
+      uint32_t width = layout->output_width[k];
+      if (width > 0) {
+        status = split_output(batch, k, buffers[layout->num_inputs + k], width);
+      }
+    }
+    for (uint32_t b = 0; b < num_buffers; b++) {
+      if (buffers[b] != 0) {
+        platformDeviceFree(buffers[b]);
+      }
+    }
+  }
+  alveoCoalesceComplete(batch, status);
+  return status;
+}
+
+static fstatus_t dispatch_batch(void *ctx, AlveoCoalesceBatch *batch) {
+  (void) ctx;
+  return platformDispatch(run_batch, batch);
+}
+
+fstatus_t platformCoalesceStart(const AlveoCoalesceLayout *layout) {
+  if ((alveo_state.num_cus == 0) || alveo_state.coalescer.running) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  fstatus_t status = alveoCoalesceStart(&alveo_state.coalescer, layout, alveo_state.config.coalesce_rows,
+                                        alveo_state.config.coalesce_delay_us * 1000, dispatch_batch, NULL);
+  if ((status == FLETCHER_STATUS_OK) && (alveo_state.stager.cpus != NULL)) {
+    alveoNumaPin(alveo_state.coalescer.thread, alveo_state.stager.cpus);
+  }
+  return status;
+}
+
+fstatus_t platformCoalesceSubmit(int64_t num_rows, const uint8_t *const *inputs, uint8_t *const *outputs,
+                                 AlveoFuture **future) {
+  return alveoCoalesceSubmit(&alveo_state.coalescer, num_rows, inputs, outputs, future);
+}
+
+fstatus_t platformCoalesceFlush(void) {
+  if (!alveo_state.coalescer.running) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  alveoCoalesceFlush(&alveo_state.coalescer);
+  return FLETCHER_STATUS_OK;
+}
+
+void platformCoalesceStop(void) {
+  if (alveo_state.coalescer.running && ENABLE_DEBUG_PRINT) {
+    alveoCoalescePrintStats(&alveo_state.coalescer);
+  }
+  alveoCoalesceStop(&alveo_state.coalescer);
+}
+
+// Set by asynchronous operations while they run, so that they are profiled from the moment they were queued.
+static __thread uint64_t op_queued_ns = 0;
+
+static void profile_begin(AlveoProfileRecord *r, AlveoProfileKind kind, const AlveoCU *cu, int64_t size) {
+  if (!alveo_state.profiler.enabled) {
+    return;
+  }
+  r->kind = kind;
+  r->card = cu->card->index;
+  r->cu = cu->index;
+  r->bank = -1;
+  r->size = size;
+  r->queued_ns = op_queued_ns != 0 ? op_queued_ns : alveoNowNs();
+  r->submit_ns = r->queued_ns;
+  r->start_ns = 0;
+  r->end_ns = 0;
+}
+
+static void profile_submit(AlveoProfileRecord *r) {
+  if (alveo_state.profiler.enabled) {
+    r->submit_ns = alveoNowNs();
+  }
+}
+
+// Take start and end of a command from the profiling counters of its event. Those run on the device clock, so they are
+// moved onto the host clock by lining up the end of the command with the moment the blocking call returned.
+static void profile_event(AlveoProfileRecord *r, cl_event event) {
+  cl_ulong start;
+  cl_ulong end;
+  if ((clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) == CL_SUCCESS)
+      && (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) == CL_SUCCESS)) {
+    r->end_ns = alveoNowNs();
+    r->start_ns = r->end_ns - (end - start);
+    if (r->start_ns < r->submit_ns) {
+      r->start_ns = r->submit_ns;
+    }
+  }
+  clReleaseEvent(event);
+}
+
+static fstatus_t profile_end(AlveoProfileRecord *r, fstatus_t status) {
+  if (!alveo_state.profiler.enabled || (status != FLETCHER_STATUS_OK)) {
+    return status;
+  }
+  if (r->end_ns == 0) {
+    r->end_ns = alveoNowNs();
+  }
+  if (r->start_ns == 0) {
+    r->start_ns = r->submit_ns;
+  }
+  alveoProfileRecord(&alveo_state.profiler, r);
+  return status;
+}
+
+// A kernel run lasts from writing its start bit until platformWaitStatus sees it done.
+static void profile_start_bit(AlveoCU *cu, const AlveoProfileRecord *r, uint64_t offset, uint32_t value) {
+  if (alveo_state.profiler.enabled && (offset == FLETCHER_REG_CONTROL) && (value & ALVEO_CONTROL_START)) {
+    cu->run_queued_ns = r->queued_ns;
+    cu->run_started_ns = r->submit_ns;
+  }
+}
+
+static void profile_run_done(AlveoCU *cu, uint32_t mask) {
+  if (!(mask & ALVEO_STATUS_DONE) || (cu->run_queued_ns == 0)) {
+    return;
+  }
+  AlveoProfileRecord r;
+  profile_begin(&r, ALVEO_PROFILE_RUN, cu, 0);
+  r.queued_ns = cu->run_queued_ns;
+  r.submit_ns = cu->run_started_ns;
+  cu->run_queued_ns = 0;
+  profile_end(&r, FLETCHER_STATUS_OK);
+}
+
+fstatus_t platformWriteMMIO(uint64_t offset, uint32_t value) {
+  AlveoCU *cu = alveo_cu();
+  AlveoProfileRecord r;
+  profile_begin(&r, ALVEO_PROFILE_MMIO, cu, 1);
+  profile_start_bit(cu, &r, offset, value);
+  if (cu->card->emu != NULL) {
+    return profile_end(&r, alveoEmuWriteMMIO(cu->card->emu, cu->index, offset, value));
+  }
+  xclRegWrite(cu->card->device_handle, cu->cu_index, 4 * offset, value);
+
+  debug_print("[FLETCHER_SNAP] Writing MMIO register.       %04lu <= 0x%08X\n", offset, value);
+  return profile_end(&r, FLETCHER_STATUS_OK);
+}
+
+fstatus_t platformWriteMMIOBatch(const uint64_t *offsets, const uint32_t *values, size_t n) {
+  AlveoCU *cu = alveo_cu();
+  AlveoProfileRecord r;
+  profile_begin(&r, ALVEO_PROFILE_MMIO, cu, (int64_t) n);
+  for (size_t i = 0; i < n; i++) {
+    profile_start_bit(cu, &r, offsets[i], values[i]);
+  }
+  if (cu->card->emu != NULL) {
+    return profile_end(&r, alveoEmuWriteMMIOBatch(cu->card->emu, cu->index, offsets, values, n));
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (xclRegWrite(cu->card->device_handle, cu->cu_index, 4 * offsets[i], values[i]) != 0) {
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  debug_print("[FLETCHER_ALVEO] Wrote %lu MMIO registers.\n", (unsigned long) n);
+  return profile_end(&r, FLETCHER_STATUS_OK);
+}
+
 fstatus_t platformReadMMIO(uint64_t offset, uint32_t *value) {
+  AlveoCU *cu = alveo_cu();
   *value = 0xDEADBEEF;
-  // Sleep a few seconds in simulation mode to prevent status register polling spam
-  if (snap_state.sim && offset == FLETCHER_REG_STATUS) {
-    sleep(2);
+  if (cu->card->emu != NULL) {
+    return alveoEmuReadMMIO(cu->card->emu, cu->index, offset, value);
   }
-  snap_action_read32(snap_state.card_handle, FLETCHER_SNAP_ACTION_REG_OFFSET + 4*offset, value);
+  xclRegRead(cu->card->device_handle, cu->cu_index, 4 * offset, value);
   debug_print("[FLETCHER_SNAP] Reading MMIO register.       %04lu => 0x%08X\n", offset, *value);
   return FLETCHER_STATUS_OK;
 }
 
+static void wait_done(AlveoWaitStats *stats, uint64_t start, uint64_t *counter, uint64_t *waited_ns) {
+  uint64_t elapsed = alveoNowNs() - start;
+  stats->calls++;
+  stats->total_ns += elapsed;
+  if (elapsed > stats->max_ns) {
+    stats->max_ns = elapsed;
+  }
+  if (counter != NULL) {
+    (*counter)++;
+  }
+  if (waited_ns != NULL) {
+    *waited_ns = elapsed;
+  }
+  debug_print("[FLETCHER_ALVEO] Waited for status.           %lu ns.\n", (unsigned long) elapsed);
+}
+
+fstatus_t platformWaitStatus(uint32_t mask, uint64_t timeout_us, uint64_t *waited_ns) {
+  AlveoCU *cu = alveo_cu();
+  AlveoWaitStats *stats = &cu->wait_stats;
+  uint64_t start = alveoNowNs();
+  uint64_t deadline = timeout_us > 0 ? start + timeout_us * 1000 : UINT64_MAX;
+  uint64_t backoff = 1000;
+  uint32_t status;
+
+  for (;;) {
+    if (platformReadMMIO(FLETCHER_REG_STATUS, &status) != FLETCHER_STATUS_OK) {
+      return FLETCHER_STATUS_ERROR;
+    }
+    uint64_t now = alveoNowNs();
+    if ((status & mask) == mask) {
+      if (now - start < alveo_state.config.wait_spin_ns) {
+        wait_done(stats, start, &stats->spin_done, waited_ns);
+      } else if (backoff < alveo_state.config.wait_max_backoff_ns) {
+        wait_done(stats, start, &stats->backoff_done, waited_ns);
+      } else {
+        wait_done(stats, start, &stats->sleep_done, waited_ns);
+      }
+      profile_run_done(cu, mask);
+      return FLETCHER_STATUS_OK;
+    }
+    if (now >= deadline) {
+      stats->timeouts++;
+      wait_done(stats, start, NULL, waited_ns);
+      return FLETCHER_STATUS_ERROR;
+    }
+    if (now - start < alveo_state.config.wait_spin_ns) {
+      continue;
+    }
+    // The kernel is started through its registers rather than as an XRT command, so no completion interrupt wakes up
+    // the host; long-running kernels are polled at the capped backoff period.
+    if (backoff > alveo_state.config.wait_max_backoff_ns) {
+      backoff = alveo_state.config.wait_max_backoff_ns;
+    }
+    struct timespec ts = {(time_t) (backoff / 1000000000), (long) (backoff % 1000000000)};
+    nanosleep(&ts, NULL);
+    if (backoff < alveo_state.config.wait_max_backoff_ns) {
+      backoff *= 2;
+    }
+  }
+}
+
 //Streams should be directly attached to the OpenCL device object because it does not use any command queue.
 //A stream itself is a command queue that only passes the data in a particular direction, either the kernel
 //reading data from the host, or the kernel writing data to the host.
@@ -319,94 +1213,1083 @@ is used to identify the kernel, and the kernel argument the stream is associated
 
 /*A stream itself is a command queue that only passes the data in a particular direction, either the kernel
 reading data from the host, or the kernel writing data to the host.*/
-fstatus_t platformCopyHostToDevice(const uint8_t *host_source, da_t device_destination, int64_t size) {
-    cl_mem_ext_ptr_t ext;
-    ext.param = alveo_state.kernel;
-    ext.obj = nullptr;
+// Return the host buffer registration that holds [device, device + size), and the offset of device in it, or NULL.
+static cl_mem find_host_mapping(AlveoCard *card, da_t device, int64_t size, uint64_t *offset) {
+  pthread_mutex_lock(&card->mem_lock);
+  AlveoHostMapping *m = alveoHostMapFind(&card->hostmap, device, size, offset);
+  cl_mem mem = m != NULL ? m->mem : NULL;
+  pthread_mutex_unlock(&card->mem_lock);
+  return mem;
+}
 
+static fstatus_t copy_h2d(AlveoCU *cu, const uint8_t *host_source, da_t device_destination, int64_t size,
+                          AlveoProfileRecord *r) {
+    AlveoCard *card = cu->card;
+    if (card->emu != NULL) {
+      // As on the card, addresses outside of on-board memory refer to kernel streams.
+      r->bank = alveoEmuBank(card->emu, device_destination, size);
+      profile_submit(r);
+      if (r->bank < 0) {
+        return alveoEmuStream(card->emu, ALVEO_EMU_H2D, (uint8_t *) host_source, size, NULL);
+      }
+      uint64_t offset;
+      AlveoArena *arena = alveoDevMemFind(&card->devmem, device_destination, size, &offset);
+      if (arena != NULL) {
+        count_traffic(arena, size, 1);
+      }
+      return alveoEmuCopy(card->emu, ALVEO_EMU_H2D, (uint8_t *) host_source, device_destination, size);
+    }
 
-    ext.flags = 0; // Create write stream for argument 0 of kernel. MAY NEED FIXING!
-    alveo_state.h2k_stream = clCreateStream(alveo_state.device_id, XCL_STREAM_READ_ONLY, CL_STREAM, &ext, &alveo_state.ret);
+    // Copies to on-board memory go through the buffer of the arena that holds the destination.
+    uint64_t offset;
+    AlveoArena *arena = alveoDevMemFind(&card->devmem, device_destination, size, &offset);
+    if (arena != NULL) {
+      cl_event event = NULL;
+      r->bank = arena->bank;
+      count_traffic(arena, size, 1);
+      profile_submit(r);
+      cl_int err = clEnqueueWriteBuffer(alveo_queue(card), arena->mem, CL_TRUE, offset, (size_t) size, host_source,
+                                        0, NULL, alveo_state.profiler.enabled ? &event : NULL);
+      if (event != NULL) {
+        profile_event(r, event);
+      }
+      return err == CL_SUCCESS ? FLETCHER_STATUS_OK : FLETCHER_STATUS_ERROR;
+    }
 
-    // Initiate the READ transfer
-    cl_stream_xfer_req rd_req {0};
-    rd_req.flags = CL_STREAM_EOT | CL_STREAM_NONBLOCKING;
-    rd_req.priv_data = (void*)"read";
-    clReadStream(alveo_state.k2h_stream, host_read_ptr, max_read_size, &rd_req, &alveo_state.ret);
+    // Registered host buffers are synchronized by DMA straight from their pages.
+    cl_mem mem = find_host_mapping(card, device_destination, size, &offset);
+    if (mem != NULL) {
+      cl_event event = NULL;
+      r->bank = -1;
+      profile_submit(r);
+      cl_int err = clEnqueueWriteBuffer(alveo_queue(card), mem, CL_TRUE, offset, (size_t) size, host_source,
+                                        0, NULL, alveo_state.profiler.enabled ? &event : NULL);
+      if (event != NULL) {
+        profile_event(r, event);
+      }
+      return err == CL_SUCCESS ? FLETCHER_STATUS_OK : FLETCHER_STATUS_ERROR;
+    }
 
-    // Checking the request completion
-    cl_streams_poll_req_completions poll_req[2] {0}; // 1 Requests
+    // Anything else is streamed to the kernel through one of the streams created at platformInit.
+    AlveoStream *stream = alveoStreamFind(&cu->streams, ALVEO_H2K, device_destination);
+    if (stream == NULL) {
+      return FLETCHER_STATUS_ERROR;
+    }
     debug_print(
-      "[FLETCHER_SNAP] Copying from host to device. [host] 0x%016lX --> [dev] 0x%016lX (%lu bytes) (NOT IMPLEMENTED)\n",
+      "[FLETCHER_ALVEO] Copying from host to device. [host] 0x%016lX --> [arg] %u (%lu bytes)\n",
       (uint64_t) host_source,
-      device_destination,
+      stream->arg,
       size);
-    return FLETCHER_STATUS_OK;
+    profile_submit(r);
+    pthread_mutex_lock(&cu->stream_lock);
+    fstatus_t status = alveoStreamTransfer(&cu->streams, stream, (void *) host_source, size,
+                                           alveo_state.config.chunk_size, alveo_state.config.queue_depth);
+    pthread_mutex_unlock(&cu->stream_lock);
+    return status;
 }
 
-fstatus_t platformCopyDeviceToHost(da_t device_source, uint8_t *host_destination, int64_t size) {
-    cl_mem_ext_ptr_t ext;
-    ext.param = alveo_state.kernel;
-    ext.obj = nullptr;
+fstatus_t platformCopyHostToDevice(const uint8_t *host_source, da_t device_destination, int64_t size) {
+  AlveoCU *cu = alveo_cu();
+  AlveoProfileRecord r;
+  profile_begin(&r, ALVEO_PROFILE_H2D, cu, size);
+  // The driver can only DMA straight from page-aligned memory, and bounces anything else through a buffer of its own
+  // with a plain copy. Large misaligned sources are staged here instead, with the vectorized, multithreaded copy.
+  uint8_t *staged = NULL;
+  if ((cu->card->emu == NULL) && (size >= ALVEO_STAGE_MIN_SIZE)
+      && (((uintptr_t) host_source % ALVEO_DEVICE_ALIGNMENT) != 0)
+      && (platformHostAllocate(size, &staged) == FLETCHER_STATUS_OK)) {
+    alveoStageCopy(&alveo_state.stager, staged, host_source, size);
+  }
+  fstatus_t status = copy_h2d(cu, staged != NULL ? staged : host_source, device_destination, size, &r);
+  platformHostFree(staged, size);
+  return profile_end(&r, status);
+}
 
-    ext.flags = 0; // Create write stream for argument 0 of kernel. MAY NEED FIXING!
-    alveo_state.k2h_stream = clCreateStream(alveo_state.device_id, XCL_STREAM_WRITE_ONLY, CL_STREAM, &ext, &alveo_state.ret);
+fstatus_t platformCopyBitmapToDevice(const uint8_t *bitmap, int64_t bit_offset, int64_t length,
+                                     da_t device_destination) {
+  int64_t size = (length + 7) / 8;
+  if ((bit_offset % 8 == 0) && (length % 8 == 0)) {
+    return platformCopyHostToDevice(bitmap + bit_offset / 8, device_destination, size);
+  }
+  uint8_t *staged;
+  if (platformHostAllocate(size, &staged) != FLETCHER_STATUS_OK) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  alveoStageBitmap(&alveo_state.stager, staged, bitmap, bit_offset, length);
+  AlveoCU *cu = alveo_cu();
+  AlveoProfileRecord r;
+  profile_begin(&r, ALVEO_PROFILE_H2D, cu, size);
+  fstatus_t status = profile_end(&r, copy_h2d(cu, staged, device_destination, size, &r));
+  platformHostFree(staged, size);
+  return status;
+}
 
-    // Initiating the WRITE transfer
-    cl_stream_xfer_req wr_req {0};
-    wr_req.flags = CL_STREAM_EOT | CL_STREAM_NONBLOCKING;
-    wr_req.priv_data = (void*)"write";
-    clWriteStream(h2k_stream, host_write_ptr, write_size, &wr_req , &alveo_state.ret);
+static fstatus_t copy_d2h(AlveoCU *cu, da_t device_source, uint8_t *host_destination, int64_t size,
+                          AlveoProfileRecord *r) {
+    AlveoCard *card = cu->card;
+    if (card->emu != NULL) {
+      r->bank = alveoEmuBank(card->emu, device_source, size);
+      profile_submit(r);
+      if (r->bank < 0) {
+        return alveoEmuStream(card->emu, ALVEO_EMU_D2H, host_destination, size, NULL);
+      }
+      uint64_t offset;
+      AlveoArena *arena = alveoDevMemFind(&card->devmem, device_source, size, &offset);
+      if (arena != NULL) {
+        count_traffic(arena, size, 0);
+      }
+      return alveoEmuCopy(card->emu, ALVEO_EMU_D2H, host_destination, device_source, size);
+    }
+
+    uint64_t offset;
+    AlveoArena *arena = alveoDevMemFind(&card->devmem, device_source, size, &offset);
+    if (arena != NULL) {
+      cl_event event = NULL;
+      r->bank = arena->bank;
+      count_traffic(arena, size, 0);
+      profile_submit(r);
+      cl_int err = clEnqueueReadBuffer(alveo_queue(card), arena->mem, CL_TRUE, offset, (size_t) size,
+                                       host_destination, 0, NULL, alveo_state.profiler.enabled ? &event : NULL);
+      if (event != NULL) {
+        profile_event(r, event);
+      }
+      return err == CL_SUCCESS ? FLETCHER_STATUS_OK : FLETCHER_STATUS_ERROR;
+    }
 
-    cl_streams_poll_req_completions poll_req[2] {0}; // 1 Requests
+    cl_mem mem = find_host_mapping(card, device_source, size, &offset);
+    if (mem != NULL) {
+      cl_event event = NULL;
+      r->bank = -1;
+      profile_submit(r);
+      cl_int err = clEnqueueReadBuffer(alveo_queue(card), mem, CL_TRUE, offset, (size_t) size, host_destination,
+                                       0, NULL, alveo_state.profiler.enabled ? &event : NULL);
+      if (event != NULL) {
+        profile_event(r, event);
+      }
+      return err == CL_SUCCESS ? FLETCHER_STATUS_OK : FLETCHER_STATUS_ERROR;
+    }
+
+    AlveoStream *stream = alveoStreamFind(&cu->streams, ALVEO_K2H, device_source);
+    if (stream == NULL) {
+      return FLETCHER_STATUS_ERROR;
+    }
     debug_print(
-      "[FLETCHER_SNAP] Copying from device to host. [dev] 0x%016lX --> [host] 0x%016lX (%lu bytes) (NOT IMPLEMENTED)\n",
-      device_source,
+      "[FLETCHER_ALVEO] Copying from device to host. [arg] %u --> [host] 0x%016lX (%lu bytes)\n",
+      stream->arg,
       (uint64_t) host_destination,
       size);
+    profile_submit(r);
+    pthread_mutex_lock(&cu->stream_lock);
+    fstatus_t status = alveoStreamTransfer(&cu->streams, stream, host_destination, size,
+                                           alveo_state.config.chunk_size, alveo_state.config.queue_depth);
+    pthread_mutex_unlock(&cu->stream_lock);
+    return status;
+}
+
+fstatus_t platformCopyDeviceToHost(da_t device_source, uint8_t *host_destination, int64_t size) {
+  AlveoCU *cu = alveo_cu();
+  AlveoProfileRecord r;
+  profile_begin(&r, ALVEO_PROFILE_D2H, cu, size);
+  return profile_end(&r, copy_d2h(cu, device_source, host_destination, size, &r));
+}
+
+// Return whether device_source refers to a kernel-to-host stream rather than to memory.
+static int is_stream(AlveoCard *card, da_t device, int64_t size) {
+  uint64_t offset;
+  if (card->emu != NULL) {
+    return alveoEmuBank(card->emu, device, size) < 0;
+  }
+  return (alveoDevMemFind(&card->devmem, device, size, &offset) == NULL)
+      && (find_host_mapping(card, device, size, &offset) == NULL);
+}
+
+fstatus_t platformCopyResultToHost(da_t device_source, uint8_t *host_destination, int64_t capacity, uint64_t count_reg,
+                                   int64_t element_size, int64_t *size) {
+  AlveoCU *cu = alveo_cu();
+  AlveoCard *card = cu->card;
+  *size = 0;
+  AlveoProfileRecord r;
+  if (is_stream(card, device_source, capacity)) {
+    // The kernel ends the transaction after its last byte, which ends the read early.
+    profile_begin(&r, ALVEO_PROFILE_D2H, cu, capacity);
+    if (card->emu != NULL) {
+      profile_submit(&r);
+      fstatus_t status = alveoEmuStream(card->emu, ALVEO_EMU_D2H, host_destination, capacity, size);
+      r.size = *size;
+      return profile_end(&r, status);
+    }
+    AlveoTransfer x;
+    memset(&x, 0, sizeof(x));
+    x.stream = alveoStreamFind(&cu->streams, ALVEO_K2H, device_source);
+    x.host = host_destination;
+    x.size = capacity;
+    if (x.stream == NULL) {
+      return profile_end(&r, FLETCHER_STATUS_ERROR);
+    }
+    profile_submit(&r);
+    pthread_mutex_lock(&cu->stream_lock);
+    fstatus_t status = alveoStreamPipeline(&cu->streams, &x, 1, alveo_state.config.chunk_size,
+                                           alveo_state.config.queue_depth);
+    pthread_mutex_unlock(&cu->stream_lock);
+    *size = x.completed;
+    r.size = x.completed;
+    return profile_end(&r, status);
+  }
+  uint32_t lo;
+  uint32_t hi;
+  if ((platformReadMMIO(count_reg, &lo) != FLETCHER_STATUS_OK)
+      || (platformReadMMIO(count_reg + 1, &hi) != FLETCHER_STATUS_OK)) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  uint64_t count = ((uint64_t) hi << 32) | lo;
+  if ((element_size <= 0) || (count > (uint64_t) capacity / (uint64_t) element_size)) {
+    // A count that does not fit means the register is not what the caller thinks it is.
+    return FLETCHER_STATUS_ERROR;
+  }
+  uint64_t produced = count * (uint64_t) element_size;
+  debug_print("[FLETCHER_ALVEO] Reading back result.         [device] 0x%016lX (%lu of %lu bytes).\n",
+              device_source, (unsigned long) produced, (unsigned long) capacity);
+  *size = (int64_t) produced;
+  if (produced == 0) {
     return FLETCHER_STATUS_OK;
+  }
+  profile_begin(&r, ALVEO_PROFILE_D2H, cu, (int64_t) produced);
+  return profile_end(&r, copy_d2h(cu, device_source, host_destination, (int64_t) produced, &r));
+}
+
+// Fetch a block of a result mapped by platformMapResult. This runs on the thread that resolves the faults on mapped
+// results for every card and context, so it uses the queue of the card.
+static fstatus_t fetch_result(void *ctx, da_t address, uint8_t *host, int64_t size) {
+  AlveoCard *card = (AlveoCard *) ctx;
+  if (card->emu != NULL) {
+    return alveoEmuCopy(card->emu, ALVEO_EMU_D2H, host, address, size);
+  }
+  uint64_t offset;
+  AlveoArena *arena = alveoDevMemFind(&card->devmem, address, size, &offset);
+  if (arena == NULL) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  count_traffic(arena, size, 0);
+  cl_int err = clEnqueueReadBuffer(card->commands, arena->mem, CL_TRUE, offset, (size_t) size, host, 0, NULL, NULL);
+  return err == CL_SUCCESS ? FLETCHER_STATUS_OK : FLETCHER_STATUS_ERROR;
+}
+
+fstatus_t platformMapResult(da_t device_source, int64_t size, int64_t produced, const uint8_t **host) {
+  AlveoCard *card = alveo_card();
+  uint64_t offset;
+  int onboard = card->emu != NULL ? alveoEmuBank(card->emu, device_source, size) >= 0
+                                  : alveoDevMemFind(&card->devmem, device_source, size, &offset) != NULL;
+  if (!onboard) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  return alveoLazyMap(device_source, size, produced, fetch_result, card, host);
+}
+
+fstatus_t platformUnmapResult(const uint8_t *host) {
+  return alveoLazyUnmap(host);
+}
+
+// Resolve every descriptor to the buffer or stream copy_h2d would use, merge them into runs, and write every run with
+// one command. Buffer writes do not block, so they are all in flight while the stream runs are pipelined.
+// The emulated card models a vectored copy as one DMA transfer that spreads over the banks it writes to.
+static fstatus_t copy_h2d_v_emu(AlveoCU *cu, const AlveoCopyDesc *descs, uint32_t n, AlveoProfileRecord *r) {
+  AlveoCard *card = cu->card;
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t offset;
+    AlveoArena *arena = alveoDevMemFind(&card->devmem, descs[i].device, descs[i].size, &offset);
+    if (arena != NULL) {
+      count_traffic(arena, descs[i].size, 1);
+    }
+  }
+  profile_submit(r);
+  return alveoEmuCopyV(card->emu, descs, n);
+}
+
+static fstatus_t copy_h2d_v(AlveoCU *cu, const AlveoCopyDesc *descs, uint32_t n, AlveoProfileRecord *r) {
+  AlveoCard *card = cu->card;
+  AlveoGatherPiece *pieces = (AlveoGatherPiece *) malloc(n * sizeof(AlveoGatherPiece));
+  AlveoGatherRun *runs = (AlveoGatherRun *) malloc(n * sizeof(AlveoGatherRun));
+  uint8_t **staging = (uint8_t **) calloc(n, sizeof(uint8_t *));
+  fstatus_t status = FLETCHER_STATUS_OK;
+  if ((pieces == NULL) || (runs == NULL) || (staging == NULL)) {
+    status = FLETCHER_STATUS_ERROR;
+  }
+
+  // Pieces for a stream are placed at increasing offsets, so that planning keeps them in order.
+  uint64_t stream_offsets[ALVEO_MAX_STREAMS] = {0};
+  for (uint32_t i = 0; (i < n) && (status == FLETCHER_STATUS_OK); i++) {
+    AlveoGatherPiece *p = &pieces[i];
+    p->host = descs[i].host;
+    p->size = descs[i].size;
+    p->stream = 0;
+    AlveoArena *arena = alveoDevMemFind(&card->devmem, descs[i].device, descs[i].size, &p->offset);
+    if (arena != NULL) {
+      count_traffic(arena, descs[i].size, 1);
+    }
+    cl_mem mem = arena != NULL ? arena->mem : find_host_mapping(card, descs[i].device, descs[i].size, &p->offset);
+    if (mem != NULL) {
+      p->target = mem;
+      continue;
+    }
+    AlveoStream *stream = alveoStreamFind(&cu->streams, ALVEO_H2K, descs[i].device);
+    if (stream == NULL) {
+      status = FLETCHER_STATUS_ERROR;
+      break;
+    }
+    uint32_t s = (uint32_t) (stream - cu->streams.streams);
+    p->target = stream;
+    p->offset = stream_offsets[s];
+    p->stream = 1;
+    stream_offsets[s] += (uint64_t) descs[i].size;
+  }
+
+  uint32_t num_runs = status == FLETCHER_STATUS_OK ? alveoGatherPlan(pieces, n, runs) : 0;
+  for (uint32_t k = 0; (k < num_runs) && (status == FLETCHER_STATUS_OK); k++) {
+    if (runs[k].host == NULL) {
+      status = platformHostAllocate(runs[k].size, &staging[k]);
+      if (status == FLETCHER_STATUS_OK) {
+        alveoGatherPack(pieces, &runs[k], staging[k]);
+      }
+    }
+  }
+
+  if (status == FLETCHER_STATUS_OK) {
+    cl_command_queue queue = alveo_queue(card);
+    AlveoTransfer xfers[ALVEO_MAX_STREAMS];
+    uint32_t num_xfers = 0;
+    cl_int err = CL_SUCCESS;
+    profile_submit(r);
+    for (uint32_t k = 0; k < num_runs; k++) {
+      const uint8_t *source = runs[k].host != NULL ? runs[k].host : staging[k];
+      if (pieces[runs[k].first].stream) {
+        memset(&xfers[num_xfers], 0, sizeof(AlveoTransfer));
+        xfers[num_xfers].stream = (AlveoStream *) runs[k].target;
+        xfers[num_xfers].host = (uint8_t *) source;
+        xfers[num_xfers].size = runs[k].size;
+        num_xfers++;
+      } else {
+        err |= clEnqueueWriteBuffer(queue, (cl_mem) runs[k].target, CL_FALSE, runs[k].offset, (size_t) runs[k].size,
+                                    source, 0, NULL, NULL);
+      }
+    }
+    status = err == CL_SUCCESS ? FLETCHER_STATUS_OK : FLETCHER_STATUS_ERROR;
+    if ((status == FLETCHER_STATUS_OK) && (num_xfers > 0)) {
+      pthread_mutex_lock(&cu->stream_lock);
+      status = alveoStreamPipeline(&cu->streams, xfers, num_xfers, alveo_state.config.chunk_size,
+                                   alveo_state.config.queue_depth);
+      pthread_mutex_unlock(&cu->stream_lock);
+    }
+    // The sources must stay untouched until the writes completed, also when something else failed.
+    if (clFinish(queue) != CL_SUCCESS) {
+      status = FLETCHER_STATUS_ERROR;
+    }
+    debug_print("[FLETCHER_ALVEO] Copied %u buffers from host to device in %u commands.\n", n, num_runs);
+  }
+
+  for (uint32_t k = 0; k < num_runs; k++) {
+    if (staging[k] != NULL) {
+      platformHostFree(staging[k], runs[k].size);
+    }
+  }
+  free(staging);
+  free(runs);
+  free(pieces);
+  return status;
+}
+
+fstatus_t platformCopyHostToDeviceV(const AlveoCopyDesc *descs, size_t n) {
+  AlveoCU *cu = alveo_cu();
+  if ((n <= 1) || (n > UINT32_MAX)) {
+    for (size_t i = 0; i < n; i++) {
+      fstatus_t status = platformCopyHostToDevice(descs[i].host, descs[i].device, descs[i].size);
+      if (status != FLETCHER_STATUS_OK) {
+        return status;
+      }
+    }
+    return FLETCHER_STATUS_OK;
+  }
+  int64_t size = 0;
+  for (size_t i = 0; i < n; i++) {
+    size += descs[i].size;
+  }
+  AlveoProfileRecord r;
+  profile_begin(&r, ALVEO_PROFILE_H2D, cu, size);
+  if (cu->card->emu != NULL) {
+    return profile_end(&r, copy_h2d_v_emu(cu, descs, (uint32_t) n, &r));
+  }
+  return profile_end(&r, copy_h2d_v(cu, descs, (uint32_t) n, &r));
+}
+
+fstatus_t platformCopyDuplex(const uint8_t *host_source, da_t device_destination, int64_t h2d_size,
+                             da_t device_source, uint8_t *host_destination, int64_t d2h_size) {
+  AlveoCU *cu = alveo_cu();
+  AlveoCard *card = cu->card;
+  if (card->emu != NULL) {
+    AlveoProfileRecord h2d;
+    AlveoProfileRecord d2h;
+    profile_begin(&h2d, ALVEO_PROFILE_H2D, cu, h2d_size);
+    profile_begin(&d2h, ALVEO_PROFILE_D2H, cu, d2h_size);
+    return profile_end(&h2d, profile_end(&d2h, alveoEmuDuplex(card->emu, (uint8_t *) host_source, device_destination,
+                                                              h2d_size, device_source, host_destination, d2h_size)));
+  }
+  uint64_t offset;
+  AlveoStream *h2k = alveoStreamFind(&cu->streams, ALVEO_H2K, device_destination);
+  AlveoStream *k2h = alveoStreamFind(&cu->streams, ALVEO_K2H, device_source);
+  if ((alveoDevMemFind(&card->devmem, device_destination, h2d_size, &offset) != NULL)
+      || (alveoDevMemFind(&card->devmem, device_source, d2h_size, &offset) != NULL)
+      || (h2k == NULL) || (k2h == NULL)) {
+    // On-board memory copies go through the in-order command queue and cannot overlap anyway.
+    fstatus_t status = platformCopyHostToDevice(host_source, device_destination, h2d_size);
+    if (status != FLETCHER_STATUS_OK) {
+      return status;
+    }
+    return platformCopyDeviceToHost(device_source, host_destination, d2h_size);
+  }
+  AlveoTransfer xfers[2];
+  memset(xfers, 0, sizeof(xfers));
+  xfers[0].stream = h2k;
+  xfers[0].host = (uint8_t *) host_source;
+  xfers[0].size = h2d_size;
+  xfers[1].stream = k2h;
+  xfers[1].host = host_destination;
+  xfers[1].size = d2h_size;
+  // Both directions are in flight for the whole pipeline, so both are recorded with the same times.
+  AlveoProfileRecord h2d;
+  AlveoProfileRecord d2h;
+  profile_begin(&h2d, ALVEO_PROFILE_H2D, cu, h2d_size);
+  profile_begin(&d2h, ALVEO_PROFILE_D2H, cu, d2h_size);
+  pthread_mutex_lock(&cu->stream_lock);
+  fstatus_t status = alveoStreamPipeline(&cu->streams, xfers, 2, alveo_state.config.chunk_size,
+                                         alveo_state.config.queue_depth);
+  pthread_mutex_unlock(&cu->stream_lock);
+  return profile_end(&h2d, profile_end(&d2h, status));
+}
+
+// A window of a record batch body: where it is in the file and whether it ends its batch.
+typedef struct {
+  uint32_t batch;
+  uint64_t pos;                 // Offset of the window in the body of its batch.
+  const uint8_t *src;
+  int64_t size;
+  int last;
+} IpcSpan;
+
+// Pinned memory a window is staged in, by a thread of its own.
+typedef struct {
+  uint8_t *dst;
+  const uint8_t *src;
+  int64_t size;
+  pthread_t thread;
+  int started;
+} IpcBuffer;
+
+// Advance c to the next non-empty window of at most window bytes. Returns 0 at the end of the file.
+static int ipc_next(const AlveoIpcFile *f, IpcSpan *c, int64_t window) {
+  c->pos += (uint64_t) c->size;
+  while ((c->batch < f->num_batches) && (c->pos >= f->batches[c->batch].body_size)) {
+    c->batch++;
+    c->pos = 0;
+  }
+  if (c->batch == f->num_batches) {
+    c->size = 0;
+    return 0;
+  }
+  uint64_t left = f->batches[c->batch].body_size - c->pos;
+  c->size = left < (uint64_t) window ? (int64_t) left : window;
+  c->src = alveoIpcBody(f, c->batch) + c->pos;
+  c->last = (uint64_t) c->size == left;
+  return 1;
+}
+
+static void *ipc_stage(void *arg) {
+  IpcBuffer *b = (IpcBuffer *) arg;
+  // Reading the mapping faults the pages of the window in, so this is where the disk is waited for.
+  alveoStageCopy(&alveo_state.stager, b->dst, b->src, b->size);
+  return NULL;
+}
+
+static void ipc_stage_start(IpcBuffer *b, const IpcSpan *span) {
+  b->src = span->src;
+  b->size = span->size;
+  b->started = pthread_create(&b->thread, NULL, ipc_stage, b) == 0;
+  if (b->started) {
+    alveoNumaPin(b->thread, alveo_state.stager.cpus);
+  } else {
+    ipc_stage(b);
+  }
+}
+
+static void ipc_stage_wait(IpcBuffer *b) {
+  if (b->started) {
+    pthread_join(b->thread, NULL);
+    b->started = 0;
+  }
+}
+
+// Send a staged window to stream. Only the last window of a batch ends the transaction.
+static fstatus_t ipc_send(AlveoCU *cu, da_t stream, const uint8_t *host, const IpcSpan *span) {
+  AlveoProfileRecord r;
+  profile_begin(&r, ALVEO_PROFILE_H2D, cu, span->size);
+  if (cu->card->emu != NULL) {
+    profile_submit(&r);
+    return profile_end(&r, alveoEmuStream(cu->card->emu, ALVEO_EMU_H2D, (uint8_t *) host, span->size, NULL));
+  }
+  AlveoTransfer x;
+  memset(&x, 0, sizeof(x));
+  x.stream = alveoStreamFind(&cu->streams, ALVEO_H2K, stream);
+  x.host = (uint8_t *) host;
+  x.size = span->size;
+  x.partial = !span->last;
+  if (x.stream == NULL) {
+    return profile_end(&r, FLETCHER_STATUS_ERROR);
+  }
+  profile_submit(&r);
+  pthread_mutex_lock(&cu->stream_lock);
+  fstatus_t status = alveoStreamPipeline(&cu->streams, &x, 1, alveo_state.config.chunk_size,
+                                         alveo_state.config.queue_depth);
+  pthread_mutex_unlock(&cu->stream_lock);
+  return profile_end(&r, status);
+}
+
+static fstatus_t ipc_announce(const AlveoIpcFile *f, uint32_t batch, AlveoIpcBatchFn before, void *arg) {
+  if (before == NULL) {
+    return FLETCHER_STATUS_OK;
+  }
+  return before(arg, batch, alveoIpcRows(f, batch), (int64_t) f->batches[batch].body_size);
+}
+
+fstatus_t platformStreamIpcFile(const char *path, da_t stream, AlveoIpcBatchFn before, void *arg) {
+  AlveoIpcFile file;
+  if (alveoIpcOpen(&file, path) != FLETCHER_STATUS_OK) {
+    printf("Error: Failed to read Arrow IPC file %s.\n", path);
+    return FLETCHER_STATUS_ERROR;
+  }
+  debug_print("[FLETCHER_ALVEO] Streaming %u record batches from %s (%lu bytes).\n", file.num_batches, path,
+              (unsigned long) file.size);
+  AlveoCU *cu = alveo_cu();
+  int64_t window = alveo_state.config.ipc_window;
+  IpcBuffer buffers[2];
+  memset(buffers, 0, sizeof(buffers));
+  fstatus_t status = FLETCHER_STATUS_OK;
+  if ((platformHostAllocate(window, &buffers[0].dst) != FLETCHER_STATUS_OK)
+      || (platformHostAllocate(window, &buffers[1].dst) != FLETCHER_STATUS_OK)) {
+    status = FLETCHER_STATUS_ERROR;
+  }
+  IpcSpan cur;
+  memset(&cur, 0, sizeof(cur));
+  int have = (status == FLETCHER_STATUS_OK) && ipc_next(&file, &cur, window);
+  if (have) {
+    alveoIpcAdvise(&file, (uint64_t) (cur.src - file.data), 2 * (uint64_t) window, 1);
+    ipc_stage_start(&buffers[0], &cur);
+  }
+  uint32_t announced = 0;
+  for (uint64_t k = 0; have; k++) {
+    IpcBuffer *now = &buffers[k % 2];
+    IpcBuffer *later = &buffers[(k + 1) % 2];
+    ipc_stage_wait(now);
+    // Stage the next window while this one streams, and have the kernel read the one after that from disk.
+    IpcSpan next = cur;
+    int more = ipc_next(&file, &next, window);
+    if (more) {
+      ipc_stage_start(later, &next);
+      alveoIpcAdvise(&file, (uint64_t) (next.src - file.data) + (uint64_t) next.size, (uint64_t) window, 1);
+    }
+    // Batches are announced in order, also those without a body, which are not sent.
+    while ((status == FLETCHER_STATUS_OK) && (announced <= cur.batch)) {
+      status = ipc_announce(&file, announced++, before, arg);
+    }
+    if (status == FLETCHER_STATUS_OK) {
+      status = ipc_send(cu, stream, now->dst, &cur);
+    }
+    // The window is in pinned memory, and sent, so its pages of the file are not needed anymore.
+    alveoIpcAdvise(&file, (uint64_t) (cur.src - file.data), (uint64_t) cur.size, 0);
+    if (status != FLETCHER_STATUS_OK) {
+      ipc_stage_wait(later);
+      break;
+    }
+    cur = next;
+    have = more;
+  }
+  while ((status == FLETCHER_STATUS_OK) && (announced < file.num_batches)) {
+    status = ipc_announce(&file, announced++, before, arg);
+  }
+  platformHostFree(buffers[0].dst, window);
+  platformHostFree(buffers[1].dst, window);
+  alveoIpcClose(&file);
+  return status;
+}
+
+// Asynchronous operations run on the thread of the queue of their compute unit, with that compute unit selected.
+static fstatus_t run_h2d(void *ctx, const AlveoAsyncOp *op) {
+  select_cu((AlveoCU *) ctx);
+  op_queued_ns = op->queued_ns;
+  fstatus_t status = platformCopyHostToDevice(op->host, op->device, op->size);
+  op_queued_ns = 0;
+  return status;
+}
+
+static fstatus_t run_d2h(void *ctx, const AlveoAsyncOp *op) {
+  select_cu((AlveoCU *) ctx);
+  op_queued_ns = op->queued_ns;
+  fstatus_t status = platformCopyDeviceToHost(op->device, op->host, op->size);
+  op_queued_ns = 0;
+  return status;
+}
+
+static fstatus_t run_kernel(void *ctx, const AlveoAsyncOp *op) {
+  select_cu((AlveoCU *) ctx);
+  const uint64_t offsets[2] = {FLETCHER_REG_CONTROL, FLETCHER_REG_CONTROL};
+  const uint32_t values[2] = {ALVEO_CONTROL_START, 0};
+  op_queued_ns = op->queued_ns;
+  fstatus_t status = platformWriteMMIOBatch(offsets, values, 2);
+  op_queued_ns = 0;
+  if (status != FLETCHER_STATUS_OK) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  return platformWaitStatus(ALVEO_STATUS_DONE, op->timeout_us, NULL);
+}
+
+static fstatus_t submit_async(AlveoAsyncFn run, uint8_t *host, da_t device, int64_t size, uint64_t timeout_us,
+                              AlveoFuture *after, AlveoFuture **future) {
+  AlveoAsyncOp op;
+  op.run = run;
+  op.host = host;
+  op.device = device;
+  op.size = size;
+  op.timeout_us = timeout_us;
+  op.queued_ns = alveo_state.profiler.enabled ? alveoNowNs() : 0;
+  op.after = after;
+  // Without a future to hand out, queueing takes no allocation.
+  op.future = NULL;
+  if (future != NULL) {
+    op.future = alveoFutureCreate();
+    if (op.future == NULL) {
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  fstatus_t status = alveoAsyncSubmit(&alveo_cu()->async, &op);
+  if ((status == FLETCHER_STATUS_OK) && (future != NULL)) {
+    *future = op.future;
+  } else if (op.future != NULL) {
+    alveoFutureRelease(op.future);
+  }
+  return status;
+}
+
+fstatus_t platformCopyHostToDeviceAsync(const uint8_t *host_source, da_t device_destination, int64_t size,
+                                        AlveoFuture *after, AlveoFuture **future) {
+  debug_print("[FLETCHER_ALVEO] Queueing copy to device.     [host] 0x%016lX --> 0x%016lX (%10lu bytes).\n",
+              (uint64_t) host_source, device_destination, size);
+  return submit_async(run_h2d, (uint8_t *) host_source, device_destination, size, 0, after, future);
+}
+
+fstatus_t platformCopyDeviceToHostAsync(da_t device_source, uint8_t *host_destination, int64_t size,
+                                        AlveoFuture *after, AlveoFuture **future) {
+  debug_print("[FLETCHER_ALVEO] Queueing copy to host.       [device] 0x%016lX --> 0x%016lX (%10lu bytes).\n",
+              device_source, (uint64_t) host_destination, size);
+  return submit_async(run_d2h, host_destination, device_source, size, 0, after, future);
+}
+
+fstatus_t platformRunAsync(uint64_t timeout_us, AlveoFuture *after, AlveoFuture **future) {
+  return submit_async(run_kernel, NULL, 0, 0, timeout_us, after, future);
+}
+
+fstatus_t platformFutureWait(AlveoFuture *future) {
+  return alveoFutureWait(future);
+}
+
+int platformFuturePoll(AlveoFuture *future, fstatus_t *status) {
+  return alveoFuturePoll(future, status);
+}
+
+void platformFutureRelease(AlveoFuture *future) {
+  if (future != NULL) {
+    alveoFutureRelease(future);
+  }
+}
+
+static void cu_terminate(AlveoCU *cu) {
+  alveoAsyncTerminate(&cu->async);
+  if (ENABLE_DEBUG_PRINT) {
+    AlveoWaitStats *w = &cu->wait_stats;
+    fprintf(stderr, "[FLETCHER_ALVEO] Card %u unit %u: %lu jobs, %lu asynchronous operations, %lu failed, "
+                    "%lu queued to a full ring.\n",
+            cu->card->index, cu->index,
+            (unsigned long) cu->jobs,
+            (unsigned long) cu->async.executed,
+            (unsigned long) cu->async.failed,
+            (unsigned long) cu->async.full);
+    fprintf(stderr, "[FLETCHER_ALVEO] Status waits: %lu calls, %lu ns average, %lu ns max, %lu spinning, "
+                    "%lu backing off, %lu sleeping, %lu timeouts.\n",
+            (unsigned long) w->calls,
+            (unsigned long) (w->calls > 0 ? w->total_ns / w->calls : 0),
+            (unsigned long) w->max_ns,
+            (unsigned long) w->spin_done,
+            (unsigned long) w->backoff_done,
+            (unsigned long) w->sleep_done,
+            (unsigned long) w->timeouts);
+  }
+  pthread_mutex_destroy(&cu->lock);
+  pthread_mutex_destroy(&cu->stream_lock);
+  if (cu->card->emu != NULL) {
+    return;
+  }
+  alveoStreamPoolClose(&cu->streams);
+  if (cu->context_open) {
+    xclCloseContext(cu->card->device_handle, alveo_state.xclbin_uuid, cu->cu_index);
+    cu->context_open = 0;
+  }
+  if (cu->kernel != NULL) {
+    clReleaseKernel(cu->kernel);
+  }
+}
+
+static void card_terminate(AlveoCard *card) {
+  for (uint32_t i = 0; i < card->num_cus; i++) {
+    cu_terminate(&card->cus[i]);
+  }
+  if (ENABLE_DEBUG_PRINT) {
+    alveoCachePrintStats(&card->cache);
+    alveoDevMemPrintStats(&card->devmem);
+    alveoHostMapPrintStats(&card->hostmap);
+  }
+  alveoHostMapTerminate(&card->hostmap);
+  alveoCacheTerminate(&card->cache, &card->devmem);
+  for (uint32_t i = 0; i < card->devmem.num_arenas; i++) {
+    if (card->devmem.arenas[i].mem != NULL) {
+      clReleaseMemObject(card->devmem.arenas[i].mem);
+    }
+  }
+  alveoDevMemTerminate(&card->devmem);
+  pthread_cond_destroy(&card->cache.ready);
+  pthread_mutex_destroy(&card->mem_lock);
+  if (card->emu != NULL) {
+    if (ENABLE_DEBUG_PRINT) {
+      alveoEmuPrintStats(card->emu);
+    }
+    alveoEmuTerminate(card->emu);
+    free(card->emu);
+    card->emu = NULL;
+    return;
+  }
+  if (card->kernel != NULL) {
+    clReleaseKernel(card->kernel);
+  }
+  if (card->program != NULL) {
+    clReleaseProgram(card->program);
+  }
+  if (card->commands != NULL) {
+    clReleaseCommandQueue(card->commands);
+  }
+  if (card->context != NULL) {
+    clReleaseContext(card->context);
+  }
 }
 
 fstatus_t platformTerminate(void *arg) {
-  debug_print("[FLETCHER SNAP] Terminating platform.        Arguments @ [host] 0x%016lX.\n", (uint64_t) arg);
-  snap_detach_action(snap_state.action_handle);
-  snap_card_free(snap_state.card_handle);
+  debug_print("[FLETCHER_ALVEO] Terminating platform.        Arguments @ [host] 0x%016lX.\n", (uint64_t) arg);
+  // The last batches are dispatched, so the dispatcher is stopped after the coalescer.
+  platformCoalesceStop();
+  if (ENABLE_DEBUG_PRINT) {
+    alveoDispatchPrintStats(&alveo_state.dispatcher);
+  }
+  alveoDispatchStop(&alveo_state.dispatcher);
+  // Queue threads still execute the remaining operations on the command queues of their contexts, so every queue
+  // thread is joined before any command queue is released.
+  for (uint32_t c = 0; c < alveo_state.num_cards; c++) {
+    for (uint32_t i = 0; i < alveo_state.cards[c].num_cus; i++) {
+      alveoAsyncTerminate(&alveo_state.cards[c].cus[i].async);
+    }
+  }
+  pthread_mutex_lock(&alveo_state.ctx_lock);
+  for (AlveoContext *ctx = alveo_state.contexts; ctx != NULL; ctx = ctx->next) {
+    context_release_queues(ctx);
+  }
+  context_release_queues(&fallback_ctx);
+  pthread_mutex_unlock(&alveo_state.ctx_lock);
+  for (uint32_t c = 0; c < alveo_state.num_cards; c++) {
+    card_terminate(&alveo_state.cards[c]);
+  }
+  alveo_state.num_cards = 0;
+  alveo_state.num_cus = 0;
+  // Contexts outlive the platform; their queues and compute units do not.
+  pthread_mutex_lock(&alveo_state.ctx_lock);
+  for (AlveoContext *ctx = alveo_state.contexts; ctx != NULL; ctx = ctx->next) {
+    ctx->cu = NULL;
+  }
+  pthread_mutex_unlock(&alveo_state.ctx_lock);
+  fallback_ctx.cu = NULL;
+  alveoProfilePrintStats(&alveo_state.profiler);
+  if ((alveo_state.config.trace_path != NULL)
+      && (alveoProfileWriteTrace(&alveo_state.profiler, alveo_state.config.trace_path) != FLETCHER_STATUS_OK)) {
+    printf("Error: Failed to write trace to %s.\n", alveo_state.config.trace_path);
+  }
+  alveoProfileTerminate(&alveo_state.profiler);
+  if (ENABLE_DEBUG_PRINT) {
+    alveoStagePrintStats(&alveo_state.stager);
+    alveoHostMemPrintStats(&alveo_state.hostmem);
+    alveoLazyPrintStats();
+  }
+  alveo_state.stager.cpus = NULL;
+  if (alveo_state.xclbin_data != NULL) {
+    munmap((void *) alveo_state.xclbin_data, alveo_state.xclbin_size);
+    alveo_state.xclbin_data = NULL;
+  }
+  memset(&alveo_state.topology, 0, sizeof(alveo_state.topology));
   return FLETCHER_STATUS_OK;
 }
 
+// The banks to place buffers for cu in: the ones it can reach. If FLETCHER_ALVEO_ARENAS left none of them with an
+// arena, any bank.
+static uint64_t cu_alloc_banks(const AlveoCU *cu) {
+  uint64_t banks = cu->banks & cu->card->devmem.banks;
+  return banks != 0 ? banks : ~0ull;
+}
+
 fstatus_t platformDeviceMalloc(da_t *device_address, int64_t size) {
-  da_t ptr;
-  posix_memalign((void**)(&ptr), FLETCHER_SNAP_DEVICE_ALIGNMENT, size);
-  debug_print("[FLETCHER_SNAP] Allocating device memory.    [device] 0x%016lX (%10lu bytes).\n",
-               ptr,
+  AlveoCU *cu = alveo_cu();
+  AlveoCard *card = cu->card;
+  pthread_mutex_lock(&card->mem_lock);
+  // Stripe buffers over the banks the compute unit can reach.
+  fstatus_t status = alveoDevMemAllocBanks(&card->devmem, device_address, size, cu_alloc_banks(cu));
+  pthread_mutex_unlock(&card->mem_lock);
+  debug_print("[FLETCHER_ALVEO] Allocating device memory.    [device] 0x%016lX (%10lu bytes).\n",
+               *device_address,
                size);
-  *device_address = ptr;
+  return status;
+}
+
+fstatus_t platformDeviceMallocBank(da_t *device_address, int64_t size, int bank) {
+  AlveoCard *card = alveo_card();
+  if ((bank < 0) || (bank >= 64) || !((card->devmem.banks >> bank) & 1)) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  pthread_mutex_lock(&card->mem_lock);
+  fstatus_t status = alveoDevMemAlloc(&card->devmem, device_address, size, bank);
+  pthread_mutex_unlock(&card->mem_lock);
+  debug_print("[FLETCHER_ALVEO] Allocating device memory.    [device] 0x%016lX (%10lu bytes) in bank %d.\n",
+               *device_address,
+               size,
+               bank);
+  return status;
+}
+
+uint32_t platformBankCount(void) {
+  return alveo_card()->devmem.num_arenas;
+}
+
+fstatus_t platformBankUsage(uint32_t index, AlveoBankUsage *usage) {
+  AlveoCard *card = alveo_card();
+  if (index >= card->devmem.num_arenas) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  memset(usage, 0, sizeof(*usage));
+  pthread_mutex_lock(&card->mem_lock);
+  const AlveoArena *a = &card->devmem.arenas[index];
+  usage->bank = a->bank;
+  usage->capacity = a->stats.capacity;
+  usage->in_use = a->stats.in_use;
+  usage->peak = a->stats.peak;
+  usage->bytes_written = __atomic_load_n(&a->stats.bytes_written, __ATOMIC_RELAXED);
+  usage->bytes_read = __atomic_load_n(&a->stats.bytes_read, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&card->mem_lock);
+  const AlveoBank *bank = alveoTopologyBank(&alveo_state.topology, usage->bank);
+  if ((bank != NULL) && (card->emu == NULL)) {
+    memcpy(usage->tag, bank->tag, sizeof(usage->tag));
+  } else {
+    snprintf(usage->tag, sizeof(usage->tag), "bank[%d]", usage->bank);
+  }
+  for (uint32_t i = 0; i < card->num_cus; i++) {
+    if ((card->cus[i].banks >> usage->bank) & 1) {
+      usage->cus |= 1u << i;
+    }
+  }
   return FLETCHER_STATUS_OK;
 }
 
 fstatus_t platformDeviceFree(da_t device_address) {
-  debug_print("[FLETCHER_SNAP] Freeing device memory.       [device] 0x%016lX. (NOT IMPLEMENTED)\n", device_address);
-  return FLETCHER_STATUS_OK;
+  AlveoCard *card = alveo_card();
+  debug_print("[FLETCHER_ALVEO] Freeing device memory.       [device] 0x%016lX.\n", device_address);
+  pthread_mutex_lock(&card->mem_lock);
+  // Cached buffers and registered host buffers stay resident; freeing them only drops a reference.
+  fstatus_t status = FLETCHER_STATUS_OK;
+  if (!alveoHostMapRelease(&card->hostmap, device_address)
+      && !alveoCacheRelease(&card->cache, &card->devmem, device_address)) {
+    status = alveoDevMemFree(&card->devmem, device_address);
+  }
+  pthread_mutex_unlock(&card->mem_lock);
+  return status;
 }
 
 fstatus_t platformPrepareHostBuffer(const uint8_t *host_source, da_t *device_destination, int64_t size, int *alloced) {
-  *device_destination = (da_t) host_source;
-  *alloced = 0;
-  debug_print("[FLETCHER_SNAP] Preparing buffer for device. [host] 0x%016lX --> 0x%016lX (%10lu bytes).\n",
+  AlveoCard *card = alveo_card();
+  if (card->emu != NULL) {
+    // The emulated card does not share the host address space, so the buffer has to be copied to on-board memory.
+    *alloced = 1;
+    return platformCacheHostBuffer(host_source, device_destination, size);
+  }
+  // Only whole pages can be registered. Misaligned buffers are copied to on-board memory instead.
+  if (((uintptr_t) host_source % ALVEO_DEVICE_ALIGNMENT) != 0) {
+    pthread_mutex_lock(&card->mem_lock);
+    card->hostmap.stats.fallbacks++;
+    pthread_mutex_unlock(&card->mem_lock);
+    *alloced = 1;
+    return platformCacheHostBuffer(host_source, device_destination, size);
+  }
+
+  pthread_mutex_lock(&card->mem_lock);
+  AlveoHostMapping *m = alveoHostMapLookup(&card->hostmap, host_source, size);
+  cl_mem mem = m != NULL ? m->mem : NULL;
+  uint64_t offset = m != NULL ? (uint64_t) (host_source - m->host) : 0;
+  da_t device = m != NULL ? m->device + offset : 0;
+  pthread_mutex_unlock(&card->mem_lock);
+
+  cl_int err;
+  if (mem != NULL) {
+    // The buffer may have changed since it was registered; bring the device side up to date, straight from its pages.
+    err = clEnqueueWriteBuffer(alveo_queue(card), mem, CL_TRUE, offset, (size_t) size, host_source, 0, NULL, NULL);
+    if (err != CL_SUCCESS) {
+      pthread_mutex_lock(&card->mem_lock);
+      alveoHostMapRelease(&card->hostmap, device);
+      pthread_mutex_unlock(&card->mem_lock);
+      return FLETCHER_STATUS_ERROR;
+    }
+  } else {
+    // Register the whole pages the buffer lies in. Migrating the buffer makes it resident, which gives it a device
+    // address, and moves its contents by DMA from the host pages without a staging copy.
+    uint64_t length = ((uint64_t) size + ALVEO_DEVICE_ALIGNMENT - 1) & ~((uint64_t) ALVEO_DEVICE_ALIGNMENT - 1);
+    mem = clCreateBuffer(card->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, length, (void *) host_source, &err);
+    if (err != CL_SUCCESS) {
+      return FLETCHER_STATUS_ERROR;
+    }
+    cl_command_queue queue = alveo_queue(card);
+    err = clEnqueueMigrateMemObjects(queue, 1, &mem, 0, 0, NULL, NULL);
+    err |= clFinish(queue);
+    err |= xclGetMemObjDeviceAddress(mem, card->device_id, sizeof(device), &device);
+    // Only memory of the host pool is known to stay mapped until the registration is forgotten; the pool is asked
+    // before taking the memory lock, because it calls back into the host map under its own lock.
+    int keep = alveoHostMemOwns(&alveo_state.hostmem, host_source, (int64_t) length);
+    pthread_mutex_lock(&card->mem_lock);
+    m = err == CL_SUCCESS ? alveoHostMapInsert(&card->hostmap, host_source, length, mem, device, keep) : NULL;
+    pthread_mutex_unlock(&card->mem_lock);
+    if (m == NULL) {
+      clReleaseMemObject(mem);
+      return FLETCHER_STATUS_ERROR;
+    }
+  }
+  // The registration holds a reference until the device address is freed.
+  *device_destination = device;
+  *alloced = 1;
+  debug_print("[FLETCHER_ALVEO] Preparing buffer for device. [host] 0x%016lX --> 0x%016lX (%10lu bytes).\n",
               (unsigned long) host_source,
               (unsigned long) *device_destination,
               size);
-  buffer_ptr += size;
   return FLETCHER_STATUS_OK;
 }
 
 fstatus_t platformCacheHostBuffer(const uint8_t *host_source, da_t *device_destination, int64_t size) {
-  *device_destination = buffer_ptr;
-  debug_print(
-      "[FLETCHER_SNAP] Caching buffer on device.    [host] 0x%016lX --> 0x%016lX (%10lu bytes). (NOT IMPLEMENTED)\n",
-      (unsigned long) host_source,
-      (unsigned long) *device_destination,
-      size);
-  buffer_ptr += size;
+  AlveoCU *cu = alveo_cu();
+  AlveoCard *card = cu->card;
+  uint64_t banks = cu_alloc_banks(cu);
+  uint64_t fingerprint = 0;
+  if (card->cache.budget > 0) {
+    fingerprint = alveoFingerprint(alveo_state.stager.isa, host_source, size);
+    pthread_mutex_lock(&card->mem_lock);
+    AlveoCacheEntry *entry = alveoCacheLookup(&card->cache, &card->devmem, host_source, size, fingerprint, banks);
+    // Another thread may still be uploading it. If that fails, this is a miss.
+    if ((entry != NULL) && !alveoCacheWaitReady(&card->cache, &card->devmem, entry, &card->mem_lock)) {
+      entry = NULL;
+    }
+    pthread_mutex_unlock(&card->mem_lock);
+    if (entry != NULL) {
+      *device_destination = entry->device;
+      debug_print("[FLETCHER_ALVEO] Cache hit on device.        [host] 0x%016lX --> 0x%016lX (%10lu bytes).\n",
+                  (unsigned long) host_source,
+                  (unsigned long) *device_destination,
+                  size);
+      return FLETCHER_STATUS_OK;
+    }
+  }
+  pthread_mutex_lock(&card->mem_lock);
+  AlveoCacheEntry *entry = alveoCacheInsert(&card->cache, &card->devmem, host_source, size, fingerprint, banks);
+  pthread_mutex_unlock(&card->mem_lock);
+  if (entry != NULL) {
+    *device_destination = entry->device;
+  } else {
+    // Not cacheable; fall back to a plain allocation that platformDeviceFree releases as usual.
+    fstatus_t status = platformDeviceMalloc(device_destination, size);
+    if (status != FLETCHER_STATUS_OK) {
+      return status;
+    }
+  }
+  debug_print("[FLETCHER_ALVEO] Caching buffer on device.    [host] 0x%016lX --> 0x%016lX (%10lu bytes).\n",
+              (unsigned long) host_source,
+              (unsigned long) *device_destination,
+              size);
+  fstatus_t status = platformCopyHostToDevice(host_source, *device_destination, size);
+  if (entry != NULL) {
+    pthread_mutex_lock(&card->mem_lock);
+    alveoCacheReady(&card->cache, &card->devmem, entry, status == FLETCHER_STATUS_OK);
+    pthread_mutex_unlock(&card->mem_lock);
+  } else if (status != FLETCHER_STATUS_OK) {
+    platformDeviceFree(*device_destination);
+  }
+  return status;
+}
+
+// The host memory pool may be used before platformInit, so it reads its own configuration on first use.
+static void hostmem_init(void) {
+  const char *huge_pages = getenv("FLETCHER_ALVEO_HUGE_PAGES");
+  alveo_state.hostmem.huge_pages = (huge_pages != NULL) && (strcmp(huge_pages, "0") != 0);
+}
+
+fstatus_t platformHostAllocate(int64_t size, uint8_t **out) {
+  pthread_once(&hostmem_once, hostmem_init);
+  if (alveoHostMemAllocate(&alveo_state.hostmem, size, out) != 0) {
+    return FLETCHER_STATUS_ERROR;
+  }
   return FLETCHER_STATUS_OK;
 }
+
+fstatus_t platformHostReallocate(int64_t old_size, int64_t new_size, uint8_t **ptr) {
+  pthread_once(&hostmem_once, hostmem_init);
+  if (alveoHostMemReallocate(&alveo_state.hostmem, old_size, new_size, ptr) != 0) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+void platformHostFree(uint8_t *buffer, int64_t size) {
+  alveoHostMemFree(&alveo_state.hostmem, buffer, size);
+}
+
+// Memory may only be unmapped once no card has it registered anymore.
+static int forget_host_memory(void *arg, void *base, size_t size) {
+  (void) arg;
+  int forgotten = 1;
+  for (uint32_t c = 0; c < alveo_state.num_cards; c++) {
+    AlveoCard *card = &alveo_state.cards[c];
+    pthread_mutex_lock(&card->mem_lock);
+    forgotten &= alveoHostMapForget(&card->hostmap, (const uint8_t *) base, size);
+    pthread_mutex_unlock(&card->mem_lock);
+  }
+  return forgotten;
+}
+
+void platformHostReleaseUnused(void) {
+  alveoHostMemTrim(&alveo_state.hostmem, forget_host_memory, NULL);
+}
+
+int64_t platformHostBytesAllocated(void) {
+  pthread_mutex_lock(&alveo_state.hostmem.lock);
+  int64_t bytes = alveo_state.hostmem.bytes_allocated;
+  pthread_mutex_unlock(&alveo_state.hostmem.lock);
+  return bytes;
+}
+
+int64_t platformHostMaxMemory(void) {
+  pthread_mutex_lock(&alveo_state.hostmem.lock);
+  int64_t bytes = alveo_state.hostmem.max_memory;
+  pthread_mutex_unlock(&alveo_state.hostmem.lock);
+  return bytes;
+}
@@ -1,40 +1,173 @@
+#pragma once
 
 #include <unistd.h>
+#include <pthread.h>
+#include <uuid/uuid.h>
 
 #include <CL/opencl.h>
 #include <CL/cl_ext.h>
+#include <CL/cl_ext_xilinx.h>
 #include "xclhal2.h"
 
 #include "fletcher/fletcher.h"
 
+#include "alveo_emu.h"
+#include "alveo_devmem.h"
+#include "alveo_cache.h"
+#include "alveo_hostmap.h"
+#include "alveo_hostmem.h"
+#include "alveo_gather.h"
+#include "alveo_stage.h"
+#include "alveo_topology.h"
+#include "alveo_numa.h"
+#include "alveo_ipc.h"
+#include "alveo_lazy.h"
+#include "alveo_stream.h"
+#include "alveo_dispatch.h"
+#include "alveo_coalesce.h"
+#include "alveo_async.h"
+#include "alveo_profile.h"
+
 
 #define debug_print(...) do { if (ENABLE_DEBUG_PRINT) fprintf(stderr, __VA_ARGS__); } while (0)
 
 #define FLETCHER_PLATFORM_NAME "alveo"
 #define ALVEO_DEVICE_NAME "xilinx_alveo_U250"  // Look at this and correct it.
+#define ALVEO_DEVICE_ALIGNMENT 4096
+#define ALVEO_MAX_CARDS 8
+#define ALVEO_MAX_CUS 16
+#define ALVEO_STAGE_MIN_SIZE (64 * 1024)  // Misaligned sources from this size on are staged before they are copied.
 
-typedef struct {
+// Control and status register bits of the Fletcher kernel.
+#define ALVEO_CONTROL_START 0x1u
+#define ALVEO_STATUS_DONE 0x4u
 
+typedef struct {
+    int emulation;                  // Run on the in-process emulated card (FLETCHER_ALVEO_EMULATION=1).
+    AlveoEmuCostModel emu_model;
+    uint32_t num_arenas;            // Most banks to carve device memory arenas from, 0 for all connected banks.
+    uint64_t arena_size;            // Size of each arena in bytes, at most the size of its bank.
+    uint64_t cache_budget;          // Bytes of on-board memory platformCacheHostBuffer may keep resident.
+    uint32_t h2k_args[ALVEO_MAX_STREAMS];  // Kernel arguments that are host-to-kernel streams.
+    uint32_t num_h2k_args;
+    uint32_t k2h_args[ALVEO_MAX_STREAMS];  // Kernel arguments that are kernel-to-host streams.
+    uint32_t num_k2h_args;
+    int64_t chunk_size;             // Stream transfers are split into chunks of this many bytes.
+    uint32_t queue_depth;           // Number of chunks kept in flight per direction.
+    uint64_t wait_spin_ns;          // platformWaitStatus spins this long before it starts backing off.
+    uint64_t wait_max_backoff_ns;   // Backoff limit, after which it polls at this period.
+    uint32_t cards[ALVEO_MAX_CARDS];  // Indices of the matching devices to open, all of them if num_cards is 0.
+    uint32_t num_cards;
+    uint32_t num_emu_cards;         // Number of emulated cards.
+    uint32_t host_mappings;         // Unreferenced host buffer registrations kept for reuse.
+    AlveoStageIsa stage_isa;        // Widest instruction set the staging kernels may use.
+    uint32_t stage_threads;         // Threads a large staging copy is split over.
+    int64_t ipc_window;             // Bytes of an Arrow IPC file platformStreamIpcFile stages at a time.
+    uint32_t async_depth;           // Slots in the asynchronous operation ring of every compute unit.
+    int64_t coalesce_rows;          // platformCoalesceSubmit runs a batch as soon as it holds this many rows.
+    uint64_t coalesce_delay_us;     // Or when its first job waited this long.
+    int numa;                       // Place host memory and threads on the NUMA node of the cards (default 1).
+    int numa_node;                  // Node to use for all cards instead of the one sysfs reports, -1 to detect.
+    int profile;                    // Record every copy, kernel run and register write (FLETCHER_ALVEO_PROFILE=1).
+    uint64_t profile_records;       // Number of records kept for the trace.
+    const char *trace_path;         // Write a Chrome trace here at platformTerminate, if not NULL.
 } AlveoConfig;
 
 typedef struct {
+    uint64_t calls;
+    uint64_t timeouts;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t spin_done;             // Calls that completed while spinning.
+    uint64_t backoff_done;          // Calls that completed during exponential backoff.
+    uint64_t sleep_done;            // Calls that completed while polling at the backoff limit.
+} AlveoWaitStats;
+
+struct AlveoCard;
+
+// A compute unit: one instance of the Fletcher kernel. Every compute unit has its own registers and streams.
+typedef struct {
+    uint32_t index;                 // Index of the compute unit on its card.
+    struct AlveoCard *card;
+    cl_kernel kernel;               // Kernel handle bound to this compute unit only.
+    cl_uint cu_index;               // Index of the compute unit whose registers platformWriteMMIO accesses.
+    int context_open;               // The context on the compute unit stays open from platformInit until terminate.
+    AlveoStreamPool streams;
+    AlveoWaitStats wait_stats;
+    pthread_mutex_t lock;           // Held by the job running on this compute unit, see platformAcquireCard.
+    uint32_t queued;                // Jobs that acquired this compute unit and did not release it yet.
+    uint64_t jobs;                  // Jobs run on this compute unit.
+    AlveoAsyncQueue async;          // Asynchronous operations on this compute unit, executed in order.
+    uint64_t run_queued_ns;         // When the running kernel was asked to start, 0 if it is not running.
+    uint64_t run_started_ns;        // When its start bit was written.
+    pthread_mutex_t stream_lock;    // Serializes the threads that use the streams of this compute unit.
+    uint64_t banks;                 // Memory banks the compute unit is connected to, see alveo_topology.h.
+} AlveoCU;
+
+// A card that platformInit opened. Every card has its own context, queue, program, on-board memory and cache, shared by
+// its compute units.
+typedef struct AlveoCard {
+    uint32_t index;
     xclDeviceHandle device_handle;
+    cl_device_id device_id;
+    cl_context context;
+    cl_command_queue commands;
+    cl_program program;
+    cl_kernel kernel;               // Kernel handle that may run on any compute unit, used to discover them.
+    int xclbin_reused;              // The card already held the xclbin and was not reprogrammed.
+    AlveoEmu *emu;                  // Non-NULL when this is an emulated card.
+    AlveoCU cus[ALVEO_MAX_CUS];
+    uint32_t num_cus;
+    pthread_mutex_t mem_lock;       // Protects devmem, cache and hostmap, which all compute units of the card use.
+    AlveoDevMem devmem;
+    AlveoCache cache;
+    AlveoHostMap hostmap;           // Host buffers registered by platformPrepareHostBuffer.
+    int numa_node;                  // NUMA node of the PCIe root the card is attached to, -1 if unknown.
+    AlveoCpuSet cpus;               // Processors of that node, which the threads driving the card run on.
+    int num_cpus;                   // 0 if the threads are not pinned.
+} AlveoCard;
+
+/**
+ * A context: what one thread needs to drive the cards on its own. It holds the selected compute unit, through which the
+ * card's streams, registers and on-board memory allocator are reached, and an in-order command queue per card, so that
+ * threads enqueue copies without contending on one queue or waiting behind each other's commands.
+ *
+ * Every thread gets a context of its own implicitly, which is freed when the thread exits. platformContextCreate makes
+ * one that can be bound to, and handed over between, threads explicitly.
+ */
+typedef struct AlveoContext {
+    AlveoCU *cu;                    // Selected compute unit, NULL for the first one of the first card.
+    cl_command_queue queues[ALVEO_MAX_CARDS];  // Created on first use.
+    int implicit;                   // Belongs to a thread that did not bind a context, freed when that thread exits.
+    struct AlveoContext *next;
+} AlveoContext;
+
+typedef struct {
     char *xclbin;
+    const unsigned char *xclbin_data;   // The xclbin, mapped read-only.
+    size_t xclbin_size;
+    uuid_t xclbin_uuid;
+    AlveoTopology topology;         // Memory banks of the xclbin and their connections, empty if it has none.
     char *target_device_name;
-    cl_device_id device_id;
     cl_int err;
     cl_platform_id platform_id;
     char cl_platform_vendor[1001];
-    cl_context context;
-    cl_command_queue commands;
-    cl_program program;
-    cl_kernel kernel;
-    cl_stream h2k_stream;
-    cl_stream k2h_stream;
-    cl_int *stream_ret;
+    AlveoConfig config;
+    AlveoCard cards[ALVEO_MAX_CARDS];
+    uint32_t num_cards;
+    AlveoCU *cus[ALVEO_MAX_CARDS * ALVEO_MAX_CUS];  // The compute units of all cards, in card order.
+    uint32_t num_cus;
+    uint32_t next_cu;               // Compute unit the scheduler considers first, to break ties round-robin.
+    AlveoDispatcher dispatcher;     // One worker per compute unit.
+    AlveoCoalescer coalescer;       // Gathers the jobs of platformCoalesceSubmit into batches for the dispatcher.
+    AlveoProfiler profiler;
+    AlveoStager stager;             // Repacks misaligned sources and sliced bitmaps into pinned staging memory.
+    AlveoHostMem hostmem;           // Pinned host memory, usable before platformInit and after platformTerminate.
+    pthread_mutex_t ctx_lock;       // Protects the list of contexts.
+    AlveoContext *contexts;         // All contexts, so that platformTerminate can release their queues.
 } PlatformState;
 
-PlatformState alveo_state ={NULL, ALVEO_DEVICE_NAME, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+extern PlatformState alveo_state;
 
 /// @brief Store the platform name in a buffer of size /p size pointed to by /p name.
 fstatus_t platformGetName(char *name, size_t size);
@@ -43,21 +176,266 @@ fstatus_t platformGetName(char *name, size_t size);
 /// arguments.
 fstatus_t platformInit(void *arg);
 
+/// @brief Return the number of cards opened by platformInit.
+uint32_t platformCardCount(void);
+
+/**
+ * @brief Make \p card the card that all further platform calls of the calling thread operate on.
+ *
+ * Device addresses are only valid on the card they were allocated on. Threads that never select a card use card 0.
+ */
+fstatus_t platformSelectCard(uint32_t card);
+
+/**
+ * @brief Create a context, starting out on the compute unit the calling thread works on.
+ *
+ * Platform calls operate on the context bound to the calling thread. A context may be bound to one thread at a time.
+ */
+fstatus_t platformContextCreate(AlveoContext **ctx);
+
+/// @brief Bind \p ctx to the calling thread, or its own implicit context if \p ctx is NULL.
+fstatus_t platformContextBind(AlveoContext *ctx);
+
+/// @brief Destroy \p ctx, which must not be bound to any other thread anymore.
+void platformContextDestroy(AlveoContext *ctx);
+
+/// @brief Return the number of compute units of the selected card.
+uint32_t platformComputeUnitCount(void);
+
+/// @brief Make compute unit \p cu of the selected card the one whose registers and streams the calling thread uses.
+fstatus_t platformSelectComputeUnit(uint32_t cu);
+
+/**
+ * @brief Schedule a job, e.g. an independent record batch, on the compute unit with the fewest jobs queued.
+ *
+ * All compute units of all cards are considered. Blocks until the job before it on that compute unit released it, then
+ * selects its card and compute unit for the calling thread. Running one thread per job spreads the jobs over all
+ * compute units.
+ *
+ * @param card                  The index of the card is stored here.
+ * @return                      FLETCHER_STATUS_OK if successful, FLETCHER_STATUS_ERROR otherwise.
+ */
+fstatus_t platformAcquireCard(uint32_t *card);
+
+/// @brief End the job of the calling thread on \p card, so that the next job queued on its compute unit can start.
+fstatus_t platformReleaseCard(uint32_t card);
+
+/**
+ * @brief Queue \p fn(\p arg) to run on one of the compute units of any card.
+ *
+ * Every compute unit has a worker thread with its own job queue. Jobs go to the shortest queue, and idle workers steal
+ * jobs queued behind a slow one. The job runs with its compute unit selected, so platform calls made by \p fn address
+ * that compute unit.
+ */
+fstatus_t platformDispatch(AlveoJobFn fn, void *arg);
+
+/// @brief Wait until all dispatched jobs completed. Returns FLETCHER_STATUS_ERROR if any of them failed.
+fstatus_t platformDispatchWait(void);
+
+/**
+ * @brief Start gathering small jobs into batches that run as one kernel invocation each.
+ *
+ * \p layout tells which registers take the index range and the buffer addresses, and how many bytes per row every
+ * input and output buffer has. A batch is dispatched when it holds FLETCHER_ALVEO_COALESCE_ROWS rows or its first job
+ * waited FLETCHER_ALVEO_COALESCE_US microseconds. Its inputs are packed back to back into on-board memory, the kernel
+ * runs once over all rows, and the outputs are copied back and split over the jobs.
+ */
+fstatus_t platformCoalesceStart(const AlveoCoalesceLayout *layout);
+
+/**
+ * @brief Add a job of \p num_rows rows to the batch being gathered, see platformCoalesceStart.
+ *
+ * @param inputs                Host buffers of the job, one per input of the layout. They must stay valid until the job
+ *                              completed.
+ * @param outputs               Host buffers its results are copied to, one per output of the layout.
+ * @param future                A future completed when the results are in place is stored here; release it with
+ *                              platformFutureRelease. May be NULL.
+ */
+fstatus_t platformCoalesceSubmit(int64_t num_rows, const uint8_t *const *inputs, uint8_t *const *outputs,
+                                 AlveoFuture **future);
+
+/// @brief Dispatch the batch being gathered right away, e.g. at the end of a stream of jobs.
+fstatus_t platformCoalesceFlush(void);
+
+/// @brief Dispatch the remaining jobs and stop gathering. Called by platformTerminate.
+void platformCoalesceStop(void);
+
 /// @brief Write \p value to MMIO register \p offset
 fstatus_t platformWriteMMIO(uint64_t offset, uint32_t value);
 
+/// @brief Write \p n values \p values[i] to MMIO registers \p offsets[i], in order.
+fstatus_t platformWriteMMIOBatch(const uint64_t *offsets, const uint32_t *values, size_t n);
+
 /// @brief Read MMIO register \p offset into \p value
 fstatus_t platformReadMMIO(uint64_t offset, uint32_t *value);
 
+/**
+ * @brief Wait until all bits in \p mask are set in the status register.
+ *
+ * Spins for a short while first, which gives microsecond latency for short kernels, then backs off exponentially, and
+ * finally sleeps for the backoff limit in between status reads, so that long kernels do not burn a core.
+ *
+ * @param mask                  Status bits to wait for, e.g. the done bit.
+ * @param timeout_us            Give up after this many microseconds, 0 waits indefinitely.
+ * @param waited_ns             If not NULL, the observed wait time in nanoseconds is stored here.
+ * @return                      FLETCHER_STATUS_OK if the bits were set, FLETCHER_STATUS_ERROR on timeout or error.
+ */
+fstatus_t platformWaitStatus(uint32_t mask, uint64_t timeout_us, uint64_t *waited_ns);
+
 /// @brief Copy \p size bytes from host address \p host_source to device address \p device_destination.
+///
+/// Large sources that are not page aligned, such as the values of sliced Arrow arrays, are first copied to pinned
+/// staging memory with the staging kernels, so that the driver does not bounce them through a buffer of its own.
 fstatus_t platformCopyHostToDevice(const uint8_t *host_source, da_t device_destination, int64_t size);
 
 /// @brief Copy \p size bytes from device address \p device_source to host address \p host_destination.
 fstatus_t platformCopyDeviceToHost(const da_t device_source, uint8_t *host_destination, int64_t size);
 
+/**
+ * @brief Copy the result a kernel produced at \p device_source, at most \p capacity bytes, to \p host_destination.
+ *
+ * Only the bytes the kernel produced are moved, and their number is stored in \p size. For a kernel-to-host stream,
+ * those are the bytes the kernel sent before it ended the transaction. For memory, the kernel reports the number of
+ * elements of \p element_size bytes it wrote in the 64-bit result register at MMIO offset \p count_reg (low word) and
+ * \p count_reg + 1 (high word), which is read first. Filter and aggregation kernels typically fill a small part of a
+ * result buffer that is sized for the worst case.
+ * @return                      FLETCHER_STATUS_OK if successful, FLETCHER_STATUS_ERROR if the copy failed or the count
+ *                              exceeds \p capacity.
+ */
+fstatus_t platformCopyResultToHost(da_t device_source, uint8_t *host_destination, int64_t capacity, uint64_t count_reg,
+                                   int64_t element_size, int64_t *size);
+
+/**
+ * @brief Map \p size bytes of on-board memory at \p device_source into host memory, fetching them on first touch.
+ *
+ * Nothing is copied up front. The first access to every block of ALVEO_LAZY_BLOCK bytes copies that block from the
+ * card, while the thread that made the access waits. Bytes from \p produced on read as zeros without any transfer;
+ * pass -1 to fetch all of them. The mapping may be written to, but writes stay on the host. Remove it with
+ * platformUnmapResult before the device memory is freed. Fails if the kernel does not offer userfaultfd; copy the
+ * result with platformCopyResultToHost instead.
+ */
+fstatus_t platformMapResult(da_t device_source, int64_t size, int64_t produced, const uint8_t **host);
+
+/// @brief Remove a mapping made by platformMapResult. Fails if one of its blocks could not be fetched.
+fstatus_t platformUnmapResult(const uint8_t *host);
+
+/**
+ * @brief Copy \p length bits of a validity bitmap, from bit \p bit_offset of \p bitmap, to \p device_destination.
+ *
+ * Bitmaps of sliced Arrow arrays start at an arbitrary bit. The bitmap is shifted to start at bit 0 in pinned staging
+ * memory first, with AVX-512 or AVX2 if available, split over several threads if it is large. (\p length + 7) / 8 bytes
+ * are copied; the unused bits of the last byte are cleared.
+ */
+fstatus_t platformCopyBitmapToDevice(const uint8_t *bitmap, int64_t bit_offset, int64_t length,
+                                     da_t device_destination);
+
+/**
+ * @brief Copy the \p n buffers described by \p descs from the host to the device, e.g. all buffers of a record batch.
+ *
+ * Buffers that are adjacent on the device are merged and written with one command, straight from the host if they are
+ * adjacent there as well, or else packed into pinned staging memory if they are small. All writes are in flight at once
+ * and the call waits only once. All buffers for one stream are sent as one transfer, in the order of \p descs, so the
+ * kernel receives them back to back, followed by a single end-of-transaction.
+ */
+fstatus_t platformCopyHostToDeviceV(const AlveoCopyDesc *descs, size_t n);
+
+/**
+ * @brief Copy \p h2d_size bytes from \p host_source to \p device_destination, while copying \p d2h_size bytes from
+ * \p device_source to \p host_destination.
+ *
+ * Both copies are pipelined and overlap, so that e.g. the upload of the next record batch hides behind the download of
+ * the results of the previous one. Either size may be zero.
+ */
+fstatus_t platformCopyDuplex(const uint8_t *host_source, da_t device_destination, int64_t h2d_size,
+                             da_t device_source, uint8_t *host_destination, int64_t d2h_size);
+
+/// @brief Called by platformStreamIpcFile before record batch \p batch of \p num_rows rows and \p size bytes is sent.
+typedef fstatus_t (*AlveoIpcBatchFn)(void *arg, uint32_t batch, int64_t num_rows, int64_t size);
+
+/**
+ * @brief Send the record batches of the Arrow IPC file or stream at \p path, one after the other, to host-to-kernel
+ * stream \p stream of the selected compute unit.
+ *
+ * The file is memory-mapped and never read as a whole, so it may be much larger than host and on-board memory. The
+ * body of every record batch is sent as one transaction: all its buffers back to back, as laid out in the file,
+ * followed by end-of-transaction. Batches without a body are not sent. Bodies are staged in pinned memory in windows
+ * of FLETCHER_ALVEO_IPC_WINDOW bytes (default 32 MiB); the next window is staged by another thread while the current
+ * one streams, and the one after that is read ahead from disk. Windows that were sent are dropped from memory again.
+ *
+ * @param before                If not NULL, called for every batch before it is sent, e.g. to write its number of rows
+ *                              to a register. Sending stops if it does not return FLETCHER_STATUS_OK.
+ * @return                      FLETCHER_STATUS_OK if all batches were sent, FLETCHER_STATUS_ERROR otherwise.
+ */
+fstatus_t platformStreamIpcFile(const char *path, da_t stream, AlveoIpcBatchFn before, void *arg);
+
+/**
+ * @brief Queue a copy of \p size bytes from \p host_source to \p device_destination on the selected compute unit.
+ *
+ * Returns as soon as the copy is queued. Asynchronous operations on one compute unit execute in order, on a thread of
+ * that compute unit. Queueing takes no lock; it only waits if FLETCHER_ALVEO_ASYNC_DEPTH operations are outstanding on
+ * the compute unit already. The host buffer must stay valid until the copy completed. Do not make synchronous
+ * transfers to the same compute unit while asynchronous ones are outstanding.
+ *
+ * @param after                 If not NULL, the copy starts once this operation completed. If that one failed, the
+ *                              copy fails as well.
+ * @param future                If not NULL, a handle to wait on is stored here. Release it with platformFutureRelease.
+ *                              Without one, nothing is allocated; wait on a later operation of the same compute unit
+ *                              instead.
+ * @return                      FLETCHER_STATUS_OK if the copy was queued, FLETCHER_STATUS_ERROR otherwise.
+ */
+fstatus_t platformCopyHostToDeviceAsync(const uint8_t *host_source, da_t device_destination, int64_t size,
+                                        AlveoFuture *after, AlveoFuture **future);
+
+/// @brief Queue a copy of \p size bytes from \p device_source to \p host_destination, see
+/// platformCopyHostToDeviceAsync.
+fstatus_t platformCopyDeviceToHostAsync(da_t device_source, uint8_t *host_destination, int64_t size,
+                                        AlveoFuture *after, AlveoFuture **future);
+
+/// @brief Queue a kernel run on the selected compute unit: start it, and wait up to \p timeout_us (0 waits
+/// indefinitely) until it is done. See platformCopyHostToDeviceAsync for \p after and \p future.
+fstatus_t platformRunAsync(uint64_t timeout_us, AlveoFuture *after, AlveoFuture **future);
+
+/// @brief Wait until the operation of \p future completed, and return its status.
+fstatus_t platformFutureWait(AlveoFuture *future);
+
+/// @brief Return 1 and store the status in \p status if the operation of \p future completed, 0 otherwise.
+int platformFuturePoll(AlveoFuture *future, fstatus_t *status);
+
+/// @brief Release a handle returned by one of the asynchronous operations.
+void platformFutureRelease(AlveoFuture *future);
+
 /// @brief Allocate \p size bytes on the device.
 fstatus_t platformDeviceMalloc(da_t *device_address, int64_t size);
 
+/**
+ * @brief Allocate \p size bytes on the device, in memory bank \p bank.
+ *
+ * Banks are numbered as in the memory topology of the xclbin, e.g. as the --sp options of the linker map kernel
+ * arguments to them. platformDeviceMalloc spreads buffers over the banks the selected compute unit is connected to;
+ * this pins a buffer to one bank instead, e.g. to keep the buffers that are read at the same time in different banks.
+ * @return                      FLETCHER_STATUS_OK if successful, FLETCHER_STATUS_DEVICE_OUT_OF_MEMORY if the bank is
+ *                              full, FLETCHER_STATUS_ERROR if the card has no memory in \p bank.
+ */
+fstatus_t platformDeviceMallocBank(da_t *device_address, int64_t size, int bank);
+
+/// @brief Utilization of one memory bank, see platformBankUsage.
+typedef struct {
+    int bank;                       // Index in the memory topology.
+    char tag[17];                   // E.g. "DDR[1]" or "HBM[12]".
+    uint64_t capacity;              // Bytes the runtime manages in the bank.
+    uint64_t in_use;
+    uint64_t peak;
+    uint64_t bytes_written;         // Bytes copied from the host to the bank.
+    uint64_t bytes_read;            // Bytes copied from the bank to the host.
+    uint32_t cus;                   // Compute units of the card that are connected to the bank, one bit each.
+} AlveoBankUsage;
+
+/// @brief Return the number of memory banks the selected card allocates device memory in.
+uint32_t platformBankCount(void);
+
+/// @brief Store the utilization of the \p index-th bank of the selected card in \p usage.
+fstatus_t platformBankUsage(uint32_t index, AlveoBankUsage *usage);
+
 /// @brief Free the memory allocated at \p device_address.
 fstatus_t platformDeviceFree(da_t device_address);
 
@@ -71,6 +449,11 @@ fstatus_t platformDeviceFree(da_t device_address);
  * (for example, that must make a copy to on-board memory), this means this function must allocate a memory region to
  * copy the bytes to on the device. The address of this region will be the device destination address.
  *
+ * On Alveo cards, page-aligned buffers are registered with the driver as host-pointer buffers, so the card moves them
+ * by DMA straight from their pages. Registrations are kept by address range and reused while they are referenced.
+ * Misaligned buffers are copied to on-board memory instead. In both cases the device address holds a reference, so
+ * \p alloced is set and the address must be freed with platformDeviceFree.
+ *
  * This function can be used mainly for streamable applications. When data reuse is expected, on-board memory is often
  * faster. For this purpose, platformCacheHostBuffer can be used.
  *
@@ -97,6 +480,33 @@ fstatus_t platformPrepareHostBuffer(const uint8_t *host_source, da_t *device_des
  */
 fstatus_t platformCacheHostBuffer(const uint8_t *host_source, da_t *device_destination, int64_t size);
 
+/**
+ * @brief Allocate \p size bytes of pinned host memory that the card can DMA from directly.
+ *
+ * The memory is at least 4 KiB aligned, 2 MiB aligned from 2 MiB on, and comes from a pool of locked, huge-page backed
+ * chunks (FLETCHER_ALVEO_HUGE_PAGES=1 tries explicit huge pages first). platformCopyHostToDevice from such memory needs
+ * no bounce buffer, and platformPrepareHostBuffer always registers it without a copy.
+ *
+ * The signatures follow arrow::MemoryPool, so that a pool for Arrow builders can forward to these functions; see
+ * alveo_arrow_pool.h.
+ */
+fstatus_t platformHostAllocate(int64_t size, uint8_t **out);
+
+/// @brief Resize host memory allocated by platformHostAllocate, moving it to \p *ptr if needed.
+fstatus_t platformHostReallocate(int64_t old_size, int64_t new_size, uint8_t **ptr);
+
+/// @brief Return \p size bytes at \p buffer, allocated by platformHostAllocate, to the pool.
+void platformHostFree(uint8_t *buffer, int64_t size);
+
+/// @brief Return unused pooled host memory of 2 MiB and up to the system, dropping its registrations with the cards.
+void platformHostReleaseUnused(void);
+
+/// @brief Return the number of bytes currently allocated by platformHostAllocate.
+int64_t platformHostBytesAllocated(void);
+
+/// @brief Return the peak number of bytes allocated by platformHostAllocate.
+int64_t platformHostMaxMemory(void);
+
 /**
  * @brief Terminate the platform.
  *
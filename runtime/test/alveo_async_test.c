@@ -0,0 +1,182 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Tests of the asynchronous operation queue. Operations only log their size, so they run without a card.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alveo_async.h"
+
+#define SUBMITTERS 4
+#define PER_SUBMITTER 20000
+
+// What the operations of a queue log. Only the thread of the queue writes it.
+typedef struct {
+  int64_t log[SUBMITTERS * PER_SUBMITTER];
+  uint32_t count;
+  AlveoFuture *gate;            ///< The first operation waits for it, if not NULL.
+  int blocked;                  ///< Set once the first operation waits for the gate.
+} Log;
+
+static fstatus_t run_log(void *ctx, const AlveoAsyncOp *op) {
+  Log *l = (Log *) ctx;
+  if ((l->count == 0) && (l->gate != NULL)) {
+    __atomic_store_n(&l->blocked, 1, __ATOMIC_RELEASE);
+    alveoFutureWait(l->gate);
+  }
+  l->log[l->count++] = op->size;
+  return op->size < 0 ? FLETCHER_STATUS_ERROR : FLETCHER_STATUS_OK;
+}
+
+static fstatus_t submit(AlveoAsyncQueue *q, int64_t size, AlveoFuture *after, AlveoFuture *future) {
+  AlveoAsyncOp op;
+  memset(&op, 0, sizeof(op));
+  op.run = run_log;
+  op.size = size;
+  op.after = after;
+  op.future = future;
+  return alveoAsyncSubmit(q, &op);
+}
+
+static Log log_;
+
+// Operations run in the order they were queued, many times around a small ring.
+static void test_ring_wraps_around(void) {
+  AlveoAsyncQueue q;
+  memset(&log_, 0, sizeof(log_));
+  alveoAsyncInit(&q, &log_, 3);
+  assert(q.depth == 4);
+  for (int64_t i = 0; i < 1000; i++) {
+    assert(submit(&q, i, NULL, NULL) == FLETCHER_STATUS_OK);
+  }
+  AlveoFuture *last = alveoFutureCreate();
+  assert(submit(&q, 1000, NULL, last) == FLETCHER_STATUS_OK);
+  assert(alveoFutureWait(last) == FLETCHER_STATUS_OK);
+  alveoFutureRelease(last);
+  assert(q.tail == 1001);
+  assert(log_.count == 1001);
+  for (int64_t i = 0; i <= 1000; i++) {
+    assert(log_.log[i] == i);
+  }
+  alveoAsyncTerminate(&q);
+  assert(q.executed == 1001);
+  assert(q.failed == 0);
+}
+
+typedef struct {
+  AlveoAsyncQueue *q;
+  int64_t first;
+  int64_t count;
+  int done;
+} Submitter;
+
+static void *submitter_main(void *arg) {
+  Submitter *s = (Submitter *) arg;
+  for (int64_t i = 0; i < s->count; i++) {
+    assert(submit(s->q, s->first + i, NULL, NULL) == FLETCHER_STATUS_OK);
+  }
+  __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// A submission to a full ring waits until the thread of the queue frees a slot, and is counted.
+static void test_full_ring_waits(void) {
+  AlveoAsyncQueue q;
+  memset(&log_, 0, sizeof(log_));
+  log_.gate = alveoFutureCreate();
+  alveoAsyncInit(&q, &log_, 2);
+  assert(submit(&q, 0, NULL, NULL) == FLETCHER_STATUS_OK);
+  while (!__atomic_load_n(&log_.blocked, __ATOMIC_ACQUIRE)) {
+    usleep(100);
+  }
+  // The thread took the first operation out, so two more fill the ring, and the third has to wait.
+  Submitter s = {&q, 1, 3, 0};
+  pthread_t thread;
+  assert(pthread_create(&thread, NULL, submitter_main, &s) == 0);
+  usleep(50 * 1000);
+  assert(!__atomic_load_n(&s.done, __ATOMIC_ACQUIRE));
+  assert(__atomic_load_n(&q.tail, __ATOMIC_RELAXED) == 3);
+  alveoFutureComplete(log_.gate, FLETCHER_STATUS_OK);
+  pthread_join(thread, NULL);
+  alveoAsyncTerminate(&q);
+  assert(q.full == 1);
+  assert(log_.count == 4);
+  for (int64_t i = 0; i < 4; i++) {
+    assert(log_.log[i] == i);
+  }
+  alveoFutureRelease(log_.gate);
+}
+
+// Concurrent submitters lose no operations, and the operations of each run in the order it queued them.
+static void test_concurrent_submitters(void) {
+  AlveoAsyncQueue q;
+  memset(&log_, 0, sizeof(log_));
+  alveoAsyncInit(&q, &log_, 8);
+  Submitter s[SUBMITTERS];
+  pthread_t threads[SUBMITTERS];
+  for (int t = 0; t < SUBMITTERS; t++) {
+    s[t] = (Submitter) {&q, (int64_t) t * PER_SUBMITTER, PER_SUBMITTER, 0};
+    assert(pthread_create(&threads[t], NULL, submitter_main, &s[t]) == 0);
+  }
+  for (int t = 0; t < SUBMITTERS; t++) {
+    pthread_join(threads[t], NULL);
+  }
+  alveoAsyncTerminate(&q);
+  assert(q.executed == SUBMITTERS * PER_SUBMITTER);
+  assert(log_.count == SUBMITTERS * PER_SUBMITTER);
+  int64_t next[SUBMITTERS];
+  for (int t = 0; t < SUBMITTERS; t++) {
+    next[t] = (int64_t) t * PER_SUBMITTER;
+  }
+  for (uint32_t i = 0; i < log_.count; i++) {
+    int t = (int) (log_.log[i] / PER_SUBMITTER);
+    assert(log_.log[i] == next[t]);
+    next[t]++;
+  }
+}
+
+// An operation that waits for a failed one fails without running.
+static void test_failure_propagates(void) {
+  AlveoAsyncQueue q;
+  memset(&log_, 0, sizeof(log_));
+  alveoAsyncInit(&q, &log_, 4);
+  AlveoFuture *failed = alveoFutureCreate();
+  AlveoFuture *dependent = alveoFutureCreate();
+  assert(submit(&q, -1, NULL, failed) == FLETCHER_STATUS_OK);
+  assert(submit(&q, 5, failed, dependent) == FLETCHER_STATUS_OK);
+  assert(alveoFutureWait(dependent) == FLETCHER_STATUS_ERROR);
+  assert(alveoFutureWait(failed) == FLETCHER_STATUS_ERROR);
+  alveoFutureRelease(failed);
+  alveoFutureRelease(dependent);
+  alveoAsyncTerminate(&q);
+  assert(log_.count == 1);
+  assert(q.executed == 2);
+  assert(q.failed == 2);
+  // A second terminate does nothing.
+  alveoAsyncTerminate(&q);
+}
+
+int main(void) {
+  test_ring_wraps_around();
+  test_full_ring_waits();
+  test_concurrent_submitters();
+  test_failure_propagates();
+  printf("alveo_async_test: all tests passed.\n");
+  return 0;
+}
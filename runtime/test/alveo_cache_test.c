@@ -0,0 +1,116 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Tests of the resident-buffer cache. It only does bookkeeping on top of the on-board memory allocator, so it runs
+// without a card.
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "alveo_cache.h"
+
+#define SIZE (64ull << 20)
+
+static AlveoDevMem dm;
+static AlveoCache cache;
+static uint8_t buffer[4096];
+
+// Two arenas, in bank 0 and bank 1.
+static void setup(void) {
+  memset(&dm, 0, sizeof(dm));
+  memset(&cache, 0, sizeof(cache));
+  assert(alveoDevMemAddArena(&dm, 0x100000000ull, SIZE, 0, NULL) == FLETCHER_STATUS_OK);
+  assert(alveoDevMemAddArena(&dm, 0x200000000ull, SIZE, 1, NULL) == FLETCHER_STATUS_OK);
+  cache.budget = SIZE;
+  pthread_cond_init(&cache.ready, NULL);
+}
+
+static void teardown(void) {
+  alveoCacheTerminate(&cache, &dm);
+  pthread_cond_destroy(&cache.ready);
+  alveoDevMemTerminate(&dm);
+}
+
+static int bank_of(da_t device) {
+  uint64_t offset;
+  return alveoDevMemFind(&dm, device, 1, &offset)->bank;
+}
+
+// Copies are placed in the banks they are inserted for, and only found from those banks.
+static void test_copies_stay_in_their_banks(void) {
+  setup();
+  uint64_t fingerprint = alveoFingerprint(ALVEO_STAGE_SCALAR, buffer, sizeof(buffer));
+  AlveoCacheEntry *e1 = alveoCacheInsert(&cache, &dm, buffer, sizeof(buffer), fingerprint, 1ull << 1);
+  assert(e1 != NULL);
+  assert(bank_of(e1->device) == 1);
+  alveoCacheReady(&cache, &dm, e1, 1);
+  // A compute unit that only reaches bank 0 misses, and gets a copy of its own.
+  assert(alveoCacheLookup(&cache, &dm, buffer, sizeof(buffer), fingerprint, 1ull << 0) == NULL);
+  AlveoCacheEntry *e0 = alveoCacheInsert(&cache, &dm, buffer, sizeof(buffer), fingerprint, 1ull << 0);
+  assert(e0 != NULL);
+  assert(bank_of(e0->device) == 0);
+  alveoCacheReady(&cache, &dm, e0, 1);
+  assert(alveoCacheLookup(&cache, &dm, buffer, sizeof(buffer), fingerprint, 1ull << 0) == e0);
+  assert(alveoCacheLookup(&cache, &dm, buffer, sizeof(buffer), fingerprint, 1ull << 1) == e1);
+  assert(alveoCacheLookup(&cache, &dm, buffer, sizeof(buffer), fingerprint, 3) != NULL);
+  // Changing the buffer invalidates both copies.
+  buffer[0] ^= 1;
+  uint64_t changed = alveoFingerprint(ALVEO_STAGE_SCALAR, buffer, sizeof(buffer));
+  assert(alveoCacheLookup(&cache, &dm, buffer, sizeof(buffer), changed, 3) == NULL);
+  assert(cache.stats.invalidations == 2);
+  assert(e0->stale && e1->stale);
+  assert(alveoCacheRelease(&cache, &dm, e0->device));
+  teardown();
+}
+
+// Every instruction set the CPU supports computes the same fingerprint, and moving or changing bytes changes it.
+static void test_fingerprint_is_the_same_for_every_isa(void) {
+  static uint8_t data[3 * 64 * 1024];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t) (i * 7 + (i >> 9));
+  }
+  int64_t sizes[] = {0, 7, 64, 1000, 4096, 64 * 1024, sizeof(data)};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    uint64_t scalar = alveoFingerprint(ALVEO_STAGE_SCALAR, data, sizes[i]);
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+      assert(alveoFingerprint(ALVEO_STAGE_AVX2, data, sizes[i]) == scalar);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+      assert(alveoFingerprint(ALVEO_STAGE_AVX512, data, sizes[i]) == scalar);
+    }
+#endif
+  }
+  uint64_t before = alveoFingerprint(ALVEO_STAGE_SCALAR, data, 4096);
+  // Swap two stripes of 64 bytes.
+  uint8_t stripe[64];
+  memcpy(stripe, data, 64);
+  memcpy(data, data + 64, 64);
+  memcpy(data + 64, stripe, 64);
+  assert(alveoFingerprint(ALVEO_STAGE_SCALAR, data, 4096) != before);
+  memcpy(data + 64, data, 64);
+  memcpy(data, stripe, 64);
+  assert(alveoFingerprint(ALVEO_STAGE_SCALAR, data, 4096) == before);
+  data[4000] ^= 0x80;
+  assert(alveoFingerprint(ALVEO_STAGE_SCALAR, data, 4096) != before);
+}
+
+int main(void) {
+  test_copies_stay_in_their_banks();
+  test_fingerprint_is_the_same_for_every_isa();
+  printf("alveo_cache_test: all tests passed.\n");
+  return 0;
+}
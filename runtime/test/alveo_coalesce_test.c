@@ -0,0 +1,199 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Tests of the coalescing of small jobs into batches. Batches are recorded and completed by the test instead of being
+// dispatched to a compute unit, so they run without a card.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "alveo_coalesce.h"
+
+#define MAX_BATCHES 16
+#define MAX_JOBS 64
+#define NEVER (60ull * 1000000000)
+
+// What a batch held when it was handed over.
+typedef struct {
+  uint32_t num_jobs;
+  int64_t num_rows;
+  int64_t first[MAX_JOBS];
+  int64_t rows[MAX_JOBS];
+} Recorded;
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static Recorded recorded[MAX_BATCHES];
+static uint32_t num_recorded;
+static int refuse;
+
+static fstatus_t record(void *ctx, AlveoCoalesceBatch *batch) {
+  (void) ctx;
+  if (refuse) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  pthread_mutex_lock(&record_lock);
+  assert(num_recorded < MAX_BATCHES);
+  assert(batch->num_jobs <= MAX_JOBS);
+  Recorded *r = &recorded[num_recorded++];
+  r->num_jobs = batch->num_jobs;
+  r->num_rows = batch->num_rows;
+  for (uint32_t j = 0; j < batch->num_jobs; j++) {
+    r->first[j] = batch->jobs[j].first;
+    r->rows[j] = batch->jobs[j].num_rows;
+  }
+  pthread_mutex_unlock(&record_lock);
+  alveoCoalesceComplete(batch, FLETCHER_STATUS_OK);
+  return FLETCHER_STATUS_OK;
+}
+
+static uint32_t recorded_count(void) {
+  pthread_mutex_lock(&record_lock);
+  uint32_t n = num_recorded;
+  pthread_mutex_unlock(&record_lock);
+  return n;
+}
+
+static AlveoCoalescer c;
+
+static void start(int64_t max_rows, uint64_t max_delay_ns) {
+  AlveoCoalesceLayout layout;
+  memset(&layout, 0, sizeof(layout));
+  layout.num_inputs = 1;
+  layout.input_width[0] = 4;
+  layout.num_outputs = 1;
+  layout.output_width[0] = 8;
+  num_recorded = 0;
+  refuse = 0;
+  assert(alveoCoalesceStart(&c, &layout, max_rows, max_delay_ns, record, NULL) == FLETCHER_STATUS_OK);
+}
+
+static fstatus_t submit(int64_t num_rows, AlveoFuture **future) {
+  static uint8_t input[4];
+  static uint8_t output[8];
+  const uint8_t *inputs[1] = {input};
+  uint8_t *outputs[1] = {output};
+  return alveoCoalesceSubmit(&c, num_rows, inputs, outputs, future);
+}
+
+// A batch is handed over by the job that brings it to max_rows, which stays in it, and the next job starts a new batch
+// at row 0.
+static void test_batch_boundaries(void) {
+  start(100, NEVER);
+  for (int i = 0; i < 3; i++) {
+    assert(submit(30, NULL) == FLETCHER_STATUS_OK);
+  }
+  assert(recorded_count() == 0);
+  assert(submit(30, NULL) == FLETCHER_STATUS_OK);
+  assert(recorded_count() == 1);
+  assert(recorded[0].num_jobs == 4);
+  assert(recorded[0].num_rows == 120);
+  for (int j = 0; j < 4; j++) {
+    assert(recorded[0].first[j] == 30 * j);
+    assert(recorded[0].rows[j] == 30);
+  }
+  // Exactly max_rows rows fill a batch.
+  assert(submit(50, NULL) == FLETCHER_STATUS_OK);
+  assert(submit(50, NULL) == FLETCHER_STATUS_OK);
+  assert(recorded_count() == 2);
+  assert(recorded[1].num_jobs == 2);
+  assert(recorded[1].first[0] == 0);
+  assert(recorded[1].first[1] == 50);
+  // A job larger than max_rows is a batch of its own, and empty jobs take no rows.
+  assert(submit(0, NULL) == FLETCHER_STATUS_OK);
+  assert(submit(250, NULL) == FLETCHER_STATUS_OK);
+  assert(recorded_count() == 3);
+  assert(recorded[2].num_jobs == 2);
+  assert(recorded[2].first[0] == 0);
+  assert(recorded[2].first[1] == 0);
+  assert(recorded[2].num_rows == 250);
+  alveoCoalesceStop(&c);
+  assert(recorded_count() == 3);
+  assert(c.stats.full == 3);
+  assert(c.stats.jobs == 8);
+  assert(c.stats.rows == 470);
+}
+
+// A batch keeps growing past its initial capacity, and its jobs keep their order.
+static void test_batch_grows(void) {
+  start(40, NEVER);
+  for (int i = 0; i < 40; i++) {
+    assert(submit(1, NULL) == FLETCHER_STATUS_OK);
+  }
+  assert(recorded_count() == 1);
+  assert(recorded[0].num_jobs == 40);
+  for (int j = 0; j < 40; j++) {
+    assert(recorded[0].first[j] == j);
+  }
+  alveoCoalesceStop(&c);
+  assert(c.stats.max_jobs == 40);
+}
+
+// A batch that does not fill up is handed over once its first job waited the longest delay.
+static void test_batch_expires(void) {
+  start(1000, 1000000);
+  AlveoFuture *first;
+  AlveoFuture *second;
+  assert(submit(10, &first) == FLETCHER_STATUS_OK);
+  assert(submit(20, &second) == FLETCHER_STATUS_OK);
+  assert(alveoFutureWait(first) == FLETCHER_STATUS_OK);
+  assert(alveoFutureWait(second) == FLETCHER_STATUS_OK);
+  alveoFutureRelease(first);
+  alveoFutureRelease(second);
+  alveoCoalesceStop(&c);
+  assert(recorded_count() == 1);
+  assert(recorded[0].num_jobs == 2);
+  assert(recorded[0].first[1] == 10);
+  assert(c.stats.expired == 1);
+}
+
+// Flush and stop hand the batch being gathered over right away, and nothing is accepted after stop.
+static void test_flush_and_stop(void) {
+  start(1000, NEVER);
+  AlveoFuture *f;
+  assert(submit(10, &f) == FLETCHER_STATUS_OK);
+  alveoCoalesceFlush(&c);
+  assert(alveoFutureWait(f) == FLETCHER_STATUS_OK);
+  alveoFutureRelease(f);
+  assert(submit(10, &f) == FLETCHER_STATUS_OK);
+  alveoCoalesceStop(&c);
+  assert(alveoFuturePoll(f, NULL));
+  alveoFutureRelease(f);
+  assert(recorded_count() == 2);
+  assert(c.stats.flushed == 2);
+  assert(submit(10, NULL) == FLETCHER_STATUS_ERROR);
+}
+
+// The jobs of a batch that cannot be handed over fail.
+static void test_refused_batch_fails(void) {
+  start(10, NEVER);
+  refuse = 1;
+  AlveoFuture *f;
+  assert(submit(10, &f) == FLETCHER_STATUS_OK);
+  assert(alveoFutureWait(f) == FLETCHER_STATUS_ERROR);
+  alveoFutureRelease(f);
+  alveoCoalesceStop(&c);
+}
+
+int main(void) {
+  test_batch_boundaries();
+  test_batch_grows();
+  test_batch_expires();
+  test_flush_and_stop();
+  test_refused_batch_fails();
+  printf("alveo_coalesce_test: all tests passed.\n");
+  return 0;
+}
@@ -0,0 +1,95 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests of the on-board memory allocator. It only does bookkeeping, so it runs without a card.
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "alveo_devmem.h"
+
+#define BASE 0x100000000ull
+#define SIZE (64ull << 20)
+
+static AlveoDevMem dm;
+
+static void setup(void) {
+  memset(&dm, 0, sizeof(dm));
+  assert(alveoDevMemAddArena(&dm, BASE, SIZE, 0, NULL) == FLETCHER_STATUS_OK);
+}
+
+static int overlaps(da_t a, int64_t a_size, da_t b, int64_t b_size) {
+  return (a < b + (uint64_t) b_size) && (b < a + (uint64_t) a_size);
+}
+
+// Only the address an allocation was handed out at can be freed.
+static void test_free_rejects_non_heads(void) {
+  setup();
+  da_t a;
+  const int64_t size = 1 << 20;
+  assert(alveoDevMemAlloc(&dm, &a, size, -1) == FLETCHER_STATUS_OK);
+  // Inside the allocation, on a granule boundary.
+  assert(alveoDevMemFree(&dm, a + ALVEO_DEVMEM_GRANULE) == FLETCHER_STATUS_ERROR);
+  // Never allocated.
+  assert(alveoDevMemFree(&dm, BASE + SIZE / 2) == FLETCHER_STATUS_ERROR);
+  // Just past the arena.
+  assert(alveoDevMemFree(&dm, BASE + SIZE) == FLETCHER_STATUS_ERROR);
+  // Nothing that was rejected was returned to the allocator: new allocations stay clear of a.
+  for (int i = 0; i < 16; i++) {
+    da_t b;
+    assert(alveoDevMemAlloc(&dm, &b, size, -1) == FLETCHER_STATUS_OK);
+    assert(!overlaps(a, size, b, size));
+  }
+  assert(alveoDevMemFree(&dm, a) == FLETCHER_STATUS_OK);
+  assert(alveoDevMemFree(&dm, a) == FLETCHER_STATUS_ERROR);
+  alveoDevMemTerminate(&dm);
+}
+
+// Blocks merged back into larger ones no longer count as blocks of their own.
+static void test_free_rejects_merged_halves(void) {
+  setup();
+  da_t a;
+  da_t b;
+  const int64_t size = 2 * ALVEO_DEVMEM_GRANULE;
+  assert(alveoDevMemAlloc(&dm, &a, size, -1) == FLETCHER_STATUS_OK);
+  assert(alveoDevMemAlloc(&dm, &b, size, -1) == FLETCHER_STATUS_OK);
+  assert(alveoDevMemFree(&dm, a) == FLETCHER_STATUS_OK);
+  assert(alveoDevMemFree(&dm, b) == FLETCHER_STATUS_OK);
+  da_t c;
+  assert(alveoDevMemAlloc(&dm, &c, 2 * size, -1) == FLETCHER_STATUS_OK);
+  da_t upper = c + (uint64_t) size;
+  assert(alveoDevMemFree(&dm, upper) == FLETCHER_STATUS_ERROR);
+  assert(alveoDevMemFree(&dm, c) == FLETCHER_STATUS_OK);
+  alveoDevMemTerminate(&dm);
+}
+
+static void test_slab_objects(void) {
+  setup();
+  da_t a;
+  assert(alveoDevMemAlloc(&dm, &a, 256, -1) == FLETCHER_STATUS_OK);
+  assert(alveoDevMemFree(&dm, a + 16) == FLETCHER_STATUS_ERROR);
+  assert(alveoDevMemFree(&dm, a + 256) == FLETCHER_STATUS_ERROR);
+  assert(alveoDevMemFree(&dm, a) == FLETCHER_STATUS_OK);
+  assert(alveoDevMemFree(&dm, a) == FLETCHER_STATUS_ERROR);
+  alveoDevMemTerminate(&dm);
+}
+
+int main(void) {
+  test_free_rejects_non_heads();
+  test_free_rejects_merged_halves();
+  test_slab_objects();
+  printf("alveo_devmem_test: all tests passed.\n");
+  return 0;
+}
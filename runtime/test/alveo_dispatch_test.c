@@ -0,0 +1,173 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Tests of the work-stealing dispatcher. Jobs only count, or wait on a gate to play a compute unit stuck on a slow
+// batch, so they run without a card.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alveo_dispatch.h"
+
+#define WORKERS 2
+
+static AlveoDispatcher d;
+
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate_open[WORKERS];
+static uint32_t blocked;        ///< Jobs waiting on a gate.
+static uint32_t done;           ///< Counting jobs that ran.
+static uint32_t inside[WORKERS];  ///< Jobs between the enter and leave hook, per worker.
+static __thread int32_t worker = -1;
+
+static void enter(uint32_t w) {
+  assert(w < WORKERS);
+  assert(__atomic_add_fetch(&inside[w], 1, __ATOMIC_RELAXED) == 1);
+  worker = (int32_t) w;
+}
+
+static void leave(uint32_t w) {
+  assert(worker == (int32_t) w);
+  assert(__atomic_sub_fetch(&inside[w], 1, __ATOMIC_RELAXED) == 0);
+}
+
+// A job that waits until its gate opens, and tells which worker ran it.
+typedef struct {
+  int gate;
+  int32_t worker;
+} Stuck;
+
+static fstatus_t wait_gate(void *arg) {
+  Stuck *s = (Stuck *) arg;
+  s->worker = worker;
+  pthread_mutex_lock(&gate_lock);
+  blocked++;
+  pthread_cond_broadcast(&gate_cond);
+  while (!gate_open[s->gate]) {
+    pthread_cond_wait(&gate_cond, &gate_lock);
+  }
+  pthread_mutex_unlock(&gate_lock);
+  return FLETCHER_STATUS_OK;
+}
+
+static fstatus_t count(void *arg) {
+  (void) arg;
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+  return FLETCHER_STATUS_OK;
+}
+
+static fstatus_t fail(void *arg) {
+  (void) arg;
+  return FLETCHER_STATUS_ERROR;
+}
+
+static void start(void) {
+  memset(gate_open, 0, sizeof(gate_open));
+  blocked = 0;
+  done = 0;
+  assert(alveoDispatchStart(&d, WORKERS, enter, leave) == FLETCHER_STATUS_OK);
+}
+
+// Wait until n jobs wait on a gate.
+static void wait_blocked(uint32_t n) {
+  pthread_mutex_lock(&gate_lock);
+  while (blocked < n) {
+    pthread_cond_wait(&gate_cond, &gate_lock);
+  }
+  pthread_mutex_unlock(&gate_lock);
+}
+
+static void open_gate(int gate) {
+  pthread_mutex_lock(&gate_lock);
+  gate_open[gate] = 1;
+  pthread_cond_broadcast(&gate_cond);
+  pthread_mutex_unlock(&gate_lock);
+}
+
+// Start a job on every worker that waits for the gate of its own, then queue n counting jobs behind them.
+static void block_workers(Stuck *stuck, int n) {
+  for (int w = 0; w < WORKERS; w++) {
+    stuck[w].gate = w;
+    assert(alveoDispatchSubmit(&d, wait_gate, &stuck[w]) == FLETCHER_STATUS_OK);
+  }
+  wait_blocked(WORKERS);
+  assert(stuck[0].worker != stuck[1].worker);
+  for (int i = 0; i < n; i++) {
+    assert(alveoDispatchSubmit(&d, count, NULL) == FLETCHER_STATUS_OK);
+  }
+}
+
+// New jobs go to the shortest queue, and queues grow past their initial capacity.
+static void test_jobs_spread_over_queues(void) {
+  start();
+  Stuck stuck[WORKERS];
+  block_workers(stuck, 1000);
+  assert(d.deques[0].count == 500);
+  assert(d.deques[1].count == 500);
+  assert(d.deques[0].capacity > 64);
+  open_gate(0);
+  open_gate(1);
+  assert(alveoDispatchWait(&d) == FLETCHER_STATUS_OK);
+  assert(done == 1000);
+  assert(d.deques[0].executed + d.deques[1].executed == 1002);
+  alveoDispatchStop(&d);
+}
+
+// While one worker is stuck, the other one runs its own jobs and then steals all jobs queued behind the stuck one.
+static void test_idle_worker_steals(void) {
+  start();
+  Stuck stuck[WORKERS];
+  block_workers(stuck, 1000);
+  open_gate(0);
+  while (__atomic_load_n(&done, __ATOMIC_RELAXED) < 1000) {
+    usleep(100);
+  }
+  open_gate(1);
+  assert(alveoDispatchWait(&d) == FLETCHER_STATUS_OK);
+  const AlveoDeque *thief = &d.deques[stuck[0].worker];
+  const AlveoDeque *victim = &d.deques[stuck[1].worker];
+  assert(thief->executed == 1001);
+  assert(thief->stolen == 500);
+  assert(victim->executed == 1);
+  assert(victim->stolen == 0);
+  alveoDispatchStop(&d);
+}
+
+// A failed job is reported by the next wait only, and stop runs the jobs that are still queued.
+static void test_failure_and_stop(void) {
+  start();
+  assert(alveoDispatchSubmit(&d, fail, NULL) == FLETCHER_STATUS_OK);
+  assert(alveoDispatchSubmit(&d, count, NULL) == FLETCHER_STATUS_OK);
+  assert(alveoDispatchWait(&d) == FLETCHER_STATUS_ERROR);
+  assert(alveoDispatchWait(&d) == FLETCHER_STATUS_OK);
+  for (int i = 0; i < 100; i++) {
+    assert(alveoDispatchSubmit(&d, count, NULL) == FLETCHER_STATUS_OK);
+  }
+  alveoDispatchStop(&d);
+  assert(done == 101);
+  assert(alveoDispatchSubmit(&d, count, NULL) == FLETCHER_STATUS_ERROR);
+}
+
+int main(void) {
+  test_jobs_spread_over_queues();
+  test_idle_worker_steals();
+  test_failure_and_stop();
+  printf("alveo_dispatch_test: all tests passed.\n");
+  return 0;
+}
@@ -0,0 +1,122 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Tests of the cost model of the emulated card: transfers that share a PCIe direction or a bank queue up, others
+// overlap. The model is not enforced, so the tests run instantly and only look at the modeled times.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alveo_emu.h"
+
+#define SIZE (1 << 20)
+#define LATENCY 5000
+
+static AlveoEmu emu;
+static uint8_t host[2][SIZE];
+
+static void setup(void) {
+  AlveoEmuCostModel model;
+  memset(&model, 0, sizeof(model));
+  model.mmio_latency_ns = 1000;
+  model.dma_latency_ns = LATENCY;
+  model.pcie_bandwidth = 1.0;
+  model.ddr_bandwidth = 2.0;
+  model.num_banks = 2;
+  model.bank_size = 16 << 20;
+  model.num_cus = 1;
+  assert(alveoEmuInit(&emu, &model) == FLETCHER_STATUS_OK);
+}
+
+// Time from the start of the first transfer to the end of the last one.
+static uint64_t span(void) {
+  return emu.stats.last_ns - emu.stats.first_ns;
+}
+
+// The time a transfer of SIZE bytes takes on its own.
+static const uint64_t single = LATENCY + SIZE;
+
+// Copies in one direction share the link, also when they go to different banks.
+static void test_same_direction_queues(void) {
+  setup();
+  assert(alveoEmuCopy(&emu, ALVEO_EMU_H2D, host[0], ALVEO_EMU_BANK_BASE(0), SIZE) == FLETCHER_STATUS_OK);
+  assert(alveoEmuCopy(&emu, ALVEO_EMU_H2D, host[1], ALVEO_EMU_BANK_BASE(1), SIZE) == FLETCHER_STATUS_OK);
+  assert(emu.stats.modeled_ns == 2 * single);
+  assert(span() >= 2 * single);
+  assert(emu.stats.wait_ns > 0);
+  alveoEmuTerminate(&emu);
+}
+
+// Opposite directions overlap, unless they use the same bank.
+static void test_duplex(void) {
+  setup();
+  assert(alveoEmuDuplex(&emu, host[0], ALVEO_EMU_BANK_BASE(0), SIZE, ALVEO_EMU_BANK_BASE(1), host[1], SIZE)
+         == FLETCHER_STATUS_OK);
+  assert(span() < single + single / 2);
+  alveoEmuTerminate(&emu);
+  setup();
+  assert(alveoEmuDuplex(&emu, host[0], ALVEO_EMU_BANK_BASE(0), SIZE, ALVEO_EMU_BANK_BASE(0) + SIZE, host[1], SIZE)
+         == FLETCHER_STATUS_OK);
+  assert(span() >= single + LATENCY + SIZE / 2);
+  alveoEmuTerminate(&emu);
+}
+
+// A vectored copy pays the DMA setup once, and its data moves as fast as the link allows.
+static void test_vectored_copy(void) {
+  setup();
+  AlveoCopyDesc descs[4];
+  for (int i = 0; i < 4; i++) {
+    descs[i].host = host[0] + i * (SIZE / 4);
+    descs[i].device = ALVEO_EMU_BANK_BASE(i % 2) + (uint64_t) i * SIZE;
+    descs[i].size = SIZE / 4;
+  }
+  assert(alveoEmuCopyV(&emu, descs, 4) == FLETCHER_STATUS_OK);
+  assert(emu.stats.transfers[ALVEO_EMU_H2D] == 1);
+  assert(emu.stats.bytes[ALVEO_EMU_H2D] == SIZE);
+  assert(emu.stats.modeled_ns == single);
+  assert(memcmp(alveoEmuTranslate(&emu, descs[3].device, SIZE / 4), descs[3].host, SIZE / 4) == 0);
+  alveoEmuTerminate(&emu);
+}
+
+// The emulated kernel sends back what it received on its streams, and a read of its output ends after those bytes.
+static void test_stream_loopback(void) {
+  setup();
+  int64_t moved = -1;
+  assert(alveoEmuStream(&emu, ALVEO_EMU_H2D, host[0], SIZE / 4, &moved) == FLETCHER_STATUS_OK);
+  assert(moved == SIZE / 4);
+  memset(host[1], 0xFF, SIZE);
+  assert(alveoEmuStream(&emu, ALVEO_EMU_D2H, host[1], SIZE, &moved) == FLETCHER_STATUS_OK);
+  assert(moved == SIZE / 4);
+  assert((host[1][SIZE / 4 - 1] == 0) && (host[1][SIZE / 4] == 0xFF));
+  assert(emu.stats.bytes[ALVEO_EMU_D2H] == SIZE / 4);
+  assert(alveoEmuStream(&emu, ALVEO_EMU_D2H, host[1], SIZE, &moved) == FLETCHER_STATUS_OK);
+  assert(moved == 0);
+  alveoEmuTerminate(&emu);
+}
+
+int main(void) {
+  for (int i = 0; i < SIZE; i++) {
+    host[0][i] = (uint8_t) i;
+    host[1][i] = (uint8_t) (i * 7);
+  }
+  test_same_direction_queues();
+  test_duplex();
+  test_vectored_copy();
+  test_stream_loopback();
+  printf("alveo_emu_test: all tests passed.\n");
+  return 0;
+}
@@ -0,0 +1,133 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Tests of the planning of vectored copies. Targets are only compared by address, so they run without a card.
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "alveo_gather.h"
+
+#define SMALL 1024
+#define LARGE (ALVEO_GATHER_PACK_MAX + 1)
+
+static int buffer_a;
+static int buffer_b;
+static uint8_t host[8 * ALVEO_GATHER_PACK_MAX];
+
+static AlveoGatherPiece piece(const void *target, uint64_t offset, uint64_t host_offset, int64_t size) {
+  AlveoGatherPiece p = {target, offset, host + host_offset, size, 0};
+  return p;
+}
+
+// Pack run and check that every piece landed at its offset in the run.
+static void check_pack(const AlveoGatherPiece *pieces, const AlveoGatherRun *run) {
+  static uint8_t staging[8 * ALVEO_GATHER_PACK_MAX];
+  memset(staging, 0, (size_t) run->size);
+  alveoGatherPack(pieces, run, staging);
+  for (uint32_t i = run->first; i < run->first + run->count; i++) {
+    const AlveoGatherPiece *p = &pieces[i];
+    assert(memcmp(staging + (p->offset - run->offset), p->host, (size_t) p->size) == 0);
+  }
+}
+
+// Pieces contiguous on the device and the host merge into one run that is written straight from the host, in whatever
+// order they were given.
+static void test_contiguous_pieces_merge(void) {
+  AlveoGatherPiece pieces[3] = {
+      piece(&buffer_a, 2 * SMALL, 2 * SMALL, LARGE),
+      piece(&buffer_a, 0, 0, SMALL),
+      piece(&buffer_a, SMALL, SMALL, SMALL)};
+  AlveoGatherRun runs[3];
+  assert(alveoGatherPlan(pieces, 3, runs) == 1);
+  assert(runs[0].target == &buffer_a);
+  assert(runs[0].offset == 0);
+  assert(runs[0].size == 2 * SMALL + LARGE);
+  assert(runs[0].host == host);
+  assert(runs[0].first == 0);
+  assert(runs[0].count == 3);
+}
+
+// Small pieces that are only contiguous on the device are packed; runs stop at gaps, other targets and large pieces.
+static void test_run_boundaries(void) {
+  AlveoGatherPiece pieces[7] = {
+      // Scattered on the host: packed into one run.
+      piece(&buffer_a, 0, 5 * SMALL, SMALL),
+      piece(&buffer_a, SMALL, 3 * SMALL, SMALL),
+      // A large piece is never copied, so it starts a run of its own.
+      piece(&buffer_a, 2 * SMALL, 10 * SMALL, LARGE),
+      // A gap on the device.
+      piece(&buffer_a, 2 * SMALL + LARGE + 8, 0, SMALL),
+      // Contiguous offsets in another buffer.
+      piece(&buffer_b, 3 * SMALL + LARGE + 8, SMALL, SMALL),
+      piece(&buffer_b, 0, 7 * SMALL, SMALL),
+      piece(&buffer_b, SMALL, 9 * SMALL, SMALL)};
+  AlveoGatherRun runs[7];
+  uint32_t n = alveoGatherPlan(pieces, 7, runs);
+  int b_first = (uintptr_t) &buffer_b < (uintptr_t) &buffer_a;
+  const AlveoGatherRun *a = &runs[b_first ? 2 : 0];
+  const AlveoGatherRun *b = &runs[b_first ? 0 : 3];
+  assert(n == 5);
+  assert(a[0].size == 2 * SMALL && a[0].count == 2 && a[0].host == NULL);
+  assert(a[1].offset == 2 * SMALL && a[1].size == LARGE && a[1].host == host + 10 * SMALL);
+  assert(a[2].offset == 2 * SMALL + LARGE + 8 && a[2].count == 1 && a[2].host == host);
+  assert(b[0].target == &buffer_b && b[0].size == 2 * SMALL && b[0].host == NULL);
+  assert(b[1].target == &buffer_b && b[1].count == 1);
+  check_pack(pieces, &a[0]);
+  check_pack(pieces, &b[0]);
+}
+
+// A run that is written from the host and is already large takes no small piece that would make it packed.
+static void test_large_host_run_is_not_packed(void) {
+  AlveoGatherPiece pieces[3] = {
+      piece(&buffer_a, 0, 0, SMALL),
+      piece(&buffer_a, SMALL, SMALL, ALVEO_GATHER_PACK_MAX),
+      piece(&buffer_a, SMALL + ALVEO_GATHER_PACK_MAX, 4 * ALVEO_GATHER_PACK_MAX, SMALL)};
+  AlveoGatherRun runs[3];
+  assert(alveoGatherPlan(pieces, 3, runs) == 2);
+  assert(runs[0].size == SMALL + ALVEO_GATHER_PACK_MAX);
+  assert(runs[0].host == host);
+  assert(runs[1].first == 2);
+}
+
+// Pieces of a stream always merge into one transfer, whatever their size, and empty pieces are skipped.
+static void test_stream_pieces_merge(void) {
+  AlveoGatherPiece pieces[4] = {
+      piece(&buffer_a, 0, 6 * ALVEO_GATHER_PACK_MAX, SMALL),
+      piece(&buffer_a, SMALL, 0, LARGE),
+      piece(&buffer_a, SMALL + LARGE, 3 * ALVEO_GATHER_PACK_MAX, 0),
+      piece(&buffer_a, SMALL + LARGE, 2 * ALVEO_GATHER_PACK_MAX, LARGE)};
+  for (int i = 0; i < 4; i++) {
+    pieces[i].stream = 1;
+  }
+  AlveoGatherRun runs[4];
+  assert(alveoGatherPlan(pieces, 4, runs) == 1);
+  assert(runs[0].size == SMALL + 2 * LARGE);
+  assert(runs[0].host == NULL);
+  check_pack(pieces, &runs[0]);
+}
+
+int main(void) {
+  for (size_t i = 0; i < sizeof(host); i++) {
+    host[i] = (uint8_t) (i * 13 + (i >> 8));
+  }
+  test_contiguous_pieces_merge();
+  test_run_boundaries();
+  test_large_host_run_is_not_packed();
+  test_stream_pieces_merge();
+  printf("alveo_gather_test: all tests passed.\n");
+  return 0;
+}
@@ -0,0 +1,88 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Tests of the bookkeeping of host buffer registrations. clReleaseMemObject is mocked, so they run without a card.
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "alveo_hostmap.h"
+
+#define PAGE 4096
+
+static int released;
+
+cl_int clReleaseMemObject(cl_mem mem) {
+  (void) mem;
+  released++;
+  return CL_SUCCESS;
+}
+
+static uint8_t pages[8 * PAGE] __attribute__((aligned(PAGE)));
+static AlveoHostMap hm;
+
+static void setup(uint32_t limit) {
+  memset(&hm, 0, sizeof(hm));
+  hm.limit = limit;
+  released = 0;
+}
+
+// Memory the runtime does not own may be freed by the application once the device address is freed, so its
+// registration is released with its last reference, whatever the limit.
+static void test_foreign_memory_is_released(void) {
+  setup(64);
+  assert(alveoHostMapInsert(&hm, pages, 2 * PAGE, (cl_mem) 0x1, 0x1000, 0) != NULL);
+  // A second buffer within the same pages shares the registration.
+  assert(alveoHostMapLookup(&hm, pages + PAGE, PAGE) != NULL);
+  assert(alveoHostMapRelease(&hm, 0x1000));
+  assert(released == 0);
+  assert(alveoHostMapRelease(&hm, 0x1000 + PAGE));
+  assert(released == 1);
+  assert(hm.num_maps == 0);
+  assert(alveoHostMapLookup(&hm, pages, PAGE) == NULL);
+  assert(!alveoHostMapRelease(&hm, 0x1000));
+  alveoHostMapTerminate(&hm);
+}
+
+// Memory of the host pool stays registered for reuse until more than the limit of unreferenced registrations exists.
+static void test_pool_memory_is_kept(void) {
+  setup(1);
+  assert(alveoHostMapInsert(&hm, pages, PAGE, (cl_mem) 0x1, 0x1000, 1) != NULL);
+  assert(alveoHostMapRelease(&hm, 0x1000));
+  assert(released == 0);
+  assert(alveoHostMapLookup(&hm, pages, PAGE) != NULL);
+  assert(alveoHostMapRelease(&hm, 0x1000));
+  assert(alveoHostMapInsert(&hm, pages + PAGE, PAGE, (cl_mem) 0x2, 0x2000, 1) != NULL);
+  assert(alveoHostMapRelease(&hm, 0x2000));
+  // Two unreferenced registrations exceed the limit; the least recently used one goes.
+  assert(released == 1);
+  assert(alveoHostMapLookup(&hm, pages, PAGE) == NULL);
+  assert(alveoHostMapLookup(&hm, pages + PAGE, PAGE) != NULL);
+  // Referenced registrations cannot be forgotten, unreferenced ones can.
+  assert(!alveoHostMapForget(&hm, pages, 8 * PAGE));
+  assert(alveoHostMapRelease(&hm, 0x2000));
+  assert(alveoHostMapForget(&hm, pages, 8 * PAGE));
+  assert(released == 2);
+  assert(hm.num_maps == 0);
+  alveoHostMapTerminate(&hm);
+}
+
+int main(void) {
+  test_foreign_memory_is_released();
+  test_pool_memory_is_kept();
+  printf("alveo_hostmap_test: all tests passed.\n");
+  return 0;
+}
@@ -0,0 +1,112 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests of the Arrow IPC reader on streams built by hand, including malformed ones that must be rejected rather than
+// walked forever or out of the file.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alveo_ipc.h"
+
+#define SCHEMA 1
+#define DICTIONARY_BATCH 2
+#define RECORD_BATCH 3
+
+static uint8_t file[4096];
+
+static void put_u16(uint64_t pos, uint16_t v) {
+  memcpy(file + pos, &v, sizeof(v));
+}
+
+static void put_u32(uint64_t pos, uint32_t v) {
+  memcpy(file + pos, &v, sizeof(v));
+}
+
+static void put_i64(uint64_t pos, int64_t v) {
+  memcpy(file + pos, &v, sizeof(v));
+}
+
+// Append an encapsulated message at pos: continuation marker, length, and a 48-byte Message flatbuffer with the header
+// type, an empty header table and the body length. Then body_bytes bytes of body. Returns the end of the message.
+static uint64_t put_message(uint64_t pos, uint8_t type, int64_t body_size, uint64_t body_bytes) {
+  put_u32(pos, 0xFFFFFFFFu);
+  put_u32(pos + 4, 48);
+  uint64_t fb = pos + 8;
+  memset(file + fb, 0, 48);
+  put_u32(fb, 16);              // Root table at 16.
+  put_u16(fb + 4, 12);          // Its vtable: 4 fields, of which version is absent.
+  put_u16(fb + 6, 24);
+  put_u16(fb + 8, 0);
+  put_u16(fb + 10, 4);          // header_type
+  put_u16(fb + 12, 8);          // header
+  put_u16(fb + 14, 16);         // bodyLength
+  put_u32(fb + 16, 12);         // Table, 12 bytes after its vtable.
+  file[fb + 20] = type;
+  put_u32(fb + 24, 16);         // The header table at 40.
+  put_i64(fb + 32, body_size);
+  put_u32(fb + 40, (uint32_t) -4);  // The header table, with an empty vtable right after it.
+  put_u16(fb + 44, 4);
+  put_u16(fb + 46, 4);
+  memset(file + fb + 48, 0xAB, body_bytes);
+  return fb + 48 + body_bytes;
+}
+
+// Write the first size bytes of file to a temporary file, open it, and return the status.
+static fstatus_t open_bytes(uint64_t size, AlveoIpcFile *f) {
+  char path[] = "/tmp/alveo_ipc_test_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  assert(write(fd, file, size) == (ssize_t) size);
+  close(fd);
+  fstatus_t status = alveoIpcOpen(f, path);
+  unlink(path);
+  return status;
+}
+
+static void test_stream(void) {
+  uint64_t end = put_message(0, SCHEMA, 0, 0);
+  end = put_message(end, RECORD_BATCH, 64, 64);
+  end = put_message(end, RECORD_BATCH, 8, 8);
+  AlveoIpcFile f;
+  assert(open_bytes(end, &f) == FLETCHER_STATUS_OK);
+  assert(f.num_batches == 2);
+  assert(f.batches[0].metadata_size == 56);
+  assert(f.batches[0].body_size == 64);
+  assert(alveoIpcBody(&f, 0)[0] == 0xAB);
+  assert(f.batches[1].body_size == 8);
+  alveoIpcClose(&f);
+}
+
+// Bodies of any message type must lie within the file, or the walk would go backwards or wrap around.
+static void test_malformed_body(uint8_t type, int64_t body_size) {
+  uint64_t end = put_message(0, type, body_size, 0);
+  end = put_message(end, RECORD_BATCH, 8, 8);
+  AlveoIpcFile f;
+  assert(open_bytes(end, &f) == FLETCHER_STATUS_ERROR);
+}
+
+int main(void) {
+  test_stream();
+  test_malformed_body(SCHEMA, -56);
+  test_malformed_body(SCHEMA, -1);
+  test_malformed_body(SCHEMA, INT64_MAX);
+  test_malformed_body(DICTIONARY_BATCH, 4096);
+  test_malformed_body(RECORD_BATCH, -56);
+  printf("alveo_ipc_test: all tests passed.\n");
+  return 0;
+}
@@ -0,0 +1,148 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Tests of result mappings that are fetched on first touch. The device is mocked by a fetch function that fills blocks
+// with a pattern of their device address, so they run without a card.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "alveo_lazy.h"
+
+#define ADDRESS 0x100000000ull
+
+static pthread_mutex_t fetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fetches;
+static int fail_fetches;
+static pthread_t fetch_thread;
+
+static uint8_t pattern(da_t address) {
+  return (uint8_t) ((address >> 3) ^ (address >> 11) ^ 0x5A);
+}
+
+static fstatus_t fetch(void *ctx, da_t address, uint8_t *host, int64_t size) {
+  (void) ctx;
+  // Fetches may take locks, which a signal handler could not do safely.
+  pthread_mutex_lock(&fetch_lock);
+  fetches++;
+  fetch_thread = pthread_self();
+  int fail = fail_fetches;
+  pthread_mutex_unlock(&fetch_lock);
+  if (fail) {
+    return FLETCHER_STATUS_ERROR;
+  }
+  for (int64_t i = 0; i < size; i++) {
+    host[i] = pattern(address + (uint64_t) i);
+  }
+  return FLETCHER_STATUS_OK;
+}
+
+// The fetches happen on another thread, which the compiler cannot see from a plain memory access.
+static int fetch_count(void) {
+  pthread_mutex_lock(&fetch_lock);
+  int n = fetches;
+  pthread_mutex_unlock(&fetch_lock);
+  return n;
+}
+
+static void setup(int fail) {
+  pthread_mutex_lock(&fetch_lock);
+  fetches = 0;
+  fail_fetches = fail;
+  pthread_mutex_unlock(&fetch_lock);
+}
+
+// Only touched blocks are fetched, once, and bytes past the produced size are zeros.
+static void test_fetch_on_touch(void) {
+  setup(0);
+  const int64_t size = 4 * ALVEO_LAZY_BLOCK + 100;
+  const int64_t produced = 2 * ALVEO_LAZY_BLOCK + 10;
+  const uint8_t *host;
+  assert(alveoLazyMap(ADDRESS, size, produced, fetch, NULL, &host) == FLETCHER_STATUS_OK);
+  assert(fetch_count() == 0);
+  assert(host[5] == pattern(ADDRESS + 5));
+  assert(host[ALVEO_LAZY_BLOCK - 1] == pattern(ADDRESS + ALVEO_LAZY_BLOCK - 1));
+  assert(fetch_count() == 1);
+  pthread_mutex_lock(&fetch_lock);
+  assert(!pthread_equal(fetch_thread, pthread_self()));
+  pthread_mutex_unlock(&fetch_lock);
+  // The last block with data is fetched up to the produced size only.
+  assert(host[produced - 1] == pattern(ADDRESS + (uint64_t) produced - 1));
+  assert(host[produced] == 0);
+  assert(fetch_count() == 2);
+  // Blocks without data are never fetched.
+  assert(host[3 * ALVEO_LAZY_BLOCK] == 0);
+  assert(host[size - 1] == 0);
+  assert(fetch_count() == 2);
+  assert(alveoLazyUnmap(host) == FLETCHER_STATUS_OK);
+  assert(alveoLazyUnmap(host) == FLETCHER_STATUS_ERROR);
+}
+
+typedef struct {
+  const uint8_t *host;
+  int64_t size;
+  int ok;
+} Reader;
+
+static void *read_all(void *arg) {
+  Reader *r = (Reader *) arg;
+  r->ok = 1;
+  for (int64_t i = r->size - 1; i >= 0; i -= 997) {
+    r->ok &= r->host[i] == pattern(ADDRESS + (uint64_t) i);
+  }
+  return NULL;
+}
+
+// Threads that touch the same blocks at the same time all see them complete, and every block is fetched once.
+static void test_concurrent_readers(void) {
+  setup(0);
+  enum { THREADS = 8 };
+  const int64_t size = 32 * ALVEO_LAZY_BLOCK;
+  const uint8_t *host;
+  assert(alveoLazyMap(ADDRESS, size, -1, fetch, NULL, &host) == FLETCHER_STATUS_OK);
+  pthread_t threads[THREADS];
+  Reader readers[THREADS];
+  for (int t = 0; t < THREADS; t++) {
+    readers[t].host = host;
+    readers[t].size = size;
+    assert(pthread_create(&threads[t], NULL, read_all, &readers[t]) == 0);
+  }
+  for (int t = 0; t < THREADS; t++) {
+    pthread_join(threads[t], NULL);
+    assert(readers[t].ok);
+  }
+  assert(fetch_count() == 32);
+  assert(alveoLazyUnmap(host) == FLETCHER_STATUS_OK);
+}
+
+// Blocks that fail to fetch read as zeros, and removing the mapping reports the failure.
+static void test_failed_fetch(void) {
+  setup(1);
+  const uint8_t *host;
+  assert(alveoLazyMap(ADDRESS, ALVEO_LAZY_BLOCK, -1, fetch, NULL, &host) == FLETCHER_STATUS_OK);
+  assert(host[100] == 0);
+  assert(fetch_count() == 1);
+  assert(alveoLazyUnmap(host) == FLETCHER_STATUS_ERROR);
+}
+
+int main(void) {
+  test_fetch_on_touch();
+  test_concurrent_readers();
+  test_failed_fetch();
+  printf("alveo_lazy_test: all tests passed.\n");
+  return 0;
+}
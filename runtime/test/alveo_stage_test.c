@@ -0,0 +1,145 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Tests of the staging kernels. Every instruction set the processor supports is checked against a bit-by-bit reference.
+// Sources end exactly at the end of their allocation, so that reads past the last source byte are caught when the test
+// is built with -fsanitize=address.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alveo_stage.h"
+
+#define GUARD 64
+
+static uint8_t pattern(int64_t i) {
+  return (uint8_t) ((i * 37) ^ (i >> 5) ^ 0xA5);
+}
+
+// A source of size bytes that ends at the end of its allocation.
+static uint8_t *make_source(int64_t size) {
+  uint8_t *src = malloc((size_t) (size > 0 ? size : 1));
+  assert(src != NULL);
+  for (int64_t i = 0; i < size; i++) {
+    src[i] = pattern(i);
+  }
+  return src;
+}
+
+static int bit(const uint8_t *bitmap, int64_t i) {
+  return (bitmap[i / 8] >> (i % 8)) & 1;
+}
+
+// Stage a bitmap with st and compare every bit, the cleared bits of the last byte, and the bytes after it.
+static void check_bitmap(AlveoStager *st, int64_t bit_offset, int64_t length) {
+  int64_t src_size = (bit_offset + length + 7) / 8;
+  int64_t n = (length + 7) / 8;
+  uint8_t *src = make_source(src_size);
+  uint8_t *dst = malloc((size_t) (n + GUARD));
+  assert(dst != NULL);
+  memset(dst, 0xEE, (size_t) (n + GUARD));
+  alveoStageBitmap(st, dst, src, bit_offset, length);
+  for (int64_t i = 0; i < length; i++) {
+    assert(bit(dst, i) == bit(src, bit_offset + i));
+  }
+  for (int64_t i = length; i < n * 8; i++) {
+    assert(bit(dst, i) == 0);
+  }
+  for (int64_t i = n; i < n + GUARD; i++) {
+    assert(dst[i] == 0xEE);
+  }
+  free(src);
+  free(dst);
+}
+
+static void check_copy(AlveoStager *st, int64_t size) {
+  uint8_t *src = make_source(size);
+  uint8_t *dst = malloc((size_t) (size + GUARD));
+  assert(dst != NULL);
+  memset(dst, 0xEE, (size_t) (size + GUARD));
+  alveoStageCopy(st, dst, src, size);
+  assert(memcmp(dst, src, (size_t) size) == 0);
+  for (int64_t i = size; i < size + GUARD; i++) {
+    assert(dst[i] == 0xEE);
+  }
+  free(src);
+  free(dst);
+}
+
+// A stager that uses isa, on one thread. Returns 0 if the processor does not support isa.
+static int init_isa(AlveoStager *st, AlveoStageIsa isa) {
+  alveoStageInit(st, isa, 1, 1ull << 40);
+  return st->isa == isa;
+}
+
+// Every bit offset within two bytes, for lengths around the vector widths of every instruction set.
+static void test_bitmap_matches_reference(void) {
+  for (int isa = ALVEO_STAGE_SCALAR; isa <= ALVEO_STAGE_AVX512; isa++) {
+    AlveoStager st;
+    if (!init_isa(&st, (AlveoStageIsa) isa)) {
+      printf("alveo_stage_test: %s not supported, skipped.\n", alveoStageIsaName((AlveoStageIsa) isa));
+      continue;
+    }
+    for (int64_t offset = 0; offset < 16; offset++) {
+      for (int64_t length = 0; length <= 8 * 160; length += (length < 80 ? 1 : 7)) {
+        check_bitmap(&st, offset, length);
+      }
+    }
+    check_bitmap(&st, 3, 1000003);
+    check_bitmap(&st, 8000, 999992);
+  }
+}
+
+// Copies of every size up to a few vectors, and a large one that takes the streaming store path.
+static void test_copy_matches_source(void) {
+  for (int isa = ALVEO_STAGE_SCALAR; isa <= ALVEO_STAGE_AVX512; isa++) {
+    AlveoStager st;
+    if (!init_isa(&st, (AlveoStageIsa) isa)) {
+      continue;
+    }
+    for (int64_t size = 0; size <= 300; size++) {
+      check_copy(&st, size);
+    }
+    check_copy(&st, (1 << 20) + 13);
+  }
+}
+
+// Calls split over several threads give the same result as calls on one thread.
+static void test_split_over_threads(void) {
+  for (int isa = ALVEO_STAGE_SCALAR; isa <= ALVEO_STAGE_AVX512; isa++) {
+    AlveoStager st;
+    if (!init_isa(&st, (AlveoStageIsa) isa)) {
+      continue;
+    }
+    st.threads = 5;
+    st.parallel_min = 100;
+    check_bitmap(&st, 5, 8 * 1000 + 3);
+    check_bitmap(&st, 0, 8 * 1000);
+    check_copy(&st, 1001);
+    assert(st.stats.parallel == 3);
+    assert(st.stats.bitmaps == 2);
+    assert(st.stats.copies == 1);
+  }
+}
+
+int main(void) {
+  test_bitmap_matches_reference();
+  test_copy_matches_source();
+  test_split_over_threads();
+  printf("alveo_stage_test: all tests passed.\n");
+  return 0;
+}
@@ -0,0 +1,216 @@
+// Copyright 2018 Delft University of Technology
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests of the stream pipeline against a mock of the XRT stream API, so that they run without a card. The mock kernel
+// loops H2K data back to K2H; a K2H transaction ends after the bytes that were put into it.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alveo_stream.h"
+
+#define MAX_REQUESTS 256
+
+typedef struct {
+  uint8_t *host;
+  size_t len;
+  cl_stream_xfer_req *req;
+} MockRequest;
+
+typedef struct {
+  int k2h;
+  MockRequest pending[MAX_REQUESTS];
+  uint32_t num_pending;
+  uint8_t data[1 << 20];        ///< Bytes of the current K2H transaction not read yet, or H2K bytes received.
+  int64_t available;
+  int eot;                      ///< The current K2H transaction ends after the available bytes.
+  int fail_next;                ///< Complete the next request with an error.
+  uint32_t released;
+} MockStream;
+
+static MockStream mocks[4];
+static uint32_t num_mocks = 0;
+
+cl_stream clCreateStream(cl_device_id device, cl_stream_flags flags, cl_stream_attributes attributes,
+                         cl_mem_ext_ptr_t *ext, cl_int *err) {
+  (void) device;
+  (void) attributes;
+  (void) ext;
+  MockStream *m = &mocks[num_mocks++];
+  memset(m, 0, sizeof(*m));
+  m->k2h = flags == XCL_STREAM_WRITE_ONLY;
+  *err = CL_SUCCESS;
+  return (cl_stream) m;
+}
+
+cl_int clReleaseStream(cl_stream stream) {
+  MockStream *m = (MockStream *) stream;
+  // Releasing a stream cancels its requests.
+  m->num_pending = 0;
+  m->released++;
+  return CL_SUCCESS;
+}
+
+static cl_int queue_request(cl_stream stream, void *host, size_t len, cl_stream_xfer_req *req, cl_int *err) {
+  MockStream *m = (MockStream *) stream;
+  assert(m->num_pending < MAX_REQUESTS);
+  m->pending[m->num_pending++] = (MockRequest) {(uint8_t *) host, len, req};
+  *err = CL_SUCCESS;
+  return CL_SUCCESS;
+}
+
+cl_int clWriteStream(cl_stream stream, const void *host, size_t len, cl_stream_xfer_req *req, cl_int *err) {
+  return queue_request(stream, (void *) host, len, req, err);
+}
+
+cl_int clReadStream(cl_stream stream, void *host, size_t len, cl_stream_xfer_req *req, cl_int *err) {
+  return queue_request(stream, host, len, req, err);
+}
+
+// Complete the requests at the front of the stream that can complete. A read completes once it is full, or short when
+// the transaction ends; reads behind that wait for the next transaction.
+cl_int clPollStream(cl_stream stream, cl_streams_poll_req_completions *completions, cl_int min, cl_int max,
+                    cl_int *num, cl_int timeout_ms, cl_int *err) {
+  (void) min;
+  (void) timeout_ms;
+  MockStream *m = (MockStream *) stream;
+  *num = 0;
+  *err = CL_SUCCESS;
+  while ((m->num_pending > 0) && (*num < max)) {
+    MockRequest *r = &m->pending[0];
+    cl_streams_poll_req_completions *c = &completions[*num];
+    c->priv_data = r->req->priv_data;
+    c->err_code = CL_SUCCESS;
+    if (m->fail_next) {
+      m->fail_next = 0;
+      c->nbytes = 0;
+      c->err_code = -1;
+    } else if (m->k2h) {
+      if ((m->available < (int64_t) r->len) && !m->eot) {
+        // Waits for more data, or for the next transaction if this one was read completely.
+        break;
+      }
+      size_t n = m->available < (int64_t) r->len ? (size_t) m->available : r->len;
+      memcpy(r->host, m->data, n);
+      memmove(m->data, m->data + n, (size_t) m->available - n);
+      m->available -= (int64_t) n;
+      c->nbytes = n;
+      if (m->available == 0) {
+        m->eot = 0;
+      }
+    } else {
+      memcpy(m->data + m->available, r->host, r->len);
+      m->available += (int64_t) r->len;
+      c->nbytes = r->len;
+    }
+    memmove(&m->pending[0], &m->pending[1], (m->num_pending - 1) * sizeof(MockRequest));
+    m->num_pending--;
+    (*num)++;
+  }
+  return CL_SUCCESS;
+}
+
+static AlveoStreamPool pool;
+
+static void open_pool(void) {
+  num_mocks = 0;
+  const uint32_t h2k = 0;
+  const uint32_t k2h = 1;
+  assert(alveoStreamPoolOpen(&pool, NULL, NULL, &h2k, 1, &k2h, 1) == FLETCHER_STATUS_OK);
+}
+
+// The kernel puts size bytes into the current K2H transaction and ends it.
+static void produce(MockStream *m, int64_t size) {
+  for (int64_t i = 0; i < size; i++) {
+    m->data[i] = (uint8_t) (i * 7);
+  }
+  m->available = size;
+  m->eot = 1;
+}
+
+static void test_h2k_chunks(void) {
+  open_pool();
+  static uint8_t src[100000];
+  for (size_t i = 0; i < sizeof(src); i++) {
+    src[i] = (uint8_t) i;
+  }
+  assert(alveoStreamTransfer(&pool, &pool.streams[0], src, sizeof(src), 4096, 8) == FLETCHER_STATUS_OK);
+  assert(mocks[0].available == (int64_t) sizeof(src));
+  assert(memcmp(mocks[0].data, src, sizeof(src)) == 0);
+  alveoStreamPoolClose(&pool);
+}
+
+// A K2H read that the kernel ends exactly at a chunk boundary must not leave a read behind for the next transaction.
+static void test_k2h_chunk_boundary(void) {
+  open_pool();
+  static uint8_t dst[8 * 4096];
+  produce(&mocks[1], 2 * 4096);
+  AlveoTransfer x;
+  memset(&x, 0, sizeof(x));
+  x.stream = &pool.streams[1];
+  x.host = dst;
+  x.size = sizeof(dst);
+  assert(alveoStreamPipeline(&pool, &x, 1, 4096, 8) == FLETCHER_STATUS_OK);
+  assert(x.completed == 2 * 4096);
+  assert(mocks[1].num_pending == 0);
+  alveoStreamPoolClose(&pool);
+}
+
+// A result read back with platformCopyResultToHost: the kernel produces fewer bytes than the capacity of the host
+// buffer, more than one chunk of them, and the read ends with exactly those.
+static void test_k2h_short_result(void) {
+  open_pool();
+  static uint8_t dst[8 * 4096];
+  const int64_t produced = 2 * 4096 + 1234;
+  produce(&mocks[1], produced);
+  AlveoTransfer x;
+  memset(&x, 0, sizeof(x));
+  x.stream = &pool.streams[1];
+  x.host = dst;
+  x.size = sizeof(dst);
+  assert(alveoStreamPipeline(&pool, &x, 1, 4096, 8) == FLETCHER_STATUS_OK);
+  assert(x.completed == produced);
+  for (int64_t i = 0; i < produced; i++) {
+    assert(dst[i] == (uint8_t) (i * 7));
+  }
+  assert(mocks[1].num_pending == 0);
+  // The next transaction is read whole, not partly by a read left over from this one.
+  produce(&mocks[1], 100);
+  assert(alveoStreamPipeline(&pool, &x, 1, 4096, 8) == FLETCHER_STATUS_OK);
+  assert(x.completed == 100);
+  alveoStreamPoolClose(&pool);
+}
+
+// A failed request must not leave the others in flight: they point at the transfer, which is gone after the call.
+static void test_failure_drains(void) {
+  open_pool();
+  static uint8_t src[64 * 4096];
+  mocks[0].fail_next = 1;
+  assert(alveoStreamTransfer(&pool, &pool.streams[0], src, sizeof(src), 4096, 8) == FLETCHER_STATUS_ERROR);
+  assert(mocks[0].num_pending == 0);
+  // The stream still works afterwards.
+  assert(alveoStreamTransfer(&pool, &pool.streams[0], src, 4096, 4096, 8) == FLETCHER_STATUS_OK);
+  alveoStreamPoolClose(&pool);
+}
+
+int main(void) {
+  test_h2k_chunks();
+  test_k2h_chunk_boundary();
+  test_k2h_short_result();
+  test_failure_drains();
+  printf("alveo_stream_test: all tests passed.\n");
+  return 0;
+}
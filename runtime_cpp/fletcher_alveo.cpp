@@ -1,246 +1,1098 @@
 #include "cmdlineparser.h"
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <string>
 #include <thread>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <uuid/uuid.h>
 #include <vector>
 #include <xclhal2.h>
-#include "expreimental/xclbin_util.h"
+#include "experimental/xclbin_util.h"
 //Following is for stream APIs:
 #include "CL/cl_ext_xilinx.h"
 //Following is required for OpenCL C++ wrapper APIs
 #include "xcl2.hpp"
-
-//Declaration of custom streaming APIs from xcl2.hpp:
-decltype(&clCreateStream) xcl::stream::createStream = nullptr;
-decltype(&clReleaseStream) xcl::stream::releaseStream = nullptr;
-decltype(&clReadStream) xcl::stream::readStream = nullptr;
-decltype(&clWriteStream) xcl::stream::writeStream = nullptr;
-decltype(&clPollStreams) xcl::stream::pollStreams = nullptr;
-//decltype(&xclGetComputeUnitInfo) xcl::Ext::getComputeUnitInfo = nullptr;
-
-
-void performStream(){
-
-	//Initialization of the streaming class before usage is needed before usage.
-	xcl::Stream::init(alveo_state.platform_id);
-	xcl::Ext::init(alveo_state.platform_id);
-
+#include "fletcher_alveo.hpp"
+
+//Definition of the custom streaming APIs declared in xcl2.hpp:
+decltype(&clCreateStream) xcl::Stream::createStream = nullptr;
+decltype(&clReleaseStream) xcl::Stream::releaseStream = nullptr;
+decltype(&clReadStream) xcl::Stream::readStream = nullptr;
+decltype(&clWriteStream) xcl::Stream::writeStream = nullptr;
+decltype(&clPollStreams) xcl::Stream::pollStreams = nullptr;
+//Extension functions that xcl2.hpp does not resolve, looked up like the ones above at platformInit:
+static decltype(&clPollStream) pollStream = nullptr;
+static decltype(&xclGetComputeUnitInfo) getComputeUnitInfo = nullptr;
+
+PlatformState alveo_state;
+
+//Create the stream of "s", bound to kernel argument s.arg. The kernel reads from XCL_STREAM_READ_ONLY streams and
+//writes to XCL_STREAM_WRITE_ONLY streams. On failure the stream is left null.
+static cl_int openStream(AlveoCU &cu, AlveoStream &s){
 	cl_int ret;
-
-	// Device Connection specification of the stream through extension pointer:
-  cl_mem_ext_ptr_t ext_stream;
-  ext_stream.param = (alveo_state.kernel).get();
-  ext_stream.obj = NULL;
-
-	// The .flag should be used to denote the kernel argument
-	// Create write stream for argument 1 of kernel:
-  ext_stream.flags = 1;
-
-  // Create streams:
-  cl_stream axis00_stream, axis01_stream;
-  OCL_CHECK(ret, axis00_stream = xcl::Stream::createStream(
-                     (alveo_state.device).get(), XCL_STREAM_WRITE_ONLY, CL_STREAM,
-                     &ext_stream, &ret));
-
-  ext_stream.flags = 0;
-  OCL_CHECK(ret, axis01_stream = xcl::Stream::createStream(
-                     (alveo_state.device).get(), XCL_STREAM_READ_ONLY, CL_STREAM,
-										 &ext_stream, &ret));
-
-  // Initiating the WRITE transfer
-  cl_stream_xfer_req wr_req{0};
-  wr_req.flags = CL_STREAM_EOT;
-  OCL_CHECK(ret, xcl::Stream::writeStream(axis01_stream, h_data.data(),
-                                          vector_size_bytes, &wr_req, &ret));
-
-  // Initiating the READ transfer
-  cl_stream_xfer_req rd_req{0};
-  rd_req.flags = CL_STREAM_EOT;
-  OCL_CHECK(ret, xcl::Stream::readStream(axis00_stream, read_data.data(),
-                                         vector_size_bytes, &rd_req, &ret));
+	cl_mem_ext_ptr_t ext;
+	ext.param = (cu.kernel).get();
+	ext.obj = NULL;
+	ext.flags = s.arg;
+	s.stream = xcl::Stream::createStream((cu.card->device).get(), s.flags, CL_STREAM, &ext, &ret);
+	if(ret != CL_SUCCESS){
+		s.stream = nullptr;
+	}
+	return ret;
 }
 
+//Create a stream bound to kernel argument "arg", with preallocated request slots.
+static AlveoStream createStream(AlveoCU &cu, cl_uint arg, cl_stream_flags flags){
+	AlveoStream s;
+	cl_int ret;
+	s.arg = arg;
+	s.flags = flags;
+	OCL_CHECK(ret, ret = openStream(cu, s));
+	s.reqs.resize(ALVEO_STREAM_SLOTS);
+	s.completions.resize(ALVEO_STREAM_SLOTS);
+	return s;
+}
 
+//Map the xclbin read-only instead of copying it into a heap buffer.
+static bool mapBinary(const std::string &path){
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd < 0){
+		return false;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0){
+		close(fd);
+		return false;
+	}
+	void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED){
+		return false;
+	}
+	alveo_state.xclbin_data = static_cast<const unsigned char *>(data);
+	alveo_state.xclbin_size = st.st_size;
+	xclbin_uuid(data, alveo_state.xclbin_id);
+	return true;
+}
 
+//Check whether the card already holds the mapped xclbin.
+static bool cardHoldsBinary(AlveoCard &card){
+	char path[512];
+	char loaded_str[64];
+	uuid_t loaded;
+	xclGetSysfsPath(card.handle, "icap", "xclbinuuid", path, sizeof(path));
+	FILE *f = fopen(path, "r");
+	if(f == nullptr){
+		return false;
+	}
+	char *line = fgets(loaded_str, sizeof(loaded_str), f);
+	fclose(f);
+	if(line == nullptr){
+		return false;
+	}
+	loaded_str[strcspn(loaded_str, "\r\n")] = '\0';
+	return (uuid_parse(loaded_str, loaded) == 0) && (uuid_compare(loaded, alveo_state.xclbin_id) == 0);
+}
 
+//Parse a comma-separated list of device indices, e.g. "0,2". An empty list selects all devices.
+static std::vector<unsigned int> parseCards(const std::string &list, size_t num_devices){
+	std::vector<unsigned int> cards;
+	size_t pos = 0;
+	while(pos < list.size()){
+		size_t end = list.find(',', pos);
+		if(end == std::string::npos){
+			end = list.size();
+		}
+		unsigned int i = std::stoul(list.substr(pos, end - pos));
+		if(i < num_devices){
+			cards.push_back(i);
+		}
+		pos = end + 1;
+	}
+	if(list.empty()){
+		for(unsigned int i = 0; i < num_devices; i++){
+			cards.push_back(i);
+		}
+	}
+	return cards;
+}
 
+//Start one dispatcher worker per compute unit, see platformDispatch.
+static void startDispatcher();
 
+fstatus_t platformGetName(char *name, size_t size){
+	if(size == 0){
+		return FLETCHER_STATUS_ERROR;
+	}
+	snprintf(name, size, "%s", FLETCHER_PLATFORM_NAME);
+	return FLETCHER_STATUS_OK;
+}
 
-
-
-
-
-
-
-
-
-
-
-
-
-fstatus_t platformInit(int argc, char **argv){
+fstatus_t platformInit(void *arg){
+	AlveoConfig *config = static_cast<AlveoConfig *>(arg);
+	if(config == nullptr){
+		return FLETCHER_STATUS_ERROR;
+	}
 
 	//command line parser:
 	sda::utils::CmdLineParser parser;
 
 	//Get the .xclbin file from the terminal command:
 	parser.addSwitch("--xclbin_file", "-x", "input binary file string: ", "");
-	parser.parse(argc, argv);
+	parser.addSwitch("--cards", "-c", "comma-separated indices of the devices to use, all if empty: ", "");
+	parser.addSwitch("--kernel", "-k", "name of the kernel, whose compute units are all used: ", "kernel");
+	parser.parse(config->argc, config->argv);
 
 	//Read settings:
 	std::string binaryFile = parser.value("xclbin_file");
+	const char *profile = getenv("FLETCHER_ALVEO_PROFILE");
+	alveo_state.trace_path = getenv("FLETCHER_ALVEO_TRACE");
+	alveo_state.profile = (profile != nullptr && std::string(profile) != "0") || alveo_state.trace_path != nullptr;
+	std::string kernelName = parser.value("kernel");
 
 	//If no xclbin file is provided, exit.
 	if(binaryFile.empty()){
 		parser.printHelp();
-		exit();
+		return FLETCHER_STATUS_ERROR;
 	}
 
 
 	//A vector of available devices:
 	auto devices = xcl::get_xil_devices();
 
-	//Load the binary file and return the pointer
-	//to file buffer.
-	alveo_state.fileBuf = xcl::read_binary_file(binaryFile);
-	alveo_state.bins{{(alveo_state.fileBuf).data(), fleBuf.size()}};
-	bool valid_device = false;
-	for(unsigned int = 0; i < devices.size(); i++){
-		alveo_state.device = devices[i];
+	//Map the binary file and compute its UUID once.
+	if(!mapBinary(binaryFile)){
+		std::cout << "Failed to load xclbin file " << binaryFile << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	alveo_state.bins = cl::Program::Binaries{{alveo_state.xclbin_data, alveo_state.xclbin_size}};
+
+	//Program every selected device, rather than only the first one that works:
+	std::vector<unsigned int> selected = parseCards(parser.value("cards"), devices.size());
+	for(unsigned int i : selected){
+		std::unique_ptr<AlveoCard> card(new AlveoCard);
+		card->index = alveo_state.cards.size();
+		card->device = devices[i];
 		//Create a Context and a Command Queue for the selected device.
-		OCL_CHECK(alveo_state.err, alveo_state.context = cl::Context(
-					alveo_state.device, NULL, NULL, NULL, &alveo_state.err));
-		OCL_CHECK(alveo_state.err, alveo_state.q = cl::CommandQueue(
-					alveo_state.context, alveo_state.device,
+		OCL_CHECK(alveo_state.err, card->context = cl::Context(
+					card->device, NULL, NULL, NULL, &alveo_state.err));
+		OCL_CHECK(alveo_state.err, card->q = cl::CommandQueue(
+					card->context, card->device,
 					CL_QUEUE_PROFILING_ENABLE |
 					CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &(alveo_state.err)));
+		clGetDeviceInfo((card->device).get(), CL_DEVICE_HANDLE,
+			sizeof(card->handle), &(card->handle), nullptr);
 
-		//Now, program the device.
-		std::cout << "Trying to program device[" << i << "]: " << (alveo_state).device.getInfo<
+		//Now, program the device. The driver skips the download if the card already holds this xclbin.
+		card->xclbin_reused = cardHoldsBinary(*card);
+		if(card->xclbin_reused){
+			std::cout << "Device[" << i << "] already holds " << binaryFile << ", skipping reprogramming." << std::endl;
+		}
+		std::cout << "Trying to program device[" << i << "]: " << (card->device).getInfo<
 			CL_DEVICE_NAME>() << std::endl;
 
-		alveo_state.program(alveo_state.context, {alveo_state.device}, alveo_state.bins,
+		card->program = cl::Program(card->context, {card->device}, alveo_state.bins,
 				NULL, &alveo_state.err);
 
 		if(alveo_state.err != CL_SUCCESS){
 			std::cout << "Failed to program the device [" << i << "] with xclbin file!\n ";
+			continue;
 		}
-		else{
-			std::cout << "Device [" << i << "]: programming successful!\n";
-
+		std::cout << "Device [" << i << "]: programming successful!\n";
 
 		//Creating Kernel (contained within .xlcbin file/Program):
-		OCL_CHECK(alveo_state.err, alveo_state.kernel = cl::Kernel(alveo_state.program,
-					"kernel", &alveo_state.err));
-		valid_device = true;
-		break; //we break because we found a valid device.
-		}
+		OCL_CHECK(alveo_state.err, card->kernel = cl::Kernel(card->program,
+					kernelName.c_str(), &alveo_state.err));
+		alveo_state.cards.push_back(std::move(card));
 	}
 
-	if(!valid_device){
+	if(alveo_state.cards.empty()){
 		std::cout << "Failed to program any device, exiting." << std::endl;
 		exit(EXIT_FAILURE);
 	}
 
-	alveo_state.platform_id = (alveo_state.device).getInfo<CL_DEVICE_PLATFORM>(&(alveo_state.err));
+	alveo_state.platform_id = (alveo_state.cards[0]->device).getInfo<CL_DEVICE_PLATFORM>(&(alveo_state.err));
+	xcl::Stream::init(alveo_state.platform_id);
+	pollStream = (decltype(&clPollStream))clGetExtensionFunctionAddressForPlatform(alveo_state.platform_id,
+			"clPollStream");
+	getComputeUnitInfo = (decltype(&xclGetComputeUnitInfo))clGetExtensionFunctionAddressForPlatform(
+			alveo_state.platform_id, "xclGetComputeUnitInfo");
+
+	//The xclbin may instantiate the kernel several times. Bind a kernel object, streams and a CU context
+	//to every instance once, and keep them until platformTerminate, so that register writes do not have to:
+	for(auto &card : alveo_state.cards){
+		cl_uint num_cus = 0;
+		clGetKernelInfo((card->kernel).get(), CL_KERNEL_COMPUTE_UNIT_COUNT, sizeof(num_cus), &num_cus, nullptr);
+		for(cl_uint i = 0; i < num_cus; i++){
+			std::unique_ptr<AlveoCU> cu(new AlveoCU);
+			cu->index = i;
+			cu->card = card.get();
+			char cu_name[128];
+			getComputeUnitInfo((card->kernel).get(), i,
+				XCL_COMPUTE_UNIT_NAME, sizeof(cu_name), cu_name, nullptr);
+			getComputeUnitInfo((card->kernel).get(), i,
+				XCL_COMPUTE_UNIT_INDEX, sizeof(cu->cuidx), &(cu->cuidx), nullptr);
+			std::string name = kernelName + ":{" + cu_name + "}";
+			OCL_CHECK(alveo_state.err, cu->kernel = cl::Kernel(card->program,
+						name.c_str(), &alveo_state.err));
+			if(xclOpenContext(card->handle, alveo_state.xclbin_id, cu->cuidx, true) != 0){
+				std::cout << "Failed to open a context on compute unit " << cu->cuidx
+					<< " of card " << card->index << std::endl;
+				return FLETCHER_STATUS_ERROR;
+			}
+			cu->context_open = true;
+
+			//Create all streams once, instead of on every copy:
+			for(cl_uint arg : alveo_state.h2k_args){
+				cu->h2k_streams.push_back(createStream(*cu, arg, XCL_STREAM_READ_ONLY));
+			}
+			for(cl_uint arg : alveo_state.k2h_args){
+				cu->k2h_streams.push_back(createStream(*cu, arg, XCL_STREAM_WRITE_ONLY));
+			}
+			alveo_state.cus.push_back(cu.get());
+			card->cus.push_back(std::move(cu));
+		}
+		std::cout << "Device [" << card->index << "]: " << card->cus.size() << " compute unit(s).\n";
+		if(card->cus.empty()){
+			return FLETCHER_STATUS_ERROR;
+		}
+	}
+	startDispatcher();
+	return FLETCHER_STATUS_OK;
 }
 
+//The context of the calling thread: the one it bound, or its own.
+static thread_local AlveoContext implicit_ctx;
+static thread_local AlveoContext *current_ctx = nullptr;
+
+static AlveoContext &currentContext(){
+	AlveoContext &ctx = current_ctx != nullptr ? *current_ctx : implicit_ctx;
+	//Drop the compute unit and queues of an earlier initialization of the platform.
+	uint64_t generation = alveo_state.generation;
+	if(ctx.generation != generation){
+		ctx.cu = nullptr;
+		ctx.queues.clear();
+		ctx.generation = generation;
+	}
+	return ctx;
+}
 
+static void selectCU(AlveoCU *cu){
+	currentContext().cu = cu;
+}
 
+//The compute unit the calling thread works on: the one it selected last, or the first one of the first card.
+static AlveoCU &currentCU(){
+	AlveoCU *cu = currentContext().cu;
+	return cu != nullptr ? *cu : *alveo_state.cards[0]->cus[0];
+}
 
+//The command queue of the calling thread on a card, created on first use like the queue of the card.
+static cl::CommandQueue &currentQueue(AlveoCard &card){
+	AlveoContext &ctx = currentContext();
+	if(ctx.queues.size() <= card.index){
+		ctx.queues.resize(alveo_state.cards.size());
+	}
+	cl::CommandQueue &q = ctx.queues[card.index];
+	if(q() == nullptr){
+		cl_int err;
+		q = cl::CommandQueue(card.context, card.device,
+				CL_QUEUE_PROFILING_ENABLE | CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &err);
+		if(err != CL_SUCCESS){
+			q = card.q;
+		}
+	}
+	return q;
+}
 
+fstatus_t platformContextCreate(AlveoContext **ctx){
+	AlveoContext *c = new AlveoContext;
+	c->cu = currentContext().cu;
+	c->generation = alveo_state.generation;
+	*ctx = c;
+	return FLETCHER_STATUS_OK;
+}
 
+fstatus_t platformContextBind(AlveoContext *ctx){
+	current_ctx = ctx;
+	return FLETCHER_STATUS_OK;
+}
 
+void platformContextDestroy(AlveoContext *ctx){
+	if(current_ctx == ctx){
+		current_ctx = nullptr;
+	}
+	delete ctx;
+}
 
+uint32_t platformCardCount(){
+	return alveo_state.cards.size();
+}
 
+fstatus_t platformSelectCard(uint32_t card){
+	if(card >= alveo_state.cards.size()){
+		return FLETCHER_STATUS_ERROR;
+	}
+	selectCU(alveo_state.cards[card]->cus[0].get());
+	return FLETCHER_STATUS_OK;
+}
 
+uint32_t platformComputeUnitCount(){
+	return currentCU().card->cus.size();
+}
 
+fstatus_t platformSelectComputeUnit(uint32_t cu){
+	AlveoCard &card = *currentCU().card;
+	if(cu >= card.cus.size()){
+		return FLETCHER_STATUS_ERROR;
+	}
+	selectCU(card.cus[cu].get());
+	return FLETCHER_STATUS_OK;
+}
 
+fstatus_t platformAcquireCard(uint32_t *card){
+	uint32_t n = alveo_state.cus.size();
+	if(n == 0){
+		return FLETCHER_STATUS_ERROR;
+	}
+	//Join the shortest per-CU queue over all cards, starting at a different CU every time so that idle ones are used
+	//round-robin.
+	uint32_t first = alveo_state.next_cu++;
+	AlveoCU *best = nullptr;
+	for(uint32_t i = 0; i < n; i++){
+		AlveoCU *c = alveo_state.cus[(first + i) % n];
+		if(best == nullptr || c->queued < best->queued){
+			best = c;
+		}
+	}
+	best->queued++;
+	best->lock.lock();
+	selectCU(best);
+	*card = best->card->index;
+	return FLETCHER_STATUS_OK;
+}
 
+fstatus_t platformReleaseCard(uint32_t card){
+	AlveoCU *cu = currentContext().cu;
+	if(cu == nullptr || cu->card->index != card){
+		return FLETCHER_STATUS_ERROR;
+	}
+	cu->lock.unlock();
+	cu->queued--;
+	return FLETCHER_STATUS_OK;
+}
 
+//Take the next job for worker w: its own oldest job, or else the newest job of the longest other queue.
+static bool takeJob(uint32_t w, std::pair<AlveoJobFn, void *> &job){
+	AlveoDispatcher &d = alveo_state.dispatcher;
+	uint32_t n = d.queues.size();
+	{
+		std::lock_guard<std::mutex> guard(d.queues[w]->lock);
+		if(!d.queues[w]->jobs.empty()){
+			job = d.queues[w]->jobs.front();
+			d.queues[w]->jobs.pop_front();
+			return true;
+		}
+	}
+	AlveoWorkQueue *victim = nullptr;
+	size_t longest = 0;
+	for(uint32_t i = 1; i < n; i++){
+		AlveoWorkQueue *q = d.queues[(w + i) % n].get();
+		std::lock_guard<std::mutex> guard(q->lock);
+		if(q->jobs.size() > longest){
+			victim = q;
+			longest = q->jobs.size();
+		}
+	}
+	if(victim == nullptr){
+		return false;
+	}
+	std::lock_guard<std::mutex> guard(victim->lock);
+	if(victim->jobs.empty()){
+		return false;
+	}
+	job = victim->jobs.back();
+	victim->jobs.pop_back();
+	d.queues[w]->stolen++;
+	return true;
+}
 
+//Worker w holds compute unit w for every job it runs, so a job can use the platform functions directly.
+static void workerMain(uint32_t w){
+	AlveoDispatcher &d = alveo_state.dispatcher;
+	AlveoCU *cu = alveo_state.cus[w];
+	for(;;){
+		std::pair<AlveoJobFn, void *> job;
+		if(!takeJob(w, job)){
+			std::unique_lock<std::mutex> guard(d.lock);
+			d.wake.wait(guard, [&d]{ return d.queued > 0 || d.stop; });
+			if(d.stop && d.queued <= 0){
+				return;
+			}
+			continue;
+		}
+		{
+			std::lock_guard<std::mutex> guard(d.lock);
+			d.queued--;
+		}
+		fstatus_t status;
+		{
+			std::lock_guard<std::mutex> guard(cu->lock);
+			selectCU(cu);
+			status = job.first(job.second);
+		}
+		d.queues[w]->executed++;
+		std::lock_guard<std::mutex> guard(d.lock);
+		if(status != FLETCHER_STATUS_OK){
+			d.status = FLETCHER_STATUS_ERROR;
+		}
+		if(--d.pending == 0){
+			d.drained.notify_all();
+		}
+	}
+}
 
+static void startDispatcher(){
+	AlveoDispatcher &d = alveo_state.dispatcher;
+	d.stop = false;
+	for(size_t w = 0; w < alveo_state.cus.size(); w++){
+		d.queues.emplace_back(new AlveoWorkQueue);
+	}
+	for(size_t w = 0; w < alveo_state.cus.size(); w++){
+		d.workers.emplace_back(workerMain, w);
+	}
+}
 
+static void stopDispatcher(){
+	AlveoDispatcher &d = alveo_state.dispatcher;
+	{
+		std::lock_guard<std::mutex> guard(d.lock);
+		d.stop = true;
+	}
+	d.wake.notify_all();
+	for(auto &t : d.workers){
+		t.join();
+	}
+	for(size_t w = 0; w < d.queues.size(); w++){
+		debug_print("[FLETCHER_ALVEO] Dispatcher: worker %zu ran %lu jobs, %lu of them stolen.\n", w,
+		            (unsigned long)d.queues[w]->executed, (unsigned long)d.queues[w]->stolen);
+	}
+	d.workers.clear();
+	d.queues.clear();
+}
 
-fstatus_t platformCopyHostToDevice(const uint8_t *host_source, da_t device_destination, int64_t size){
+fstatus_t platformDispatch(AlveoJobFn fn, void *arg){
+	AlveoDispatcher &d = alveo_state.dispatcher;
+	uint32_t n = d.queues.size();
+	if(n == 0){
+		return FLETCHER_STATUS_ERROR;
+	}
+	//Pick the shortest queue, starting at a different one every time so that ties are spread round-robin.
+	uint32_t first = d.next++;
+	AlveoWorkQueue *target = nullptr;
+	size_t shortest = SIZE_MAX;
+	for(uint32_t i = 0; i < n; i++){
+		AlveoWorkQueue *q = d.queues[(first + i) % n].get();
+		std::lock_guard<std::mutex> guard(q->lock);
+		if(q->jobs.size() < shortest){
+			target = q;
+			shortest = q->jobs.size();
+		}
+	}
+	{
+		std::lock_guard<std::mutex> guard(target->lock);
+		target->jobs.emplace_back(fn, arg);
+	}
+	{
+		std::lock_guard<std::mutex> guard(d.lock);
+		d.queued++;
+		d.pending++;
+	}
+	d.wake.notify_one();
+	return FLETCHER_STATUS_OK;
+}
 
+fstatus_t platformDispatchWait(){
+	AlveoDispatcher &d = alveo_state.dispatcher;
+	std::unique_lock<std::mutex> guard(d.lock);
+	d.drained.wait(guard, [&d]{ return d.pending == 0; });
+	fstatus_t status = d.status;
+	d.status = FLETCHER_STATUS_OK;
+	return status;
+}
 
+//Select the stream that a device address refers to. Any address without the stream flag uses the first stream.
+static AlveoStream *findStream(std::vector<AlveoStream> &streams, da_t address){
+	if(streams.empty()){
+		return nullptr;
+	}
+	if(!(address & ALVEO_STREAM_ADDRESS_FLAG)){
+		return &streams[0];
+	}
+	for(auto &s : streams){
+		if(s.arg == (address & 0xFFFF)){
+			return &s;
+		}
+	}
+	return nullptr;
+}
 
-	//Streams are:
-	cl_stream h2c_stream_a;
-	cl_stream c2h_stream;
+//Give up on a transfer with "in_flight" requests still outstanding. They refer to the host buffer, which the caller may
+//free and into which a read may still write, so they are drained first. If they do not all complete in time, the
+//stream is released, which cancels them, and created anew.
+static fstatus_t abortTransfer(AlveoCU &cu, AlveoStream &s, int in_flight){
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ALVEO_STREAM_DRAIN_TIMEOUT_MS);
+	while(in_flight > 0 && std::chrono::steady_clock::now() < deadline){
+		cl_int ret;
+		cl_int num_compl = 0;
+		pollStream(s.stream, s.completions.data(), 1, in_flight,
+				&num_compl, ALVEO_STREAM_DRAIN_TIMEOUT_MS, &ret);
+		if(num_compl > 0){
+			in_flight -= num_compl;
+		}
+	}
+	if(in_flight > 0){
+		xcl::Stream::releaseStream(s.stream);
+		//If this fails, the stream stays null, and transfers on it fail until platformTerminate.
+		openStream(cu, s);
+	}
+	return FLETCHER_STATUS_ERROR;
+}
 
+//Move "size" bytes through a persistent stream. The transfer is split into chunks of
+//ALVEO_CHUNK_SIZE bytes, up to ALVEO_QUEUE_DEPTH of which are kept in flight, reusing
+//the preallocated request and completion slots of the stream.
+static fstatus_t transferStream(AlveoCU &cu, AlveoStream &s, bool h2k, void *host, int64_t size){
+	std::lock_guard<std::mutex> guard(cu.stream_lock);
+	if(s.stream == nullptr){
+		return FLETCHER_STATUS_ERROR;
+	}
 	cl_int ret;
+	int64_t submitted = 0;
+	int in_flight = 0;
+	size_t slot = 0;
+	while(submitted < size || in_flight > 0){
+		while(submitted < size && in_flight < ALVEO_QUEUE_DEPTH){
+			int64_t len = std::min<int64_t>(ALVEO_CHUNK_SIZE, size - submitted);
+			cl_stream_xfer_req &req = s.reqs[slot];
+			slot = (slot + 1) % s.reqs.size();
+			req = cl_stream_xfer_req{};
+			req.flags = CL_STREAM_NONBLOCKING;
+			if(submitted + len == size){
+				req.flags |= CL_STREAM_EOT;
+			}
+			req.priv_data = (char *)&req;
+			uint8_t *ptr = (uint8_t *)host + submitted;
+			if(h2k){
+				xcl::Stream::writeStream(s.stream, ptr, len, &req, &ret);
+			}
+			else{
+				xcl::Stream::readStream(s.stream, ptr, len, &req, &ret);
+			}
+			if(ret != CL_SUCCESS){
+				return abortTransfer(cu, s, in_flight);
+			}
+			submitted += len;
+			in_flight++;
+		}
 
-	// Device Connection specification of the stream through extension pointer:
-	cl_mem_ext_ptr_t ext;
-	ext.param = increment.get();
-	ext.obj = NULL;
+		//Drain whatever has completed on this stream, at least one request. Polling the stream rather than the device
+		//leaves the completions of other compute units to the threads that wait for them. A poll that timed out
+		//returns no completions; the requests are still in flight, so keep waiting for them.
+		cl_int num_compl = 0;
+		pollStream(s.stream, s.completions.data(), 1, in_flight,
+				&num_compl, ALVEO_STREAM_POLL_TIMEOUT_MS, &ret);
+		if(num_compl <= 0){
+			continue;
+		}
+		in_flight -= num_compl;
+		for(cl_int i = 0; i < num_compl; i++){
+			if(s.completions[i].err_code != CL_SUCCESS){
+				return abortTransfer(cu, s, in_flight);
+			}
+		}
+	}
+	return FLETCHER_STATUS_OK;
+}
 
-	// The .flag should be used to denote the kernel argument
-	// Create write stream for argument 0 of kernel:
-	ext.flags = 0;
+static uint64_t nowNs(){
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-	OCL_CHECK(ret, h2c_stream_a = xcl::Stream::createStream((alveo_state.device).get(),
-			XCL_STREAM_READ_ONLY, CL_STREAM, &(alveo_state.ext), &(alveo_state.ret)));
+static void addRecord(const AlveoProfileRecord &r){
+	std::lock_guard<std::mutex> guard(alveo_state.profile_lock);
+	alveo_state.records.push_back(r);
+}
 
-	// Create read stream for argument 1 of kernel:
-  	ext.flags = 1;
-  	OCL_CHECK(ret, c2h_Stream = xcl::Stream::createStream((alveo_state.device).get(),
-                       	XCL_STREAM_WRITE_ONLY,CL_STREAM, &(alveo_state.ext), &(alveo_state.ret)));
+//Stream transfers do not go through the command queue, so they are timed on the host.
+static fstatus_t profiledTransfer(AlveoCU &cu, AlveoStream &s, bool h2k, void *host, int64_t size){
+	if(!alveo_state.profile){
+		return transferStream(cu, s, h2k, host, size);
+	}
+	uint64_t start = nowNs();
+	fstatus_t status = transferStream(cu, s, h2k, host, size);
+	if(status == FLETCHER_STATUS_OK){
+		addRecord({h2k ? "H2D" : "D2H", cu.card->index, cu.index, size, start, start, start, nowNs()});
+	}
+	return status;
+}
 
-	//Sync for the async streaming.
-	int num_compl = 2 * num_Blocks;
+fstatus_t platformCopyHostToDevice(const uint8_t *host_source, da_t device_destination, int64_t size){
+	AlveoCU &cu = currentCU();
+	AlveoStream *s = findStream(cu.h2k_streams, device_destination);
+	if(s == nullptr){
+		return FLETCHER_STATUS_ERROR;
+	}
+	return profiledTransfer(cu, *s, true, (void *)host_source, size);
+}
 
-	//Checking the request completion:
-	cl_streams_poll_req_completions *poll_req;
-	poll_req = (cl_streams_poll_req_completions *)malloc(sizeof(
-				cl_streams_poll_req_completion)*num_compl);
+fstatus_t platformCopyDeviceToHost(const da_t device_source, uint8_t *host_destination, int64_t size){
+	AlveoCU &cu = currentCU();
+	AlveoStream *s = findStream(cu.k2h_streams, device_source);
+	if(s == nullptr){
+		return FLETCHER_STATUS_ERROR;
+	}
+	return profiledTransfer(cu, *s, false, host_destination, size);
+}
 
+fstatus_t platformCopyHostToDeviceV(const AlveoCopyDesc *descs, size_t n){
+	AlveoCU &cu = currentCU();
+	//Group the buffers by stream, keeping their order. A buffer that is the only one for its stream is sent in place.
+	std::vector<std::pair<AlveoStream *, std::vector<const AlveoCopyDesc *>>> groups;
+	for(size_t i = 0; i < n; i++){
+		AlveoStream *s = findStream(cu.h2k_streams, descs[i].device);
+		if(s == nullptr){
+			return FLETCHER_STATUS_ERROR;
+		}
+		size_t g = 0;
+		while(g < groups.size() && groups[g].first != s){
+			g++;
+		}
+		if(g == groups.size()){
+			groups.emplace_back(s, std::vector<const AlveoCopyDesc *>());
+		}
+		groups[g].second.push_back(&descs[i]);
+	}
+	std::vector<uint8_t> staging;
+	for(auto &g : groups){
+		if(g.second.size() == 1){
+			const AlveoCopyDesc *d = g.second[0];
+			if(profiledTransfer(cu, *g.first, true, (void *)d->host, d->size) != FLETCHER_STATUS_OK){
+				return FLETCHER_STATUS_ERROR;
+			}
+			continue;
+		}
+		staging.clear();
+		for(const AlveoCopyDesc *d : g.second){
+			staging.insert(staging.end(), d->host, d->host + d->size);
+		}
+		if(profiledTransfer(cu, *g.first, true, staging.data(), staging.size()) != FLETCHER_STATUS_OK){
+			return FLETCHER_STATUS_ERROR;
+		}
+	}
+	return FLETCHER_STATUS_OK;
+}
 
+//Execute the operations of a compute unit in order, until it is stopped and no operation is left.
+static void asyncMain(AlveoCU *cu){
+	AlveoAsyncQueue &q = cu->async;
+	selectCU(cu);
+	for(;;){
+		std::function<void()> op;
+		{
+			std::unique_lock<std::mutex> guard(q.lock);
+			q.wake.wait(guard, [&q]{ return !q.ops.empty() || q.stop; });
+			if(q.ops.empty()){
+				return;
+			}
+			op = std::move(q.ops.front());
+			q.ops.pop_front();
+		}
+		op();
+	}
+}
 
-fstatus_t platformWriteMMIO(uint64_t offset, uint32_t value){
-	xcl::Stream::init(alveo_state.platform_id);
-	xcl::Ext::init(alveo_state.platform_id);
+static fstatus_t submitAsync(std::function<fstatus_t()> run, AlveoFuture *after, AlveoFuture **future){
+	AlveoCU &cu = currentCU();
+	//Operations that depend on a failed one fail as well, without touching the card.
+	std::shared_future<fstatus_t> dependency;
+	if(after != nullptr){
+		dependency = after->result;
+	}
+	auto task = std::make_shared<std::packaged_task<fstatus_t()>>([run, dependency]{
+		if(dependency.valid() && dependency.get() != FLETCHER_STATUS_OK){
+			return (fstatus_t)FLETCHER_STATUS_ERROR;
+		}
+		return run();
+	});
+	std::shared_future<fstatus_t> result = task->get_future().share();
+	{
+		std::lock_guard<std::mutex> guard(cu.async.lock);
+		if(!cu.async.thread.joinable()){
+			cu.async.thread = std::thread(asyncMain, &cu);
+		}
+		cu.async.ops.emplace_back([task]{ (*task)(); });
+	}
+	cu.async.wake.notify_one();
+	if(future != nullptr){
+		*future = new AlveoFuture{result};
+	}
+	return FLETCHER_STATUS_OK;
+}
 
-	uuid_t xclbinId;
-	xclbin_uuid((alveo_state.fileBuf).data(), xclbinId);
+fstatus_t platformCopyHostToDeviceAsync(const uint8_t *host_source, da_t device_destination, int64_t size,
+                                        AlveoFuture *after, AlveoFuture **future){
+	return submitAsync([=]{ return platformCopyHostToDevice(host_source, device_destination, size); }, after, future);
+}
 
-	//Getting the device handle:
-	clGetDeviceInfo((alveo_state.device).get(), CL_DEVICE_HANDLE,
-		sizeof(alveo_state.handle), &(alveo_state.handle), nullptr);
+fstatus_t platformCopyDeviceToHostAsync(da_t device_source, uint8_t *host_destination, int64_t size,
+                                        AlveoFuture *after, AlveoFuture **future){
+	return submitAsync([=]{ return platformCopyDeviceToHost(device_source, host_destination, size); }, after, future);
+}
 
-	cl_uint cuidx;
-	xcl::Ext::getComputeUnitInfo((alveo_state.kernel).get(), 0,
-		XCL_COMPUTE_UNIT_INDEX, sizeof(cuidx), &cuidx, nullptr);
+//Write a register of the compute unit. The kernel latches a register on the "valid" strobe in the next word.
+static inline int writeRegister(AlveoCU &cu, uint64_t offset, uint32_t value){
+	int ret = xclRegWrite(cu.card->handle, cu.cuidx, offset, value);
+	uint32_t drive_valid = 1;
+	ret |= xclRegWrite(cu.card->handle, cu.cuidx, offset + sizeof(int), drive_valid);
+	return ret;
+}
 
-	//Write the register value:
-	xclOpenContext(alveo_state.handle, xclbinId, cuidx, false);
+//Read a register of the compute unit, addressed like writeRegister.
+static inline int readRegister(AlveoCU &cu, uint64_t offset, uint32_t *value){
+	return xclRegRead(cu.card->handle, cu.cuidx, offset, value);
+}
 
-	//Write "value" to "offset":
-	xclRegWrite(alveo_state.handle, cuidx, offset, value);
-	std::cout << "\nThe register value that is written: " << std::endl;
+fstatus_t platformRunAsync(uint64_t timeout_us, AlveoFuture *after, AlveoFuture **future){
+	return submitAsync([=]{
+		AlveoCU &cu = currentCU();
+		if(writeRegister(cu, FLETCHER_REG_CONTROL, ALVEO_CONTROL_START) != 0){
+			return (fstatus_t)FLETCHER_STATUS_ERROR;
+		}
+		//Poll the status register, backing off up to a millisecond between reads.
+		auto start = std::chrono::steady_clock::now();
+		std::chrono::microseconds backoff(1);
+		for(;;){
+			uint32_t status = 0;
+			if(readRegister(cu, FLETCHER_REG_STATUS, &status) != 0){
+				return (fstatus_t)FLETCHER_STATUS_ERROR;
+			}
+			if(status & ALVEO_STATUS_DONE){
+				return (fstatus_t)FLETCHER_STATUS_OK;
+			}
+			if(timeout_us > 0 && std::chrono::steady_clock::now() - start > std::chrono::microseconds(timeout_us)){
+				return (fstatus_t)FLETCHER_STATUS_ERROR;
+			}
+			std::this_thread::sleep_for(backoff);
+			backoff = std::min(2 * backoff, std::chrono::microseconds(1000));
+		}
+	}, after, future);
+}
 
-	uint32_t drive_valid = 1;
-	xclRegWrite(alveo_state.handle, cuidx, offset + sizeof(int), drive_valid);
+fstatus_t platformFutureWait(AlveoFuture *future){
+	return future->result.get();
+}
 
-	//Closing the context:
-	xclCloseContext(alveo_state.handle, xclbinId, cuidx);
+int platformFuturePoll(AlveoFuture *future, fstatus_t *status){
+	if(future->result.wait_for(std::chrono::seconds(0)) != std::future_status::ready){
+		return 0;
+	}
+	if(status != nullptr){
+		*status = future->result.get();
+	}
+	return 1;
+}
 
+void platformFutureRelease(AlveoFuture *future){
+	delete future;
+}
 
-	//Streaming:
-	cl_int ret;
-	cl_mem_ext_ptr_t ext_stream;
-	ext_stream.param = krnl_incr.get();
-	ext_stream.obj = NULL;
-	ext_stream.flags = 1;
+static AlveoNode addNode(AlveoGraph &graph, AlveoGraphNode node){
+	for(AlveoNode d : node.deps){
+		if(d >= graph.nodes.size()){
+			std::cout << "Execution graph node depends on node " << d << ", which is declared after it." << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	graph.nodes.push_back(std::move(node));
+	return graph.nodes.size() - 1;
+}
+
+AlveoNode platformGraphCopyToDevice(AlveoGraph &graph, const void *host, cl::Buffer buffer, size_t offset, size_t size,
+                                    std::vector<AlveoNode> deps){
+	AlveoGraphNode node;
+	node.type = AlveoGraphNode::COPY_TO_DEVICE;
+	node.host = const_cast<void *>(host);
+	node.buffer = buffer;
+	node.offset = offset;
+	node.size = size;
+	node.deps = std::move(deps);
+	return addNode(graph, std::move(node));
+}
+
+AlveoNode platformGraphCopyToHost(AlveoGraph &graph, cl::Buffer buffer, size_t offset, size_t size, void *host,
+                                  std::vector<AlveoNode> deps){
+	AlveoGraphNode node;
+	node.type = AlveoGraphNode::COPY_TO_HOST;
+	node.host = host;
+	node.buffer = buffer;
+	node.offset = offset;
+	node.size = size;
+	node.deps = std::move(deps);
+	return addNode(graph, std::move(node));
+}
+
+AlveoNode platformGraphStreamToDevice(AlveoGraph &graph, const void *host, da_t stream, size_t size,
+                                      std::vector<AlveoNode> deps){
+	AlveoGraphNode node;
+	node.type = AlveoGraphNode::STREAM_TO_DEVICE;
+	node.host = const_cast<void *>(host);
+	node.stream = stream;
+	node.size = size;
+	node.deps = std::move(deps);
+	return addNode(graph, std::move(node));
+}
+
+AlveoNode platformGraphStreamToHost(AlveoGraph &graph, da_t stream, size_t size, void *host,
+                                    std::vector<AlveoNode> deps){
+	AlveoGraphNode node;
+	node.type = AlveoGraphNode::STREAM_TO_HOST;
+	node.host = host;
+	node.stream = stream;
+	node.size = size;
+	node.deps = std::move(deps);
+	return addNode(graph, std::move(node));
+}
+
+AlveoNode platformGraphRun(AlveoGraph &graph, std::vector<std::pair<cl_uint, cl::Buffer>> args,
+                           std::vector<AlveoNode> deps){
+	AlveoGraphNode node;
+	node.type = AlveoGraphNode::RUN;
+	node.args = std::move(args);
+	node.deps = std::move(deps);
+	return addNode(graph, std::move(node));
+}
+
+//Run a stream transfer on the asynchronous queue of the compute unit, and complete "done" when it finished.
+static fstatus_t enqueueStream(AlveoCU &cu, AlveoGraphNode &node, std::vector<cl::Event> waits){
+	cl_int err;
+	cl::UserEvent done(cu.card->context, &err);
+	if(err != CL_SUCCESS){
+		return FLETCHER_STATUS_ERROR;
+	}
+	node.done = done;
+	bool h2k = node.type == AlveoGraphNode::STREAM_TO_DEVICE;
+	da_t stream = node.stream;
+	void *host = node.host;
+	int64_t size = node.size;
+	return submitAsync([&cu, h2k, stream, host, size, waits, done]() mutable {
+		fstatus_t status = FLETCHER_STATUS_OK;
+		if(!waits.empty() && cl::WaitForEvents(waits) != CL_SUCCESS){
+			status = FLETCHER_STATUS_ERROR;
+		}
+		AlveoStream *s = findStream(h2k ? cu.h2k_streams : cu.k2h_streams, stream);
+		if(status == FLETCHER_STATUS_OK){
+			status = s != nullptr ? profiledTransfer(cu, *s, h2k, host, size) : FLETCHER_STATUS_ERROR;
+		}
+		done.setStatus(status == FLETCHER_STATUS_OK ? CL_COMPLETE : -1);
+		return status;
+	}, nullptr, nullptr);
+}
+
+fstatus_t platformGraphExecute(AlveoGraph &graph){
+	AlveoCU &cu = currentCU();
+	cl::CommandQueue &q = currentQueue(*cu.card);
+	cl_int err = CL_SUCCESS;
+	for(auto &node : graph.nodes){
+		std::vector<cl::Event> waits;
+		for(AlveoNode d : node.deps){
+			waits.push_back(graph.nodes[d].done);
+		}
+		const std::vector<cl::Event> *wait_list = waits.empty() ? nullptr : &waits;
+		switch(node.type){
+			case AlveoGraphNode::COPY_TO_DEVICE:
+				err = q.enqueueWriteBuffer(node.buffer, CL_FALSE, node.offset, node.size, node.host, wait_list,
+						&node.done);
+				break;
+			case AlveoGraphNode::COPY_TO_HOST:
+				err = q.enqueueReadBuffer(node.buffer, CL_FALSE, node.offset, node.size, node.host, wait_list,
+						&node.done);
+				break;
+			case AlveoGraphNode::RUN:
+				//Arguments are captured when the run is enqueued, so the next run may set others.
+				for(auto &arg : node.args){
+					cu.kernel.setArg(arg.first, arg.second);
+				}
+				err = q.enqueueTask(cu.kernel, wait_list, &node.done);
+				break;
+			case AlveoGraphNode::STREAM_TO_DEVICE:
+			case AlveoGraphNode::STREAM_TO_HOST:
+				err = enqueueStream(cu, node, std::move(waits)) == FLETCHER_STATUS_OK ? CL_SUCCESS : CL_INVALID_VALUE;
+				break;
+		}
+		if(err != CL_SUCCESS){
+			std::cout << "Failed to enqueue execution graph node (" << err << ")." << std::endl;
+			q.finish();
+			return FLETCHER_STATUS_ERROR;
+		}
+	}
+	q.flush();
+
+	//Wait for every node, and check that none of them failed:
+	fstatus_t status = FLETCHER_STATUS_OK;
+	for(auto &node : graph.nodes){
+		node.done.wait();
+		if(node.done.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE){
+			status = FLETCHER_STATUS_ERROR;
+		}
+	}
+	if(alveo_state.profile && status == FLETCHER_STATUS_OK){
+		//The profiling counters of the queue run on the device clock. Move them onto the host clock by lining up the
+		//last command to end with now. Stream transfers were timed on the host already.
+		uint64_t now = nowNs();
+		uint64_t last = 0;
+		for(auto &node : graph.nodes){
+			if(node.type != AlveoGraphNode::STREAM_TO_DEVICE && node.type != AlveoGraphNode::STREAM_TO_HOST){
+				last = std::max<uint64_t>(last, node.done.getProfilingInfo<CL_PROFILING_COMMAND_END>());
+			}
+		}
+		for(auto &node : graph.nodes){
+			const char *name = node.type == AlveoGraphNode::COPY_TO_DEVICE ? "H2D" :
+				node.type == AlveoGraphNode::COPY_TO_HOST ? "D2H" :
+				node.type == AlveoGraphNode::RUN ? "Run" : nullptr;
+			if(name == nullptr){
+				continue;
+			}
+			addRecord({name, cu.card->index, cu.index, (int64_t)node.size,
+				now - (last - node.done.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>()),
+				now - (last - node.done.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>()),
+				now - (last - node.done.getProfilingInfo<CL_PROFILING_COMMAND_START>()),
+				now - (last - node.done.getProfilingInfo<CL_PROFILING_COMMAND_END>())});
+		}
+	}
+	return status;
+}
 
+//Print the number, latency percentiles and effective bandwidth of every kind of operation.
+static void printProfile(){
+	for(const char *name : {"H2D", "D2H", "Run"}){
+		std::vector<uint64_t> latencies;
+		uint64_t bytes = 0;
+		uint64_t busy = 0;
+		for(auto &r : alveo_state.records){
+			if(std::string(r.name) == name){
+				latencies.push_back(r.end_ns - r.queued_ns);
+				bytes += r.size;
+				busy += r.end_ns - r.start_ns;
+			}
+		}
+		if(latencies.empty()){
+			continue;
+		}
+		std::sort(latencies.begin(), latencies.end());
+		std::cout << "Profile " << name << ": " << latencies.size() << " ops, p50 "
+			<< latencies[latencies.size() / 2] << " ns, p99 " << latencies[latencies.size() * 99 / 100]
+			<< " ns, max " << latencies.back() << " ns";
+		if(bytes > 0 && busy > 0){
+			std::cout << ", " << bytes << " bytes, " << (double)bytes / busy << " GB/s";
+		}
+		std::cout << std::endl;
+	}
+}
+
+//Write all records in the Chrome trace event format, one track per card (process) and compute unit (thread).
+static bool writeTrace(const char *path){
+	FILE *f = fopen(path, "w");
+	if(f == nullptr){
+		return false;
+	}
+	uint64_t epoch = UINT64_MAX;
+	for(auto &r : alveo_state.records){
+		epoch = std::min(epoch, r.queued_ns);
+	}
+	fprintf(f, "{\"traceEvents\":[");
+	for(size_t i = 0; i < alveo_state.records.size(); i++){
+		auto &r = alveo_state.records[i];
+		fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+			"\"args\":{\"size\":%ld,\"queued_us\":%.3f,\"submit_us\":%.3f}}",
+			i > 0 ? "," : "", r.name, r.card, r.cu,
+			(r.start_ns - epoch) / 1000.0, (r.end_ns - r.start_ns) / 1000.0, (long)r.size,
+			(r.queued_ns - epoch) / 1000.0, (r.submit_ns - epoch) / 1000.0);
+	}
+	fprintf(f, "\n]}\n");
+	return fclose(f) == 0;
+}
 
+fstatus_t platformTerminate(void *arg){
+	(void)arg;
+	stopDispatcher();
+	//Finish all queued asynchronous operations first:
+	for(AlveoCU *cu : alveo_state.cus){
+		{
+			std::lock_guard<std::mutex> guard(cu->async.lock);
+			cu->async.stop = true;
+		}
+		cu->async.wake.notify_one();
+		if(cu->async.thread.joinable()){
+			cu->async.thread.join();
+		}
+	}
+	for(AlveoCU *cu : alveo_state.cus){
+		for(auto &s : cu->h2k_streams){
+			xcl::Stream::releaseStream(s.stream);
+		}
+		for(auto &s : cu->k2h_streams){
+			xcl::Stream::releaseStream(s.stream);
+		}
+		if(cu->context_open){
+			xclCloseContext(cu->card->handle, alveo_state.xclbin_id, cu->cuidx);
+		}
+	}
+	alveo_state.cus.clear();
+	alveo_state.cards.clear();
+	alveo_state.generation++;
+	if(alveo_state.profile){
+		printProfile();
+		if(alveo_state.trace_path != nullptr && !writeTrace(alveo_state.trace_path)){
+			std::cout << "Failed to write trace to " << alveo_state.trace_path << std::endl;
+		}
+		alveo_state.records.clear();
+	}
+	if(alveo_state.xclbin_data != nullptr){
+		munmap((void *)alveo_state.xclbin_data, alveo_state.xclbin_size);
+		alveo_state.xclbin_data = nullptr;
+	}
+	return FLETCHER_STATUS_OK;
+}
 
+fstatus_t platformWriteMMIO(uint64_t offset, uint32_t value){
+	//The handle, UUID and CU index are resolved and the context is opened once, at platformInit.
+	if(writeRegister(currentCU(), offset, value) != 0){
+		return FLETCHER_STATUS_ERROR;
+	}
+	return FLETCHER_STATUS_OK;
+}
 
+fstatus_t platformWriteMMIOBatch(const uint64_t *offsets, const uint32_t *values, size_t n){
+	AlveoCU &cu = currentCU();
+	for(size_t i = 0; i < n; i++){
+		if(writeRegister(cu, offsets[i], values[i]) != 0){
+			return FLETCHER_STATUS_ERROR;
+		}
+	}
+	return FLETCHER_STATUS_OK;
+}
 
+fstatus_t platformReadMMIO(uint64_t offset, uint32_t *value){
+	if(readRegister(currentCU(), offset, value) != 0){
+		return FLETCHER_STATUS_ERROR;
+	}
+	return FLETCHER_STATUS_OK;
 }
@@ -1,7 +1,21 @@
 #include <unistd.h>
+#include <uuid/uuid.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
 
+//xcl2.hpp configures the OpenCL C++ bindings before it includes them, so it comes first.
+#include "xcl2.hpp"
 #include <CL/opencl.h>
 #include <CL/cl_ext.h>
+#include <CL/cl_ext_xilinx.h>
 #include "xclhal2.h"
 
 #include "fletcher/fletcher.h"
@@ -12,35 +26,219 @@
 #define FLETCHER_PLATFORM_NAME "alveo"
 #define ALVEO_DEVICE_NAME "xilinx_alveo_U250"  // Look at this and correct it.
 
-typedef struct {
+// Number of preallocated request/completion slots per stream.
+#define ALVEO_STREAM_SLOTS 64
+// Device addresses with this bit set refer to the stream bound to kernel argument (address & 0xFFFF).
+#define ALVEO_STREAM_ADDRESS_FLAG (1ull << 63)
+#define ALVEO_STREAM_POLL_TIMEOUT_MS 10000
+// Time given to the requests of a failed transfer to complete, before their stream is recreated to cancel them.
+#define ALVEO_STREAM_DRAIN_TIMEOUT_MS 100
+// Stream transfers are split into chunks, of which a number is kept in flight.
+#define ALVEO_CHUNK_SIZE (4 << 20)
+#define ALVEO_QUEUE_DEPTH 8
+// Control and status register bits of the Fletcher kernel.
+#define ALVEO_CONTROL_START 0x1u
+#define ALVEO_STATUS_DONE 0x4u
 
-} AlveoConfig;
+// A stream bound to a kernel argument, created once at platformInit and recreated when a transfer on it is aborted.
+struct AlveoStream {
+	cl_stream stream;
+	cl_uint arg;
+	cl_stream_flags flags;	//Direction, to recreate the stream with.
+	std::vector<cl_stream_xfer_req> reqs;
+	std::vector<cl_streams_poll_req_completions> completions;
+};
 
-typedef struct {
-	cl_int err;
-	cl::Kernel kernel;
+// Arguments of platformInit: the command line of the application, parsed for --xclbin_file, --cards and --kernel.
+struct AlveoConfig {
+	int argc;
+	char **argv;
+};
+
+struct AlveoCard;
+
+// Completion handle of an asynchronous operation.
+struct AlveoFuture {
+	std::shared_future<fstatus_t> result;
+};
+
+// In-order queue of asynchronous operations on one compute unit, executed by a thread started on first use.
+struct AlveoAsyncQueue {
+	std::mutex lock;
+	std::condition_variable wake;
+	std::deque<std::function<void()>> ops;
+	std::thread thread;
+	bool stop = false;
+};
+
+// One instance of the kernel. Every compute unit has its own registers and streams, and runs one job at a time.
+struct AlveoCU {
+	unsigned int index;	//Index of the compute unit on its card.
+	AlveoCard *card;
+	cl::Kernel kernel;	//Bound to this compute unit only, as "kernel:{name}".
+	cl_uint cuidx;
+	bool context_open = false;
+	std::vector<AlveoStream> h2k_streams;
+	std::vector<AlveoStream> k2h_streams;
+	std::mutex lock;	//Held by the job running on this compute unit, see platformAcquireCard.
+	std::mutex stream_lock;	//Serializes the threads that use the streams of this compute unit.
+	std::atomic<uint32_t> queued{0};	//Jobs that acquired this compute unit and did not release it yet.
+	AlveoAsyncQueue async;
+};
+
+// Everything that belongs to one card. Every matching card is programmed and runs its own copies of the kernel.
+struct AlveoCard {
+	unsigned int index;
 	cl::Device device;
 	cl::Context context;
-	cl::CommandQueue q;	
+	cl::CommandQueue q;
 	cl::Program program;
-	cl::Program::Binaries bins;
-	auto fileBuf;
-	auto platform_id;
+	cl::Kernel kernel;	//Any compute unit; only used to discover them.
 	xclDeviceHandle handle;
-} PlatformState;
+	bool xclbin_reused = false;	//The card already held the xclbin and was not reprogrammed.
+	std::vector<std::unique_ptr<AlveoCU>> cus;
+};
+
+// What one thread needs to drive the cards on its own: the selected compute unit, and a command queue per card so that
+// threads do not contend on one queue. Every thread has one implicitly; platformContextCreate makes one that can be
+// bound to threads explicitly.
+struct AlveoContext {
+	AlveoCU *cu = nullptr;	//Selected compute unit, nullptr for the first one of the first card.
+	std::vector<cl::CommandQueue> queues;	//Per card, created on first use.
+	uint64_t generation = 0;	//Platform initialization the fields above belong to, see PlatformState.
+};
+
+// One buffer of a vectored copy, see platformCopyHostToDeviceV.
+struct AlveoCopyDesc {
+	const uint8_t *host;
+	da_t device;
+	int64_t size;
+};
+
+typedef fstatus_t (*AlveoJobFn)(void *arg);
+
+// Work-stealing dispatcher with one worker per compute unit. Jobs go to the shortest queue; an idle worker takes the
+// newest job of the longest other queue.
+struct AlveoWorkQueue {
+	std::mutex lock;
+	std::deque<std::pair<AlveoJobFn, void *>> jobs;
+	uint64_t executed = 0;
+	uint64_t stolen = 0;
+};
+
+struct AlveoDispatcher {
+	std::vector<std::unique_ptr<AlveoWorkQueue>> queues;
+	std::vector<std::thread> workers;
+	std::mutex lock;	//Protects the fields below.
+	std::condition_variable wake;
+	std::condition_variable drained;
+	int64_t queued = 0;
+	uint64_t pending = 0;
+	fstatus_t status = FLETCHER_STATUS_OK;
+	bool stop = false;
+	std::atomic<uint32_t> next{0};
+};
 
-PlatformState alveo_state ={NULL, ALVEO_DEVICE_NAME, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+// Execution graph. Nodes are declared in dependency order: a node may only depend on nodes declared before it.
+typedef size_t AlveoNode;
+
+struct AlveoGraphNode {
+	enum Type {COPY_TO_DEVICE, COPY_TO_HOST, STREAM_TO_DEVICE, STREAM_TO_HOST, RUN} type;
+	void *host = nullptr;
+	cl::Buffer buffer;
+	size_t offset = 0;
+	size_t size = 0;
+	da_t stream = 0;	//Stream address, see ALVEO_STREAM_ADDRESS_FLAG.
+	std::vector<std::pair<cl_uint, cl::Buffer>> args;	//Kernel arguments of a run.
+	std::vector<AlveoNode> deps;
+	cl::Event done;	//Set by platformGraphExecute.
+};
+
+struct AlveoGraph {
+	std::vector<AlveoGraphNode> nodes;
+};
+
+// A profiled copy, stream transfer or kernel run. Times are in nanoseconds on the host's steady clock.
+struct AlveoProfileRecord {
+	const char *name;	//"H2D", "D2H" or "Run".
+	unsigned int card;
+	unsigned int cu;
+	int64_t size;
+	uint64_t queued_ns;
+	uint64_t submit_ns;
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+struct PlatformState {
+	cl_int err;
+	cl::Program::Binaries bins;
+	const unsigned char *xclbin_data = nullptr;	//The xclbin, mapped read-only.
+	size_t xclbin_size = 0;
+	cl_platform_id platform_id;
+	uuid_t xclbin_id;	//Resolved once at platformInit.
+	std::vector<cl_uint> h2k_args{0};	//Kernel arguments that are host-to-kernel streams.
+	std::vector<cl_uint> k2h_args{1};	//Kernel arguments that are kernel-to-host streams.
+	std::vector<std::unique_ptr<AlveoCard>> cards;
+	std::vector<AlveoCU *> cus;	//Compute units of all cards.
+	std::atomic<uint32_t> next_cu{0};	//Compute unit the scheduler considers first, to break ties round-robin.
+	AlveoDispatcher dispatcher;
+	bool profile = false;	//Set by FLETCHER_ALVEO_PROFILE=1, or FLETCHER_ALVEO_TRACE.
+	const char *trace_path = nullptr;	//Chrome trace written at platformTerminate, from FLETCHER_ALVEO_TRACE.
+	std::mutex profile_lock;
+	std::vector<AlveoProfileRecord> records;
+	std::atomic<uint64_t> generation{1};	//Bumped by platformTerminate, which invalidates the state of all contexts.
+};
+
+extern PlatformState alveo_state;
 
 /// @brief Store the platform name in a buffer of size /p size pointed to by /p name.
 fstatus_t platformGetName(char *name, size_t size);
 
-/// @brief Initialize the platform. \p arg may point to a null pointer or some custom structure for initialization
-/// arguments.
+/// @brief Initialize the platform. \p arg points to an AlveoConfig with the command line of the application.
 fstatus_t platformInit(void *arg);
 
+/// @brief Return the number of cards opened by platformInit.
+uint32_t platformCardCount();
+
+/// @brief Make \p card the card that all further platform calls of the calling thread operate on.
+fstatus_t platformSelectCard(uint32_t card);
+
+/// @brief Create a context that starts out on the compute unit the calling thread works on.
+fstatus_t platformContextCreate(AlveoContext **ctx);
+
+/// @brief Bind \p ctx to the calling thread, or its own implicit context if \p ctx is nullptr. A context may be bound to
+/// one thread at a time.
+fstatus_t platformContextBind(AlveoContext *ctx);
+
+/// @brief Destroy \p ctx, which must not be bound to any other thread anymore.
+void platformContextDestroy(AlveoContext *ctx);
+
+/// @brief Return the number of compute units of the selected card.
+uint32_t platformComputeUnitCount();
+
+/// @brief Make compute unit \p cu of the selected card the one that further platform calls of this thread operate on.
+fstatus_t platformSelectComputeUnit(uint32_t cu);
+
+/// @brief Schedule a job on the compute unit with the fewest jobs queued over all cards, wait until it is free, and
+/// select it. Its card is stored in \p card.
+fstatus_t platformAcquireCard(uint32_t *card);
+
+/// @brief End the job that acquired a compute unit of \p card, so that the next job queued on it can start.
+fstatus_t platformReleaseCard(uint32_t card);
+
+/// @brief Queue \p fn(\p arg) to run on a worker thread that holds a free compute unit.
+fstatus_t platformDispatch(AlveoJobFn fn, void *arg);
+
+/// @brief Wait until all dispatched jobs completed. Returns FLETCHER_STATUS_ERROR if any of them failed.
+fstatus_t platformDispatchWait();
+
 /// @brief Write \p value to MMIO register \p offset
 fstatus_t platformWriteMMIO(uint64_t offset, uint32_t value);
 
+/// @brief Write \p n values \p values[i] to MMIO registers \p offsets[i], in order.
+fstatus_t platformWriteMMIOBatch(const uint64_t *offsets, const uint32_t *values, size_t n);
+
 /// @brief Read MMIO register \p offset into \p value
 fstatus_t platformReadMMIO(uint64_t offset, uint32_t *value);
 
@@ -50,6 +248,64 @@ fstatus_t platformCopyHostToDevice(const uint8_t *host_source, da_t device_desti
 /// @brief Copy \p size bytes from device address \p device_source to host address \p host_destination.
 fstatus_t platformCopyDeviceToHost(const da_t device_source, uint8_t *host_destination, int64_t size);
 
+/// @brief Copy the \p n buffers described by \p descs to the device. All buffers for one stream are packed and sent as
+/// one transfer, in the order of \p descs, so the kernel receives them back to back with a single end-of-transaction.
+fstatus_t platformCopyHostToDeviceV(const AlveoCopyDesc *descs, size_t n);
+
+/// @brief Queue a copy to the device on the selected compute unit, to start once \p after (if not NULL) completed.
+/// A handle to wait on is stored in \p future if it is not NULL; release it with platformFutureRelease.
+fstatus_t platformCopyHostToDeviceAsync(const uint8_t *host_source, da_t device_destination, int64_t size,
+                                        AlveoFuture *after, AlveoFuture **future);
+
+/// @brief Queue a copy to the host, see platformCopyHostToDeviceAsync.
+fstatus_t platformCopyDeviceToHostAsync(da_t device_source, uint8_t *host_destination, int64_t size,
+                                        AlveoFuture *after, AlveoFuture **future);
+
+/// @brief Queue a kernel run: start it and wait up to \p timeout_us (0 waits indefinitely) until it is done.
+fstatus_t platformRunAsync(uint64_t timeout_us, AlveoFuture *after, AlveoFuture **future);
+
+/// @brief Wait until the operation of \p future completed, and return its status.
+fstatus_t platformFutureWait(AlveoFuture *future);
+
+/// @brief Return 1 and store the status in \p status if the operation of \p future completed, 0 otherwise.
+int platformFuturePoll(AlveoFuture *future, fstatus_t *status);
+
+/// @brief Release a handle returned by one of the asynchronous operations.
+void platformFutureRelease(AlveoFuture *future);
+
+/// @brief Add a copy of \p size bytes from \p host to \p buffer at \p offset, once all nodes in \p deps completed.
+AlveoNode platformGraphCopyToDevice(AlveoGraph &graph, const void *host, cl::Buffer buffer, size_t offset, size_t size,
+                                    std::vector<AlveoNode> deps = {});
+
+/// @brief Add a copy of \p size bytes from \p buffer at \p offset to \p host, once all nodes in \p deps completed.
+AlveoNode platformGraphCopyToHost(AlveoGraph &graph, cl::Buffer buffer, size_t offset, size_t size, void *host,
+                                  std::vector<AlveoNode> deps = {});
+
+/// @brief Add a transfer of \p size bytes from \p host into the stream at device address \p stream. A kernel has to
+/// consume the stream while it is written, so a stream transfer and the run that consumes it must not depend on each
+/// other.
+AlveoNode platformGraphStreamToDevice(AlveoGraph &graph, const void *host, da_t stream, size_t size,
+                                      std::vector<AlveoNode> deps = {});
+
+/// @brief Add a transfer of \p size bytes from the stream at device address \p stream into \p host.
+AlveoNode platformGraphStreamToHost(AlveoGraph &graph, da_t stream, size_t size, void *host,
+                                    std::vector<AlveoNode> deps = {});
+
+/// @brief Add a run of the kernel with buffer arguments \p args, once all nodes in \p deps completed.
+AlveoNode platformGraphRun(AlveoGraph &graph, std::vector<std::pair<cl_uint, cl::Buffer>> args,
+                           std::vector<AlveoNode> deps = {});
+
+/**
+ * @brief Execute \p graph on the selected compute unit and wait until all nodes completed.
+ *
+ * Every node is enqueued on the out-of-order queue of the card with the events of its dependencies as wait list, so
+ * independent copies overlap and a run starts as soon as its own inputs landed. Stream transfers run on the
+ * asynchronous queue of the compute unit and complete a user event.
+ *
+ * @return                      FLETCHER_STATUS_OK if all nodes succeeded, FLETCHER_STATUS_ERROR otherwise.
+ */
+fstatus_t platformGraphExecute(AlveoGraph &graph);
+
 /// @brief Allocate \p size bytes on the device.
 fstatus_t platformDeviceMalloc(da_t *device_address, int64_t size);
 